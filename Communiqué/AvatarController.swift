@@ -35,7 +35,12 @@ public class AvatarController: AvatarProvider {
 
 		fetching.insert(person.avatar)
 
-		URLSession.shared.dataTask(with: person.avatar, completionHandler: { [weak self] (data, response, error) -> () in
+		// scheduled after the requests of the user, callbacks on the main queue
+		let request = STHTTPRequest(url: person.avatar)!
+		request.scheduler = STHTTPRequestScheduler.shared()
+		request.priority = .visibleContent
+		request.responseCache = STHTTPRequestResponseCache.shared()
+		request.completionDataBlock = { [weak self] (_, data) -> () in
 			guard let this = self else { return }
 
 			this.fetching.remove(person.avatar)
@@ -43,9 +48,13 @@ public class AvatarController: AvatarProvider {
 			if let data = data, data.count > 0 {
 				this.saveAvatar(data, forPerson: person)
 
-				DispatchQueue.main.async(execute: completion)
+				completion()
 			}
-		}).resume()
+		}
+		request.errorBlock = { [weak self] (_) -> () in
+			self?.fetching.remove(person.avatar)
+		}
+		request.startAsynchronous()
 
 		return nil
 	}
@@ -69,6 +69,7 @@ public class Item: Equatable {
 	let sender: Person
 	let message: String
 	let date: String
+	let timestamp: TimeInterval // since 1970, parsed from date
 	let id: String
 
 	init(dictionary: [String: Any]) {
@@ -78,6 +79,7 @@ public class Item: Equatable {
 		]
 		message = dictionary["text"] as! String
 		date = dictionary["created_at"] as! String
+		timestamp = Item.timestamp(fromTwitterDateString: date)
 		id = dictionary["id_str"] as! String
 	}
 
@@ -86,8 +88,23 @@ public class Item: Equatable {
 		self.people = [ to ]
 		self.message = message
 		self.date = ""
+		self.timestamp = Date().timeIntervalSince1970
 		self.id = UUID().uuidString
 	}
+
+	// the fast parser only knows the exact created_at format, the formatter is more lenient
+	private static func timestamp(fromTwitterDateString date: String) -> TimeInterval {
+		let timestamp = DateFormatter.st_timeIntervalSince1970(fromTwitterDateString: date)
+		if !timestamp.isNaN {
+			return timestamp
+		}
+
+		if let parsedDate = DateFormatter.st_TwitterDateFormatter().date(from: date) {
+			return parsedDate.timeIntervalSince1970
+		}
+
+		return Date().timeIntervalSince1970
+	}
 }
 
 public func ==(lhs: Item, rhs: Item) -> Bool {
@@ -8,8 +8,14 @@
 
 #import <Foundation/Foundation.h>
 
+// parses a 'created_at' value, eg. "Sun Jun 28 20:33:01 +0000 2009", into seconds since 1970
+// fixed format, no allocation, thread safe, returns NO if the string doesn't match
+BOOL STTwitterTimeIntervalSince1970FromDateBytes(const char *bytes, size_t length, NSTimeInterval *timeInterval);
+
 @interface NSDateFormatter (STTwitter)
 
-+ (NSDateFormatter *)st_TwitterDateFormatter;
++ (NSDateFormatter *)st_TwitterDateFormatter; // thread safe since OS X 10.9 and iOS 7, but much slower than st_timeIntervalSince1970FromTwitterDateString:
+
++ (NSTimeInterval)st_timeIntervalSince1970FromTwitterDateString:(NSString *)dateString NS_SWIFT_NAME(st_timeIntervalSince1970(fromTwitterDateString:)); // NAN if the string doesn't match
 
 @end
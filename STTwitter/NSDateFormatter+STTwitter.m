@@ -8,21 +8,128 @@
 
 #import "NSDateFormatter+STTwitter.h"
 
-static NSDateFormatter *stTwitterDateFormatter = nil;
+#define kSTTwitterDateLength 30 // "Sun Jun 28 20:33:01 +0000 2009"
+
+static BOOL STParseDigits(const char *bytes, size_t count, int *value) {
+    int v = 0;
+    for(size_t i = 0; i < count; i++) {
+        char c = bytes[i];
+        if(c < '0' || c > '9') return NO;
+        v = v * 10 + (c - '0');
+    }
+    *value = v;
+    return YES;
+}
+
+static int STParseMonth(const char *m) {
+    switch(m[0]) {
+        case 'J':
+            if(m[1] == 'a' && m[2] == 'n') return 1;
+            if(m[1] == 'u' && m[2] == 'n') return 6;
+            if(m[1] == 'u' && m[2] == 'l') return 7;
+            return 0;
+        case 'F': return (m[1] == 'e' && m[2] == 'b') ? 2 : 0;
+        case 'M':
+            if(m[1] == 'a' && m[2] == 'r') return 3;
+            if(m[1] == 'a' && m[2] == 'y') return 5;
+            return 0;
+        case 'A':
+            if(m[1] == 'p' && m[2] == 'r') return 4;
+            if(m[1] == 'u' && m[2] == 'g') return 8;
+            return 0;
+        case 'S': return (m[1] == 'e' && m[2] == 'p') ? 9 : 0;
+        case 'O': return (m[1] == 'c' && m[2] == 't') ? 10 : 0;
+        case 'N': return (m[1] == 'o' && m[2] == 'v') ? 11 : 0;
+        case 'D': return (m[1] == 'e' && m[2] == 'c') ? 12 : 0;
+        default: return 0;
+    }
+}
+
+// days since 1970-01-01 in the proleptic Gregorian calendar, http://howardhinnant.github.io/date_algorithms.html
+static int64_t STDaysFromCivil(int64_t y, int m, int d) {
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+BOOL STTwitterTimeIntervalSince1970FromDateBytes(const char *b, size_t length, NSTimeInterval *timeInterval) {
+    
+    if(b == NULL || length != kSTTwitterDateLength) return NO;
+    
+    if(b[3] != ' ' || b[7] != ' ' || b[10] != ' ' || b[13] != ':' || b[16] != ':' || b[19] != ' ' || b[25] != ' ') return NO;
+    if(b[20] != '+' && b[20] != '-') return NO;
+    
+    // the day of the week is redundant
+    
+    int month = STParseMonth(b + 4);
+    if(month == 0) return NO;
+    
+    int day, hours, minutes, seconds, offsetHours, offsetMinutes, year;
+    
+    if(STParseDigits(b + 8, 2, &day) == NO) return NO;
+    if(STParseDigits(b + 11, 2, &hours) == NO) return NO;
+    if(STParseDigits(b + 14, 2, &minutes) == NO) return NO;
+    if(STParseDigits(b + 17, 2, &seconds) == NO) return NO;
+    if(STParseDigits(b + 21, 2, &offsetHours) == NO) return NO;
+    if(STParseDigits(b + 23, 2, &offsetMinutes) == NO) return NO;
+    if(STParseDigits(b + 26, 4, &year) == NO) return NO;
+    
+    if(day < 1 || day > 31 || hours > 23 || minutes > 59 || seconds > 60 || offsetMinutes > 59) return NO;
+    
+    int64_t offset = (offsetHours * 3600 + offsetMinutes * 60) * (b[20] == '-' ? -1 : 1);
+    
+    int64_t t = STDaysFromCivil(year, month, day) * 86400 + hours * 3600 + minutes * 60 + seconds - offset;
+    
+    if(timeInterval) *timeInterval = (NSTimeInterval)t;
+    
+    return YES;
+}
 
 @implementation NSDateFormatter (STTwitter)
 
 + (NSDateFormatter *)st_TwitterDateFormatter {
-
+    
     // parses the 'created_at' field, eg. "Sun Jun 28 20:33:01 +0000 2009"
     
-    if(stTwitterDateFormatter == nil) {
+    static NSDateFormatter *stTwitterDateFormatter = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
         stTwitterDateFormatter = [[NSDateFormatter alloc] init];
         [stTwitterDateFormatter setLocale:[[NSLocale alloc] initWithLocaleIdentifier:@"en_US_POSIX"]];
         [stTwitterDateFormatter setDateFormat:@"EEE MMM dd HH:mm:ss Z yyyy"];
-    }
+    });
     
     return stTwitterDateFormatter;
 }
 
++ (NSTimeInterval)st_timeIntervalSince1970FromTwitterDateString:(NSString *)dateString {
+    
+    if(dateString == nil) return NAN;
+    
+    CFStringRef s = (__bridge CFStringRef)dateString;
+    CFIndex length = CFStringGetLength(s);
+    if(length != kSTTwitterDateLength) return NAN;
+    
+    NSTimeInterval timeInterval = NAN;
+    
+    // strings decoded from JSON usually expose their ASCII bytes, otherwise they are copied on the stack
+    const char *bytes = CFStringGetCStringPtr(s, kCFStringEncodingASCII);
+    
+    if(bytes == NULL) {
+        char buffer[kSTTwitterDateLength];
+        CFIndex usedLength = 0;
+        CFIndex convertedLength = CFStringGetBytes(s, CFRangeMake(0, length), kCFStringEncodingASCII, 0, false, (UInt8 *)buffer, sizeof(buffer), &usedLength);
+        if(convertedLength != length || usedLength != kSTTwitterDateLength) return NAN;
+        
+        if(STTwitterTimeIntervalSince1970FromDateBytes(buffer, kSTTwitterDateLength, &timeInterval) == NO) return NAN;
+        return timeInterval;
+    }
+    
+    if(STTwitterTimeIntervalSince1970FromDateBytes(bytes, strlen(bytes), &timeInterval) == NO) return NAN;
+    return timeInterval;
+}
+
 @end
@@ -24,7 +24,7 @@ static NSRegularExpression *xmlErrorRegex = nil;
                              underlyingError:(NSError *)underlyingError {
     
     NSError *jsonError = nil;
-    NSDictionary *json = [NSJSONSerialization JSONObjectWithData:responseData options:NSJSONReadingMutableLeaves error:&jsonError];
+    NSDictionary *json = [NSJSONSerialization JSONObjectWithData:responseData options:0 error:&jsonError];
     
     NSString *message = nil;
     NSInteger code = 0;
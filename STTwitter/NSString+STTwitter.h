@@ -13,6 +13,8 @@ extern NSUInteger kSTTwitterDefaultShortURLLengthHTTPS;
 
 extern NSString *kSTPOSTDataKey; // dummy parameter to tell a key used to post raw media, necessary because media are ignored in OAuth signatures
 extern NSString *kSTPOSTMediaFileNameKey; // dummy parameter to tell the name of a file to be uploaded, optional but more correct than none
+extern NSString *kSTStreamRequestKey; // dummy parameter to tell a long-lived streaming request, whose response is passed to the progress block and never accumulated
+extern NSString *kSTRequestPriorityKey; // dummy parameter to tell the STHTTPRequestPriority of a request, as an NSNumber, default: interactive for POST, visible content for GET
 
 @interface NSString (STTwitter)
 
@@ -27,4 +29,7 @@ extern NSString *kSTPOSTMediaFileNameKey; // dummy parameter to tell the name of
 
 - (NSDictionary <NSString *, id> *)st_parametersFromQuery;
 
+// numeric components are IDs, eg. "/1.1/statuses/show/123.json" -> "/1.1/statuses/show/:id.json" with @":id"
+- (NSString *)st_pathByReplacingIDComponentsWithString:(NSString *)replacement;
+
 @end
@@ -13,6 +13,8 @@ NSUInteger kSTTwitterDefaultShortURLLengthHTTPS = 23;
 
 NSString *kSTPOSTDataKey = @"kSTPOSTDataKey";
 NSString *kSTPOSTMediaFileNameKey = @"kSTPOSTMediaFileNameKey";
+NSString *kSTStreamRequestKey = @"kSTStreamRequestKey";
+NSString *kSTRequestPriorityKey = @"kSTRequestPriorityKey";
 
 @implementation NSString (STTwitter)
 
@@ -88,4 +90,29 @@ NSString *kSTPOSTMediaFileNameKey = @"kSTPOSTMediaFileNameKey";
 	return [parameters copy];
 }
 
+- (NSString *)st_pathByReplacingIDComponentsWithString:(NSString *)replacement {
+    
+    NSCharacterSet *nonDigits = [[NSCharacterSet decimalDigitCharacterSet] invertedSet];
+    
+    NSMutableArray *components = [NSMutableArray array];
+    
+    for(NSString *component in [self componentsSeparatedByString:@"/"]) {
+        
+        // ids show up as "123" or "123.json", not to be confused with the "1.1" version
+        NSString *name = [component stringByDeletingPathExtension];
+        NSString *extension = [component pathExtension];
+        
+        BOOL isID = [name length] > 0 && [name rangeOfCharacterFromSet:nonDigits].location == NSNotFound
+        && ([extension length] == 0 || [extension rangeOfCharacterFromSet:nonDigits].location != NSNotFound);
+        
+        if(isID) {
+            [components addObject:[extension length] ? [NSString stringWithFormat:@"%@.%@", replacement, extension] : replacement];
+        } else {
+            [components addObject:component];
+        }
+    }
+    
+    return [components componentsJoinedByString:@"/"];
+}
+
 @end
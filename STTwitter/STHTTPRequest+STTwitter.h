@@ -19,6 +19,21 @@
                          stTwitterSuccessBlock:(void(^)(NSDictionary *requestHeaders, NSDictionary *responseHeaders, id json))successBlock
                            stTwitterErrorBlock:(void(^)(NSDictionary *requestHeaders, NSDictionary *responseHeaders, NSError *error))errorBlock;
 
+// shared by the GET requests, responses without validators are stored only for the endpoints given a time to live
++ (STHTTPRequestResponseCache *)twitterResponseCache;
+
+// feeds STTwitterRateLimiter, the account is the schedulingGroup
+- (void)st_updateRateLimitsWithResponseHeaders:(NSDictionary *)responseHeaders;
+
+// starts the request if STTwitterRateLimiter admits it, or once the rate limit window resets, or fails with error 88 without sending it
+- (void)st_startAsynchronousWithinRateLimits;
+
+// same, signingBlock is called right before the request starts, so that a delayed request gets a fresh timestamp and nonce
+- (void)st_startAsynchronousWithinRateLimitsSignedWithBlock:(void(^)(STHTTPRequest *r))signingBlock;
+
+// sets the streaming and priority properties according to kSTStreamRequestKey and kSTRequestPriorityKey, returns the parameters without them
+- (NSDictionary *)st_parametersByConsumingRequestKeys:(NSDictionary *)params;
+
 + (void)expandedURLStringForShortenedURLString:(NSString *)urlString
                                   successBlock:(void(^)(NSString *expandedURLString))successBlock
                                     errorBlock:(void(^)(NSError *error))errorBlock;
@@ -9,6 +9,8 @@
 #import "STHTTPRequest+STTwitter.h"
 #import "NSString+STTwitter.h"
 #import "NSError+STTwitter.h"
+#import "STTwitterEndpointMetrics.h"
+#import "STTwitterRateLimiter.h"
 
 #if DEBUG
 #   define STLog(...) NSLog(__VA_ARGS__)
@@ -39,35 +41,52 @@
     
     r.downloadProgressBlock = downloadProgressBlock;
     
-    r.completionDataBlock = ^(NSDictionary *responseHeaders, NSData *responseData) {
+    if([HTTPMethod isEqualToString:@"GET"]) {
+        r.responseCache = [self twitterResponseCache]; // callers set responseCacheVariant for the account
+    }
+    
+    // callers set schedulingGroup for the account
+    r.scheduler = [STHTTPRequestScheduler sharedScheduler];
+    r.priority = [HTTPMethod isEqualToString:@"GET"] ? STHTTPRequestPriorityVisibleContent : STHTTPRequestPriorityInteractive;
+    
+    r.metricsBlock = ^(STHTTPRequestMetrics *metrics) {
+        [[STTwitterEndpointMetrics sharedMetrics] recordRequestMetrics:metrics];
+    };
+    
+    // JSON decoding and error parsing run on the request's processingQueue,
+    // only the resulting objects are delivered on the callbackQueue
+    
+    r.responseProcessingBlock = ^id(NSDictionary *responseHeaders, NSData *responseData) {
         
         STHTTPRequest *sr = wr; // strong request
-
+        
         NSError *jsonError = nil;
-        id json = [NSJSONSerialization JSONObjectWithData:responseData options:NSJSONReadingMutableLeaves error:&jsonError];
+        id json = [NSJSONSerialization JSONObjectWithData:responseData options:0 error:&jsonError];
         
         if(json == nil) {
-            successBlock(sr.requestHeaders, sr.responseHeaders, sr.responseString); // response is not necessarily json
-            return;
+            return sr.responseString; // response is not necessarily json
         }
         
-        successBlock(sr.requestHeaders, sr.responseHeaders, json);
+        return json;
     };
     
-    r.errorBlock = ^(NSError *error) {
+    r.completionObjectBlock = ^(NSDictionary *responseHeaders, id json) {
         
         STHTTPRequest *sr = wr; // strong request
-
-        NSError *e = [NSError st_twitterErrorFromResponseData:sr.responseData responseHeaders:sr.responseHeaders underlyingError:error];
-        if(e) {
-            errorBlock(sr.requestHeaders, sr.responseHeaders, e);
-            return;
-        }
-
-        if(error) {
-            errorBlock(sr.requestHeaders, sr.responseHeaders, error);
-            return;
-        }
+        
+        [sr st_updateRateLimitsWithResponseHeaders:responseHeaders];
+        
+        successBlock(sr.requestHeaders, responseHeaders, json);
+    };
+    
+    r.errorProcessingBlock = ^NSError *(NSError *error, NSDictionary *responseHeaders, NSData *responseData) {
+        
+        STHTTPRequest *sr = wr; // strong request
+        
+        NSError *e = [NSError st_twitterErrorFromResponseData:responseData responseHeaders:responseHeaders underlyingError:error];
+        if(e) return e;
+        
+        if(error) return error;
         
         e = [NSError errorWithDomain:NSStringFromClass([self class]) code:0 userInfo:@{NSLocalizedDescriptionKey : sr.responseString}];
         
@@ -76,12 +95,97 @@
         //        BOOL isCancellationError = [[error domain] isEqualToString:@"STHTTPRequest"] && ([error code] == kSTHTTPRequestCancellationError);
         //        if(isCancellationError) return;
         
-        errorBlock(sr.requestHeaders, sr.responseHeaders, e);
+        return e;
+    };
+    
+    r.errorBlock = ^(NSError *error) {
+        
+        STHTTPRequest *sr = wr; // strong request
+        
+        [sr st_updateRateLimitsWithResponseHeaders:sr.responseHeaders];
+        
+        errorBlock(sr.requestHeaders, sr.responseHeaders, error);
     };
     
     return r;
 }
 
++ (STHTTPRequestResponseCache *)twitterResponseCache {
+    static STHTTPRequestResponseCache *twitterResponseCache = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        twitterResponseCache = [STHTTPRequestResponseCache sharedCache];
+        
+        // the API sends no validators and "no-cache, no-store, must-revalidate" on every response,
+        // the overrides keep these rarely changing public resources for a while, nothing else is stored
+        [twitterResponseCache setTimeToLive:24 * 3600 forURLPathSuffix:@"/help/configuration.json"];
+        [twitterResponseCache setTimeToLive:5 * 60 forURLPathSuffix:@"/users/show.json"];
+        [twitterResponseCache setTimeToLive:5 * 60 forURLPathSuffix:@"/users/lookup.json"];
+    });
+    return twitterResponseCache;
+}
+
+- (void)st_updateRateLimitsWithResponseHeaders:(NSDictionary *)responseHeaders {
+    if(self.responseIsFromCache) return; // the stored headers are outdated
+    [[STTwitterRateLimiter sharedRateLimiter] updateWithResponseHeaders:responseHeaders URL:self.url account:self.schedulingGroup];
+}
+
+- (void)st_startAsynchronousWithinRateLimits {
+    [self st_startAsynchronousWithinRateLimitsSignedWithBlock:nil];
+}
+
+- (void)st_startAsynchronousWithinRateLimitsSignedWithBlock:(void(^)(STHTTPRequest *r))signingBlock {
+    
+    // streams have their own limits, on connections
+    if(self.streaming) {
+        if(signingBlock) signingBlock(self);
+        [self startAsynchronous];
+        return;
+    }
+    
+    STTwitterRateLimiter *rateLimiter = [STTwitterRateLimiter sharedRateLimiter];
+    
+    NSDate *retryDate = nil;
+    STTwitterRateLimitAdmission admission = [rateLimiter admitRequestToURL:self.url account:self.schedulingGroup priority:self.priority retryDate:&retryDate];
+    
+    if(admission == STTwitterRateLimitAdmissionAdmitted) {
+        if(signingBlock) signingBlock(self);
+        [self startAsynchronous];
+        return;
+    }
+    
+    // signed only once admitted, a request delayed for minutes would carry an expired timestamp
+    if(admission == STTwitterRateLimitAdmissionDelayed) {
+        STLog(@"-- rate limit exhausted, %@ delayed until %@", [self.url path], retryDate);
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)([retryDate timeIntervalSinceNow] * NSEC_PER_SEC)), dispatch_get_main_queue(), ^{
+            if(self.error) return; // cancelled meanwhile
+            [self st_startAsynchronousWithinRateLimitsSignedWithBlock:signingBlock];
+        });
+        return;
+    }
+    
+    [self failWithError:[rateLimiter rateLimitErrorForURL:self.url account:self.schedulingGroup]];
+}
+
+- (NSDictionary *)st_parametersByConsumingRequestKeys:(NSDictionary *)params {
+    
+    if([params valueForKey:kSTStreamRequestKey] == nil && [params valueForKey:kSTRequestPriorityKey] == nil) return params;
+    
+    NSMutableDictionary *md = [params mutableCopy];
+    
+    if([params valueForKey:kSTStreamRequestKey]) {
+        self.streaming = [[params valueForKey:kSTStreamRequestKey] boolValue];
+        [md removeObjectForKey:kSTStreamRequestKey];
+    }
+    
+    if([params valueForKey:kSTRequestPriorityKey]) {
+        self.priority = [[params valueForKey:kSTRequestPriorityKey] integerValue];
+        [md removeObjectForKey:kSTRequestPriorityKey];
+    }
+    
+    return md;
+}
+
 + (void)expandedURLStringForShortenedURLString:(NSString *)urlString
                                   successBlock:(void(^)(NSString *expandedURLString))successBlock
                                     errorBlock:(void(^)(NSError *error))errorBlock {
@@ -1,5 +1,14 @@
 #import "STTwitterAPI.h"
 #import "STTwitterHTML.h"
+#import "STTwitterEndpointMetrics.h"
+#import "STTwitterRequestCoalescer.h"
+#import "STTwitterCursorPaginator.h"
+#import "STTwitterRateLimiter.h"
+#import "STTwitterMediaUploader.h"
+#import "STTwitterUserLookupBatcher.h"
+#import "STTwitterStreamQueue.h"
+#import "STTwitterStreamRecorder.h"
+#import "STTwitterStreamSession.h"
 
 #import "NSDateFormatter+STTwitter.h"
 #import "NSString+STTwitter.h"
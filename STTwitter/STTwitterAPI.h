@@ -21,8 +21,13 @@
 
 #import <Foundation/Foundation.h>
 #import "STTwitterStreamParser.h"
+#import "STTwitterStreamRecorder.h"
 #import "STTwitterRequestProtocol.h"
 
+@class STTwitterUserLookupBatcher;
+@class STTwitterStreamQueue;
+@class STTwitterMediaUploader;
+
 NS_ASSUME_NONNULL_BEGIN
 
 extern NS_ENUM(NSUInteger, STTwitterAPIErrorCode) {
@@ -32,6 +37,7 @@ extern NS_ENUM(NSUInteger, STTwitterAPIErrorCode) {
 };
 
 extern NSString *kBaseURLStringAPI_1_1;
+extern NSString *kBaseURLStringUpload_1_1;
 extern NSString *kBaseURLStringStream_1_1;
 extern NSString *kBaseURLStringUserStream_1_1;
 extern NSString *kBaseURLStringSiteStream_1_1;
@@ -157,6 +163,10 @@ authenticateInsteadOfAuthorize:(BOOL)authenticateInsteadOfAuthorize // use NO if
 @property (nonatomic, readonly) NSString *oauthAccessTokenSecret;
 @property (nonatomic, readonly) NSString *bearerToken;
 
+@property (nonatomic, strong, readonly) STTwitterUserLookupBatcher *userLookupBatcher; // created lazily, gathers single user lookups into users/lookup requests
+
+@property (nonatomic, strong, nullable) STTwitterStreamRecorder *streamRecorder; // when set, raw bytes received by the streaming methods are recorded, see STTwitterStreamReplayer
+
 - (NSDictionary *)OAuthEchoHeadersToVerifyCredentials;
 
 #pragma mark Generic methods to GET and POST
@@ -517,6 +527,19 @@ authenticateInsteadOfAuthorize:(BOOL)authenticateInsteadOfAuthorize // use NO if
 
 #pragma mark Streaming
 
+/*
+ Generic streaming method, messages are enqueued into streamQueue instead of being passed to a progress block,
+ so that a slow consumer doesn't hold up the stream. The policy of streamQueue cannot be STTwitterStreamQueuePolicyBlock.
+ */
+
+- (NSObject<STTwitterRequestProtocol> *)streamResource:(NSString *)resource
+                                            HTTPMethod:(NSString *)HTTPMethod
+                                         baseURLString:(NSString *)baseURLString
+                                            parameters:(nullable NSDictionary *)params
+                                         acceptedTypes:(STTwitterStreamJSONTypeMask)acceptedTypes
+                                           streamQueue:(STTwitterStreamQueue *)streamQueue
+                                            errorBlock:(nullable void(^)(NSError *error))errorBlock;
+
 /*
  POST	statuses/filter
  
@@ -536,6 +559,15 @@ authenticateInsteadOfAuthorize:(BOOL)authenticateInsteadOfAuthorize // use NO if
                                                     progressBlock:(nullable void(^)(NSDictionary *json, STTwitterStreamJSONType type))progressBlock
                                                        errorBlock:(nullable void(^)(NSError *error))errorBlock;
 
+// messages whose type is not in acceptedTypes are dropped before being decoded
+- (NSObject<STTwitterRequestProtocol> *)postStatusesFilterUserIDs:(nullable NSArray *)userIDs
+                                                  keywordsToTrack:(nullable NSArray *)keywordsToTrack
+                                            locationBoundingBoxes:(nullable NSArray *)locationBoundingBoxes
+                                                    stallWarnings:(nullable NSNumber *)stallWarnings
+                                                    acceptedTypes:(STTwitterStreamJSONTypeMask)acceptedTypes
+                                                    progressBlock:(nullable void(^)(NSDictionary *json, STTwitterStreamJSONType type))progressBlock
+                                                       errorBlock:(nullable void(^)(NSError *error))errorBlock;
+
 // convenience
 - (NSObject<STTwitterRequestProtocol> *)postStatusesFilterKeyword:(nullable NSString *)keyword
                                                        tweetBlock:(nullable void(^)(NSDictionary *tweet))tweetBlock
@@ -556,6 +588,12 @@ authenticateInsteadOfAuthorize:(BOOL)authenticateInsteadOfAuthorize // use NO if
                                                          progressBlock:(nullable void(^)(NSDictionary *json, STTwitterStreamJSONType type))progressBlock
                                                             errorBlock:(nullable void(^)(NSError *error))errorBlock;
 
+// messages whose type is not in acceptedTypes are dropped before being decoded
+- (NSObject<STTwitterRequestProtocol> *)getStatusesSampleStallWarnings:(nullable NSNumber *)stallWarnings
+                                                         acceptedTypes:(STTwitterStreamJSONTypeMask)acceptedTypes
+                                                         progressBlock:(nullable void(^)(NSDictionary *json, STTwitterStreamJSONType type))progressBlock
+                                                            errorBlock:(nullable void(^)(NSError *error))errorBlock;
+
 // convenience
 - (NSObject<STTwitterRequestProtocol> *)getStatusesSampleTweetBlock:(nullable void(^)(NSDictionary *tweet))tweetBlock
                                                   stallWarningBlock:(nullable void(^)(NSString *code, NSString *message, NSUInteger percentFull))stallWarningBlock
@@ -591,6 +629,16 @@ authenticateInsteadOfAuthorize:(BOOL)authenticateInsteadOfAuthorize // use NO if
                                                      progressBlock:(nullable void(^)(NSDictionary *json, STTwitterStreamJSONType type))progressBlock
                                                         errorBlock:(nullable void(^)(NSError *error))errorBlock;
 
+// messages whose type is not in acceptedTypes are dropped before being decoded
+- (NSObject<STTwitterRequestProtocol> *)getUserStreamStallWarnings:(nullable NSNumber *)stallWarnings
+                               includeMessagesFromFollowedAccounts:(nullable NSNumber *)includeMessagesFromFollowedAccounts
+                                                    includeReplies:(nullable NSNumber *)includeReplies
+                                                   keywordsToTrack:(nullable NSArray *)keywordsToTrack
+                                             locationBoundingBoxes:(nullable NSArray *)locationBoundingBoxes
+                                                     acceptedTypes:(STTwitterStreamJSONTypeMask)acceptedTypes
+                                                     progressBlock:(nullable void(^)(NSDictionary *json, STTwitterStreamJSONType type))progressBlock
+                                                        errorBlock:(nullable void(^)(NSError *error))errorBlock;
+
 // convenience
 - (NSObject<STTwitterRequestProtocol> *)getUserStreamIncludeMessagesFromFollowedAccounts:(nullable NSNumber *)includeMessagesFromFollowedAccounts
                                                                           includeReplies:(nullable NSNumber *)includeReplies
@@ -1086,6 +1134,8 @@ authenticateInsteadOfAuthorize:(BOOL)authenticateInsteadOfAuthorize // use NO if
  - If a requested user is unknown, suspended, or deleted, then that user will not be returned in the results list.
  - If none of your lookup criteria can be satisfied by returning a user object, a HTTP 404 will be thrown.
  - You are strongly encouraged to use a POST for larger requests.
+ 
+ To look up users one by one, use the userLookupBatcher, which sends these requests.
  */
 
 - (NSObject<STTwitterRequestProtocol> *)getUsersLookupForScreenName:(nullable NSString *)screenName
@@ -2022,11 +2072,18 @@ authenticateInsteadOfAuthorize:(BOOL)authenticateInsteadOfAuthorize // use NO if
                                                            successBlock:(nullable void(^)(NSString *mediaID, NSString *expiresAfterSecs))successBlock
                                                              errorBlock:(nullable void(^)(NSError *error))errorBlock;
 
-- (void)postMediaUploadAPPENDWithVideoURL:(nullable NSURL *)videoMediaURL
-                                  mediaID:(nullable NSString *)mediaID
-                      uploadProgressBlock:(nullable void(^)(int64_t bytesWritten, int64_t totalBytesWritten, int64_t totalBytesExpectedToWrite))uploadProgressBlock
-                             successBlock:(nullable void(^)(id response))successBlock
-                               errorBlock:(nullable void(^)(NSError *error))errorBlock;
+// the uploader can be cancelled, its resumeData can be saved and passed later to the method below
+- (STTwitterMediaUploader *)postMediaUploadAPPENDWithVideoURL:(nullable NSURL *)videoMediaURL
+                                                      mediaID:(nullable NSString *)mediaID
+                                          uploadProgressBlock:(nullable void(^)(int64_t bytesWritten, int64_t totalBytesWritten, int64_t totalBytesExpectedToWrite))uploadProgressBlock
+                                                 successBlock:(nullable void(^)(id response))successBlock
+                                                   errorBlock:(nullable void(^)(NSError *error))errorBlock;
+
+// sends the segments missing from an interrupted upload, returns nil and calls errorBlock if the file changed
+- (nullable STTwitterMediaUploader *)postMediaUploadAPPENDWithResumeData:(NSDictionary *)resumeData
+                                                     uploadProgressBlock:(nullable void(^)(int64_t bytesWritten, int64_t totalBytesWritten, int64_t totalBytesExpectedToWrite))uploadProgressBlock
+                                                            successBlock:(nullable void(^)(id response))successBlock
+                                                              errorBlock:(nullable void(^)(NSError *error))errorBlock;
 
 - (NSObject<STTwitterRequestProtocol> *)postMediaUploadFINALIZEWithMediaID:(nullable NSString *)mediaID
                                                               successBlock:(nullable void(^)(NSString *mediaID, NSString *size, NSString *expiresAfter, NSString *videoType))successBlock
@@ -14,6 +14,12 @@
 #import <Accounts/Accounts.h>
 #import "STHTTPRequest.h"
 #import "STHTTPRequest+STTwitter.h"
+#import "STTwitterStreamSession.h"
+#import "STTwitterRequestCoalescer.h"
+#import "STTwitterCursorPaginator.h"
+#import "STTwitterRateLimiter.h"
+#import "STTwitterMediaUploader.h"
+#import "STTwitterUserLookupBatcher.h"
 
 NSString *kBaseURLStringAPI_1_1 = @"https://api.twitter.com/1.1";
 NSString *kBaseURLStringUpload_1_1 = @"https://upload.twitter.com/1.1";
@@ -25,9 +31,10 @@ static NSDateFormatter *dateFormatter = nil;
 
 @interface STTwitterAPI ()
 @property (nonatomic, strong) NSObject <STTwitterProtocol> *oauth;
-@property (nonatomic, strong) STTwitterStreamParser *streamParser;
+@property (nonatomic, strong) NSMutableDictionary *streamSessions; // STTwitterStreamSession instances by key, only accessed on the main queue
 @property (nonatomic, weak) NSObject <STTwitterAPIOSProtocol> *delegate;
 @property (nonatomic, weak) id observer;
+@property (nonatomic, strong) STTwitterUserLookupBatcher *userLookupBatcher;
 @end
 
 @implementation STTwitterAPI
@@ -213,10 +220,14 @@ static NSDateFormatter *dateFormatter = nil;
 }
 
 - (NSDateFormatter *)dateFormatter {
-    if(dateFormatter == nil) {
+    // created once, so that concurrent callers share it, NSDateFormatter is thread safe since OS X 10.9 and iOS 7
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
         dateFormatter = [[NSDateFormatter alloc] init];
-        [dateFormatter setDateFormat:@"yyyy-MM-dd'T'HH:mm:SS'Z'"];
-    }
+        [dateFormatter setLocale:[[NSLocale alloc] initWithLocaleIdentifier:@"en_US_POSIX"]];
+        [dateFormatter setTimeZone:[NSTimeZone timeZoneWithAbbreviation:@"UTC"]];
+        [dateFormatter setDateFormat:@"yyyy-MM-dd'T'HH:mm:ss'Z'"];
+    });
     return dateFormatter;
 }
 
@@ -263,19 +274,38 @@ authenticateInsteadOfAuthorize:authenticateInsteadOfAuthorize
         if(username) [strongSelf setUserName:username];
         if(userID) [strongSelf setUserID:userID];
         
-        [_oauth verifyCredentialsRemotelyWithSuccessBlock:^(NSString *username, NSString *userID) {
+        // login and session restoration can verify the same account concurrently
+        NSString *key = [NSString stringWithFormat:@"verify_credentials %@", [strongSelf coalescingAccountKey]];
+        
+        [[STTwitterRequestCoalescer sharedCoalescer] requestWithKey:key startBlock:^NSObject<STTwitterRequestProtocol> *(STTwitterCoalescedCompletionBlock completionBlock) {
+            
+            [_oauth verifyCredentialsRemotelyWithSuccessBlock:^(NSString *username, NSString *userID) {
+                completionBlock(nil, nil, @[username ? username : @"", userID ? userID : @""], nil);
+            } errorBlock:^(NSError *error) {
+                completionBlock(nil, nil, nil, error);
+            }];
+            
+            return nil;
+            
+        } completionBlock:^(NSObject<STTwitterRequestProtocol> *request, NSDictionary *requestHeaders, NSDictionary *responseHeaders, NSArray *response, NSError *error) {
+            
+            if(response == nil) {
+                errorBlock(error);
+                return;
+            }
             
             if(strongSelf == nil) {
                 errorBlock(nil);
                 return;
             }
             
+            NSString *username = [response[0] length] ? response[0] : nil;
+            NSString *userID = [response[1] length] ? response[1] : nil;
+            
             [strongSelf setUserName:username];
             [strongSelf setUserID:userID];
             
             successBlock(username, userID);
-        } errorBlock:^(NSError *error) {
-            errorBlock(error);
         }];
         
     } errorBlock:^(NSError *error) {
@@ -353,6 +383,58 @@ authenticateInsteadOfAuthorize:authenticateInsteadOfAuthorize
 
 /**/
 
+#pragma mark Coalescing
+
+// identifies the account the requests are signed for, the parameters added by the signature are not part of the keys
+- (NSString *)coalescingAccountKey {
+    
+    NSString *identity = [self oauthAccessToken];
+    if(identity == nil) identity = [self bearerToken];
+    if(identity == nil) identity = [self userName];
+    
+    return [NSString stringWithFormat:@"%@ %@ %@", [_oauth loginTypeDescription], [_oauth consumerName], identity];
+}
+
+// identical GETs in flight for the same account share a single request
+// requests which report their download progress are never coalesced, late callers would miss the first chunks
+- (NSObject<STTwitterRequestProtocol> *)fetchCoalescedGETResource:(NSString *)resource
+                                                    baseURLString:(NSString *)baseURLString
+                                                       parameters:(NSDictionary *)params
+                                                     successBlock:(void(^)(NSObject<STTwitterRequestProtocol> *request, NSDictionary *requestHeaders, NSDictionary *responseHeaders, id response))successBlock
+                                                       errorBlock:(void(^)(NSObject<STTwitterRequestProtocol> *request, NSDictionary *requestHeaders, NSDictionary *responseHeaders, NSError *error))errorBlock {
+    
+    NSString *key = [STTwitterRequestCoalescer keyForHTTPMethod:@"GET"
+                                                      URLString:[NSString stringWithFormat:@"%@/%@", baseURLString, resource]
+                                                     parameters:params
+                                                        account:[self coalescingAccountKey]];
+    
+    return [[STTwitterRequestCoalescer sharedCoalescer] requestWithKey:key startBlock:^NSObject<STTwitterRequestProtocol> *(STTwitterCoalescedCompletionBlock completionBlock) {
+        
+        return [_oauth fetchResource:resource
+                          HTTPMethod:@"GET"
+                       baseURLString:baseURLString
+                          parameters:params
+                 uploadProgressBlock:nil
+               downloadProgressBlock:nil
+                        successBlock:^(id request, NSDictionary *requestHeaders, NSDictionary *responseHeaders, id response) {
+                            completionBlock(requestHeaders, responseHeaders, response, nil);
+                        } errorBlock:^(id request, NSDictionary *requestHeaders, NSDictionary *responseHeaders, NSError *error) {
+                            completionBlock(requestHeaders, responseHeaders, nil, error ? error : [NSError errorWithDomain:NSStringFromClass([self class]) code:0 userInfo:nil]);
+                        }];
+        
+    } completionBlock:^(NSObject<STTwitterRequestProtocol> *request, NSDictionary *requestHeaders, NSDictionary *responseHeaders, id response, NSError *error) {
+        
+        if(error) {
+            if(errorBlock) errorBlock(request, requestHeaders, responseHeaders, error);
+            return;
+        }
+        
+        if(successBlock) successBlock(request, requestHeaders, responseHeaders, response);
+    }];
+}
+
+/**/
+
 #pragma mark Generic methods to GET and POST
 
 - (NSObject<STTwitterRequestProtocol> *)fetchResource:(NSString *)resource
@@ -364,6 +446,14 @@ authenticateInsteadOfAuthorize:authenticateInsteadOfAuthorize
                                          successBlock:(void(^)(NSObject<STTwitterRequestProtocol> *request, NSDictionary *requestHeaders, NSDictionary *responseHeaders, id response))successBlock
                                            errorBlock:(void(^)(NSObject<STTwitterRequestProtocol> *request, NSDictionary *requestHeaders, NSDictionary *responseHeaders, NSError *error))errorBlock {
     
+    if([HTTPMethod isEqualToString:@"GET"] && downloadProgressBlock == nil) {
+        return [self fetchCoalescedGETResource:resource
+                                 baseURLString:baseURLString
+                                    parameters:params
+                                  successBlock:successBlock
+                                    errorBlock:errorBlock];
+    }
+    
     return [_oauth fetchResource:resource
                       HTTPMethod:HTTPMethod
                    baseURLString:baseURLString
@@ -384,62 +474,24 @@ authenticateInsteadOfAuthorize:authenticateInsteadOfAuthorize
                                                               pauseBlock:(void(^)(NSDate *nextRequestDate))pauseBlock
                                                               errorBlock:(void(^)(NSObject<STTwitterRequestProtocol> *request, NSDictionary *requestHeaders, NSDictionary *responseHeaders, NSError *error))errorBlock {
     
-    __block BOOL shouldStop = NO;
     
-    return [_oauth fetchResource:resource
-                      HTTPMethod:HTTPMethod
-                   baseURLString:baseURLString
-                      parameters:params
-             uploadProgressBlock:uploadProgressBlock
-           downloadProgressBlock:downloadProgressBlock
-                    successBlock:^(id request, NSDictionary *requestHeaders, NSDictionary *responseHeaders, id response) {
-                        
-                        // https://dev.twitter.com/overview/api/cursoring
-                        
-                        NSString *nextCursor = [response valueForKey:@"next_cursor_str"];
-                        
-                        BOOL morePagesToCome = NO;
-                        
-                        NSMutableDictionary *paramsWithCursor = [params mutableCopy];
-                        if([nextCursor integerValue] > 0) {
-                            paramsWithCursor[@"cursor"] = nextCursor;
-                            morePagesToCome = YES;
-                        }
-                        
-                        successBlock(request, requestHeaders, responseHeaders, response, morePagesToCome, &shouldStop);
-                        
-                        if(shouldStop || morePagesToCome == NO) return;
-                        
-                        // now consider rate limits
-                        
-                        NSString *remainingString = [responseHeaders objectForKey:@"x-rate-limit-remaining"];
-                        NSString *resetString = [responseHeaders objectForKey:@"x-rate-limit-reset"];
-                        
-                        NSInteger remainingInteger = [remainingString integerValue];
-                        NSInteger resetInteger = [resetString integerValue];
-                        NSTimeInterval timeInterval = 0;
-                        
-                        if(remainingInteger == 0) {
-                            NSDate *resetDate = [[NSDate alloc] initWithTimeIntervalSince1970:resetInteger];
-                            timeInterval = [resetDate timeIntervalSinceDate:[NSDate date]] + 5;
-                            pauseBlock([NSDate dateWithTimeIntervalSinceNow:timeInterval]);
-                        }
-                        
-                        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(timeInterval * NSEC_PER_SEC)), dispatch_get_main_queue(), ^{
-                            
-                            [self fetchAndFollowCursorsForResource:resource
-                                                        HTTPMethod:HTTPMethod
-                                                     baseURLString:baseURLString
-                                                        parameters:paramsWithCursor
-                                               uploadProgressBlock:uploadProgressBlock
-                                             downloadProgressBlock:downloadProgressBlock
-                                                      successBlock:successBlock
-                                                        pauseBlock:pauseBlock
-                                                        errorBlock:errorBlock];
-                            
-                        });
-                        
-                    } errorBlock:errorBlock];
+    // pages are requested ahead of the consumer, within the rate limits, see STTwitterCursorPaginator
+    STTwitterCursorPaginator *paginator = [[STTwitterCursorPaginator alloc] initWithTwitterAPI:self
+                                                                                      resource:resource
+                                                                                    HTTPMethod:HTTPMethod
+                                                                                 baseURLString:baseURLString
+                                                                                    parameters:params];
+    paginator.pauseBlock = pauseBlock;
+    paginator.downloadProgressBlock = downloadProgressBlock;
+    
+    [paginator enumeratePagesUsingBlock:^(STTwitterCursorPage *page, BOOL *stop) {
+        successBlock(page.request, page.requestHeaders, page.responseHeaders, page.response, page.morePagesToCome, stop);
+    } errorBlock:^(NSError *error) {
+        // the paginator stands for the request when it was cancelled
+        errorBlock(paginator.failedRequest ? paginator.failedRequest : paginator, paginator.failedRequestHeaders, paginator.failedResponseHeaders, error);
+    }];
+    
+    return paginator;
 }
 
 - (NSObject<STTwitterRequestProtocol> *)getResource:(NSString *)resource
@@ -450,6 +502,17 @@ authenticateInsteadOfAuthorize:authenticateInsteadOfAuthorize
                                        successBlock:(void(^)(NSDictionary *rateLimits, id json))successBlock
                                          errorBlock:(void(^)(NSError *error))errorBlock {
     
+    if(downloadProgressBlock == nil) {
+        return [self fetchCoalescedGETResource:resource
+                                 baseURLString:baseURLString
+                                    parameters:parameters
+                                  successBlock:^(id request, NSDictionary *requestHeaders, NSDictionary *responseHeaders, id response) {
+                                      if(successBlock) successBlock(responseHeaders, response);
+                                  } errorBlock:^(id request, NSDictionary *requestHeaders, NSDictionary *responseHeaders, NSError *error) {
+                                      if(errorBlock) errorBlock(error);
+                                  }];
+    }
+    
     return [_oauth fetchResource:resource
                       HTTPMethod:@"GET"
                    baseURLString:baseURLString
@@ -1322,6 +1385,110 @@ authenticateInsteadOfAuthorize:authenticateInsteadOfAuthorize
 
 #pragma mark Streaming
 
+- (NSObject<STTwitterRequestProtocol> *)streamResource:(NSString *)resource
+                                            HTTPMethod:(NSString *)HTTPMethod
+                                         baseURLString:(NSString *)baseURLString
+                                            parameters:(NSDictionary *)params
+                                         acceptedTypes:(STTwitterStreamJSONTypeMask)acceptedTypes
+                                         progressBlock:(void(^)(NSDictionary *json, STTwitterStreamJSONType type))progressBlock
+                                            errorBlock:(void(^)(NSError *error))errorBlock {
+    
+    return [self streamResource:resource HTTPMethod:HTTPMethod baseURLString:baseURLString parameters:params subscribeBlock:^STTwitterStreamSubscription *(STTwitterStreamSession *session) {
+        return [session subscribeWithAcceptedTypes:acceptedTypes progressBlock:progressBlock errorBlock:errorBlock];
+    }];
+}
+
+- (NSObject<STTwitterRequestProtocol> *)streamResource:(NSString *)resource
+                                            HTTPMethod:(NSString *)HTTPMethod
+                                         baseURLString:(NSString *)baseURLString
+                                            parameters:(NSDictionary *)params
+                                         acceptedTypes:(STTwitterStreamJSONTypeMask)acceptedTypes
+                                           streamQueue:(STTwitterStreamQueue *)streamQueue
+                                            errorBlock:(void(^)(NSError *error))errorBlock {
+    
+    return [self streamResource:resource HTTPMethod:HTTPMethod baseURLString:baseURLString parameters:params subscribeBlock:^STTwitterStreamSubscription *(STTwitterStreamSession *session) {
+        return [session subscribeWithAcceptedTypes:acceptedTypes streamQueue:streamQueue errorBlock:errorBlock];
+    }];
+}
+
+// streams with the same endpoint and parameters share one connection and one parser
+- (NSObject<STTwitterRequestProtocol> *)streamResource:(NSString *)resource
+                                            HTTPMethod:(NSString *)HTTPMethod
+                                         baseURLString:(NSString *)baseURLString
+                                            parameters:(NSDictionary *)params
+                                        subscribeBlock:(STTwitterStreamSubscription *(^)(STTwitterStreamSession *session))subscribeBlock {
+    
+    NSAssert([NSThread isMainThread], @"streams must be started on the main thread");
+    
+    if(_streamSessions == nil) self.streamSessions = [NSMutableDictionary dictionary];
+    
+    NSString *key = [STTwitterStreamSession keyForResource:resource HTTPMethod:HTTPMethod baseURLString:baseURLString parameters:params];
+    
+    STTwitterStreamSession *session = _streamSessions[key];
+    
+    if(session) {
+        return subscribeBlock(session);
+    }
+    
+    session = [[STTwitterStreamSession alloc] initWithKey:key decodingConcurrency:[[NSProcessInfo processInfo] activeProcessorCount]];
+    _streamSessions[key] = session;
+    
+    STTwitterStreamSubscription *subscription = subscribeBlock(session);
+    
+    __weak typeof(self) weakSelf = self;
+    STTwitterStreamRecorder *streamRecorder = self.streamRecorder;
+    
+    session.didEndBlock = ^(STTwitterStreamSession *s) {
+        __strong typeof(weakSelf) strongSelf = weakSelf;
+        if(strongSelf.streamSessions[s.key] == s) {
+            [strongSelf.streamSessions removeObjectForKey:s.key];
+        }
+    };
+    
+    // called again by the session for each reconnection
+    session.connectBlock = ^NSObject<STTwitterRequestProtocol> *(STTwitterStreamSession *s) {
+        
+        __strong typeof(weakSelf) strongSelf = weakSelf;
+        if(strongSelf == nil) return nil;
+        
+        __weak STTwitterStreamSession *weakSession = s;
+        
+        return [strongSelf fetchResource:resource
+                              HTTPMethod:HTTPMethod
+                           baseURLString:baseURLString
+                              parameters:params
+                     uploadProgressBlock:nil
+                   downloadProgressBlock:^(NSObject<STTwitterRequestProtocol> *request, NSData *data) {
+                       
+                       [streamRecorder recordData:data];
+                       
+                       [weakSession request:request didReceiveData:data];
+                       
+                   } successBlock:^(NSObject<STTwitterRequestProtocol> *request, NSDictionary *requestHeaders, NSDictionary *responseHeaders, id response) {
+                       
+                       // reaching successBlock for a stream request means the connection was closed
+                       NSError *error = nil;
+                       if([response isKindOfClass:[NSError class]]) {
+                           error = response;
+                       } else if([response isKindOfClass:[NSString class]] && [response length] == 0) {
+                           error = [NSError errorWithDomain:NSStringFromClass([STTwitterAPI class]) code:STTwitterAPIEmptyStream userInfo:@{NSLocalizedDescriptionKey : @"stream is empty"}];
+                       } else {
+                           error = [NSError errorWithDomain:NSStringFromClass([STTwitterAPI class]) code:STTwitterAPIEmptyStream userInfo:@{NSLocalizedDescriptionKey : @"stream ended"}];
+                       }
+                       
+                       [weakSession request:request didFailWithError:error];
+                       
+                   } errorBlock:^(NSObject<STTwitterRequestProtocol> *request, NSDictionary *requestHeaders, NSDictionary *responseHeaders, NSError *error) {
+                       
+                       [weakSession request:request didFailWithError:error];
+                   }];
+    };
+    
+    [session connect];
+    
+    return subscription;
+}
+
 + (NSDictionary *)stallWarningDictionaryFromJSON:(NSString *)json {
     if([json isKindOfClass:[NSDictionary class]]) return nil;
     return [json valueForKey:@"warning"];
@@ -1336,6 +1503,23 @@ authenticateInsteadOfAuthorize:authenticateInsteadOfAuthorize
                                                     progressBlock:(void(^)(NSDictionary *json, STTwitterStreamJSONType type))progressBlock
                                                        errorBlock:(void(^)(NSError *error))errorBlock {
     
+    return [self postStatusesFilterUserIDs:userIDs
+                           keywordsToTrack:keywordsToTrack
+                     locationBoundingBoxes:locationBoundingBoxes
+                             stallWarnings:stallWarnings
+                             acceptedTypes:STTwitterStreamJSONTypeMaskAll
+                             progressBlock:progressBlock
+                                errorBlock:errorBlock];
+}
+
+- (NSObject<STTwitterRequestProtocol> *)postStatusesFilterUserIDs:(NSArray *)userIDs
+                                                  keywordsToTrack:(NSArray *)keywordsToTrack
+                                            locationBoundingBoxes:(NSArray *)locationBoundingBoxes
+                                                    stallWarnings:(NSNumber *)stallWarnings
+                                                    acceptedTypes:(STTwitterStreamJSONTypeMask)acceptedTypes
+                                                    progressBlock:(void(^)(NSDictionary *json, STTwitterStreamJSONType type))progressBlock
+                                                       errorBlock:(void(^)(NSError *error))errorBlock {
+    
     NSString *follow = [userIDs componentsJoinedByString:@","];
     NSString *keywords = [keywordsToTrack componentsJoinedByString:@","];
     NSString *locations = [locationBoundingBoxes componentsJoinedByString:@","];
@@ -1344,6 +1528,7 @@ authenticateInsteadOfAuthorize:authenticateInsteadOfAuthorize
     
     NSMutableDictionary *md = [NSMutableDictionary dictionary];
     md[@"delimited"] = @"length";
+    md[kSTStreamRequestKey] = @"1";
     
     if(stallWarnings) md[@"stall_warnings"] = [stallWarnings boolValue] ? @"1" : @"0";
     
@@ -1351,33 +1536,13 @@ authenticateInsteadOfAuthorize:authenticateInsteadOfAuthorize
     if([keywords length]) md[@"track"] = keywords;
     if([locations length]) md[@"locations"] = locations;
     
-    self.streamParser = [[STTwitterStreamParser alloc] init];
-    __weak STTwitterStreamParser *streamParser = self.streamParser;
-    
-    return [self postResource:@"statuses/filter.json"
-                baseURLString:kBaseURLStringStream_1_1
-                   parameters:md
-          uploadProgressBlock:nil
-        downloadProgressBlock:^(NSData *data) {
-            
-            if (streamParser) {
-                [streamParser parseWithStreamData:data parsedJSONBlock:^(NSDictionary *json, STTwitterStreamJSONType type) {
-                    progressBlock(json, type);
-                }];
-            }
-            
-        } successBlock:^(NSDictionary *rateLimits, id response) {
-            if([response isKindOfClass:[NSString class]] && [response length] == 0) {
-                NSError *error = [NSError errorWithDomain:NSStringFromClass([self class]) code:STTwitterAPIEmptyStream userInfo:@{NSLocalizedDescriptionKey : @"stream is empty"}];
-                errorBlock(error);
-                return;
-            };
-            
-            // reaching successBlock for a stream request is an error
-            errorBlock(response);
-        } errorBlock:^(NSError *error) {
-            errorBlock(error);
-        }];
+    return [self streamResource:@"statuses/filter.json"
+                     HTTPMethod:@"POST"
+                  baseURLString:kBaseURLStringStream_1_1
+                     parameters:md
+                  acceptedTypes:acceptedTypes
+                  progressBlock:progressBlock
+                     errorBlock:errorBlock];
 }
 
 // convenience
@@ -1392,6 +1557,7 @@ authenticateInsteadOfAuthorize:authenticateInsteadOfAuthorize
                            keywordsToTrack:@[keyword]
                      locationBoundingBoxes:nil
                              stallWarnings:stallWarningBlock ? @YES : @NO
+                             acceptedTypes:STTwitterStreamJSONTypeMaskTweet | STTwitterStreamJSONTypeMaskWarning
                              progressBlock:^(NSDictionary *json, STTwitterStreamJSONType type) {
                                  
                                  switch (type) {
@@ -1427,31 +1593,30 @@ authenticateInsteadOfAuthorize:authenticateInsteadOfAuthorize
                                                          progressBlock:(void(^)(NSDictionary *json, STTwitterStreamJSONType type))progressBlock
                                                             errorBlock:(void(^)(NSError *error))errorBlock {
     
+    return [self getStatusesSampleStallWarnings:stallWarnings
+                                  acceptedTypes:STTwitterStreamJSONTypeMaskAll
+                                  progressBlock:progressBlock
+                                     errorBlock:errorBlock];
+}
+
+- (NSObject<STTwitterRequestProtocol> *)getStatusesSampleStallWarnings:(NSNumber *)stallWarnings
+                                                         acceptedTypes:(STTwitterStreamJSONTypeMask)acceptedTypes
+                                                         progressBlock:(void(^)(NSDictionary *json, STTwitterStreamJSONType type))progressBlock
+                                                            errorBlock:(void(^)(NSError *error))errorBlock {
+    
     NSMutableDictionary *md = [NSMutableDictionary dictionary];
     md[@"delimited"] = @"length";
+    md[kSTStreamRequestKey] = @"1";
     
     if(stallWarnings) md[@"stall_warnings"] = [stallWarnings boolValue] ? @"1" : @"0";
     
-    self.streamParser = [[STTwitterStreamParser alloc] init];
-    __weak STTwitterStreamParser *streamParser = self.streamParser;
-    
-    return [self getResource:@"statuses/sample.json"
-               baseURLString:kBaseURLStringStream_1_1
-                  parameters:md
-       downloadProgressBlock:^(id response) {
-           
-           if (streamParser) {
-               [streamParser parseWithStreamData:response parsedJSONBlock:^(NSDictionary *json, STTwitterStreamJSONType type) {
-                   progressBlock(json, type);
-               }];
-           }
-           
-       } successBlock:^(NSDictionary *rateLimits, id json) {
-           // reaching successBlock for a stream request is an error
-           errorBlock(json);
-       } errorBlock:^(NSError *error) {
-           errorBlock(error);
-       }];
+    return [self streamResource:@"statuses/sample.json"
+                     HTTPMethod:@"GET"
+                  baseURLString:kBaseURLStringStream_1_1
+                     parameters:md
+                  acceptedTypes:acceptedTypes
+                  progressBlock:progressBlock
+                     errorBlock:errorBlock];
 }
 
 // convenience
@@ -1460,6 +1625,7 @@ authenticateInsteadOfAuthorize:authenticateInsteadOfAuthorize
                                                          errorBlock:(void (^)(NSError *))errorBlock
 {
     return [self getStatusesSampleStallWarnings:stallWarningBlock ? @YES : @NO
+                                  acceptedTypes:STTwitterStreamJSONTypeMaskTweet | STTwitterStreamJSONTypeMaskWarning
                                   progressBlock:^(NSDictionary *json, STTwitterStreamJSONType type) {
                                       
                                       switch (type) {
@@ -1496,30 +1662,18 @@ authenticateInsteadOfAuthorize:authenticateInsteadOfAuthorize
     
     NSMutableDictionary *md = [NSMutableDictionary dictionary];
     md[@"delimited"] = @"length";
+    md[kSTStreamRequestKey] = @"1";
     
     if(count) md[@"count"] = count;
     if(stallWarnings) md[@"stall_warnings"] = [stallWarnings boolValue] ? @"1" : @"0";
     
-    self.streamParser = [[STTwitterStreamParser alloc] init];
-    __weak STTwitterStreamParser *streamParser = self.streamParser;
-    
-    return [self getResource:@"statuses/firehose.json"
-               baseURLString:kBaseURLStringStream_1_1
-                  parameters:md
-       downloadProgressBlock:^(id response) {
-           
-           if (streamParser) {
-               [streamParser parseWithStreamData:response parsedJSONBlock:^(NSDictionary *json, STTwitterStreamJSONType type) {
-                   progressBlock(json, type);
-               }];
-           }
-           
-       } successBlock:^(NSDictionary *rateLimits, id json) {
-           // reaching successBlock for a stream request is an error
-           errorBlock(json);
-       } errorBlock:^(NSError *error) {
-           errorBlock(error);
-       }];
+    return [self streamResource:@"statuses/firehose.json"
+                     HTTPMethod:@"GET"
+                  baseURLString:kBaseURLStringStream_1_1
+                     parameters:md
+                  acceptedTypes:STTwitterStreamJSONTypeMaskAll
+                  progressBlock:progressBlock
+                     errorBlock:errorBlock];
 }
 
 // GET user
@@ -1531,9 +1685,29 @@ authenticateInsteadOfAuthorize:authenticateInsteadOfAuthorize
                                                      progressBlock:(void(^)(NSDictionary *json, STTwitterStreamJSONType type))progressBlock
                                                         errorBlock:(void(^)(NSError *error))errorBlock {
     
+    return [self getUserStreamStallWarnings:stallWarnings
+        includeMessagesFromFollowedAccounts:includeMessagesFromFollowedAccounts
+                             includeReplies:includeReplies
+                            keywordsToTrack:keywordsToTrack
+                      locationBoundingBoxes:locationBoundingBoxes
+                              acceptedTypes:STTwitterStreamJSONTypeMaskAll
+                              progressBlock:progressBlock
+                                 errorBlock:errorBlock];
+}
+
+- (NSObject<STTwitterRequestProtocol> *)getUserStreamStallWarnings:(NSNumber *)stallWarnings
+                               includeMessagesFromFollowedAccounts:(NSNumber *)includeMessagesFromFollowedAccounts // default: @(NO)
+                                                    includeReplies:(NSNumber *)includeReplies
+                                                   keywordsToTrack:(NSArray *)keywordsToTrack
+                                             locationBoundingBoxes:(NSArray *)locationBoundingBoxes
+                                                     acceptedTypes:(STTwitterStreamJSONTypeMask)acceptedTypes
+                                                     progressBlock:(void(^)(NSDictionary *json, STTwitterStreamJSONType type))progressBlock
+                                                        errorBlock:(void(^)(NSError *error))errorBlock {
+    
     NSMutableDictionary *md = [NSMutableDictionary dictionary];
     md[@"stringify_friend_ids"] = @"1";
     md[@"delimited"] = @"length";
+    md[kSTStreamRequestKey] = @"1";
     
     if(stallWarnings) md[@"stall_warnings"] = [stallWarnings boolValue] ? @"1" : @"0";
     if(includeMessagesFromFollowedAccounts) md[@"with"] = @"followings";
@@ -1545,26 +1719,13 @@ authenticateInsteadOfAuthorize:authenticateInsteadOfAuthorize
     if([keywords length]) md[@"track"] = keywords;
     if([locations length]) md[@"locations"] = locations;
     
-    self.streamParser = [[STTwitterStreamParser alloc] init];
-    __weak STTwitterStreamParser *streamParser = self.streamParser;
-    
-    return [self getResource:@"user.json"
-               baseURLString:kBaseURLStringUserStream_1_1
-                  parameters:md
-       downloadProgressBlock:^(id response) {
-           
-           if (streamParser) {
-               [streamParser parseWithStreamData:response parsedJSONBlock:^(NSDictionary *json, STTwitterStreamJSONType type) {
-                   progressBlock(json, type);
-               }];
-           }
-           
-       } successBlock:^(NSDictionary *rateLimits, id json) {
-           // reaching successBlock for a stream request is an error
-           errorBlock(json);
-       } errorBlock:^(NSError *error) {
-           errorBlock(error);
-       }];
+    return [self streamResource:@"user.json"
+                     HTTPMethod:@"GET"
+                  baseURLString:kBaseURLStringUserStream_1_1
+                     parameters:md
+                  acceptedTypes:acceptedTypes
+                  progressBlock:progressBlock
+                     errorBlock:errorBlock];
 }
 
 // convenience
@@ -1581,6 +1742,7 @@ authenticateInsteadOfAuthorize:authenticateInsteadOfAuthorize
                              includeReplies:includeReplies
                             keywordsToTrack:keywordsToTrack
                       locationBoundingBoxes:locationBoundingBoxes
+                              acceptedTypes:STTwitterStreamJSONTypeMaskTweet | STTwitterStreamJSONTypeMaskWarning
                               progressBlock:^(NSDictionary *json, STTwitterStreamJSONType type) {
                                   
                                   switch (type) {
@@ -1629,6 +1791,7 @@ authenticateInsteadOfAuthorize:authenticateInsteadOfAuthorize
     NSMutableDictionary *md = [NSMutableDictionary dictionary];
     md[@"stringify_friend_ids"] = @"1";
     if(delimited) md[@"delimited"] = [delimited boolValue] ? @"1" : @"0";
+    md[kSTStreamRequestKey] = @"1";
     if(stallWarnings) md[@"stall_warnings"] = [stallWarnings boolValue] ? @"1" : @"0";
     if(restrictToUserMessages) md[@"with"] = @"user"; // default is 'followings'
     if(includeReplies && [includeReplies boolValue]) md[@"replies"] = @"all";
@@ -1636,26 +1799,13 @@ authenticateInsteadOfAuthorize:authenticateInsteadOfAuthorize
     NSString *follow = [userIDs componentsJoinedByString:@","];
     if([follow length]) md[@"follow"] = follow;
     
-    self.streamParser = [[STTwitterStreamParser alloc] init];
-    __weak STTwitterStreamParser *streamParser = self.streamParser;
-    
-    return [self getResource:@"site.json"
-               baseURLString:kBaseURLStringSiteStream_1_1
-                  parameters:md
-       downloadProgressBlock:^(NSData *data) {
-           
-           if (streamParser) {
-               [streamParser parseWithStreamData:data parsedJSONBlock:^(NSDictionary *json, STTwitterStreamJSONType type) {
-                   progressBlock(json, type);
-               }];
-           }
-           
-       } successBlock:^(NSDictionary *rateLimits, id json) {
-           // reaching successBlock for a stream request is an error
-           errorBlock(json);
-       } errorBlock:^(NSError *error) {
-           errorBlock(error);
-       }];
+    return [self streamResource:@"site.json"
+                     HTTPMethod:@"GET"
+                  baseURLString:kBaseURLStringSiteStream_1_1
+                     parameters:md
+                  acceptedTypes:STTwitterStreamJSONTypeMaskAll
+                  progressBlock:progressBlock
+                     errorBlock:errorBlock];
 }
 
 #pragma mark Direct Messages
@@ -2577,6 +2727,13 @@ authenticateInsteadOfAuthorize:authenticateInsteadOfAuthorize
     }];
 }
 
+- (STTwitterUserLookupBatcher *)userLookupBatcher {
+    if(_userLookupBatcher == nil) {
+        self.userLookupBatcher = [[STTwitterUserLookupBatcher alloc] initWithTwitterAPI:self];
+    }
+    return _userLookupBatcher;
+}
+
 - (NSObject<STTwitterRequestProtocol> *)getUserInformationFor:(NSString *)screenName
                                                  successBlock:(void(^)(NSDictionary *user))successBlock
                                                    errorBlock:(void(^)(NSError *error))errorBlock {
@@ -4246,6 +4403,7 @@ authenticateInsteadOfAuthorize:authenticateInsteadOfAuthorize
     if (resources)
         d = @{ @"resources" : [resources componentsJoinedByString:@","] };
     return [self getAPIResource:@"application/rate_limit_status.json" parameters:d successBlock:^(NSDictionary *rateLimits, id response) {
+        [[STTwitterRateLimiter sharedRateLimiter] updateWithRateLimitStatus:response];
         successBlock(response);
     } errorBlock:^(NSError *error) {
         errorBlock(error);
@@ -4344,7 +4502,7 @@ authenticateInsteadOfAuthorize:authenticateInsteadOfAuthorize
     
     // https://dev.twitter.com/rest/public/uploading-media
     
-    NSData *data = [NSData dataWithContentsOfURL:videoMediaURL];
+    NSData *data = [NSData dataWithContentsOfURL:videoMediaURL options:NSDataReadingMappedIfSafe error:nil]; // only the length is needed
     
     if(data == nil) {
         NSError *error = [NSError errorWithDomain:NSStringFromClass([self class])
@@ -4383,95 +4541,50 @@ authenticateInsteadOfAuthorize:authenticateInsteadOfAuthorize
                  }];
 }
 
-- (void)postMediaUploadAPPENDWithVideoURL:(NSURL *)videoMediaURL
-                                  mediaID:(NSString *)mediaID
-                      uploadProgressBlock:(void(^)(int64_t bytesWritten, int64_t totalBytesWritten, int64_t totalBytesExpectedToWrite))uploadProgressBlock
-                             successBlock:(void(^)(id response))successBlock
-                               errorBlock:(void(^)(NSError *error))errorBlock {
+- (STTwitterMediaUploader *)postMediaUploadAPPENDWithVideoURL:(NSURL *)videoMediaURL
+                                                      mediaID:(NSString *)mediaID
+                                          uploadProgressBlock:(void(^)(int64_t bytesWritten, int64_t totalBytesWritten, int64_t totalBytesExpectedToWrite))uploadProgressBlock
+                                                 successBlock:(void(^)(id response))successBlock
+                                                   errorBlock:(void(^)(NSError *error))errorBlock {
     
     // https://dev.twitter.com/rest/public/uploading-media
     // https://dev.twitter.com/rest/reference/post/media/upload-chunked
     
-    NSData *data = [NSData dataWithContentsOfURL:videoMediaURL];
-    
-    NSInteger dataLength = [data length];
-    
-    if(dataLength == 0) {
-        NSError *error = [NSError errorWithDomain:NSStringFromClass([self class]) code:STTwitterAPIMediaDataIsEmpty userInfo:@{NSLocalizedDescriptionKey : @"cannot upload empty data"}];
-        errorBlock(error);
-        return;
-    }
+    // segments are read from the mapped file and sent a few at a time, see STTwitterMediaUploader
+    STTwitterMediaUploader *uploader = [[STTwitterMediaUploader alloc] initWithTwitterAPI:self fileURL:videoMediaURL mediaID:mediaID];
+    uploader.uploadProgressBlock = uploadProgressBlock;
     
-    NSString *fileName = [videoMediaURL isFileURL] ? [[videoMediaURL path] lastPathComponent] : @"media.jpg";
+    [uploader startWithSuccessBlock:^(id response) {
+        if(successBlock) successBlock(response);
+    } errorBlock:^(NSError *error) {
+        if(errorBlock) errorBlock(error);
+    }];
     
-    NSUInteger fiveMegaBytes = 5 * (int) pow((double) 2,20);
+    return uploader;
+}
+
+- (STTwitterMediaUploader *)postMediaUploadAPPENDWithResumeData:(NSDictionary *)resumeData
+                                            uploadProgressBlock:(void(^)(int64_t bytesWritten, int64_t totalBytesWritten, int64_t totalBytesExpectedToWrite))uploadProgressBlock
+                                                   successBlock:(void(^)(id response))successBlock
+                                                     errorBlock:(void(^)(NSError *error))errorBlock {
     
-    NSUInteger segmentIndex = 0;
+    STTwitterMediaUploader *uploader = [[STTwitterMediaUploader alloc] initWithTwitterAPI:self resumeData:resumeData];
     
-    __block id lastResponseReceived = nil;
-    __block NSError *lastErrorReceived = nil;
-    __block NSUInteger accumulatedBytesWritten = 0;
+    if(uploader == nil) {
+        NSError *error = [NSError errorWithDomain:NSStringFromClass([self class]) code:0 userInfo:@{NSLocalizedDescriptionKey : @"cannot resume upload, the resume data is invalid or the file changed"}];
+        if(errorBlock) errorBlock(error);
+        return nil;
+    }
     
-    dispatch_group_t group = dispatch_group_create();
+    uploader.uploadProgressBlock = uploadProgressBlock;
     
-    while((segmentIndex * fiveMegaBytes) < dataLength) {
-        
-        NSUInteger subDataLength = MIN(dataLength - segmentIndex * fiveMegaBytes, fiveMegaBytes);
-        NSRange subDataRange = NSMakeRange(segmentIndex * fiveMegaBytes, subDataLength);
-        NSData *subData = [data subdataWithRange:subDataRange];
-        
-        //NSLog(@"-- SEGMENT INDEX %lu, SUBDATA %@", segmentIndex, NSStringFromRange(subDataRange));
-        
-        __weak typeof(self) weakSelf = self;
-        
-        dispatch_group_enter(group);
-        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^{
-        
-            __strong typeof(weakSelf) strongSelf = weakSelf;
-            if(strongSelf == nil) {
-                lastErrorReceived = [NSError errorWithDomain:@"STTwitter" code:9999 userInfo:nil]; // TODO: improve
-                return;
-            }
-            
-            NSMutableDictionary *md = [NSMutableDictionary dictionary];
-            md[@"command"] = @"APPEND";
-            md[@"media_id"] = mediaID;
-            md[@"segment_index"] = [NSString stringWithFormat:@"%lu", (unsigned long)segmentIndex];
-            md[@"media"] = subData;
-            md[kSTPOSTDataKey] = @"media";
-            md[kSTPOSTMediaFileNameKey] = fileName;
-            
-            //NSLog(@"-- POST %@", [md valueForKey:@"segment_index"]);
-            
-            [strongSelf postResource:@"media/upload.json"
-                 baseURLString:kBaseURLStringUpload_1_1
-                    parameters:md
-           uploadProgressBlock:^(int64_t bytesWritten, int64_t totalBytesWritten, int64_t totalBytesExpectedToWrite) {
-               accumulatedBytesWritten += bytesWritten;
-               uploadProgressBlock(bytesWritten, accumulatedBytesWritten, dataLength);
-           } downloadProgressBlock:nil
-                  successBlock:^(NSDictionary *rateLimits, id response) {
-                      //NSLog(@"-- POST OK %@", [md valueForKey:@"segment_index"]);
-                      lastResponseReceived = response;
-                      dispatch_group_leave(group);
-                  } errorBlock:^(NSError *error) {
-                      //NSLog(@"-- POST KO %@", [md valueForKey:@"segment_index"]);
-                      errorBlock(error);
-                      dispatch_group_leave(group);
-                  }];
-        });
-        
-        segmentIndex += 1;
-    }
+    [uploader startWithSuccessBlock:^(id response) {
+        if(successBlock) successBlock(response);
+    } errorBlock:^(NSError *error) {
+        if(errorBlock) errorBlock(error);
+    }];
     
-    dispatch_group_notify(group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^{
-        NSLog(@"finished");
-        if(lastErrorReceived) {
-            errorBlock(lastErrorReceived);
-        } else {
-            successBlock(lastResponseReceived);
-        }
-    });
+    return uploader;
 }
 
 - (NSObject<STTwitterRequestProtocol> *)postMediaUploadFINALIZEWithMediaID:(NSString *)mediaID
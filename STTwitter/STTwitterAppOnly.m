@@ -185,9 +185,11 @@
         [r setHeaderWithName:@"Authorization" value:[NSString stringWithFormat:@"Bearer %@", _bearerToken]];
     }
     
-    r.GETDictionary = params;
+    r.responseCacheVariant = _consumerKey; // application-only responses don't depend on a user
+    r.schedulingGroup = _consumerKey;
+    r.GETDictionary = [r st_parametersByConsumingRequestKeys:params];
     
-    [r startAsynchronous];
+    [r st_startAsynchronousWithinRateLimits];
     
     return r;
 }
@@ -254,6 +256,10 @@
                                                errorBlock(wr, requestHeaders, responseHeaders, error);
                                            }];
     
+    r.schedulingGroup = _consumerKey;
+    
+    params = [r st_parametersByConsumingRequestKeys:params];
+    
     NSMutableDictionary *paramsToBeSent = [NSMutableDictionary dictionaryWithCapacity:[params count]];
     
     NSString *stTwitterHeaderPrefix = @"[STTWITTER_HEADER_APPONLY_POST]";
@@ -285,7 +291,7 @@
         r.encodePOSTDictionary = YES;
     }
     
-    [r startAsynchronous];
+    [r st_startAsynchronousWithinRateLimits];
     
     return r;
 }
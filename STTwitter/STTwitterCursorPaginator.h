@@ -0,0 +1,64 @@
+//
+//  STTwitterCursorPaginator.h
+//  STTwitter
+//
+
+#import <Foundation/Foundation.h>
+#import "STTwitterRequestProtocol.h"
+
+@class STTwitterAPI;
+
+@interface STTwitterCursorPage : NSObject
+
+@property (nonatomic, strong, readonly) NSObject<STTwitterRequestProtocol> *request;
+@property (nonatomic, strong, readonly) NSDictionary *requestHeaders;
+@property (nonatomic, strong, readonly) NSDictionary *responseHeaders;
+@property (nonatomic, strong, readonly) id response;
+@property (nonatomic, readonly) BOOL morePagesToCome;
+
+@end
+
+/*
+ Follows the cursors of a resource, https://dev.twitter.com/overview/api/cursoring
+
+ The request for page N+1 is sent as soon as page N is received, while the consumer still processes page N,
+ up to prefetchDepth pages ahead of the consumer. Pages are requested with the backfill priority.
+
+ Rate limits are respected: pages are prefetched only while x-rate-limit-remaining leaves room for them
+ and for rateLimitReserve other requests, then the paginator waits for pages to be consumed, or for the limit to reset.
+
+ The paginator runs on the main queue, its blocks are called on the main queue.
+ */
+
+@interface STTwitterCursorPaginator : NSObject <STTwitterRequestProtocol>
+
+- (instancetype)initWithTwitterAPI:(STTwitterAPI *)twitter
+                          resource:(NSString *)resource
+                        HTTPMethod:(NSString *)HTTPMethod
+                     baseURLString:(NSString *)baseURLString
+                        parameters:(NSDictionary *)params;
+
+@property (nonatomic) NSUInteger prefetchDepth; // default 2, pages received ahead of the consumer, 0 fetches on demand
+@property (nonatomic) NSUInteger rateLimitReserve; // default 1, requests left in the rate limit window for other uses
+@property (nonatomic, copy) void(^pauseBlock)(NSDate *nextRequestDate); // the rate limit is exhausted, requests resume at nextRequestDate
+@property (nonatomic, copy) void(^downloadProgressBlock)(NSObject<STTwitterRequestProtocol> *request, NSData *data);
+
+// async iterator, pages are delivered in order, a nil page and a nil error when all pages were delivered
+- (void)nextPageWithCompletionBlock:(void(^)(STTwitterCursorPage *page, NSError *error))completionBlock;
+
+// pulls pages until the last one, an error, or stop
+- (void)enumeratePagesUsingBlock:(void(^)(STTwitterCursorPage *page, BOOL *stop))block
+                      errorBlock:(void(^)(NSError *error))errorBlock;
+
+- (void)cancel; // cancels the request in flight, pending completion blocks receive a cancellation error
+
+@property (nonatomic, readonly) BOOL isFinished; // no more pages to deliver
+@property (nonatomic, readonly) NSUInteger fetchedPagesCount;
+@property (nonatomic, readonly) NSUInteger bufferedPagesCount;
+
+// the request which failed, once a completion block received its error
+@property (nonatomic, strong, readonly) NSObject<STTwitterRequestProtocol> *failedRequest;
+@property (nonatomic, strong, readonly) NSDictionary *failedRequestHeaders;
+@property (nonatomic, strong, readonly) NSDictionary *failedResponseHeaders;
+
+@end
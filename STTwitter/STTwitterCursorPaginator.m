@@ -0,0 +1,281 @@
+//
+//  STTwitterCursorPaginator.m
+//  STTwitter
+//
+
+#import "STTwitterCursorPaginator.h"
+#import "STTwitterAPI.h"
+#import "STHTTPRequest.h"
+#import "NSString+STTwitter.h"
+
+@interface STTwitterCursorPage ()
+@property (nonatomic, strong) NSObject<STTwitterRequestProtocol> *request;
+@property (nonatomic, strong) NSDictionary *requestHeaders;
+@property (nonatomic, strong) NSDictionary *responseHeaders;
+@property (nonatomic, strong) id response;
+@property (nonatomic) BOOL morePagesToCome;
+@end
+
+@implementation STTwitterCursorPage
+@end
+
+/**/
+
+@interface STTwitterCursorPaginator ()
+@property (nonatomic, strong) STTwitterAPI *twitter;
+@property (nonatomic, strong) NSString *resource;
+@property (nonatomic, strong) NSString *HTTPMethod;
+@property (nonatomic, strong) NSString *baseURLString;
+@property (nonatomic, strong) NSDictionary *params;
+
+@property (nonatomic, strong) NSString *nextCursor; // nil before the first page
+@property (nonatomic) BOOL isLastPageReceived;
+@property (nonatomic, strong) NSError *error;
+@property (nonatomic) BOOL isCancelled;
+@property (nonatomic, strong) NSObject<STTwitterRequestProtocol> *failedRequest;
+@property (nonatomic, strong) NSDictionary *failedRequestHeaders;
+@property (nonatomic, strong) NSDictionary *failedResponseHeaders;
+
+@property (nonatomic, strong) NSObject<STTwitterRequestProtocol> *request; // in flight
+@property (nonatomic) BOOL isPaused; // waiting for the rate limit reset
+@property (nonatomic, strong) NSMutableArray *pages; // STTwitterCursorPage instances, received and not yet delivered
+@property (nonatomic, strong) NSMutableArray *completionBlocks; // waiting for pages
+
+@property (nonatomic) NSInteger rateLimitRemaining; // -1 when unknown
+@property (nonatomic) NSTimeInterval rateLimitReset; // since 1970
+@property (nonatomic) NSUInteger fetchedPagesCount;
+@end
+
+@implementation STTwitterCursorPaginator
+
+- (instancetype)initWithTwitterAPI:(STTwitterAPI *)twitter
+                          resource:(NSString *)resource
+                        HTTPMethod:(NSString *)HTTPMethod
+                     baseURLString:(NSString *)baseURLString
+                        parameters:(NSDictionary *)params {
+    self = [super init];
+    
+    self.twitter = twitter;
+    self.resource = resource;
+    self.HTTPMethod = HTTPMethod;
+    self.baseURLString = baseURLString;
+    
+    // following cursors must not delay the requests of the user
+    NSMutableDictionary *md = params ? [params mutableCopy] : [NSMutableDictionary dictionary];
+    if(md[kSTRequestPriorityKey] == nil) md[kSTRequestPriorityKey] = @(STHTTPRequestPriorityBackfill);
+    self.params = md;
+    
+    self.nextCursor = params[@"cursor"];
+    self.prefetchDepth = 2;
+    self.rateLimitReserve = 1;
+    self.rateLimitRemaining = -1;
+    self.pages = [NSMutableArray array];
+    self.completionBlocks = [NSMutableArray array];
+    
+    return self;
+}
+
+- (BOOL)isFinished {
+    return (_isLastPageReceived || _error) && [_pages count] == 0;
+}
+
+- (NSUInteger)bufferedPagesCount {
+    return [_pages count];
+}
+
+#pragma mark Iteration
+
+- (void)nextPageWithCompletionBlock:(void(^)(STTwitterCursorPage *page, NSError *error))completionBlock {
+    
+    if([NSThread isMainThread] == NO) {
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [self nextPageWithCompletionBlock:completionBlock];
+        });
+        return;
+    }
+    
+    [_completionBlocks addObject:[completionBlock copy]];
+    
+    [self deliverPages];
+    [self fetchNextPageIfNeeded];
+}
+
+- (void)enumeratePagesUsingBlock:(void(^)(STTwitterCursorPage *page, BOOL *stop))block
+                      errorBlock:(void(^)(NSError *error))errorBlock {
+    
+    // the next page is already requested when the block is called, see prefetchDepth
+    [self nextPageWithCompletionBlock:^(STTwitterCursorPage *page, NSError *error) {
+        
+        if(page == nil) {
+            if(error && errorBlock) errorBlock(error);
+            return;
+        }
+        
+        BOOL stop = NO;
+        block(page, &stop);
+        
+        if(stop) {
+            [self cancelRequest];
+            return;
+        }
+        
+        if(page.morePagesToCome) {
+            [self enumeratePagesUsingBlock:block errorBlock:errorBlock];
+        }
+    }];
+}
+
+- (void)cancel {
+    
+    if([NSThread isMainThread] == NO) {
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [self cancel];
+        });
+        return;
+    }
+    
+    [self cancelRequest];
+    
+    self.error = [NSError st_cancellationError];
+    
+    [_pages removeAllObjects];
+    [self deliverPages];
+}
+
+// stops fetching without notifying anyone
+- (void)cancelRequest {
+    self.isCancelled = YES;
+    
+    NSObject<STTwitterRequestProtocol> *request = _request;
+    self.request = nil;
+    [request cancel]; // its error block finds isCancelled
+}
+
+#pragma mark Delivery
+
+- (void)deliverPages {
+    
+    while([_completionBlocks count] > 0) {
+        
+        STTwitterCursorPage *page = [_pages firstObject];
+        
+        if(page == nil && [self isFinished] == NO) return; // waiting for the network
+        
+        void(^completionBlock)(STTwitterCursorPage *page, NSError *error) = [_completionBlocks firstObject];
+        [_completionBlocks removeObjectAtIndex:0];
+        
+        if(page) {
+            [_pages removeObjectAtIndex:0];
+            completionBlock(page, nil);
+        } else {
+            completionBlock(nil, _error); // finished
+        }
+    }
+}
+
+#pragma mark Fetching
+
+- (BOOL)hasRateLimitRoomForRequests:(NSUInteger)requestsCount {
+    if(_rateLimitRemaining < 0) return YES; // unknown
+    if([[NSDate date] timeIntervalSince1970] > _rateLimitReset) return YES; // new window
+    return _rateLimitRemaining >= (NSInteger)(requestsCount + _rateLimitReserve);
+}
+
+- (void)fetchNextPageIfNeeded {
+    
+    if(_request || _isPaused || _isLastPageReceived || _error || _isCancelled) return;
+    
+    BOOL isDemanded = [_completionBlocks count] > [_pages count];
+    BOOL canPrefetch = [_pages count] < _prefetchDepth;
+    
+    if(isDemanded == NO && canPrefetch == NO) return;
+    
+    // prefetching leaves room for the pages already buffered, a demanded page only for the reserve
+    NSUInteger requestsCount = isDemanded ? 1 : [_pages count] + 1;
+    
+    if([self hasRateLimitRoomForRequests:requestsCount] == NO) {
+        
+        if(isDemanded == NO) return; // fetched later, on demand
+        
+        NSTimeInterval timeInterval = _rateLimitReset - [[NSDate date] timeIntervalSince1970] + 5;
+        
+        self.isPaused = YES;
+        if(_pauseBlock) _pauseBlock([NSDate dateWithTimeIntervalSinceNow:timeInterval]);
+        
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(timeInterval * NSEC_PER_SEC)), dispatch_get_main_queue(), ^{
+            self.isPaused = NO;
+            self.rateLimitRemaining = -1;
+            [self fetchNextPageIfNeeded];
+        });
+        
+        return;
+    }
+    
+    NSMutableDictionary *params = [_params mutableCopy];
+    if(_nextCursor) params[@"cursor"] = _nextCursor;
+    
+    // the blocks are called asynchronously, once the request is set
+    self.request = [_twitter fetchResource:_resource
+                                HTTPMethod:_HTTPMethod
+                             baseURLString:_baseURLString
+                                parameters:params
+                       uploadProgressBlock:nil
+                     downloadProgressBlock:_downloadProgressBlock
+                              successBlock:^(NSObject<STTwitterRequestProtocol> *request, NSDictionary *requestHeaders, NSDictionary *responseHeaders, id response) {
+                                  dispatch_async(dispatch_get_main_queue(), ^{
+                                      [self didReceiveResponse:response request:request requestHeaders:requestHeaders responseHeaders:responseHeaders];
+                                  });
+                              } errorBlock:^(NSObject<STTwitterRequestProtocol> *request, NSDictionary *requestHeaders, NSDictionary *responseHeaders, NSError *error) {
+                                  dispatch_async(dispatch_get_main_queue(), ^{
+                                      [self didFailWithError:error request:request requestHeaders:requestHeaders responseHeaders:responseHeaders];
+                                  });
+                              }];
+}
+
+- (void)didReceiveResponse:(id)response request:(NSObject<STTwitterRequestProtocol> *)request requestHeaders:(NSDictionary *)requestHeaders responseHeaders:(NSDictionary *)responseHeaders {
+    
+    if(_isCancelled) return;
+    
+    self.request = nil;
+    
+    NSString *remainingString = [responseHeaders objectForKey:@"x-rate-limit-remaining"];
+    NSString *resetString = [responseHeaders objectForKey:@"x-rate-limit-reset"];
+    if(remainingString && resetString) {
+        self.rateLimitRemaining = [remainingString integerValue];
+        self.rateLimitReset = [resetString doubleValue];
+    }
+    
+    NSString *nextCursor = [response isKindOfClass:[NSDictionary class]] ? [response valueForKey:@"next_cursor_str"] : nil;
+    
+    STTwitterCursorPage *page = [[STTwitterCursorPage alloc] init];
+    page.request = request;
+    page.requestHeaders = requestHeaders;
+    page.responseHeaders = responseHeaders;
+    page.response = response;
+    page.morePagesToCome = [nextCursor longLongValue] > 0;
+    
+    self.nextCursor = nextCursor;
+    self.isLastPageReceived = (page.morePagesToCome == NO);
+    self.fetchedPagesCount += 1;
+    
+    [_pages addObject:page];
+    
+    // the next request is sent before the page is delivered
+    [self fetchNextPageIfNeeded];
+    [self deliverPages];
+}
+
+- (void)didFailWithError:(NSError *)error request:(NSObject<STTwitterRequestProtocol> *)request requestHeaders:(NSDictionary *)requestHeaders responseHeaders:(NSDictionary *)responseHeaders {
+    
+    if(_isCancelled) return;
+    
+    self.request = nil;
+    self.failedRequest = request;
+    self.failedRequestHeaders = requestHeaders;
+    self.failedResponseHeaders = responseHeaders;
+    self.error = error ? error : [NSError errorWithDomain:NSStringFromClass([self class]) code:0 userInfo:nil];
+    
+    [self deliverPages];
+}
+
+@end
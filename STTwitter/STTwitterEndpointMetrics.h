@@ -0,0 +1,39 @@
+//
+//  STTwitterEndpointMetrics.h
+//  STTwitter
+//
+
+#import <Foundation/Foundation.h>
+
+@class STHTTPRequestMetrics;
+
+/*
+ Aggregates STHTTPRequestMetrics per endpoint, so that slow endpoints stand out.
+
+ Endpoints are the HTTP method and the URL path, with numeric path components replaced by :id.
+ Total and time to first byte durations are kept in log scale histograms, 4 buckets per doubling from 1 ms,
+ so percentiles are accurate to about 20%. Other phases are kept as sums, for means.
+ */
+
+@interface STTwitterEndpointMetrics : NSObject
+
++ (instancetype)sharedMetrics; // fed by the requests of STTwitterOAuth and STTwitterAppOnly
+
+@property (atomic) BOOL enabled; // default YES
+
++ (NSString *)endpointForHTTPMethod:(NSString *)HTTPMethod URL:(NSURL *)url; // eg. "GET /1.1/statuses/show/:id.json"
+
+- (void)recordRequestMetrics:(STHTTPRequestMetrics *)metrics; // thread safe
+
+- (NSArray *)endpoints;
+- (NSTimeInterval)percentile:(double)percentile ofTotalForEndpoint:(NSString *)endpoint; // percentile in [0, 1], -1 when no samples
+- (NSTimeInterval)percentile:(double)percentile ofTimeToFirstByteForEndpoint:(NSString *)endpoint;
+- (NSArray *)endpointsSortedByPercentile:(double)percentile; // slowest first, by total
+
+// JSON serializable
+// { endpoint : { count, failures, bytes, p50, p90, p99, max, ttfb_p50, ttfb_p90, ttfb_p99, mean : { phase : seconds }, buckets : [[upper_bound_ms, count], ...] } }
+- (NSDictionary *)exportedHistograms;
+
+- (void)reset;
+
+@end
@@ -0,0 +1,242 @@
+//
+//  STTwitterEndpointMetrics.m
+//  STTwitter
+//
+
+#import "STTwitterEndpointMetrics.h"
+#import "STHTTPRequest.h"
+#import "NSString+STTwitter.h"
+
+#define kSTEndpointHistogramBucketsCount 64
+#define kSTEndpointHistogramBucketsPerDoubling 4.0
+
+// bucket i holds the durations in ]2^((i-1)/4), 2^(i/4)] ms, the first bucket everything up to 1 ms, the last one everything above
+static NSUInteger STEndpointHistogramBucketIndex(NSTimeInterval duration) {
+    double ms = duration * 1000.0;
+    if(ms <= 1.0) return 0;
+    double index = ceil(log2(ms) * kSTEndpointHistogramBucketsPerDoubling);
+    if(index >= kSTEndpointHistogramBucketsCount - 1) return kSTEndpointHistogramBucketsCount - 1;
+    return (NSUInteger)index;
+}
+
+static NSTimeInterval STEndpointHistogramBucketUpperBound(NSUInteger index) {
+    return pow(2.0, index / kSTEndpointHistogramBucketsPerDoubling) / 1000.0;
+}
+
+typedef struct {
+    uint64_t counts[kSTEndpointHistogramBucketsCount];
+    uint64_t samplesCount;
+    NSTimeInterval max;
+} STEndpointHistogram;
+
+static void STEndpointHistogramRecord(STEndpointHistogram *h, NSTimeInterval duration) {
+    if(duration < 0) return; // unknown
+    h->counts[STEndpointHistogramBucketIndex(duration)] += 1;
+    h->samplesCount += 1;
+    if(duration > h->max) h->max = duration;
+}
+
+static NSTimeInterval STEndpointHistogramPercentile(const STEndpointHistogram *h, double percentile) {
+    if(h->samplesCount == 0) return -1;
+    
+    uint64_t rank = (uint64_t)ceil(MAX(0.0, MIN(1.0, percentile)) * h->samplesCount);
+    if(rank == 0) rank = 1;
+    
+    uint64_t cumulated = 0;
+    for(NSUInteger i = 0; i < kSTEndpointHistogramBucketsCount; i++) {
+        cumulated += h->counts[i];
+        if(cumulated >= rank) return MIN(STEndpointHistogramBucketUpperBound(i), h->max);
+    }
+    
+    return h->max;
+}
+
+/**/
+
+typedef NS_ENUM(NSUInteger, STEndpointPhase) {
+    STEndpointPhaseQueueing,
+    STEndpointPhaseDomainLookup,
+    STEndpointPhaseConnect,
+    STEndpointPhaseSecureConnection,
+    STEndpointPhaseTransfer,
+    STEndpointPhaseDecode,
+    STEndpointPhaseCallbackDispatch,
+    STEndpointPhasesCount
+};
+
+static NSString * const STEndpointPhaseNames[STEndpointPhasesCount] = {
+    @"queueing", @"dns", @"connect", @"tls", @"transfer", @"decode", @"callback_dispatch"
+};
+
+@interface STTwitterEndpointStats : NSObject {
+@public
+    STEndpointHistogram _total;
+    STEndpointHistogram _timeToFirstByte;
+    NSTimeInterval _phaseSums[STEndpointPhasesCount];
+    uint64_t _phaseCounts[STEndpointPhasesCount];
+    uint64_t _failuresCount;
+    uint64_t _bytesCount;
+}
+@end
+
+@implementation STTwitterEndpointStats
+
+- (void)recordPhase:(STEndpointPhase)phase duration:(NSTimeInterval)duration {
+    if(duration < 0) return; // unknown
+    _phaseSums[phase] += duration;
+    _phaseCounts[phase] += 1;
+}
+
+- (void)recordRequestMetrics:(STHTTPRequestMetrics *)metrics {
+    STEndpointHistogramRecord(&_total, metrics.total);
+    STEndpointHistogramRecord(&_timeToFirstByte, metrics.timeToFirstByte);
+    
+    [self recordPhase:STEndpointPhaseQueueing duration:metrics.queueing];
+    [self recordPhase:STEndpointPhaseDomainLookup duration:metrics.domainLookup];
+    [self recordPhase:STEndpointPhaseConnect duration:metrics.connect];
+    [self recordPhase:STEndpointPhaseSecureConnection duration:metrics.secureConnection];
+    [self recordPhase:STEndpointPhaseTransfer duration:metrics.transfer];
+    [self recordPhase:STEndpointPhaseDecode duration:metrics.decode];
+    [self recordPhase:STEndpointPhaseCallbackDispatch duration:metrics.callbackDispatch];
+    
+    if(metrics.failed) _failuresCount += 1;
+    _bytesCount += (uint64_t)MAX(0, metrics.responseBytesCount);
+}
+
+- (NSDictionary *)dictionaryRepresentation {
+    
+    NSMutableDictionary *means = [NSMutableDictionary dictionary];
+    for(NSUInteger i = 0; i < STEndpointPhasesCount; i++) {
+        if(_phaseCounts[i] == 0) continue;
+        means[STEndpointPhaseNames[i]] = @(_phaseSums[i] / _phaseCounts[i]);
+    }
+    
+    NSMutableArray *buckets = [NSMutableArray array];
+    for(NSUInteger i = 0; i < kSTEndpointHistogramBucketsCount; i++) {
+        if(_total.counts[i] == 0) continue;
+        [buckets addObject:@[@(STEndpointHistogramBucketUpperBound(i) * 1000.0), @(_total.counts[i])]];
+    }
+    
+    return @{@"count"    : @(_total.samplesCount),
+             @"failures" : @(_failuresCount),
+             @"bytes"    : @(_bytesCount),
+             @"p50"      : @(STEndpointHistogramPercentile(&_total, 0.5)),
+             @"p90"      : @(STEndpointHistogramPercentile(&_total, 0.9)),
+             @"p99"      : @(STEndpointHistogramPercentile(&_total, 0.99)),
+             @"max"      : @(_total.max),
+             @"ttfb_p50" : @(STEndpointHistogramPercentile(&_timeToFirstByte, 0.5)),
+             @"ttfb_p90" : @(STEndpointHistogramPercentile(&_timeToFirstByte, 0.9)),
+             @"ttfb_p99" : @(STEndpointHistogramPercentile(&_timeToFirstByte, 0.99)),
+             @"mean"     : means,
+             @"buckets"  : buckets};
+}
+
+@end
+
+/**/
+
+@interface STTwitterEndpointMetrics ()
+@property (nonatomic, strong) NSMutableDictionary *statsByEndpoint; // STTwitterEndpointStats instances, protected by @synchronized(self)
+@end
+
+@implementation STTwitterEndpointMetrics
+
++ (instancetype)sharedMetrics {
+    static STTwitterEndpointMetrics *sharedMetrics = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        sharedMetrics = [[self alloc] init];
+    });
+    return sharedMetrics;
+}
+
+- (instancetype)init {
+    self = [super init];
+    
+    _enabled = YES;
+    _statsByEndpoint = [NSMutableDictionary dictionary];
+    
+    return self;
+}
+
++ (NSString *)endpointForHTTPMethod:(NSString *)HTTPMethod URL:(NSURL *)url {
+    
+    NSString *path = [url path];
+    if([path length] == 0) path = @"/";
+    
+    return [NSString stringWithFormat:@"%@ %@", HTTPMethod ? HTTPMethod : @"GET", [path st_pathByReplacingIDComponentsWithString:@":id"]];
+}
+
+- (void)recordRequestMetrics:(STHTTPRequestMetrics *)metrics {
+    
+    if(self.enabled == NO || metrics == nil || metrics.total < 0) return;
+    
+    NSString *endpoint = [[self class] endpointForHTTPMethod:metrics.HTTPMethod URL:metrics.URL];
+    
+    @synchronized(self) {
+        STTwitterEndpointStats *stats = _statsByEndpoint[endpoint];
+        if(stats == nil) {
+            stats = [[STTwitterEndpointStats alloc] init];
+            _statsByEndpoint[endpoint] = stats;
+        }
+        [stats recordRequestMetrics:metrics];
+    }
+}
+
+- (NSArray *)endpoints {
+    @synchronized(self) {
+        return [[_statsByEndpoint allKeys] sortedArrayUsingSelector:@selector(compare:)];
+    }
+}
+
+- (NSTimeInterval)percentile:(double)percentile ofTotalForEndpoint:(NSString *)endpoint {
+    @synchronized(self) {
+        STTwitterEndpointStats *stats = _statsByEndpoint[endpoint];
+        if(stats == nil) return -1;
+        return STEndpointHistogramPercentile(&stats->_total, percentile);
+    }
+}
+
+- (NSTimeInterval)percentile:(double)percentile ofTimeToFirstByteForEndpoint:(NSString *)endpoint {
+    @synchronized(self) {
+        STTwitterEndpointStats *stats = _statsByEndpoint[endpoint];
+        if(stats == nil) return -1;
+        return STEndpointHistogramPercentile(&stats->_timeToFirstByte, percentile);
+    }
+}
+
+- (NSArray *)endpointsSortedByPercentile:(double)percentile {
+    
+    NSMutableDictionary *percentiles = [NSMutableDictionary dictionary];
+    
+    @synchronized(self) {
+        [_statsByEndpoint enumerateKeysAndObjectsUsingBlock:^(NSString *endpoint, STTwitterEndpointStats *stats, BOOL *stop) {
+            percentiles[endpoint] = @(STEndpointHistogramPercentile(&stats->_total, percentile));
+        }];
+    }
+    
+    return [percentiles keysSortedByValueUsingComparator:^NSComparisonResult(NSNumber *n1, NSNumber *n2) {
+        return [n2 compare:n1];
+    }];
+}
+
+- (NSDictionary *)exportedHistograms {
+    
+    NSMutableDictionary *histograms = [NSMutableDictionary dictionary];
+    
+    @synchronized(self) {
+        [_statsByEndpoint enumerateKeysAndObjectsUsingBlock:^(NSString *endpoint, STTwitterEndpointStats *stats, BOOL *stop) {
+            histograms[endpoint] = [stats dictionaryRepresentation];
+        }];
+    }
+    
+    return histograms;
+}
+
+- (void)reset {
+    @synchronized(self) {
+        [_statsByEndpoint removeAllObjects];
+    }
+}
+
+@end
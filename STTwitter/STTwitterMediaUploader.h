@@ -0,0 +1,49 @@
+//
+//  STTwitterMediaUploader.h
+//  STTwitter
+//
+
+#import <Foundation/Foundation.h>
+#import "STTwitterRequestProtocol.h"
+
+@class STTwitterAPI;
+
+/*
+ Sends the APPEND segments of a chunked media upload, https://dev.twitter.com/rest/reference/post/media/upload-chunked
+
+ The file is memory mapped and each segment is read from the mapping when it is sent, so that at most
+ maxConcurrentSegments segments are in memory. Segment sizes follow the measured throughput, so that a segment
+ takes about targetSegmentDuration to upload. Failed segments are retried with an exponential backoff.
+
+ resumeData describes the segments already uploaded, an uploader created with it sends only the missing ones,
+ as long as the media_id has not expired and the file has not changed.
+
+ The uploader runs on the main queue, its blocks are called on the main queue.
+ */
+
+@interface STTwitterMediaUploader : NSObject <STTwitterRequestProtocol>
+
+- (instancetype)initWithTwitterAPI:(STTwitterAPI *)twitter fileURL:(NSURL *)fileURL mediaID:(NSString *)mediaID; // mediaID as returned by INIT
+- (instancetype)initWithTwitterAPI:(STTwitterAPI *)twitter resumeData:(NSDictionary *)resumeData; // nil if the file changed
+
+@property (nonatomic) NSUInteger maxConcurrentSegments; // default 2
+@property (nonatomic) NSUInteger initialSegmentSize; // default 1 MB
+@property (nonatomic) NSUInteger minimumSegmentSize; // default 256 KB, raised when the file would need more than 1000 segments
+@property (nonatomic) NSUInteger maximumSegmentSize; // default 5 MB, the API limit
+@property (nonatomic) NSTimeInterval targetSegmentDuration; // default 4
+@property (nonatomic) NSUInteger maxRetriesPerSegment; // default 3, network errors, timeouts and server errors only
+@property (nonatomic, copy) void(^uploadProgressBlock)(int64_t bytesWritten, int64_t totalBytesWritten, int64_t totalBytesExpectedToWrite); // aggregated over the segments
+
+@property (nonatomic, strong, readonly) NSURL *fileURL;
+@property (nonatomic, strong, readonly) NSString *mediaID;
+@property (nonatomic, readonly) int64_t totalBytesCount;
+@property (nonatomic, readonly) int64_t uploadedBytesCount; // acknowledged segments only
+@property (nonatomic, readonly) NSDictionary *resumeData; // property list, kept up to date while uploading
+
+// successBlock receives the response to the last segment, call FINALIZE then
+- (void)startWithSuccessBlock:(void(^)(id response))successBlock
+                   errorBlock:(void(^)(NSError *error))errorBlock;
+
+- (void)cancel; // the error block receives a cancellation error, resumeData stays valid
+
+@end
@@ -0,0 +1,402 @@
+//
+//  STTwitterMediaUploader.m
+//  STTwitter
+//
+
+#import "STTwitterMediaUploader.h"
+#import "STTwitterAPI.h"
+#import "STHTTPRequest.h"
+#import "NSString+STTwitter.h"
+#import "NSError+STTwitter.h"
+
+#define kSTMediaUploadMaxSegmentsCount 1000 // segment_index is in [0, 999]
+
+@interface STTwitterMediaSegment : NSObject
+@property (nonatomic) NSUInteger index;
+@property (nonatomic) int64_t offset;
+@property (nonatomic) NSUInteger length;
+@property (nonatomic) BOOL isUploaded;
+@property (nonatomic) BOOL isInFlight;
+@property (nonatomic) BOOL isWaitingForRetry;
+@property (nonatomic) NSUInteger attemptsCount;
+@property (nonatomic) int64_t bytesWritten; // current attempt
+@property (nonatomic) CFAbsoluteTime startTime;
+@property (nonatomic, strong) NSObject<STTwitterRequestProtocol> *request;
+@end
+
+@implementation STTwitterMediaSegment
+@end
+
+/**/
+
+@interface STTwitterMediaUploader ()
+@property (nonatomic, strong) STTwitterAPI *twitter;
+@property (nonatomic, strong) NSURL *fileURL;
+@property (nonatomic, strong) NSString *mediaID;
+@property (nonatomic) int64_t totalBytesCount;
+@property (nonatomic, strong) NSDate *fileModificationDate;
+
+@property (nonatomic, strong) NSData *mappedData; // while uploading
+@property (nonatomic, strong) NSMutableArray *segments; // STTwitterMediaSegment instances, by index
+@property (nonatomic) int64_t nextOffset; // the file is covered by segments up to there
+@property (nonatomic) double throughput; // bytes per second and per segment, 0 when unknown
+@property (nonatomic) int64_t reportedBytesCount;
+
+@property (nonatomic, copy) void(^successBlock)(id response);
+@property (nonatomic, copy) void(^errorBlock)(NSError *error);
+@property (nonatomic, strong) id lastResponse;
+@property (nonatomic) BOOL isStarted;
+@property (nonatomic) BOOL isFinished;
+@end
+
+@implementation STTwitterMediaUploader
+
+- (instancetype)initWithTwitterAPI:(STTwitterAPI *)twitter fileURL:(NSURL *)fileURL mediaID:(NSString *)mediaID {
+    self = [super init];
+    
+    self.twitter = twitter;
+    self.fileURL = fileURL;
+    self.mediaID = mediaID;
+    self.segments = [NSMutableArray array];
+    
+    self.maxConcurrentSegments = 2;
+    self.initialSegmentSize = 1024 * 1024;
+    self.minimumSegmentSize = 256 * 1024;
+    self.maximumSegmentSize = 5 * 1024 * 1024;
+    self.targetSegmentDuration = 4;
+    self.maxRetriesPerSegment = 3;
+    
+    NSDictionary *attributes = [[NSFileManager defaultManager] attributesOfItemAtPath:[fileURL path] error:nil];
+    self.totalBytesCount = (int64_t)[attributes fileSize];
+    self.fileModificationDate = [attributes fileModificationDate];
+    
+    return self;
+}
+
+- (instancetype)initWithTwitterAPI:(STTwitterAPI *)twitter resumeData:(NSDictionary *)resumeData {
+    
+    NSString *path = resumeData[@"file_path"];
+    NSString *mediaID = resumeData[@"media_id"];
+    if(path == nil || mediaID == nil) return nil;
+    
+    self = [self initWithTwitterAPI:twitter fileURL:[NSURL fileURLWithPath:path] mediaID:mediaID];
+    
+    if(_totalBytesCount != [resumeData[@"file_size"] longLongValue]) return nil;
+    if([_fileModificationDate isEqualToDate:resumeData[@"file_modification_date"]] == NO) return nil;
+    
+    for(NSArray *a in resumeData[@"segments"]) {
+        STTwitterMediaSegment *segment = [[STTwitterMediaSegment alloc] init];
+        segment.index = [_segments count];
+        segment.offset = [a[0] longLongValue];
+        segment.length = [a[1] unsignedIntegerValue];
+        segment.isUploaded = [a[2] boolValue];
+        [_segments addObject:segment];
+        
+        self.nextOffset = segment.offset + segment.length;
+    }
+    
+    return self;
+}
+
+- (int64_t)uploadedBytesCount {
+    int64_t count = 0;
+    for(STTwitterMediaSegment *segment in _segments) {
+        if(segment.isUploaded) count += segment.length;
+    }
+    return count;
+}
+
+- (NSDictionary *)resumeData {
+    
+    // segments not uploaded yet are kept too, their indexes must keep their ranges
+    NSMutableArray *segments = [NSMutableArray arrayWithCapacity:[_segments count]];
+    for(STTwitterMediaSegment *segment in _segments) {
+        [segments addObject:@[@(segment.offset), @(segment.length), @(segment.isUploaded)]];
+    }
+    
+    NSMutableDictionary *md = [NSMutableDictionary dictionary];
+    md[@"media_id"] = _mediaID;
+    md[@"file_path"] = [_fileURL path];
+    md[@"file_size"] = @(_totalBytesCount);
+    if(_fileModificationDate) md[@"file_modification_date"] = _fileModificationDate;
+    md[@"segments"] = segments;
+    
+    return md;
+}
+
+#pragma mark Upload
+
+- (void)startWithSuccessBlock:(void(^)(id response))successBlock
+                   errorBlock:(void(^)(NSError *error))errorBlock {
+    
+    if([NSThread isMainThread] == NO) {
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [self startWithSuccessBlock:successBlock errorBlock:errorBlock];
+        });
+        return;
+    }
+    
+    NSAssert(_isStarted == NO, @"an uploader can be started only once, create another one with resumeData");
+    self.isStarted = YES;
+    
+    self.successBlock = successBlock;
+    self.errorBlock = errorBlock;
+    
+    if(_totalBytesCount == 0) {
+        NSError *error = [NSError errorWithDomain:NSStringFromClass([self class]) code:STTwitterAPIMediaDataIsEmpty userInfo:@{NSLocalizedDescriptionKey : @"cannot upload empty data"}];
+        [self finishWithError:error];
+        return;
+    }
+    
+    // pages are read from the file as the segments are sent, and can be dropped from memory once sent
+    NSError *error = nil;
+    self.mappedData = [NSData dataWithContentsOfURL:_fileURL options:NSDataReadingMappedAlways error:&error];
+    
+    if(_mappedData == nil || (int64_t)[_mappedData length] != _totalBytesCount) {
+        if(error == nil) {
+            error = [NSError errorWithDomain:NSStringFromClass([self class]) code:STTwitterAPIMediaDataIsEmpty userInfo:@{NSLocalizedDescriptionKey : @"the file has changed"}];
+        }
+        [self finishWithError:error];
+        return;
+    }
+    
+    [self reportProgress];
+    [self sendSegments];
+}
+
+- (void)cancel {
+    
+    if([NSThread isMainThread] == NO) {
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [self cancel];
+        });
+        return;
+    }
+    
+    if(_isFinished) return;
+    
+    NSError *error = [NSError st_cancellationError];
+    
+    [self finishWithError:error];
+}
+
+- (NSUInteger)nextSegmentSize {
+    
+    int64_t remainingBytesCount = _totalBytesCount - _nextOffset;
+    
+    double size = _throughput > 0 ? _throughput * _targetSegmentDuration : _initialSegmentSize;
+    
+    // the remaining indexes must be enough for the remaining bytes
+    NSUInteger remainingIndexesCount = kSTMediaUploadMaxSegmentsCount - MIN([_segments count], kSTMediaUploadMaxSegmentsCount - 1);
+    double minimumSize = MAX(_minimumSegmentSize, ceil((double)remainingBytesCount / remainingIndexesCount));
+    
+    size = MIN(MAX(size, minimumSize), _maximumSegmentSize);
+    
+    return (NSUInteger)MIN((int64_t)size, remainingBytesCount);
+}
+
+- (void)sendSegments {
+    
+    if(_isFinished) return;
+    
+    NSUInteger inFlightCount = 0;
+    for(STTwitterMediaSegment *segment in _segments) {
+        if(segment.isInFlight) inFlightCount += 1;
+    }
+    
+    while(inFlightCount < MAX(_maxConcurrentSegments, 1)) {
+        
+        STTwitterMediaSegment *segment = nil;
+        
+        for(STTwitterMediaSegment *s in _segments) {
+            if(s.isUploaded || s.isInFlight || s.isWaitingForRetry) continue;
+            segment = s;
+            break;
+        }
+        
+        if(segment == nil && _nextOffset < _totalBytesCount) {
+            segment = [[STTwitterMediaSegment alloc] init];
+            segment.index = [_segments count];
+            segment.offset = _nextOffset;
+            segment.length = [self nextSegmentSize];
+            [_segments addObject:segment];
+            
+            self.nextOffset += segment.length;
+        }
+        
+        if(segment == nil) break;
+        
+        [self sendSegment:segment];
+        inFlightCount += 1;
+    }
+    
+    if(inFlightCount == 0 && _nextOffset == _totalBytesCount && [self uploadedBytesCount] == _totalBytesCount) {
+        [self finishWithResponse:_lastResponse];
+    }
+}
+
+- (void)sendSegment:(STTwitterMediaSegment *)segment {
+    
+    segment.isInFlight = YES;
+    segment.attemptsCount += 1;
+    segment.bytesWritten = 0;
+    segment.startTime = CFAbsoluteTimeGetCurrent();
+    
+    NSUInteger attempt = segment.attemptsCount;
+    
+    // no copy, the bytes are read from the file when the request body is built, the mapping lives as long as the segment data
+    NSData *mappedData = _mappedData;
+    NSData *data = [[NSData alloc] initWithBytesNoCopy:(void *)((const char *)[mappedData bytes] + segment.offset)
+                                                length:segment.length
+                                           deallocator:^(void *bytes, NSUInteger length) {
+                                               [mappedData self];
+                                           }];
+    
+    NSMutableDictionary *md = [NSMutableDictionary dictionary];
+    md[@"command"] = @"APPEND";
+    md[@"media_id"] = _mediaID;
+    md[@"segment_index"] = [NSString stringWithFormat:@"%lu", (unsigned long)segment.index];
+    md[@"media"] = data;
+    md[kSTPOSTDataKey] = @"media";
+    md[kSTPOSTMediaFileNameKey] = [_fileURL lastPathComponent];
+    
+    segment.request = [_twitter postResource:@"media/upload.json"
+                               baseURLString:kBaseURLStringUpload_1_1
+                                  parameters:md
+                         uploadProgressBlock:^(int64_t bytesWritten, int64_t totalBytesWritten, int64_t totalBytesExpectedToWrite) {
+                             dispatch_async(dispatch_get_main_queue(), ^{
+                                 if(segment.attemptsCount != attempt || segment.isInFlight == NO) return;
+                                 segment.bytesWritten = MIN(totalBytesWritten, (int64_t)segment.length); // the multipart body is a bit larger
+                                 [self reportProgress];
+                             });
+                         } downloadProgressBlock:nil
+                                successBlock:^(NSDictionary *rateLimits, id response) {
+                                    dispatch_async(dispatch_get_main_queue(), ^{
+                                        if(segment.attemptsCount != attempt || segment.isInFlight == NO) return;
+                                        [self segment:segment didUploadWithResponse:response];
+                                    });
+                                } errorBlock:^(NSError *error) {
+                                    dispatch_async(dispatch_get_main_queue(), ^{
+                                        if(segment.attemptsCount != attempt || segment.isInFlight == NO) return;
+                                        [self segment:segment didFailWithError:error];
+                                    });
+                                }];
+}
+
+- (void)segment:(STTwitterMediaSegment *)segment didUploadWithResponse:(id)response {
+    
+    if(_isFinished) return;
+    
+    segment.isInFlight = NO;
+    segment.isUploaded = YES;
+    segment.request = nil;
+    segment.bytesWritten = segment.length;
+    
+    // moving average, so that a single slow segment doesn't shrink the next ones too much
+    NSTimeInterval duration = CFAbsoluteTimeGetCurrent() - segment.startTime;
+    if(duration > 0) {
+        double throughput = segment.length / duration;
+        self.throughput = _throughput > 0 ? 0.7 * _throughput + 0.3 * throughput : throughput;
+    }
+    
+    self.lastResponse = response;
+    
+    [self reportProgress];
+    [self sendSegments];
+}
+
+- (BOOL)shouldRetryAfterError:(NSError *)error {
+    
+    if([error st_isCancellationError]) return NO;
+    
+    if([[error domain] isEqualToString:NSURLErrorDomain]) return YES; // timeouts, lost connections
+    
+    if([[error domain] isEqualToString:kSTTwitterTwitterErrorDomain]) {
+        return [error code] == STTwitterTwitterErrorOverCapacity || [error code] == STTwitterTwitterErrorInternalError;
+    }
+    
+    return [[error domain] isEqualToString:@"STHTTPRequest"] && [error code] >= 500;
+}
+
+- (void)segment:(STTwitterMediaSegment *)segment didFailWithError:(NSError *)error {
+    
+    if(_isFinished) return;
+    
+    segment.isInFlight = NO;
+    segment.request = nil;
+    segment.bytesWritten = 0;
+    
+    if([self shouldRetryAfterError:error] == NO || segment.attemptsCount > _maxRetriesPerSegment) {
+        [self finishWithError:error];
+        return;
+    }
+    
+    [self reportProgress];
+    
+    // 1, 2, 4... seconds
+    NSTimeInterval delay = pow(2, segment.attemptsCount - 1);
+    
+    segment.isWaitingForRetry = YES;
+    
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC)), dispatch_get_main_queue(), ^{
+        segment.isWaitingForRetry = NO;
+        [self sendSegments];
+    });
+    
+    // the other segments go on meanwhile
+    [self sendSegments];
+}
+
+- (void)reportProgress {
+    
+    if(_uploadProgressBlock == nil) return;
+    
+    int64_t totalBytesWritten = 0;
+    for(STTwitterMediaSegment *segment in _segments) {
+        if(segment.isUploaded || segment.isInFlight) totalBytesWritten += segment.bytesWritten;
+    }
+    
+    // resumed segments count as written, retried ones are written again
+    int64_t bytesWritten = MAX(0, totalBytesWritten - _reportedBytesCount);
+    self.reportedBytesCount = totalBytesWritten;
+    
+    _uploadProgressBlock(bytesWritten, totalBytesWritten, _totalBytesCount);
+}
+
+#pragma mark Completion
+
+- (void)cancelSegments {
+    for(STTwitterMediaSegment *segment in _segments) {
+        if(segment.isInFlight == NO) continue;
+        
+        segment.isInFlight = NO;
+        segment.bytesWritten = 0;
+        
+        NSObject<STTwitterRequestProtocol> *request = segment.request;
+        segment.request = nil;
+        [request cancel]; // its error block finds the segment not in flight
+    }
+}
+
+- (void)finishWithResponse:(id)response {
+    self.isFinished = YES;
+    self.mappedData = nil;
+    
+    if(_successBlock) _successBlock(response);
+    
+    self.successBlock = nil;
+    self.errorBlock = nil;
+}
+
+- (void)finishWithError:(NSError *)error {
+    self.isFinished = YES;
+    [self cancelSegments];
+    self.mappedData = nil;
+    
+    if(_errorBlock) _errorBlock(error);
+    
+    self.successBlock = nil;
+    self.errorBlock = nil;
+}
+
+@end
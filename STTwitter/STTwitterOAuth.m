@@ -10,6 +10,7 @@
 #import "STHTTPRequest.h"
 #import "NSString+STTwitter.h"
 #import "STHTTPRequest+STTwitter.h"
+#import "STTwitterOAuthSigningContext.h"
 
 #include <CommonCrypto/CommonHMAC.h>
 
@@ -41,10 +42,14 @@
 @property (nonatomic, retain) NSString *testOauthNonce;
 @property (nonatomic, retain) NSString *testOauthTimestamp;
 
+@property (nonatomic, strong) STTwitterOAuthSigningContext *signingContext; // built lazily, reset when a secret changes
+
 @end
 
 @implementation STTwitterOAuth
 
+@synthesize signingContext = _signingContext;
+
 + (instancetype)twitterOAuthWithConsumerName:(NSString *)consumerName
                                  consumerKey:(NSString *)consumerKey
                               consumerSecret:(NSString *)consumerSecret {
@@ -86,64 +91,59 @@
     return to;
 }
 
-+ (NSArray *)encodedParametersDictionaries:(NSArray *)parameters {
+// arrays of one-key dictionaries, the raw keys and values may repeat
++ (STHTTPRequestParameters *)canonicalParametersWithParametersDictionaries:(NSArray *)parametersDictionaries {
     
-    NSMutableArray *encodedParameters = [NSMutableArray array];
+    STHTTPRequestParameters *parameters = [STHTTPRequestParameters parametersWithDictionary:nil];
     
-    for(NSDictionary *d in parameters) {
-        
-        NSString *key = [[d allKeys] lastObject];
-        NSString *value = [[d allValues] lastObject];
-        
-        NSString *encodedKey = [key st_urlEncodedString];
-        NSString *encodedValue = [value st_urlEncodedString];
-        
-        [encodedParameters addObject:@{encodedKey : encodedValue}];
+    for(NSDictionary *d in parametersDictionaries) {
+        parameters = [parameters parametersByAddingParameters:[STHTTPRequestParameters parametersWithDictionary:d]];
     }
     
-    return encodedParameters;
+    return parameters;
 }
 
-+ (NSString *)stringFromParametersDictionaries:(NSArray *)parametersDictionaries {
+// parameters which enter the signature, encoded and sorted once, the request reuses the same instances to build its URL and body
++ (STHTTPRequestParameters *)canonicalParametersOfRequest:(STHTTPRequest *)r {
     
-    NSMutableArray *parameters = [NSMutableArray array];
+    STHTTPRequestParameters *GETParameters = r.GETParameters ? r.GETParameters : [STHTTPRequestParameters parametersWithDictionary:r.GETDictionary];
+    STHTTPRequestParameters *POSTParameters = r.POSTParameters ? r.POSTParameters : [STHTTPRequestParameters parametersWithDictionary:r.POSTDictionary];
     
-    for(NSDictionary *d in parametersDictionaries) {
-        
-        NSString *encodedKey = [[d allKeys] lastObject];
-        NSString *encodedValue = [[d allValues] lastObject];
-        
-        NSString *s = [NSString stringWithFormat:@"%@=\"%@\"", encodedKey, encodedValue];
-        
-        [parameters addObject:s];
+    STHTTPRequestParameters *parameters = [GETParameters parametersByAddingParameters:POSTParameters];
+    
+    // "In the HTTP request the parameters are URL encoded, but you should collect the raw values."
+    // https://dev.twitter.com/docs/auth/creating-signature
+    
+    if([r.url query]) {
+        parameters = [parameters parametersByAddingParameters:[self canonicalParametersWithParametersDictionaries:[r.url st_rawGetParametersDictionaries]]];
     }
     
-    return [parameters componentsJoinedByString:@", "];
+    return parameters;
 }
 
-+ (NSString *)oauthHeaderValueWithParameters:(NSArray *)parametersDictionaries {
-    
-    NSArray *encodedParametersDictionaries = [self encodedParametersDictionaries:parametersDictionaries];
-    
-    NSString *encodedParametersString = [self stringFromParametersDictionaries:encodedParametersDictionaries];
-    
-    NSString *headerValue = [NSString stringWithFormat:@"OAuth %@", encodedParametersString];
-    
-    return headerValue;
+- (void)setOauthConsumerSecret:(NSString *)oauthConsumerSecret {
+    _oauthConsumerSecret = oauthConsumerSecret;
+    self.signingContext = nil;
 }
 
-+ (NSArray *)parametersDictionariesSortedByKey:(NSArray *)parametersDictionaries {
-    
-    return [parametersDictionaries sortedArrayUsingComparator:^NSComparisonResult(id obj1, id obj2) {
-        NSDictionary *d1 = (NSDictionary *)obj1;
-        NSDictionary *d2 = (NSDictionary *)obj2;
-        
-        NSString *key1 = [[d1 allKeys] lastObject];
-        NSString *key2 = [[d2 allKeys] lastObject];
-        
-        return [key1 compare:key2];
-    }];
-    
+- (void)setOauthAccessTokenSecret:(NSString *)oauthAccessTokenSecret {
+    _oauthAccessTokenSecret = oauthAccessTokenSecret;
+    self.signingContext = nil;
+}
+
+- (STTwitterOAuthSigningContext *)signingContext {
+    @synchronized(self) {
+        if(_signingContext == nil) {
+            _signingContext = [[STTwitterOAuthSigningContext alloc] initWithConsumerSecret:_oauthConsumerSecret tokenSecret:_oauthAccessTokenSecret];
+        }
+        return _signingContext;
+    }
+}
+
+- (void)setSigningContext:(STTwitterOAuthSigningContext *)signingContext {
+    @synchronized(self) {
+        _signingContext = signingContext;
+    }
 }
 
 - (NSString *)consumerName {
@@ -157,37 +157,29 @@
 - (NSString *)oauthNonce {
     if(_testOauthNonce) return _testOauthNonce;
     
-    return [NSString st_random32Characters];
+    return [STTwitterOAuthSigningContext nonce];
 }
 
 + (NSString *)signatureBaseStringWithHTTPMethod:(NSString *)httpMethod url:(NSURL *)url allParametersUnsorted:(NSArray *)parameters {
-    NSMutableArray *allParameters = [NSMutableArray arrayWithArray:parameters];
-    
-    NSArray *encodedParametersDictionaries = [self encodedParametersDictionaries:allParameters];
-    
-    NSArray *sortedEncodedParametersDictionaries = [self parametersDictionariesSortedByKey:encodedParametersDictionaries];
-    
-    /**/
-    
-    NSMutableArray *encodedParameters = [NSMutableArray array];
+    return [self signatureBaseStringWithHTTPMethod:httpMethod url:url canonicalParameters:[self canonicalParametersWithParametersDictionaries:parameters]];
+}
+
++ (NSString *)signatureBaseStringWithHTTPMethod:(NSString *)httpMethod url:(NSURL *)url canonicalParameters:(STHTTPRequestParameters *)parameters {
     
-    for(NSDictionary *d in sortedEncodedParametersDictionaries) {
-        NSString *encodedKey = [[d allKeys] lastObject];
-        NSString *encodedValue = [[d allValues] lastObject];
-        
-        NSString *s = [NSString stringWithFormat:@"%@=%@", encodedKey, encodedValue];
-        
-        [encodedParameters addObject:s];
-    }
+    NSString *normalizedURLString = [url st_normalizedForOauthSignatureString];
+    NSString *queryString = [parameters queryString];
     
-    NSString *encodedParametersString = [encodedParameters componentsJoinedByString:@"&"];
+    // METHOD&encoded_url&encoded_query_string, built in a single buffer
+    // the query string is already encoded, encoding it again turns '%', '=' and '&' into '%25', '%3D' and '%26'
+    NSMutableData *buffer = [NSMutableData dataWithCapacity:[httpMethod length] + 3 * ([normalizedURLString length] + [queryString length]) + 2];
     
-    NSString *signatureBaseString = [NSString stringWithFormat:@"%@&%@&%@",
-                                     [httpMethod uppercaseString],
-                                     [[url st_normalizedForOauthSignatureString] st_urlEncodedString],
-                                     [encodedParametersString st_urlEncodedString]];
+    [[httpMethod uppercaseString] st_appendRFC3986PercentEscapedUTF8BytesToData:buffer];
+    [buffer appendBytes:"&" length:1];
+    [normalizedURLString st_appendRFC3986PercentEscapedUTF8BytesToData:buffer];
+    [buffer appendBytes:"&" length:1];
+    [queryString st_appendRFC3986PercentEscapedUTF8BytesToData:buffer];
     
-    return signatureBaseString;
+    return [[NSString alloc] initWithData:buffer encoding:NSASCIIStringEncoding];
 }
 
 + (NSString *)oauthSignatureWithHTTPMethod:(NSString *)httpMethod url:(NSURL *)url parameters:(NSArray *)parameters consumerSecret:(NSString *)consumerSecret tokenSecret:(NSString *)tokenSecret {
@@ -196,24 +188,11 @@
      https://dev.twitter.com/docs/auth/creating-signature
      */
     
-    NSString *signatureBaseString = [[self class] signatureBaseStringWithHTTPMethod:httpMethod url:url allParametersUnsorted:parameters];
-    
-    /*
-     Note that there are some flows, such as when obtaining a request token, where the token secret is not yet known. In this case, the signing key should consist of the percent encoded consumer secret followed by an ampersand character '&'.
-     */
-    
-    NSString *encodedConsumerSecret = [consumerSecret st_urlEncodedString];
-    NSString *encodedTokenSecret = [tokenSecret st_urlEncodedString];
-    
-    NSString *signingKey = [NSString stringWithFormat:@"%@&", encodedConsumerSecret];
-    
-    if(encodedTokenSecret) {
-        signingKey = [signingKey stringByAppendingString:encodedTokenSecret];
-    }
+    STTwitterOAuthSigningContext *signingContext = [[STTwitterOAuthSigningContext alloc] initWithConsumerSecret:consumerSecret tokenSecret:tokenSecret];
     
-    NSString *oauthSignature = [signatureBaseString st_signHmacSHA1WithKey:signingKey];
+    NSString *signatureBaseString = [self signatureBaseStringWithHTTPMethod:httpMethod url:url allParametersUnsorted:parameters];
     
-    return oauthSignature;
+    return [signingContext signatureForBaseString:signatureBaseString];
 }
 
 - (void)verifyCredentialsLocallyWithSuccessBlock:(void(^)(NSString *username, NSString *userID))successBlock
@@ -444,49 +423,39 @@
     NSParameterAssert(_oauthConsumerKey);
     NSParameterAssert(_oauthConsumerSecret);
     
-    NSMutableArray *oauthParameters = [NSMutableArray arrayWithObjects:
-                                       @{@"oauth_consumer_key"     : [self oauthConsumerKey]},
-                                       @{@"oauth_nonce"            : [self oauthNonce]},
-                                       @{@"oauth_signature_method" : [self oauthSignatureMethod]},
-                                       @{@"oauth_timestamp"        : [self oauthTimestamp]},
-                                       @{@"oauth_version"          : [self oauthVersion]}, nil];
+    NSMutableDictionary *oauthParameters = [NSMutableDictionary dictionaryWithCapacity:7];
+    oauthParameters[@"oauth_consumer_key"] = [self oauthConsumerKey];
+    oauthParameters[@"oauth_nonce"] = [self oauthNonce];
+    oauthParameters[@"oauth_signature_method"] = [self oauthSignatureMethod];
+    oauthParameters[@"oauth_timestamp"] = [self oauthTimestamp];
+    oauthParameters[@"oauth_version"] = [self oauthVersion];
     
-    if([oauthCallback length]) [oauthParameters addObject:@{@"oauth_callback" : oauthCallback}];
+    if([oauthCallback length]) oauthParameters[@"oauth_callback"] = oauthCallback;
     
     if(_oauthAccessToken) { // missing while authenticating with XAuth
-        [oauthParameters addObject:@{@"oauth_token" : [self oauthAccessToken]}];
+        oauthParameters[@"oauth_token"] = [self oauthAccessToken];
     } else if(_oauthRequestToken) {
-        [oauthParameters addObject:@{@"oauth_token" : [self oauthRequestToken]}];
+        oauthParameters[@"oauth_token"] = [self oauthRequestToken];
     }
     
-    NSMutableArray *oauthAndPOSTParameters = [oauthParameters mutableCopy];
+    STHTTPRequestParameters *encodedOAuthParameters = [STHTTPRequestParameters parametersWithDictionary:oauthParameters];
     
-    if(r.POSTDictionary) {
-        [r.POSTDictionary enumerateKeysAndObjectsUsingBlock:^(id key, id obj, BOOL *stop) {
-            [oauthAndPOSTParameters addObject:@{ key : obj }];
-        }];
+    // media uploads are signed without their POST parameters
+    STHTTPRequestParameters *signedParameters = encodedOAuthParameters;
+    if(isMediaUpload == NO) {
+        signedParameters = [signedParameters parametersByAddingParameters:[[self class] canonicalParametersOfRequest:r]];
     }
     
-    // "In the HTTP request the parameters are URL encoded, but you should collect the raw values."
-    // https://dev.twitter.com/docs/auth/creating-signature
+    NSString *signatureBaseString = [[self class] signatureBaseStringWithHTTPMethod:r.HTTPMethod url:r.url canonicalParameters:signedParameters];
+    NSString *signature = [[self signingContext] signatureForBaseString:signatureBaseString];
     
-    NSMutableArray *oauthAndPOSTandGETParameters = [[r.url st_rawGetParametersDictionaries] mutableCopy];
-    [oauthAndPOSTandGETParameters addObjectsFromArray:oauthAndPOSTParameters];
+    NSMutableString *s = [NSMutableString stringWithString:@"OAuth "];
     
-    [r.GETDictionary enumerateKeysAndObjectsUsingBlock:^(id key, id obj, BOOL *stop) {
-        NSDictionary *d = @{key:obj};
-        [oauthAndPOSTandGETParameters addObject:d];
+    [encodedOAuthParameters enumerateEncodedKeysAndValuesUsingBlock:^(NSString *encodedKey, NSString *encodedValue, BOOL *stop) {
+        [s appendFormat:@"%@=\"%@\", ", encodedKey, encodedValue];
     }];
     
-    NSString *signature = [[self class] oauthSignatureWithHTTPMethod:r.HTTPMethod
-                                                                 url:r.url
-                                                          parameters:isMediaUpload ? oauthParameters : oauthAndPOSTandGETParameters
-                                                      consumerSecret:_oauthConsumerSecret
-                                                         tokenSecret:_oauthAccessTokenSecret];
-    
-    [oauthParameters addObject:@{@"oauth_signature" : signature}];
-    
-    NSString *s = [[self class] oauthHeaderValueWithParameters:oauthParameters];
+    [s appendFormat:@"oauth_signature=\"%@\"", [signature st_urlEncodedString]];
     
     [r setHeaderWithName:@"Authorization" value:s];
 }
@@ -563,18 +532,21 @@
     wr = r;
     
     r.HTTPMethod = HTTPMethod;
+    r.schedulingGroup = _oauthAccessToken ? _oauthAccessToken : _oauthConsumerKey;
+    
+    params = [r st_parametersByConsumingRequestKeys:params];
     
     NSString *postKey = [params valueForKey:kSTPOSTDataKey];
     NSData *postData = [params valueForKey:postKey];;
     
+    // parameters are encoded and sorted once, for the signature and for the URL or the body
+    
     if([HTTPMethod isEqualToString:@"GET"]) {
-        r.GETDictionary = params;
-        [self signRequest:r];
+        r.responseCacheVariant = _oauthAccessToken ? _oauthAccessToken : _oauthConsumerKey; // responses depend on the user
+        r.GETParameters = [STHTTPRequestParameters parametersWithDictionary:params];
     } else {
         // https://dev.twitter.com/docs/api/1.1/post/statuses/update_with_media
         
-        r.POSTDictionary = params;
-        
         NSString *postMediaFileName = [params valueForKey:kSTPOSTMediaFileNameKey];
         
         NSMutableDictionary *mutableParams = [params mutableCopy];
@@ -586,17 +558,23 @@
             NSString *filename = postMediaFileName ? postMediaFileName : @"media.jpg";
             
             [r addDataToUpload:postData parameterName:postKey mimeType:@"application/octet-stream" fileName:filename];
+            
+            // POST parameters must not be encoded while posting media, or spaces will appear as %20 in the status
+            r.encodePOSTDictionary = NO;
+            r.POSTDictionary = mutableParams ? mutableParams : @{};
+        } else {
+            r.POSTParameters = [STHTTPRequestParameters parametersWithDictionary:mutableParams]; // may be empty, POST request without body
         }
-        
-        [self signRequest:r isMediaUpload:(postData != nil) oauthCallback:oauthCallback];
-        
-        // POST parameters must not be encoded while posting media, or spaces will appear as %20 in the status
-        r.encodePOSTDictionary = (postData == nil);
-        
-        r.POSTDictionary = mutableParams ? mutableParams : @{};
     }
     
-    [r startAsynchronous];
+    BOOL isGET = [HTTPMethod isEqualToString:@"GET"];
+    BOOL isMediaUpload = (isGET == NO) && (postData != nil);
+    NSString *signedOAuthCallback = isGET ? nil : oauthCallback;
+    
+    // signed when it starts, possibly after a rate limit delay
+    [r st_startAsynchronousWithinRateLimitsSignedWithBlock:^(STHTTPRequest *requestToSign) {
+        [self signRequest:requestToSign isMediaUpload:isMediaUpload oauthCallback:signedOAuthCallback];
+    }];
     
     return r;
 }
@@ -688,25 +666,18 @@
 
 @implementation NSString (STTwitterOAuth)
 
-+ (NSString *)st_randomString {
-    CFUUIDRef cfuuid = CFUUIDCreate (kCFAllocatorDefault);
-    NSString *uuid = (__bridge_transfer NSString *)(CFUUIDCreateString (kCFAllocatorDefault, cfuuid));
-    CFRelease (cfuuid);
-    return uuid;
-}
-
 + (NSString *)st_random32Characters {
-    NSString *randomString = [self st_randomString];
-    
-    NSAssert([randomString length] >= 32, @"");
-    
-    return [randomString substringToIndex:32];
+    return [STTwitterOAuthSigningContext nonce];
 }
 
 - (NSString *)st_signHmacSHA1WithKey:(NSString *)key {
     
+    // lengths in bytes, not in UTF-16 units
+    NSData *keyData = [key dataUsingEncoding:NSUTF8StringEncoding];
+    NSData *messageData = [self dataUsingEncoding:NSUTF8StringEncoding];
+    
     unsigned char buf[CC_SHA1_DIGEST_LENGTH];
-    CCHmac(kCCHmacAlgSHA1, [key UTF8String], [key length], [self UTF8String], [self length], buf);
+    CCHmac(kCCHmacAlgSHA1, [keyData bytes], [keyData length], [messageData bytes], [messageData length], buf);
     NSData *data = [NSData dataWithBytes:buf length:CC_SHA1_DIGEST_LENGTH];
     return [data base64Encoding];
 }
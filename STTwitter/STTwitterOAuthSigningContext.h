@@ -0,0 +1,23 @@
+//
+//  STTwitterOAuthSigningContext.h
+//  STTwitter
+//
+
+#import <Foundation/Foundation.h>
+
+/*
+ HMAC-SHA1 signing state for one pair of consumer and token secrets.
+ The key pads are hashed once, signing a base string then costs two SHA1 passes over the message and the inner digest.
+ https://dev.twitter.com/oauth/overview/creating-signatures
+ */
+
+@interface STTwitterOAuthSigningContext : NSObject
+
+// the secrets are percent encoded and joined by '&' to form the signing key, tokenSecret may be nil
+- (instancetype)initWithConsumerSecret:(NSString *)consumerSecret tokenSecret:(NSString *)tokenSecret;
+
+- (NSString *)signatureForBaseString:(NSString *)signatureBaseString; // base64 encoded, thread safe
+
++ (NSString *)nonce; // 32 hex characters, from a buffered CSPRNG
+
+@end
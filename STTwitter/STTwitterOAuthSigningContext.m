@@ -0,0 +1,122 @@
+//
+//  STTwitterOAuthSigningContext.m
+//  STTwitter
+//
+
+#import "STTwitterOAuthSigningContext.h"
+#import "STTwitterOAuth.h"
+#import <Security/Security.h>
+
+#include <CommonCrypto/CommonDigest.h>
+
+#define kSTHMACSHA1BlockLength 64
+#define kSTNonceBytesCount 16
+#define kSTRandomBufferLength 4096 // 256 nonces per refill
+
+@interface NSData (Base64)
+- (NSString *)base64Encoding; // private API
+@end
+
+@implementation STTwitterOAuthSigningContext {
+    CC_SHA1_CTX _innerContext; // after the inner key pad
+    CC_SHA1_CTX _outerContext; // after the outer key pad
+}
+
+- (instancetype)initWithConsumerSecret:(NSString *)consumerSecret tokenSecret:(NSString *)tokenSecret {
+    self = [super init];
+    
+    /*
+     Note that there are some flows, such as when obtaining a request token, where the token secret is not yet known. In this case, the signing key should consist of the percent encoded consumer secret followed by an ampersand character '&'.
+     */
+    
+    NSString *signingKey = [NSString stringWithFormat:@"%@&%@", [consumerSecret st_urlEncodedString], tokenSecret ? [tokenSecret st_urlEncodedString] : @""];
+    
+    NSData *keyData = [signingKey dataUsingEncoding:NSUTF8StringEncoding];
+    
+    // RFC 2104, keys longer than the block are hashed first
+    unsigned char key[kSTHMACSHA1BlockLength] = {0};
+    if([keyData length] > kSTHMACSHA1BlockLength) {
+        CC_SHA1([keyData bytes], (CC_LONG)[keyData length], key);
+    } else {
+        memcpy(key, [keyData bytes], [keyData length]);
+    }
+    
+    unsigned char innerPad[kSTHMACSHA1BlockLength];
+    unsigned char outerPad[kSTHMACSHA1BlockLength];
+    for(NSUInteger i = 0; i < kSTHMACSHA1BlockLength; i++) {
+        innerPad[i] = key[i] ^ 0x36;
+        outerPad[i] = key[i] ^ 0x5c;
+    }
+    
+    CC_SHA1_Init(&_innerContext);
+    CC_SHA1_Update(&_innerContext, innerPad, kSTHMACSHA1BlockLength);
+    
+    CC_SHA1_Init(&_outerContext);
+    CC_SHA1_Update(&_outerContext, outerPad, kSTHMACSHA1BlockLength);
+    
+    memset(key, 0, sizeof(key));
+    memset(innerPad, 0, sizeof(innerPad));
+    memset(outerPad, 0, sizeof(outerPad));
+    
+    return self;
+}
+
+- (void)dealloc {
+    memset(&_innerContext, 0, sizeof(_innerContext));
+    memset(&_outerContext, 0, sizeof(_outerContext));
+}
+
+- (NSString *)signatureForBaseString:(NSString *)signatureBaseString {
+    
+    // the base string is percent encoded, hence ASCII, but hash its exact UTF-8 bytes anyway
+    const char *message = [signatureBaseString UTF8String];
+    CC_LONG messageLength = (CC_LONG)strlen(message);
+    
+    unsigned char digest[CC_SHA1_DIGEST_LENGTH];
+    
+    CC_SHA1_CTX context = _innerContext; // the precomputed contexts are never mutated
+    CC_SHA1_Update(&context, message, messageLength);
+    CC_SHA1_Final(digest, &context);
+    
+    context = _outerContext;
+    CC_SHA1_Update(&context, digest, CC_SHA1_DIGEST_LENGTH);
+    CC_SHA1_Final(digest, &context);
+    
+    NSData *data = [[NSData alloc] initWithBytesNoCopy:digest length:CC_SHA1_DIGEST_LENGTH freeWhenDone:NO];
+    return [data base64Encoding];
+}
+
+#pragma mark Nonce
+
++ (NSString *)nonce {
+    
+    static unsigned char buffer[kSTRandomBufferLength];
+    static NSUInteger offset = kSTRandomBufferLength;
+    
+    unsigned char bytes[kSTNonceBytesCount];
+    
+    @synchronized(self) {
+        if(offset + kSTNonceBytesCount > kSTRandomBufferLength) {
+            int status = SecRandomCopyBytes(kSecRandomDefault, kSTRandomBufferLength, buffer);
+            NSAssert(status == 0, @"-- cannot read random bytes");
+            if(status != 0) arc4random_buf(buffer, kSTRandomBufferLength);
+            offset = 0;
+        }
+        
+        memcpy(bytes, buffer + offset, kSTNonceBytesCount);
+        memset(buffer + offset, 0, kSTNonceBytesCount); // a nonce is never handed out twice
+        offset += kSTNonceBytesCount;
+    }
+    
+    static const char hexDigits[] = "0123456789abcdef";
+    
+    char hex[kSTNonceBytesCount * 2];
+    for(NSUInteger i = 0; i < kSTNonceBytesCount; i++) {
+        hex[i * 2] = hexDigits[bytes[i] >> 4];
+        hex[i * 2 + 1] = hexDigits[bytes[i] & 0x0f];
+    }
+    
+    return [[NSString alloc] initWithBytes:hex length:sizeof(hex) encoding:NSASCIIStringEncoding];
+}
+
+@end
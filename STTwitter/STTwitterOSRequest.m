@@ -32,6 +32,7 @@ typedef void (^stream_block_t)(NSObject<STTwitterRequestProtocol> *request, NSDa
 @property (nonatomic, strong) NSString *baseURLString;
 @property (nonatomic, strong) NSString *resource;
 @property (nonatomic) NSTimeInterval timeoutInSeconds;
+@property (nonatomic) BOOL streaming; // received data goes to streamBlock only
 @end
 
 @implementation STTwitterOSRequest
@@ -62,6 +63,7 @@ typedef void (^stream_block_t)(NSObject<STTwitterRequestProtocol> *request, NSDa
     self.uploadProgressBlock = uploadProgressBlock;
     self.streamBlock = streamBlock;
     self.timeoutInSeconds = timeoutInSeconds;
+    self.streaming = [[params valueForKey:kSTStreamRequestKey] boolValue] || [baseURLString rangeOfString:@"stream"].location != NSNotFound;
     
     return self;
 }
@@ -75,6 +77,8 @@ typedef void (^stream_block_t)(NSObject<STTwitterRequestProtocol> *request, NSDa
     if(postDataKey) [paramsWithoutMedia removeObjectForKey:postDataKey];
     [paramsWithoutMedia removeObjectForKey:kSTPOSTDataKey];
     [paramsWithoutMedia removeObjectForKey:kSTPOSTMediaFileNameKey];
+    [paramsWithoutMedia removeObjectForKey:kSTStreamRequestKey];
+    [paramsWithoutMedia removeObjectForKey:kSTRequestPriorityKey];
     
     NSString *urlString = [_baseURLString stringByAppendingString:_resource];
     NSURL *url = [NSURL URLWithString:urlString];
@@ -124,11 +128,7 @@ typedef void (^stream_block_t)(NSObject<STTwitterRequestProtocol> *request, NSDa
     
     NSURLRequest *request = [_task currentRequest];
     
-    NSString *s = @"Connection was cancelled.";
-    NSDictionary *userInfo = @{NSLocalizedDescriptionKey: s};
-    NSError *error = [NSError errorWithDomain:NSStringFromClass([self class])
-                                         code:kSTHTTPRequestCancellationError
-                                     userInfo:userInfo];
+    NSError *error = [NSError st_cancellationError];
     self.errorBlock(self, [self requestHeadersForRequest:request], [_httpURLResponse allHeaderFields], error);
 }
 
@@ -183,14 +183,12 @@ didReceiveResponse:(NSURLResponse *)response
 
     dispatch_async(dispatch_get_main_queue(), ^{
         
-        BOOL isStreaming = [[[[dataTask originalRequest] URL] host] rangeOfString:@"stream"].location != NSNotFound;
-        
         __strong typeof(weakSelf) strongSelf = weakSelf;
         if(strongSelf == nil) {
             return;
         }
         
-        if(isStreaming) {
+        if(strongSelf.streaming) {
             strongSelf.streamBlock(strongSelf, data);
         } else {
             [strongSelf.data appendData:data];
@@ -0,0 +1,67 @@
+//
+//  STTwitterRateLimiter.h
+//  STTwitter
+//
+
+#import <Foundation/Foundation.h>
+#import "STHTTPRequest.h"
+
+typedef NS_ENUM(NSInteger, STTwitterRateLimitAdmission) {
+    STTwitterRateLimitAdmissionAdmitted,
+    STTwitterRateLimitAdmissionDelayed, // to be sent again at retryDate
+    STTwitterRateLimitAdmissionRejected // would be answered by a 429
+};
+
+/*
+ Keeps the rate limit budgets of the process, per account and per resource, https://dev.twitter.com/rest/public/rate-limiting
+
+ Budgets are fed by the x-rate-limit-* headers of every response, and can be seeded with application/rate_limit_status.
+ Requests are then checked locally before being sent: admitted while the budget lasts, delayed until the window resets,
+ or rejected with the error Twitter would have sent, without a round-trip.
+
+ Resources are named as in application/rate_limit_status, eg. "/statuses/show/:id".
+ Accounts are the access token, or the consumer key for application-only requests, as in rate_limit_context.
+ */
+
+@interface STTwitterRateLimiter : NSObject
+
++ (instancetype)sharedRateLimiter; // used by STTwitterOAuth and STTwitterAppOnly
+
+@property (atomic) BOOL enabled; // default YES, when NO every request is admitted
+@property (atomic) NSUInteger reservedForInteractive; // default 1, last requests of a window left to interactive and visible content requests
+@property (atomic) NSTimeInterval maximumDelay; // default 60, exhausted interactive and visible content requests wait at most this long for the reset, or are rejected
+
+// budgets are keyed by the resource path without API version, extension, ":param" placeholders and numeric IDs,
+// so that URLs and the keys of application/rate_limit_status meet, eg. "/statuses/show" for
+// https://api.twitter.com/1.1/statuses/show.json, https://api.twitter.com/1.1/statuses/show/123.json and "/statuses/show/:id"
++ (NSString *)resourceForPath:(NSString *)path;
++ (NSString *)resourceForURL:(NSURL *)url;
+
+// thread safe
+- (void)updateWithResponseHeaders:(NSDictionary *)responseHeaders URL:(NSURL *)url account:(NSString *)account;
+- (void)updateWithRateLimitStatus:(NSDictionary *)rateLimitStatus; // the response of application/rate_limit_status, its rate_limit_context names the account
+
+// admitted requests are deducted from the budget until the next response tells the actual count
+- (STTwitterRateLimitAdmission)admitRequestToURL:(NSURL *)url
+                                         account:(NSString *)account
+                                        priority:(STHTTPRequestPriority)priority
+                                       retryDate:(NSDate **)retryDate; // set for delayed and rejected requests
+
+- (NSError *)rateLimitErrorForURL:(NSURL *)url account:(NSString *)account; // as sent by Twitter, error 88
+
+// gauges, -1 and nil when unknown, resource is normalized with +resourceForPath:
+- (NSInteger)remainingForResource:(NSString *)resource account:(NSString *)account;
+- (NSDate *)resetDateForResource:(NSString *)resource account:(NSString *)account;
+
+// JSON serializable
+// { account : { resource : { limit, remaining, reset } } }, reset since 1970
+- (NSDictionary *)gauges;
+
+// counters
+@property (readonly) NSUInteger admittedCount;
+@property (readonly) NSUInteger delayedCount;
+@property (readonly) NSUInteger rejectedCount;
+
+- (void)reset; // forgets the budgets and the counters
+
+@end
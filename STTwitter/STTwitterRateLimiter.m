@@ -0,0 +1,283 @@
+//
+//  STTwitterRateLimiter.m
+//  STTwitter
+//
+
+#import "STTwitterRateLimiter.h"
+#import "NSError+STTwitter.h"
+#import "NSString+STTwitter.h"
+
+@interface STTwitterRateLimitBudget : NSObject
+@property (nonatomic) NSInteger limit;
+@property (nonatomic) NSInteger remaining; // counts the admitted requests not answered yet
+@property (nonatomic) NSTimeInterval reset; // since 1970
+@end
+
+@implementation STTwitterRateLimitBudget
+@end
+
+/**/
+
+@interface STTwitterRateLimiter ()
+@property (nonatomic, strong) NSMutableDictionary *budgetsByAccount; // { account : { resource : STTwitterRateLimitBudget } }, protected by @synchronized(self)
+@property NSUInteger admittedCount;
+@property NSUInteger delayedCount;
+@property NSUInteger rejectedCount;
+@end
+
+@implementation STTwitterRateLimiter
+
++ (instancetype)sharedRateLimiter {
+    static STTwitterRateLimiter *sharedRateLimiter = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        sharedRateLimiter = [[self alloc] init];
+    });
+    return sharedRateLimiter;
+}
+
+- (instancetype)init {
+    self = [super init];
+    
+    _enabled = YES;
+    _reservedForInteractive = 1;
+    _maximumDelay = 60;
+    _budgetsByAccount = [NSMutableDictionary dictionary];
+    
+    return self;
+}
+
++ (NSString *)resourceForPath:(NSString *)path {
+    
+    // IDs, as in URLs, become placeholders, as in rate_limit_status
+    NSString *pathWithPlaceholders = [[path stringByDeletingPathExtension] st_pathByReplacingIDComponentsWithString:@":id"];
+    
+    NSMutableArray *components = [NSMutableArray array];
+    
+    for(NSString *component in [pathWithPlaceholders componentsSeparatedByString:@"/"]) {
+        
+        if([component length] == 0) continue;
+        
+        if([components count] == 0 && [component isEqualToString:@"1.1"]) continue; // API version
+        
+        if([component hasPrefix:@":"]) continue; // placeholder
+        
+        [components addObject:component];
+    }
+    
+    return [@"/" stringByAppendingString:[components componentsJoinedByString:@"/"]];
+}
+
++ (NSString *)resourceForURL:(NSURL *)url {
+    return [self resourceForPath:[url path]];
+}
+
+#pragma mark Budgets
+
+// with @synchronized(self)
+- (STTwitterRateLimitBudget *)budgetForResource:(NSString *)resource account:(NSString *)account create:(BOOL)create {
+    
+    if(account == nil) account = @"";
+    
+    NSMutableDictionary *budgetsByResource = _budgetsByAccount[account];
+    if(budgetsByResource == nil) {
+        if(create == NO) return nil;
+        budgetsByResource = [NSMutableDictionary dictionary];
+        _budgetsByAccount[account] = budgetsByResource;
+    }
+    
+    STTwitterRateLimitBudget *budget = budgetsByResource[resource];
+    if(budget == nil && create) {
+        budget = [[STTwitterRateLimitBudget alloc] init];
+        budgetsByResource[resource] = budget;
+    }
+    
+    return budget;
+}
+
+// with @synchronized(self)
+- (void)updateBudgetForResource:(NSString *)resource account:(NSString *)account limit:(NSInteger)limit remaining:(NSInteger)remaining reset:(NSTimeInterval)reset {
+    
+    STTwitterRateLimitBudget *budget = [self budgetForResource:resource account:account create:YES];
+    
+    if(reset > budget.reset) {
+        budget.reset = reset; // new window
+        budget.remaining = remaining;
+    } else if(reset == budget.reset) {
+        budget.remaining = MIN(budget.remaining, remaining); // responses may arrive out of order
+    } else {
+        return; // older window
+    }
+    
+    budget.limit = limit;
+}
+
+- (void)updateWithResponseHeaders:(NSDictionary *)responseHeaders URL:(NSURL *)url account:(NSString *)account {
+    
+    NSString *limitString = [responseHeaders valueForKey:@"x-rate-limit-limit"];
+    NSString *remainingString = [responseHeaders valueForKey:@"x-rate-limit-remaining"];
+    NSString *resetString = [responseHeaders valueForKey:@"x-rate-limit-reset"];
+    
+    if(remainingString == nil || resetString == nil) return;
+    
+    NSString *resource = [[self class] resourceForURL:url];
+    
+    @synchronized(self) {
+        [self updateBudgetForResource:resource
+                              account:account
+                                limit:[limitString integerValue]
+                            remaining:[remainingString integerValue]
+                                reset:[resetString doubleValue]];
+    }
+}
+
+- (void)updateWithRateLimitStatus:(NSDictionary *)rateLimitStatus {
+    
+    if([rateLimitStatus isKindOfClass:[NSDictionary class]] == NO) return;
+    
+    /*
+     {
+     "rate_limit_context": { "access_token": "786491-24zE39NUezJ8UTmOGOtLhgyLgCkPyY4dAcx6NA6sDKw" },
+     "resources": { "statuses": { "/statuses/show/:id": { "limit": 180, "remaining": 180, "reset": 1403602426 }, ... }, ... }
+     }
+     */
+    
+    NSDictionary *context = [rateLimitStatus valueForKey:@"rate_limit_context"];
+    if([context isKindOfClass:[NSDictionary class]] == NO) return;
+    
+    NSString *account = [context valueForKey:@"access_token"];
+    if(account == nil) account = [context valueForKey:@"application"];
+    if([account isKindOfClass:[NSString class]] == NO) return;
+    
+    NSDictionary *families = [rateLimitStatus valueForKey:@"resources"];
+    if([families isKindOfClass:[NSDictionary class]] == NO) return;
+    
+    @synchronized(self) {
+        [families enumerateKeysAndObjectsUsingBlock:^(NSString *family, NSDictionary *resources, BOOL *stop) {
+            if([resources isKindOfClass:[NSDictionary class]] == NO) return;
+            
+            [resources enumerateKeysAndObjectsUsingBlock:^(NSString *resource, NSDictionary *d, BOOL *stop) {
+                if([d isKindOfClass:[NSDictionary class]] == NO) return;
+                
+                [self updateBudgetForResource:[[self class] resourceForPath:resource]
+                                      account:account
+                                        limit:[[d valueForKey:@"limit"] integerValue]
+                                    remaining:[[d valueForKey:@"remaining"] integerValue]
+                                        reset:[[d valueForKey:@"reset"] doubleValue]];
+            }];
+        }];
+    }
+}
+
+#pragma mark Admission
+
+- (STTwitterRateLimitAdmission)admitRequestToURL:(NSURL *)url
+                                         account:(NSString *)account
+                                        priority:(STHTTPRequestPriority)priority
+                                       retryDate:(NSDate **)retryDate {
+    
+    if(self.enabled == NO) return STTwitterRateLimitAdmissionAdmitted;
+    
+    NSString *resource = [[self class] resourceForURL:url];
+    
+    @synchronized(self) {
+        
+        STTwitterRateLimitBudget *budget = [self budgetForResource:resource account:account create:NO];
+        
+        NSTimeInterval now = [[NSDate date] timeIntervalSince1970];
+        
+        if(budget == nil || now >= budget.reset) { // unknown or new window
+            _admittedCount += 1;
+            return STTwitterRateLimitAdmissionAdmitted;
+        }
+        
+        BOOL isBackground = priority >= STHTTPRequestPriorityBackfill;
+        NSInteger reserved = isBackground ? (NSInteger)_reservedForInteractive : 0;
+        
+        if(budget.remaining > reserved) {
+            budget.remaining -= 1;
+            _admittedCount += 1;
+            return STTwitterRateLimitAdmissionAdmitted;
+        }
+        
+        // the clocks may differ by a second or so
+        NSDate *resetDate = [NSDate dateWithTimeIntervalSince1970:budget.reset + 1];
+        if(retryDate) *retryDate = resetDate;
+        
+        if(isBackground || budget.reset + 1 - now <= _maximumDelay) {
+            _delayedCount += 1;
+            return STTwitterRateLimitAdmissionDelayed;
+        }
+        
+        _rejectedCount += 1;
+        return STTwitterRateLimitAdmissionRejected;
+    }
+}
+
+- (NSError *)rateLimitErrorForURL:(NSURL *)url account:(NSString *)account {
+    
+    NSMutableDictionary *md = [NSMutableDictionary dictionary];
+    md[NSLocalizedDescriptionKey] = @"Rate limit exceeded";
+    
+    @synchronized(self) {
+        STTwitterRateLimitBudget *budget = [self budgetForResource:[[self class] resourceForURL:url] account:account create:NO];
+        if(budget) {
+            md[kSTTwitterRateLimitLimit] = [@(budget.limit) description];
+            md[kSTTwitterRateLimitRemaining] = [@(MAX(0, budget.remaining)) description];
+            md[kSTTwitterRateLimitResetDate] = [NSDate dateWithTimeIntervalSince1970:budget.reset];
+        }
+    }
+    
+    return [NSError errorWithDomain:kSTTwitterTwitterErrorDomain code:STTwitterTwitterErrorRateLimitExceeded userInfo:md];
+}
+
+#pragma mark Gauges
+
+- (NSInteger)remainingForResource:(NSString *)resource account:(NSString *)account {
+    @synchronized(self) {
+        STTwitterRateLimitBudget *budget = [self budgetForResource:[[self class] resourceForPath:resource] account:account create:NO];
+        if(budget == nil) return -1;
+        return MAX(0, budget.remaining);
+    }
+}
+
+- (NSDate *)resetDateForResource:(NSString *)resource account:(NSString *)account {
+    @synchronized(self) {
+        STTwitterRateLimitBudget *budget = [self budgetForResource:[[self class] resourceForPath:resource] account:account create:NO];
+        if(budget == nil) return nil;
+        return [NSDate dateWithTimeIntervalSince1970:budget.reset];
+    }
+}
+
+- (NSDictionary *)gauges {
+    
+    NSMutableDictionary *gauges = [NSMutableDictionary dictionary];
+    
+    @synchronized(self) {
+        [_budgetsByAccount enumerateKeysAndObjectsUsingBlock:^(NSString *account, NSDictionary *budgetsByResource, BOOL *stop) {
+            
+            NSMutableDictionary *md = [NSMutableDictionary dictionary];
+            
+            [budgetsByResource enumerateKeysAndObjectsUsingBlock:^(NSString *resource, STTwitterRateLimitBudget *budget, BOOL *stop) {
+                md[resource] = @{@"limit"     : @(budget.limit),
+                                 @"remaining" : @(MAX(0, budget.remaining)),
+                                 @"reset"     : @(budget.reset)};
+            }];
+            
+            gauges[account] = md;
+        }];
+    }
+    
+    return gauges;
+}
+
+- (void)reset {
+    @synchronized(self) {
+        [_budgetsByAccount removeAllObjects];
+        _admittedCount = 0;
+        _delayedCount = 0;
+        _rejectedCount = 0;
+    }
+}
+
+@end
@@ -0,0 +1,48 @@
+//
+//  STTwitterRequestCoalescer.h
+//  STTwitter
+//
+
+#import <Foundation/Foundation.h>
+#import "STTwitterRequestProtocol.h"
+
+typedef void(^STTwitterCoalescedCompletionBlock)(NSDictionary *requestHeaders, NSDictionary *responseHeaders, id response, NSError *error);
+
+/*
+ Shares one in-flight request between the callers asking for the same thing at the same time.
+
+ The first caller for a key starts the upstream request, later callers are attached to it
+ until it completes, and the single parsed response is delivered to all of them.
+ Responses are not cached, a key is forgotten as soon as its request completes.
+ */
+
+@interface STTwitterRequestCoalescer : NSObject
+
++ (instancetype)sharedCoalescer; // used by STTwitterAPI for GET requests
+
+@property (atomic) BOOL enabled; // default YES, when NO every call starts its own request
+
+// "<method> <URL>?<query> <account>", the query being the percent-encoded parameters sorted by name,
+// so that distinct parameters never produce the same key
++ (NSString *)keyForHTTPMethod:(NSString *)HTTPMethod
+                     URLString:(NSString *)URLString
+                    parameters:(NSDictionary *)params
+                       account:(NSString *)account;
+
+// the key must identify the method, URL, parameters and account, see +keyForHTTPMethod:URLString:parameters:account:
+// startBlock is called only for the first caller, and must eventually call the completion block it receives
+// the returned handle is also passed to completionBlock, cancelling it detaches this caller only,
+// the upstream request is cancelled with the last one
+- (NSObject<STTwitterRequestProtocol> *)requestWithKey:(NSString *)key
+                                            startBlock:(NSObject<STTwitterRequestProtocol> *(^)(STTwitterCoalescedCompletionBlock completionBlock))startBlock
+                                       completionBlock:(void(^)(NSObject<STTwitterRequestProtocol> *request, NSDictionary *requestHeaders, NSDictionary *responseHeaders, id response, NSError *error))completionBlock;
+
+// counters
+@property (readonly) NSUInteger requestsCount; // calls to requestWithKey:...
+@property (readonly) NSUInteger coalescedCount; // calls attached to a request already in flight
+@property (readonly) double hitRate; // coalescedCount / requestsCount
+@property (readonly) NSUInteger inFlightCount;
+
+- (void)resetCounters;
+
+@end
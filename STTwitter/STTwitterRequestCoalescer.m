@@ -0,0 +1,199 @@
+//
+//  STTwitterRequestCoalescer.m
+//  STTwitter
+//
+
+#import "STTwitterRequestCoalescer.h"
+#import "STHTTPRequest.h"
+
+@class STTwitterCoalescedRequest;
+
+@interface STTwitterCoalescedRequestGroup : NSObject
+@property (nonatomic, strong) NSString *key;
+@property (nonatomic, strong) NSObject<STTwitterRequestProtocol> *upstreamRequest;
+@property (nonatomic, strong) NSMutableArray *waiters; // STTwitterCoalescedRequest instances
+@end
+
+@implementation STTwitterCoalescedRequestGroup
+@end
+
+/**/
+
+@interface STTwitterCoalescedRequest : NSObject <STTwitterRequestProtocol>
+@property (nonatomic, weak) STTwitterRequestCoalescer *coalescer;
+@property (nonatomic, weak) STTwitterCoalescedRequestGroup *group;
+@property (nonatomic, copy) void(^completionBlock)(NSObject<STTwitterRequestProtocol> *request, NSDictionary *requestHeaders, NSDictionary *responseHeaders, id response, NSError *error);
+@end
+
+@interface STTwitterRequestCoalescer ()
+@property (nonatomic, strong) NSMutableDictionary *groupsByKey; // STTwitterCoalescedRequestGroup instances, protected by @synchronized(self)
+@property NSUInteger requestsCount;
+@property NSUInteger coalescedCount;
+
+- (BOOL)removeWaiter:(STTwitterCoalescedRequest *)waiter;
+@end
+
+/**/
+
+@implementation STTwitterCoalescedRequest
+
+- (void)cancel {
+    
+    STTwitterRequestCoalescer *coalescer = _coalescer;
+    if(coalescer == nil || [coalescer removeWaiter:self] == NO) return;
+    
+    NSError *error = [NSError st_cancellationError];
+    
+    if(_completionBlock) _completionBlock(self, nil, nil, nil, error);
+}
+
+@end
+
+/**/
+
+@implementation STTwitterRequestCoalescer
+
++ (instancetype)sharedCoalescer {
+    static STTwitterRequestCoalescer *sharedCoalescer = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        sharedCoalescer = [[self alloc] init];
+    });
+    return sharedCoalescer;
+}
+
+- (instancetype)init {
+    self = [super init];
+    
+    _enabled = YES;
+    _groupsByKey = [NSMutableDictionary dictionary];
+    
+    return self;
+}
+
++ (NSString *)keyForHTTPMethod:(NSString *)HTTPMethod
+                     URLString:(NSString *)URLString
+                    parameters:(NSDictionary *)params
+                       account:(NSString *)account {
+    
+    NSString *queryString = [[STHTTPRequestParameters parametersWithDictionary:params] queryString];
+    
+    NSMutableString *ms = [NSMutableString stringWithFormat:@"%@ %@", HTTPMethod, URLString];
+    if([queryString length] > 0) [ms appendFormat:@"?%@", queryString];
+    [ms appendFormat:@" %@", account];
+    
+    return ms;
+}
+
+- (NSObject<STTwitterRequestProtocol> *)requestWithKey:(NSString *)key
+                                            startBlock:(NSObject<STTwitterRequestProtocol> *(^)(STTwitterCoalescedCompletionBlock completionBlock))startBlock
+                                       completionBlock:(void(^)(NSObject<STTwitterRequestProtocol> *request, NSDictionary *requestHeaders, NSDictionary *responseHeaders, id response, NSError *error))completionBlock {
+    
+    STTwitterCoalescedRequest *waiter = [[STTwitterCoalescedRequest alloc] init];
+    waiter.coalescer = self;
+    waiter.completionBlock = completionBlock;
+    
+    STTwitterCoalescedRequestGroup *group = nil;
+    
+    @synchronized(self) {
+        
+        _requestsCount += 1;
+        
+        group = (key && self.enabled) ? _groupsByKey[key] : nil;
+        
+        if(group) {
+            _coalescedCount += 1;
+            waiter.group = group;
+            [group.waiters addObject:waiter];
+            return waiter;
+        }
+        
+        group = [[STTwitterCoalescedRequestGroup alloc] init];
+        group.key = key;
+        group.waiters = [NSMutableArray arrayWithObject:waiter];
+        waiter.group = group;
+        
+        if(key && self.enabled) _groupsByKey[key] = group;
+    }
+    
+    __weak typeof(self) weakSelf = self;
+    
+    // the group is retained by this block until the upstream request completes
+    NSObject<STTwitterRequestProtocol> *upstreamRequest = startBlock(^(NSDictionary *requestHeaders, NSDictionary *responseHeaders, id response, NSError *error) {
+        
+        __strong typeof(weakSelf) strongSelf = weakSelf;
+        
+        NSArray *waiters = nil;
+        
+        @synchronized(strongSelf) {
+            if(strongSelf && strongSelf.groupsByKey[group.key] == group) {
+                [strongSelf.groupsByKey removeObjectForKey:group.key];
+            }
+            waiters = [group.waiters copy];
+            [group.waiters removeAllObjects];
+            group.upstreamRequest = nil;
+        }
+        
+        for(STTwitterCoalescedRequest *w in waiters) {
+            if(w.completionBlock) w.completionBlock(w, requestHeaders, responseHeaders, response, error);
+        }
+    });
+    
+    @synchronized(self) {
+        if([group.waiters count] > 0) {
+            group.upstreamRequest = upstreamRequest; // not yet completed
+        }
+    }
+    
+    return waiter;
+}
+
+- (BOOL)removeWaiter:(STTwitterCoalescedRequest *)waiter {
+    
+    NSObject<STTwitterRequestProtocol> *requestToCancel = nil;
+    
+    @synchronized(self) {
+        
+        STTwitterCoalescedRequestGroup *group = waiter.group;
+        if(group == nil || [group.waiters containsObject:waiter] == NO) return NO;
+        
+        [group.waiters removeObject:waiter];
+        
+        if([group.waiters count] == 0) {
+            // nobody is waiting anymore, later callers will start a new request
+            if(_groupsByKey[group.key] == group) {
+                [_groupsByKey removeObjectForKey:group.key];
+            }
+            requestToCancel = group.upstreamRequest;
+            group.upstreamRequest = nil;
+        }
+    }
+    
+    [requestToCancel cancel]; // its completion finds no waiter
+    
+    return YES;
+}
+
+#pragma mark Counters
+
+- (double)hitRate {
+    @synchronized(self) {
+        if(_requestsCount == 0) return 0;
+        return (double)_coalescedCount / _requestsCount;
+    }
+}
+
+- (NSUInteger)inFlightCount {
+    @synchronized(self) {
+        return [_groupsByKey count];
+    }
+}
+
+- (void)resetCounters {
+    @synchronized(self) {
+        _requestsCount = 0;
+        _coalescedCount = 0;
+    }
+}
+
+@end
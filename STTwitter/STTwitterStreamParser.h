@@ -23,11 +23,45 @@ typedef NS_ENUM(NSInteger, STTwitterStreamJSONType) {
     STTwitterStreamJSONTypeUnsupported,
 };
 
+typedef NS_OPTIONS(NSUInteger, STTwitterStreamJSONTypeMask) {
+    STTwitterStreamJSONTypeMaskTweet = 1 << STTwitterStreamJSONTypeTweet,
+    STTwitterStreamJSONTypeMaskFriendsLists = 1 << STTwitterStreamJSONTypeFriendsLists,
+    STTwitterStreamJSONTypeMaskDelete = 1 << STTwitterStreamJSONTypeDelete,
+    STTwitterStreamJSONTypeMaskScrubGeo = 1 << STTwitterStreamJSONTypeScrubGeo,
+    STTwitterStreamJSONTypeMaskLimit = 1 << STTwitterStreamJSONTypeLimit,
+    STTwitterStreamJSONTypeMaskDisconnect = 1 << STTwitterStreamJSONTypeDisconnect,
+    STTwitterStreamJSONTypeMaskWarning = 1 << STTwitterStreamJSONTypeWarning,
+    STTwitterStreamJSONTypeMaskEvent = 1 << STTwitterStreamJSONTypeEvent,
+    STTwitterStreamJSONTypeMaskStatusWithheld = 1 << STTwitterStreamJSONTypeStatusWithheld,
+    STTwitterStreamJSONTypeMaskUserWithheld = 1 << STTwitterStreamJSONTypeUserWithheld,
+    STTwitterStreamJSONTypeMaskControl = 1 << STTwitterStreamJSONTypeControl,
+    STTwitterStreamJSONTypeMaskUnsupported = 1 << STTwitterStreamJSONTypeUnsupported,
+    STTwitterStreamJSONTypeMaskAll = NSUIntegerMax
+};
+
 extern NSString *NSStringFromSTTwitterStreamJSONType(STTwitterStreamJSONType type);
 
 @interface STTwitterStreamParser : NSObject
 
+// concurrency 1 decodes synchronously within parseWithStreamData:parsedJSONBlock:, higher values frame the data
+// on a private serial queue, decode messages in parallel on a bounded number of workers and deliver them in arrival
+// order on deliveryQueue, at most twice the concurrency messages are decoded or waiting for delivery at any time
+- (instancetype)initWithDecodingConcurrency:(NSUInteger)decodingConcurrency;
+
+@property (nonatomic, readonly) NSUInteger decodingConcurrency; // default 1
+@property (nonatomic, strong) dispatch_queue_t deliveryQueue; // must be serial, default: main queue, ignored when decodingConcurrency is 1
+@property (nonatomic) STTwitterStreamJSONTypeMask acceptedTypes; // default: STTwitterStreamJSONTypeMaskAll, messages of other types are dropped before being decoded
+
 - (void)parseWithStreamData:(NSData *)data
             parsedJSONBlock:(void (^)(NSDictionary *json, STTwitterStreamJSONType type))parsedJsonBlock;
 
+- (void)reset; // discards a partially received message, to be called when the connection is reopened
+
+// called once the complete messages of the data passed so far were framed, decoded and delivered,
+// on deliveryQueue after the last of them, or right away when decodingConcurrency is 1
+- (void)notifyWhenIdleWithBlock:(dispatch_block_t)block;
+
+// classifies a framed message from the top-level keys of its raw bytes, without building the object graph
++ (STTwitterStreamJSONType)streamJSONTypeForMessageData:(NSData *)messageData;
+
 @end
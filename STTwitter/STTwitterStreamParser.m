@@ -38,71 +38,403 @@ NSString *NSStringFromSTTwitterStreamJSONType(STTwitterStreamJSONType type) {
     }
 }
 
-static inline BOOL isDigitsOnlyString(NSString *str) {
-    static NSCharacterSet *__notDigits;
-    static dispatch_once_t onceToken;
-    dispatch_once(&onceToken, ^{
-        __notDigits = [[NSCharacterSet decimalDigitCharacterSet] invertedSet];
-    });
-    return str.length && [str rangeOfCharacterFromSet:__notDigits].location == NSNotFound;
+// messages are framed as "<length>\r\n<length bytes of JSON, including a trailing \r\n>",
+// with blank "\r\n" lines sent as keep-alives, see https://dev.twitter.com/streaming/overview/processing
+
+static NSUInteger const kSTTwitterStreamParserMaxMessageLength = 16 * 1024 * 1024; // larger length prefixes are considered garbage
+
+// top-level keys looked for by the type sniffer, see +streamJSONTypeForJSON:
+
+typedef NS_OPTIONS(NSUInteger, STTwitterStreamTopLevelKey) {
+    STTwitterStreamTopLevelKeySource = 1 << 0,
+    STTwitterStreamTopLevelKeyText = 1 << 1,
+    STTwitterStreamTopLevelKeyFriends = 1 << 2,
+    STTwitterStreamTopLevelKeyDelete = 1 << 3,
+    STTwitterStreamTopLevelKeyScrubGeo = 1 << 4,
+    STTwitterStreamTopLevelKeyLimit = 1 << 5,
+    STTwitterStreamTopLevelKeyDisconnect = 1 << 6,
+    STTwitterStreamTopLevelKeyWarning = 1 << 7,
+    STTwitterStreamTopLevelKeyEvent = 1 << 8,
+    STTwitterStreamTopLevelKeyStatusWithheld = 1 << 9,
+    STTwitterStreamTopLevelKeyUserWithheld = 1 << 10,
+    STTwitterStreamTopLevelKeyControl = 1 << 11
+};
+
+static const struct {
+    const char *name;
+    size_t length;
+    STTwitterStreamTopLevelKey key;
+} kSTTwitterStreamTopLevelKeys[] = {
+    {"source", 6, STTwitterStreamTopLevelKeySource},
+    {"text", 4, STTwitterStreamTopLevelKeyText},
+    {"friends", 7, STTwitterStreamTopLevelKeyFriends},
+    {"friends_str", 11, STTwitterStreamTopLevelKeyFriends},
+    {"delete", 6, STTwitterStreamTopLevelKeyDelete},
+    {"scrub_geo", 9, STTwitterStreamTopLevelKeyScrubGeo},
+    {"limit", 5, STTwitterStreamTopLevelKeyLimit},
+    {"disconnect", 10, STTwitterStreamTopLevelKeyDisconnect},
+    {"warning", 7, STTwitterStreamTopLevelKeyWarning},
+    {"event", 5, STTwitterStreamTopLevelKeyEvent},
+    {"status_withheld", 15, STTwitterStreamTopLevelKeyStatusWithheld},
+    {"user_withheld", 13, STTwitterStreamTopLevelKeyUserWithheld},
+    {"control", 7, STTwitterStreamTopLevelKeyControl},
+};
+
+// same precedence as +streamJSONTypeForJSON:
+static STTwitterStreamJSONType STTwitterStreamJSONTypeForTopLevelKeys(STTwitterStreamTopLevelKey keys) {
+    if ((keys & STTwitterStreamTopLevelKeySource) && (keys & STTwitterStreamTopLevelKeyText)) return STTwitterStreamJSONTypeTweet;
+    if (keys & STTwitterStreamTopLevelKeyFriends) return STTwitterStreamJSONTypeFriendsLists;
+    if (keys & STTwitterStreamTopLevelKeyDelete) return STTwitterStreamJSONTypeDelete;
+    if (keys & STTwitterStreamTopLevelKeyScrubGeo) return STTwitterStreamJSONTypeScrubGeo;
+    if (keys & STTwitterStreamTopLevelKeyLimit) return STTwitterStreamJSONTypeLimit;
+    if (keys & STTwitterStreamTopLevelKeyDisconnect) return STTwitterStreamJSONTypeDisconnect;
+    if (keys & STTwitterStreamTopLevelKeyWarning) return STTwitterStreamJSONTypeWarning;
+    if (keys & STTwitterStreamTopLevelKeyEvent) return STTwitterStreamJSONTypeEvent;
+    if (keys & STTwitterStreamTopLevelKeyStatusWithheld) return STTwitterStreamJSONTypeStatusWithheld;
+    if (keys & STTwitterStreamTopLevelKeyUserWithheld) return STTwitterStreamJSONTypeUserWithheld;
+    if (keys & STTwitterStreamTopLevelKeyControl) return STTwitterStreamJSONTypeControl;
+    return STTwitterStreamJSONTypeUnsupported;
 }
 
 @interface STTwitterStreamParser ()
 
-@property (nonatomic) NSMutableString *receivedMessage;
-@property (nonatomic) int bytesExpected;
+@property (nonatomic, strong) NSMutableData *buffer; // received bytes not yet consumed, carried over between chunks
+@property (nonatomic) NSUInteger offset; // start of the unconsumed bytes in buffer
+@property (nonatomic) NSUInteger bytesExpected; // length of the message being received, 0 while reading a length line
+
+@property (nonatomic) NSUInteger decodingConcurrency;
+@property (nonatomic, strong) dispatch_queue_t framingQueue; // serial, owns buffer, offset and bytesExpected, waits for the decoding slots
+@property (nonatomic, strong) dispatch_queue_t decodingQueue; // concurrent, decodes and classifies messages
+@property (nonatomic, strong) dispatch_queue_t reorderingQueue; // serial, owns decodedMessages and nextSequenceNumberToDeliver
+@property (nonatomic, strong) dispatch_semaphore_t decodingSlots; // bounds the messages being decoded or waiting for delivery
+@property (nonatomic) uint64_t nextSequenceNumber;
+@property (nonatomic) uint64_t nextSequenceNumberToDeliver;
+@property (nonatomic, strong) NSMutableDictionary *decodedMessages; // sequence number -> @[json, type, parsedJSONBlock]
+@property (nonatomic, strong) NSMutableArray *pendingIdleNotifications; // @[sequence number to reach, block], owned by reorderingQueue
 
 @end
 
 @implementation STTwitterStreamParser
 
+- (instancetype)initWithDecodingConcurrency:(NSUInteger)decodingConcurrency {
+    self = [super init];
+    
+    self.buffer = [NSMutableData data];
+    
+    self.decodingConcurrency = MAX(decodingConcurrency, 1);
+    
+    if (_decodingConcurrency > 1) {
+        self.framingQueue = dispatch_queue_create("STTwitterStreamParser.framing", DISPATCH_QUEUE_SERIAL);
+        self.decodingQueue = dispatch_queue_create("STTwitterStreamParser.decoding", DISPATCH_QUEUE_CONCURRENT);
+        self.reorderingQueue = dispatch_queue_create("STTwitterStreamParser.reordering", DISPATCH_QUEUE_SERIAL);
+        self.decodingSlots = dispatch_semaphore_create(_decodingConcurrency * 2); // keep the workers busy while earlier messages wait for delivery
+        self.decodedMessages = [NSMutableDictionary dictionary];
+        self.pendingIdleNotifications = [NSMutableArray array];
+        self.deliveryQueue = dispatch_get_main_queue();
+    }
+    
+    self.acceptedTypes = STTwitterStreamJSONTypeMaskAll;
+    
+    return self;
+}
+
+- (instancetype)init {
+    return [self initWithDecodingConcurrency:1];
+}
+
 - (void)parseWithStreamData:(NSData *)data
             parsedJSONBlock:(void (^)(NSDictionary *json, STTwitterStreamJSONType type))parsedJsonBlock {
-    static NSString * const kDelimiter = @"\r\n";
-    NSString *response = [[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding];
     
-    for (NSString* part in [response componentsSeparatedByString:kDelimiter]) {
+    if (_decodingConcurrency > 1) {
+        // the framing queue may wait for decoding slots, the caller, usually the main queue, must not
+        NSData *ownedData = [NSData dataWithBytes:[data bytes] length:[data length]];
+        dispatch_async(_framingQueue, ^{
+            [self frameStreamData:ownedData parsedJSONBlock:parsedJsonBlock];
+        });
+        return;
+    }
+    
+    [self frameStreamData:data parsedJSONBlock:parsedJsonBlock];
+}
+
+- (void)frameStreamData:(NSData *)data
+        parsedJSONBlock:(void (^)(NSDictionary *json, STTwitterStreamJSONType type))parsedJsonBlock {
+    
+    // work on bytes rather than on strings, a chunk may end in the middle of a multi-byte UTF-8 character
+    
+    [_buffer appendData:data];
+    
+    const uint8_t *bytes = [_buffer bytes];
+    NSUInteger length = [_buffer length];
+    
+    while (_offset < length) {
         
-        if (self.receivedMessage == nil) {
-            if (isDigitsOnlyString(part)) {
-                self.receivedMessage = [NSMutableString string];
-                self.bytesExpected = [part intValue];
-            }
-        } else if (self.bytesExpected > 0) {
-            if (self.receivedMessage.length < self.bytesExpected) {
-                // Append the data
-                if (part.length > 0) {
-                    [self.receivedMessage appendString:part];
-                } else {
-                    [self.receivedMessage appendString:kDelimiter];
-                }
-                if (self.receivedMessage.length + kDelimiter.length == self.bytesExpected) {
-                    [self.receivedMessage appendString:kDelimiter];
-                    // Success!
-                    NSError *error = nil;
-                    id json = [NSJSONSerialization JSONObjectWithData:[self.receivedMessage dataUsingEncoding:NSUTF8StringEncoding]
-                                                              options:NSJSONReadingAllowFragments
-                                                                error:&error];
-                    if(json == nil) {
-                        NSLog(@"-- error: %@", error);
+        if (_bytesExpected == 0) {
+            
+            const uint8_t *lineFeed = memchr(bytes + _offset, '\n', length - _offset);
+            if (lineFeed == NULL) break; // incomplete length line
+            
+            NSUInteger lineEnd = lineFeed - bytes;
+            NSUInteger messageLength = 0;
+            BOOL isValid = YES;
+            
+            for (NSUInteger i = _offset; i < lineEnd; i++) {
+                uint8_t c = bytes[i];
+                if (c >= '0' && c <= '9') {
+                    messageLength = messageLength * 10 + (c - '0');
+                    if (messageLength > kSTTwitterStreamParserMaxMessageLength) {
+                        isValid = NO;
+                        break;
                     }
-                    
-                    STTwitterStreamJSONType type = [[self class] streamJSONTypeForJSON:json];
-                    parsedJsonBlock(json, type);
-                    
-                    // Reset
-                    self.receivedMessage = nil;
-                    self.bytesExpected = 0;
+                } else if (c != '\r' && c != ' ') {
+                    isValid = NO;
+                    break;
                 }
-            } else {
-                self.receivedMessage = nil;
-                self.bytesExpected = 0;
             }
+            
+            _offset = lineEnd + 1;
+            
+            // keep-alives and garbage lines are skipped
+            if (isValid) _bytesExpected = messageLength;
+            
         } else {
-            self.receivedMessage = nil;
-            self.bytesExpected = 0;
+            
+            if (length - _offset < _bytesExpected) break; // incomplete message
+            
+            NSData *messageData = [NSData dataWithBytesNoCopy:(void *)(bytes + _offset) length:_bytesExpected freeWhenDone:NO];
+            
+            BOOL isAccepted = YES;
+            if (_acceptedTypes != STTwitterStreamJSONTypeMaskAll) {
+                STTwitterStreamJSONType type = [[self class] streamJSONTypeForMessageData:messageData];
+                isAccepted = (_acceptedTypes & (1 << type)) != 0;
+            }
+            
+            if (isAccepted) {
+                [self parseMessageData:messageData parsedJSONBlock:parsedJsonBlock];
+            }
+            
+            _offset += _bytesExpected;
+            _bytesExpected = 0;
         }
     }
+    
+    // compact the buffer so that its capacity is reused instead of growing
+    
+    if (_offset == length) {
+        [_buffer setLength:0];
+        _offset = 0;
+    } else if (_offset > 0) {
+        memmove([_buffer mutableBytes], bytes + _offset, length - _offset);
+        [_buffer setLength:length - _offset];
+        _offset = 0;
+    }
+}
+
+- (void)reset {
+    
+    if (_decodingConcurrency > 1) {
+        dispatch_async(_framingQueue, ^{
+            [self resetBuffer];
+        });
+        return;
+    }
+    
+    [self resetBuffer];
+}
+
+- (void)notifyWhenIdleWithBlock:(dispatch_block_t)block {
+    
+    if (_decodingConcurrency == 1) {
+        block();
+        return;
+    }
+    
+    // the framing queue knows how many messages were framed from the data passed so far
+    dispatch_async(_framingQueue, ^{
+        uint64_t sequenceNumberToReach = _nextSequenceNumber;
+        
+        dispatch_async(_reorderingQueue, ^{
+            [_pendingIdleNotifications addObject:@[@(sequenceNumberToReach), [block copy]]];
+            [self deliverIdleNotifications];
+        });
+    });
+}
+
+- (void)resetBuffer {
+    [_buffer setLength:0];
+    _offset = 0;
+    _bytesExpected = 0;
+}
+
+- (void)parseMessageData:(NSData *)messageData
+         parsedJSONBlock:(void (^)(NSDictionary *json, STTwitterStreamJSONType type))parsedJsonBlock {
+    
+    if (_decodingConcurrency > 1) {
+        [self enqueueMessageData:messageData parsedJSONBlock:parsedJsonBlock];
+        return;
+    }
+    
+    NSError *error = nil;
+    id json = [NSJSONSerialization JSONObjectWithData:messageData
+                                              options:NSJSONReadingAllowFragments
+                                                error:&error];
+    if(json == nil) {
+        NSLog(@"-- error: %@", error);
+    }
+    
+    STTwitterStreamJSONType type = [[self class] streamJSONTypeForJSON:json];
+    parsedJsonBlock(json, type);
+}
+
+#pragma mark Parallel decoding
+
+- (void)enqueueMessageData:(NSData *)messageData
+           parsedJSONBlock:(void (^)(NSDictionary *json, STTwitterStreamJSONType type))parsedJsonBlock {
+    
+    // messageData points into the reused buffer
+    NSData *ownedMessageData = [NSData dataWithBytes:[messageData bytes] length:[messageData length]];
+    
+    uint64_t sequenceNumber = _nextSequenceNumber++;
+    
+    // back pressure, the framing queue waits when every slot is taken, a slot is released once its message was delivered
+    dispatch_semaphore_wait(_decodingSlots, DISPATCH_TIME_FOREVER);
+    
+    dispatch_async(_decodingQueue, ^{
+        
+        NSError *error = nil;
+        id json = [NSJSONSerialization JSONObjectWithData:ownedMessageData
+                                                  options:NSJSONReadingAllowFragments
+                                                    error:&error];
+        if(json == nil) {
+            NSLog(@"-- error: %@", error);
+        }
+        
+        STTwitterStreamJSONType type = [[self class] streamJSONTypeForJSON:json];
+        
+        dispatch_async(_reorderingQueue, ^{
+            _decodedMessages[@(sequenceNumber)] = @[json ? json : [NSNull null], @(type), [parsedJsonBlock copy]];
+            [self deliverDecodedMessagesInOrder];
+        });
+    });
+}
+
+// called on reorderingQueue
+- (void)deliverDecodedMessagesInOrder {
+    
+    while (YES) {
+        NSArray *decodedMessage = _decodedMessages[@(_nextSequenceNumberToDeliver)];
+        if (decodedMessage == nil) break;
+        
+        [_decodedMessages removeObjectForKey:@(_nextSequenceNumberToDeliver)];
+        _nextSequenceNumberToDeliver++;
+        
+        id json = decodedMessage[0] == [NSNull null] ? nil : decodedMessage[0];
+        STTwitterStreamJSONType type = [decodedMessage[1] integerValue];
+        void (^parsedJsonBlock)(NSDictionary *json, STTwitterStreamJSONType type) = decodedMessage[2];
+        
+        dispatch_semaphore_t decodingSlots = _decodingSlots;
+        
+        dispatch_async(_deliveryQueue, ^{
+            parsedJsonBlock(json, type);
+            dispatch_semaphore_signal(decodingSlots);
+        });
+    }
+    
+    [self deliverIdleNotifications];
+}
+
+// called on reorderingQueue, the delivery queue is serial so the notifications run after the messages they wait for
+- (void)deliverIdleNotifications {
+    
+    while ([_pendingIdleNotifications count] > 0) {
+        NSArray *notification = _pendingIdleNotifications[0];
+        if ([notification[0] unsignedLongLongValue] > _nextSequenceNumberToDeliver) break;
+        
+        [_pendingIdleNotifications removeObjectAtIndex:0];
+        
+        dispatch_block_t block = notification[1];
+        dispatch_async(_deliveryQueue, block);
+    }
+}
+
++ (STTwitterStreamJSONType)streamJSONTypeForMessageData:(NSData *)messageData {
+    
+    // walk the top-level object once, skipping over strings and nested values,
+    // and record which of the classifying keys it contains
+    
+    const uint8_t *bytes = [messageData bytes];
+    NSUInteger length = [messageData length];
+    NSUInteger i = 0;
+    
+    while (i < length && (bytes[i] == ' ' || bytes[i] == '\t' || bytes[i] == '\r' || bytes[i] == '\n')) i++;
+    if (i == length || bytes[i] != '{') return STTwitterStreamJSONTypeUnsupported;
+    
+    STTwitterStreamTopLevelKey keys = 0;
+    NSUInteger depth = 0;
+    BOOL isExpectingKey = NO;
+    BOOL isFirstKey = YES;
+    
+    for (; i < length; i++) {
+        uint8_t c = bytes[i];
+        
+        if (c == '"') {
+            NSUInteger start = i + 1;
+            NSUInteger end = start;
+            while (end < length && bytes[end] != '"') {
+                if (bytes[end] == '\\') end++;
+                end++;
+            }
+            if (end >= length) break; // truncated message
+            
+            if (depth == 1 && isExpectingKey) {
+                for (NSUInteger k = 0; k < sizeof(kSTTwitterStreamTopLevelKeys) / sizeof(kSTTwitterStreamTopLevelKeys[0]); k++) {
+                    if (kSTTwitterStreamTopLevelKeys[k].length == end - start && memcmp(bytes + start, kSTTwitterStreamTopLevelKeys[k].name, end - start) == 0) {
+                        keys |= kSTTwitterStreamTopLevelKeys[k].key;
+                        break;
+                    }
+                }
+                
+                // envelopes such as {"delete":{...}} carry their type in their first key
+                if (isFirstKey && keys != 0 && (keys & (STTwitterStreamTopLevelKeySource | STTwitterStreamTopLevelKeyText | STTwitterStreamTopLevelKeyEvent)) == 0) {
+                    return STTwitterStreamJSONTypeForTopLevelKeys(keys);
+                }
+                
+                if ((keys & STTwitterStreamTopLevelKeySource) && (keys & STTwitterStreamTopLevelKeyText)) {
+                    return STTwitterStreamJSONTypeTweet;
+                }
+                
+                isFirstKey = NO;
+                isExpectingKey = NO;
+            }
+            
+            i = end;
+            continue;
+        }
+        
+        switch (c) {
+            case '{':
+            case '[':
+                depth++;
+                isExpectingKey = (depth == 1);
+                break;
+            case '}':
+            case ']':
+                if (depth > 0) depth--;
+                break;
+            case ',':
+                isExpectingKey = (depth == 1);
+                break;
+            case ':':
+                isExpectingKey = NO;
+                break;
+            default:
+                break;
+        }
+        
+        if (depth == 0) break; // end of the top-level object
+    }
+    
+    return STTwitterStreamJSONTypeForTopLevelKeys(keys);
 }
 
 + (STTwitterStreamJSONType)streamJSONTypeForJSON:(id)json {
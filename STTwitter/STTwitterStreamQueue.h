@@ -0,0 +1,47 @@
+//
+//  STTwitterStreamQueue.h
+//  STTwitter
+//
+
+#import <Foundation/Foundation.h>
+#import "STTwitterStreamParser.h"
+
+/*
+ Bounded queue between a stream parser and a slow consumer.
+
+ Messages are enqueued from the stream's progress block and delivered one at a time on consumerQueue,
+ so that a slow consumer doesn't stall the connection until the server disconnects it.
+ */
+
+typedef NS_ENUM(NSUInteger, STTwitterStreamQueuePolicy) {
+    STTwitterStreamQueuePolicyBlock, // the producer waits for room, except on consumerQueue where the message is kept over capacity
+    STTwitterStreamQueuePolicyDropOldest, // the oldest message is dropped to make room
+    STTwitterStreamQueuePolicyDropByType // the oldest message of a droppable type is dropped, other messages are kept even over capacity
+};
+
+@interface STTwitterStreamQueue : NSObject
+
+- (instancetype)initWithCapacity:(NSUInteger)capacity
+                          policy:(STTwitterStreamQueuePolicy)policy
+                   consumerQueue:(dispatch_queue_t)consumerQueue // serial, default: a private serial queue
+                   consumerBlock:(void(^)(NSDictionary *json, STTwitterStreamJSONType type))consumerBlock;
+
+@property (nonatomic, readonly) NSUInteger capacity;
+@property (nonatomic, readonly) STTwitterStreamQueuePolicy policy;
+@property (atomic) STTwitterStreamJSONTypeMask droppableTypes; // used by STTwitterStreamQueuePolicyDropByType, default: STTwitterStreamJSONTypeMaskTweet
+
+- (void)enqueueJSON:(NSDictionary *)json type:(STTwitterStreamJSONType)type;
+
+// can be passed as the progressBlock of the streaming methods, see also -[STTwitterStreamSession subscribeWithAcceptedTypes:streamQueue:errorBlock:]
+- (void(^)(NSDictionary *json, STTwitterStreamJSONType type))enqueueBlock;
+
+// counters
+@property (readonly) NSUInteger depth; // messages waiting for delivery
+@property (readonly) NSUInteger maxDepth;
+@property (readonly) NSUInteger enqueuedCount;
+@property (readonly) NSUInteger deliveredCount;
+@property (readonly) NSUInteger droppedCount;
+@property (readonly) NSTimeInterval lag; // time spent in the queue by the last delivered message
+@property (readonly) NSTimeInterval maxLag;
+
+@end
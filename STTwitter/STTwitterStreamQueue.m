@@ -0,0 +1,224 @@
+//
+//  STTwitterStreamQueue.m
+//  STTwitter
+//
+
+#import "STTwitterStreamQueue.h"
+
+@interface STTwitterStreamQueueItem : NSObject
+@property (nonatomic, strong) NSDictionary *json;
+@property (nonatomic) STTwitterStreamJSONType type;
+@property (nonatomic) CFAbsoluteTime enqueueTime;
+@end
+
+@implementation STTwitterStreamQueueItem
+@end
+
+/**/
+
+@interface STTwitterStreamQueue ()
+
+@property (nonatomic) NSUInteger capacity;
+@property (nonatomic) STTwitterStreamQueuePolicy policy;
+@property (nonatomic, strong) dispatch_queue_t consumerQueue;
+@property (nonatomic, copy) void(^consumerBlock)(NSDictionary *json, STTwitterStreamJSONType type);
+
+@property (nonatomic, strong) NSCondition *condition; // protects everything below, signaled when room is made
+@property (nonatomic, strong) NSMutableArray *items; // STTwitterStreamQueueItem instances, oldest first
+@property (nonatomic) BOOL isDraining; // a drain is scheduled or running on consumerQueue
+
+@property (nonatomic) NSUInteger maxDepth;
+@property (nonatomic) NSUInteger enqueuedCount;
+@property (nonatomic) NSUInteger deliveredCount;
+@property (nonatomic) NSUInteger droppedCount;
+@property (nonatomic) NSTimeInterval lag;
+@property (nonatomic) NSTimeInterval maxLag;
+
+@end
+
+@implementation STTwitterStreamQueue
+
+- (instancetype)initWithCapacity:(NSUInteger)capacity
+                          policy:(STTwitterStreamQueuePolicy)policy
+                   consumerQueue:(dispatch_queue_t)consumerQueue
+                   consumerBlock:(void(^)(NSDictionary *json, STTwitterStreamJSONType type))consumerBlock {
+    
+    NSParameterAssert(consumerBlock);
+    
+    self = [super init];
+    
+    self.capacity = MAX(capacity, 1);
+    self.policy = policy;
+    self.consumerQueue = consumerQueue ? consumerQueue : dispatch_queue_create("STTwitterStreamQueue.consumer", DISPATCH_QUEUE_SERIAL);
+    self.consumerBlock = consumerBlock;
+    self.droppableTypes = STTwitterStreamJSONTypeMaskTweet;
+    
+    self.condition = [[NSCondition alloc] init];
+    self.items = [NSMutableArray arrayWithCapacity:_capacity];
+    
+    // lets enqueueJSON:type: recognize calls made on consumerQueue
+    dispatch_queue_set_specific(_consumerQueue, (__bridge const void *)self, (__bridge void *)self, NULL);
+    
+    return self;
+}
+
+- (void)dealloc {
+    dispatch_queue_set_specific(_consumerQueue, (__bridge const void *)self, NULL, NULL);
+}
+
+- (BOOL)isOnConsumerQueue {
+    if (dispatch_get_specific((__bridge const void *)self) == (__bridge void *)self) return YES;
+    return _consumerQueue == dispatch_get_main_queue() && [NSThread isMainThread];
+}
+
+- (void(^)(NSDictionary *json, STTwitterStreamJSONType type))enqueueBlock {
+    __weak typeof(self) weakSelf = self;
+    return ^(NSDictionary *json, STTwitterStreamJSONType type) {
+        [weakSelf enqueueJSON:json type:type];
+    };
+}
+
+- (void)enqueueJSON:(NSDictionary *)json type:(STTwitterStreamJSONType)type {
+    
+    STTwitterStreamQueueItem *item = [[STTwitterStreamQueueItem alloc] init];
+    item.json = json;
+    item.type = type;
+    
+    [_condition lock];
+    
+    if ([_items count] >= _capacity) {
+        switch (_policy) {
+            case STTwitterStreamQueuePolicyBlock:
+                // the drain runs on consumerQueue, waiting there would never end
+                if ([self isOnConsumerQueue]) break;
+                while ([_items count] >= _capacity) {
+                    [_condition wait];
+                }
+                break;
+            case STTwitterStreamQueuePolicyDropOldest:
+                [_items removeObjectAtIndex:0];
+                _droppedCount++;
+                break;
+            case STTwitterStreamQueuePolicyDropByType: {
+                STTwitterStreamJSONTypeMask droppableTypes = self.droppableTypes;
+                NSUInteger index = [_items indexOfObjectPassingTest:^BOOL(STTwitterStreamQueueItem *i, NSUInteger idx, BOOL *stop) {
+                    return (droppableTypes & (1 << i.type)) != 0;
+                }];
+                if (index != NSNotFound) {
+                    [_items removeObjectAtIndex:index];
+                    _droppedCount++;
+                } else if (droppableTypes & (1 << type)) {
+                    // nothing older can be dropped, drop the incoming message instead
+                    _droppedCount++;
+                    [_condition unlock];
+                    return;
+                }
+                break;
+            }
+        }
+    }
+    
+    item.enqueueTime = CFAbsoluteTimeGetCurrent();
+    [_items addObject:item];
+    _enqueuedCount++;
+    _maxDepth = MAX(_maxDepth, [_items count]);
+    
+    BOOL shouldScheduleDrain = (_isDraining == NO);
+    _isDraining = YES;
+    
+    [_condition unlock];
+    
+    if (shouldScheduleDrain) {
+        dispatch_async(_consumerQueue, ^{
+            [self drain];
+        });
+    }
+}
+
+// runs on consumerQueue
+- (void)drain {
+    
+    while (YES) {
+        
+        [_condition lock];
+        
+        if ([_items count] == 0) {
+            _isDraining = NO;
+            [_condition unlock];
+            return;
+        }
+        
+        STTwitterStreamQueueItem *item = _items[0];
+        [_items removeObjectAtIndex:0];
+        
+        _lag = CFAbsoluteTimeGetCurrent() - item.enqueueTime;
+        _maxLag = MAX(_maxLag, _lag);
+        _deliveredCount++;
+        
+        [_condition signal];
+        [_condition unlock];
+        
+        _consumerBlock(item.json, item.type);
+    }
+}
+
+#pragma mark Counters
+
+- (NSUInteger)depth {
+    [_condition lock];
+    NSUInteger depth = [_items count];
+    [_condition unlock];
+    return depth;
+}
+
+- (NSUInteger)maxDepth {
+    [_condition lock];
+    NSUInteger maxDepth = _maxDepth;
+    [_condition unlock];
+    return maxDepth;
+}
+
+- (NSUInteger)enqueuedCount {
+    [_condition lock];
+    NSUInteger count = _enqueuedCount;
+    [_condition unlock];
+    return count;
+}
+
+- (NSUInteger)deliveredCount {
+    [_condition lock];
+    NSUInteger count = _deliveredCount;
+    [_condition unlock];
+    return count;
+}
+
+- (NSUInteger)droppedCount {
+    [_condition lock];
+    NSUInteger count = _droppedCount;
+    [_condition unlock];
+    return count;
+}
+
+- (NSTimeInterval)lag {
+    [_condition lock];
+    NSTimeInterval lag = _lag;
+    [_condition unlock];
+    return lag;
+}
+
+- (NSTimeInterval)maxLag {
+    [_condition lock];
+    NSTimeInterval lag = _maxLag;
+    [_condition unlock];
+    return lag;
+}
+
+- (NSString *)description {
+    return [NSString stringWithFormat:@"<%@ %p depth:%lu/%lu max:%lu enqueued:%lu delivered:%lu dropped:%lu lag:%.3fs max:%.3fs>",
+            NSStringFromClass([self class]), self,
+            (unsigned long)[self depth], (unsigned long)_capacity, (unsigned long)[self maxDepth],
+            (unsigned long)[self enqueuedCount], (unsigned long)[self deliveredCount], (unsigned long)[self droppedCount],
+            [self lag], [self maxLag]];
+}
+
+@end
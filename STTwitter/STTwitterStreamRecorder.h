@@ -0,0 +1,55 @@
+//
+//  STTwitterStreamRecorder.h
+//  STTwitter
+//
+
+#import <Foundation/Foundation.h>
+#import "STTwitterStreamParser.h"
+
+/*
+ Capture files are a sequence of records, one per received chunk:
+
+ uint64 little endian - microseconds since the recording started
+ uint32 little endian - chunk length
+ bytes                - raw chunk, as received from the connection
+ */
+
+@interface STTwitterStreamRecorder : NSObject
+
+- (instancetype)initWithFileURL:(NSURL *)fileURL error:(NSError **)error; // truncates an existing file
+
+@property (nonatomic, strong, readonly) NSURL *fileURL;
+@property (readonly) uint64_t recordedBytesCount;
+@property (readonly) NSUInteger recordedChunksCount;
+
+- (void)recordData:(NSData *)data; // thread safe, the file is written on a private queue
+- (void)close; // flushes pending writes
+
+@end
+
+/**/
+
+@interface STTwitterStreamReplayer : NSObject
+
+- (instancetype)initWithFileURL:(NSURL *)fileURL error:(NSError **)error;
+
+@property (nonatomic, readonly) NSUInteger chunksCount;
+@property (nonatomic, readonly) uint64_t bytesCount;
+@property (nonatomic, readonly) NSTimeInterval duration; // as recorded
+
+// speed 1 replays at the recorded pace, 2 twice as fast etc., 0 as fast as possible
+// the parsed JSON block is called as documented by STTwitterStreamParser, the completion block on the main queue
+// once the parser delivered the last message, elapsed includes the decoding of the last messages
+- (void)replayIntoParser:(STTwitterStreamParser *)parser
+                   speed:(double)speed
+         parsedJSONBlock:(void (^)(NSDictionary *json, STTwitterStreamJSONType type))parsedJsonBlock
+         completionBlock:(void (^)(uint64_t bytesCount, NSUInteger messagesCount, NSTimeInterval elapsed))completionBlock;
+
+// serves the capture with chunked transfer encoding on 127.0.0.1, to every client connecting to any path
+// port 0 picks a free port, see servingPort
+- (BOOL)startServingOnPort:(uint16_t)port speed:(double)speed error:(NSError **)error;
+- (void)stopServing;
+@property (nonatomic, readonly) uint16_t servingPort;
+@property (nonatomic, readonly) NSURL *servingURL;
+
+@end
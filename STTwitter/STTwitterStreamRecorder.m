@@ -0,0 +1,349 @@
+//
+//  STTwitterStreamRecorder.m
+//  STTwitter
+//
+
+#import "STTwitterStreamRecorder.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+static size_t const kSTTwitterStreamRecordHeaderLength = sizeof(uint64_t) + sizeof(uint32_t);
+
+static NSError *STTwitterStreamPOSIXError(NSString *description) {
+    NSString *reason = [NSString stringWithUTF8String:strerror(errno)];
+    NSDictionary *userInfo = @{NSLocalizedDescriptionKey : [NSString stringWithFormat:@"%@: %@", description, reason]};
+    return [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:userInfo];
+}
+
+static BOOL STTwitterStreamWriteAll(int fd, const void *bytes, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, bytes, length);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return NO;
+        bytes = (const uint8_t *)bytes + written;
+        length -= written;
+    }
+    return YES;
+}
+
+@interface STTwitterStreamRecorder ()
+@property (nonatomic, strong) NSURL *fileURL;
+@property (nonatomic, strong) NSFileHandle *fileHandle;
+@property (nonatomic, strong) dispatch_queue_t writingQueue;
+@property (nonatomic) NSTimeInterval startTime;
+@property uint64_t recordedBytesCount;
+@property NSUInteger recordedChunksCount;
+@end
+
+@implementation STTwitterStreamRecorder
+
+- (instancetype)initWithFileURL:(NSURL *)fileURL error:(NSError **)error {
+    
+    if([[NSFileManager defaultManager] createFileAtPath:[fileURL path] contents:nil attributes:nil] == NO) {
+        if(error) *error = [NSError errorWithDomain:NSStringFromClass([self class]) code:0 userInfo:@{NSLocalizedDescriptionKey : [NSString stringWithFormat:@"cannot create %@", [fileURL path]]}];
+        return nil;
+    }
+    
+    NSFileHandle *fileHandle = [NSFileHandle fileHandleForWritingToURL:fileURL error:error];
+    if(fileHandle == nil) return nil;
+    
+    self = [super init];
+    
+    self.fileURL = fileURL;
+    self.fileHandle = fileHandle;
+    self.writingQueue = dispatch_queue_create("STTwitterStreamRecorder.writing", DISPATCH_QUEUE_SERIAL);
+    self.startTime = [[NSProcessInfo processInfo] systemUptime];
+    
+    return self;
+}
+
+- (void)dealloc {
+    [_fileHandle closeFile];
+}
+
+- (void)recordData:(NSData *)data {
+    
+    if([data length] == 0) return;
+    
+    uint64_t timestamp = (uint64_t)(([[NSProcessInfo processInfo] systemUptime] - _startTime) * 1000000);
+    
+    NSMutableData *record = [NSMutableData dataWithCapacity:kSTTwitterStreamRecordHeaderLength + [data length]];
+    uint64_t littleEndianTimestamp = CFSwapInt64HostToLittle(timestamp);
+    uint32_t littleEndianLength = CFSwapInt32HostToLittle((uint32_t)[data length]);
+    [record appendBytes:&littleEndianTimestamp length:sizeof(littleEndianTimestamp)];
+    [record appendBytes:&littleEndianLength length:sizeof(littleEndianLength)];
+    [record appendData:data];
+    
+    @synchronized(self) {
+        self.recordedBytesCount += [data length];
+        self.recordedChunksCount += 1;
+    }
+    
+    dispatch_async(_writingQueue, ^{
+        [self.fileHandle writeData:record];
+    });
+}
+
+- (void)close {
+    dispatch_sync(_writingQueue, ^{
+        [self.fileHandle synchronizeFile];
+        [self.fileHandle closeFile];
+        self.fileHandle = nil;
+    });
+}
+
+@end
+
+/**/
+
+typedef struct {
+    uint64_t timestamp; // microseconds
+    NSUInteger offset;
+    uint32_t length;
+} STTwitterStreamRecord;
+
+@interface STTwitterStreamReplayer ()
+@property (nonatomic, strong) NSData *data; // capture file, mapped when possible
+@property (nonatomic, strong) NSData *records; // STTwitterStreamRecord structs
+@property (nonatomic) NSUInteger chunksCount;
+@property (nonatomic) uint64_t bytesCount;
+@property (nonatomic) NSTimeInterval duration;
+@property (nonatomic) int listeningSocket;
+@property (nonatomic, strong) dispatch_source_t listeningSource;
+@property (nonatomic) uint16_t servingPort;
+@end
+
+@implementation STTwitterStreamReplayer
+
+- (instancetype)initWithFileURL:(NSURL *)fileURL error:(NSError **)error {
+    
+    NSData *data = [NSData dataWithContentsOfURL:fileURL options:NSDataReadingMappedIfSafe error:error];
+    if(data == nil) return nil;
+    
+    NSMutableData *records = [NSMutableData data];
+    
+    const uint8_t *bytes = [data bytes];
+    NSUInteger length = [data length];
+    NSUInteger offset = 0;
+    uint64_t bytesCount = 0;
+    
+    while (length - offset >= kSTTwitterStreamRecordHeaderLength) {
+        uint64_t timestamp;
+        uint32_t chunkLength;
+        memcpy(&timestamp, bytes + offset, sizeof(timestamp));
+        memcpy(&chunkLength, bytes + offset + sizeof(timestamp), sizeof(chunkLength));
+        
+        STTwitterStreamRecord record;
+        record.timestamp = CFSwapInt64LittleToHost(timestamp);
+        record.length = CFSwapInt32LittleToHost(chunkLength);
+        record.offset = offset + kSTTwitterStreamRecordHeaderLength;
+        
+        if (length - record.offset < record.length) break; // truncated capture, the recorder was not closed
+        
+        [records appendBytes:&record length:sizeof(record)];
+        bytesCount += record.length;
+        offset = record.offset + record.length;
+    }
+    
+    self = [super init];
+    
+    self.data = data;
+    self.records = records;
+    self.chunksCount = [records length] / sizeof(STTwitterStreamRecord);
+    self.bytesCount = bytesCount;
+    self.listeningSocket = -1;
+    
+    if(_chunksCount > 0) {
+        const STTwitterStreamRecord *lastRecord = (const STTwitterStreamRecord *)[records bytes] + (_chunksCount - 1);
+        self.duration = lastRecord->timestamp / 1000000.0;
+    }
+    
+    return self;
+}
+
+- (void)dealloc {
+    [self stopServing];
+}
+
+// calls chunkBlock for each chunk at its time, returns NO if chunkBlock asked to stop
+- (BOOL)enumerateChunksWithSpeed:(double)speed usingBlock:(BOOL(^)(NSData *chunk))chunkBlock {
+    
+    const STTwitterStreamRecord *records = [_records bytes];
+    const uint8_t *bytes = [_data bytes];
+    
+    NSTimeInterval startTime = [[NSProcessInfo processInfo] systemUptime];
+    
+    for (NSUInteger i = 0; i < _chunksCount; i++) {
+        
+        if (speed > 0) {
+            NSTimeInterval delay = startTime + (records[i].timestamp / 1000000.0) / speed - [[NSProcessInfo processInfo] systemUptime];
+            if (delay > 0) [NSThread sleepForTimeInterval:delay];
+        }
+        
+        NSData *chunk = [NSData dataWithBytesNoCopy:(void *)(bytes + records[i].offset) length:records[i].length freeWhenDone:NO];
+        
+        if (chunkBlock(chunk) == NO) return NO;
+    }
+    
+    return YES;
+}
+
+#pragma mark Parser
+
+- (void)replayIntoParser:(STTwitterStreamParser *)parser
+                   speed:(double)speed
+         parsedJSONBlock:(void (^)(NSDictionary *json, STTwitterStreamJSONType type))parsedJsonBlock
+         completionBlock:(void (^)(uint64_t bytesCount, NSUInteger messagesCount, NSTimeInterval elapsed))completionBlock {
+    
+    dispatch_queue_t replayQueue = dispatch_queue_create("STTwitterStreamReplayer.replay", DISPATCH_QUEUE_SERIAL);
+    
+    dispatch_async(replayQueue, ^{
+        
+        __block NSUInteger messagesCount = 0;
+        NSObject *lock = [[NSObject alloc] init];
+        
+        NSTimeInterval startTime = [[NSProcessInfo processInfo] systemUptime];
+        
+        [self enumerateChunksWithSpeed:speed usingBlock:^BOOL(NSData *chunk) {
+            [parser parseWithStreamData:chunk parsedJSONBlock:^(NSDictionary *json, STTwitterStreamJSONType type) {
+                @synchronized(lock) {
+                    messagesCount++;
+                }
+                if(parsedJsonBlock) parsedJsonBlock(json, type);
+            }];
+            return YES;
+        }];
+        
+        // with a decoding concurrency above 1 the last messages are still being framed, decoded or reordered
+        [parser notifyWhenIdleWithBlock:^{
+            NSTimeInterval elapsed = [[NSProcessInfo processInfo] systemUptime] - startTime;
+            
+            NSUInteger count;
+            @synchronized(lock) {
+                count = messagesCount;
+            }
+            
+            dispatch_async(dispatch_get_main_queue(), ^{
+                if(completionBlock) completionBlock(self.bytesCount, count, elapsed);
+            });
+        }];
+    });
+}
+
+#pragma mark Local HTTP server
+
+- (NSURL *)servingURL {
+    if(_listeningSocket < 0) return nil;
+    return [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%u/", _servingPort]];
+}
+
+- (BOOL)startServingOnPort:(uint16_t)port speed:(double)speed error:(NSError **)error {
+    
+    [self stopServing];
+    
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) {
+        if(error) *error = STTwitterStreamPOSIXError(@"socket");
+        return NO;
+    }
+    
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    
+    if(bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(fd, 16) != 0) {
+        if(error) *error = STTwitterStreamPOSIXError(@"bind");
+        close(fd);
+        return NO;
+    }
+    
+    socklen_t addressLength = sizeof(address);
+    getsockname(fd, (struct sockaddr *)&address, &addressLength);
+    
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    
+    self.listeningSocket = fd;
+    self.servingPort = ntohs(address.sin_port);
+    
+    __weak typeof(self) weakSelf = self;
+    
+    dispatch_source_t source = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, fd, 0, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0));
+    
+    dispatch_source_set_event_handler(source, ^{
+        int clientSocket;
+        while ((clientSocket = accept(fd, NULL, NULL)) >= 0) {
+            // accepted sockets may inherit O_NONBLOCK from the listening socket, clients are served with blocking I/O
+            fcntl(clientSocket, F_SETFL, fcntl(clientSocket, F_GETFL) & ~O_NONBLOCK);
+            dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+                __strong typeof(weakSelf) strongSelf = weakSelf;
+                if(strongSelf) [strongSelf serveClientSocket:clientSocket speed:speed];
+                close(clientSocket);
+            });
+        }
+    });
+    
+    dispatch_source_set_cancel_handler(source, ^{
+        close(fd);
+    });
+    
+    self.listeningSource = source;
+    dispatch_resume(source);
+    
+    return YES;
+}
+
+- (void)stopServing {
+    if(_listeningSource) {
+        dispatch_source_cancel(_listeningSource);
+        self.listeningSource = nil;
+    }
+    self.listeningSocket = -1;
+}
+
+- (void)serveClientSocket:(int)clientSocket speed:(double)speed {
+    
+    int yes = 1;
+#ifdef SO_NOSIGPIPE
+    setsockopt(clientSocket, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(yes));
+#endif
+    setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    
+    // read the request head, its contents don't matter
+    
+    char request[8192];
+    size_t requestLength = 0;
+    while (requestLength < sizeof(request) - 1) {
+        ssize_t n = read(clientSocket, request + requestLength, sizeof(request) - 1 - requestLength);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        requestLength += n;
+        request[requestLength] = '\0';
+        if (strstr(request, "\r\n\r\n")) break;
+    }
+    
+    const char *head = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nTransfer-Encoding: chunked\r\nConnection: close\r\n\r\n";
+    if (STTwitterStreamWriteAll(clientSocket, head, strlen(head)) == NO) return;
+    
+    BOOL completed = [self enumerateChunksWithSpeed:speed usingBlock:^BOOL(NSData *chunk) {
+        char chunkHead[32];
+        int chunkHeadLength = snprintf(chunkHead, sizeof(chunkHead), "%lx\r\n", (unsigned long)[chunk length]);
+        return STTwitterStreamWriteAll(clientSocket, chunkHead, chunkHeadLength)
+        && STTwitterStreamWriteAll(clientSocket, [chunk bytes], [chunk length])
+        && STTwitterStreamWriteAll(clientSocket, "\r\n", 2);
+    }];
+    
+    if (completed) {
+        STTwitterStreamWriteAll(clientSocket, "0\r\n\r\n", 5);
+    }
+}
+
+@end
@@ -0,0 +1,85 @@
+//
+//  STTwitterStreamSession.h
+//  STTwitter
+//
+
+#import <Foundation/Foundation.h>
+#import "STTwitterStreamParser.h"
+#import "STTwitterStreamQueue.h"
+#import "STTwitterRequestProtocol.h"
+
+@class STTwitterStreamSession;
+
+// returned by the streaming methods of STTwitterAPI, cancelling it detaches its consumer from the session
+@interface STTwitterStreamSubscription : NSObject <STTwitterRequestProtocol>
+
+@property (nonatomic, weak, readonly) STTwitterStreamSession *session;
+@property (nonatomic, readonly) STTwitterStreamJSONTypeMask acceptedTypes;
+@property (nonatomic, strong, readonly) STTwitterStreamQueue *streamQueue; // nil when messages go to the progress block directly
+
+- (void)cancel; // the subscription's error block receives a cancellation error
+
+@end
+
+/*
+ One upstream stream connection, with its own parser, shared by any number of in-process subscribers.
+ Messages are parsed once and fanned out to the subscribers which accept their type.
+
+ The session supervises its connection, see https://dev.twitter.com/streaming/overview/connecting
+ - a stall is detected when no data, keep-alives included, is received for stallTimeout
+ - network errors, stalls and closed connections reconnect with a linear backoff, 250 ms steps up to 16 s
+ - HTTP errors reconnect with an exponential backoff, from 5 s up to 320 s
+ - HTTP 420 reconnects with an exponential backoff, from 1 minute
+ - HTTP errors which won't resolve by retrying, and disconnect messages for revoked tokens, end the session
+ Tweets already delivered before a reconnection are not delivered twice.
+
+ Supervision runs on the main queue.
+ */
+
+@interface STTwitterStreamSession : NSObject
+
+- (instancetype)initWithKey:(NSString *)key decodingConcurrency:(NSUInteger)decodingConcurrency;
+
++ (NSString *)keyForResource:(NSString *)resource
+                  HTTPMethod:(NSString *)HTTPMethod
+               baseURLString:(NSString *)baseURLString
+                  parameters:(NSDictionary *)params;
+
+@property (nonatomic, strong, readonly) NSString *key;
+@property (nonatomic, strong, readonly) STTwitterStreamParser *parser;
+@property (nonatomic, copy) void (^didEndBlock)(STTwitterStreamSession *session); // after the last subscriber cancelled or the session failed
+@property (readonly) NSUInteger subscribersCount;
+
+- (STTwitterStreamSubscription *)subscribeWithAcceptedTypes:(STTwitterStreamJSONTypeMask)acceptedTypes
+                                              progressBlock:(void(^)(NSDictionary *json, STTwitterStreamJSONType type))progressBlock
+                                                 errorBlock:(void(^)(NSError *error))errorBlock;
+
+// messages are enqueued into streamQueue from the main queue, so its policy cannot be STTwitterStreamQueuePolicyBlock
+- (STTwitterStreamSubscription *)subscribeWithAcceptedTypes:(STTwitterStreamJSONTypeMask)acceptedTypes
+                                                streamQueue:(STTwitterStreamQueue *)streamQueue
+                                                 errorBlock:(void(^)(NSError *error))errorBlock;
+
+// connection
+@property (nonatomic, copy) NSObject<STTwitterRequestProtocol> *(^connectBlock)(STTwitterStreamSession *session); // opens the upstream connection, called again for each reconnection
+@property (nonatomic, strong, readonly) NSObject<STTwitterRequestProtocol> *request; // current upstream connection
+@property (nonatomic) BOOL reconnects; // default YES
+@property (nonatomic) NSTimeInterval stallTimeout; // default 90 seconds, keep-alives are sent every 30 seconds
+
+- (void)connect;
+- (void)disconnect; // stops supervision without notifying the subscribers
+
+// to be called by the blocks of the connection opened by connectBlock, calls from former connections are ignored
+- (void)request:(NSObject<STTwitterRequestProtocol> *)request didReceiveData:(NSData *)data;
+- (void)request:(NSObject<STTwitterRequestProtocol> *)request didFailWithError:(NSError *)error;
+
+- (void)failWithError:(NSError *)error; // ends the session, forwards the error to every subscriber and removes them
+
+// metrics
+@property (nonatomic, readonly) NSUInteger reconnectionsCount;
+@property (nonatomic, readonly) NSUInteger stallsCount;
+@property (nonatomic, readonly) NSUInteger stallWarningsCount; // FALLING_BEHIND warnings sent by the server
+@property (nonatomic, readonly) NSUInteger duplicatesCount; // tweets dropped because they were already delivered
+@property (nonatomic, readonly) NSTimeInterval totalDowntime; // from connection losses to the first bytes received after reconnecting
+@property (nonatomic, strong, readonly) NSError *lastError;
+
+@end
@@ -0,0 +1,431 @@
+//
+//  STTwitterStreamSession.m
+//  STTwitter
+//
+
+#import "STTwitterStreamSession.h"
+#import "STHTTPRequest.h"
+
+static NSUInteger const kSTTwitterStreamSessionRecentTweetIDsCapacity = 5000;
+
+typedef NS_ENUM(NSUInteger, STTwitterStreamSessionBackoff) {
+    STTwitterStreamSessionBackoffNone,
+    STTwitterStreamSessionBackoffNetwork, // linear
+    STTwitterStreamSessionBackoffHTTP, // exponential
+    STTwitterStreamSessionBackoffRateLimited // exponential, HTTP 420
+};
+
+static NSTimeInterval STTwitterStreamSessionUptime(void) {
+    return [[NSProcessInfo processInfo] systemUptime];
+}
+
+@interface STTwitterStreamSubscription ()
+@property (nonatomic, weak) STTwitterStreamSession *session;
+@property (nonatomic) STTwitterStreamJSONTypeMask acceptedTypes;
+@property (nonatomic, strong) STTwitterStreamQueue *streamQueue;
+@property (nonatomic, copy) void(^progressBlock)(NSDictionary *json, STTwitterStreamJSONType type);
+@property (nonatomic, copy) void(^errorBlock)(NSError *error);
+@end
+
+@interface STTwitterStreamSession ()
+@property (nonatomic, strong) NSString *key;
+@property (nonatomic, strong) STTwitterStreamParser *parser;
+@property (nonatomic, strong) NSMutableArray *subscriptions; // STTwitterStreamSubscription instances, protected by @synchronized(self)
+
+@property (nonatomic, strong) NSObject<STTwitterRequestProtocol> *request;
+@property (nonatomic) BOOL isSupervising;
+@property (nonatomic) BOOL isDisconnectedByServer; // the server asked us not to reconnect
+@property (nonatomic) NSUInteger connectionGeneration; // invalidates scheduled reconnections
+@property (nonatomic, strong) dispatch_source_t stallTimer;
+@property (nonatomic) NSTimeInterval lastDataTime;
+@property (nonatomic) NSTimeInterval downtimeStartTime; // 0 while connected
+@property (nonatomic) STTwitterStreamSessionBackoff backoff;
+@property (nonatomic) NSUInteger backoffAttempts;
+@property (nonatomic, strong) NSMutableOrderedSet *recentTweetIDs;
+
+@property (nonatomic) NSUInteger reconnectionsCount;
+@property (nonatomic) NSUInteger stallsCount;
+@property (nonatomic) NSUInteger stallWarningsCount;
+@property (nonatomic) NSUInteger duplicatesCount;
+@property (nonatomic) NSTimeInterval totalDowntime;
+@property (nonatomic, strong) NSError *lastError;
+
+- (BOOL)removeSubscription:(STTwitterStreamSubscription *)subscription;
+@end
+
+/**/
+
+@implementation STTwitterStreamSubscription
+
+- (void)cancel {
+    
+    STTwitterStreamSession *session = _session;
+    if(session == nil || [session removeSubscription:self] == NO) return;
+    
+    NSError *error = [NSError st_cancellationError];
+    
+    if(_errorBlock) _errorBlock(error);
+}
+
+@end
+
+/**/
+
+@implementation STTwitterStreamSession
+
+- (instancetype)initWithKey:(NSString *)key decodingConcurrency:(NSUInteger)decodingConcurrency {
+    self = [super init];
+    
+    self.key = key;
+    self.parser = [[STTwitterStreamParser alloc] initWithDecodingConcurrency:decodingConcurrency];
+    self.parser.acceptedTypes = 0;
+    self.subscriptions = [NSMutableArray array];
+    self.recentTweetIDs = [NSMutableOrderedSet orderedSet];
+    self.reconnects = YES;
+    self.stallTimeout = 90;
+    
+    return self;
+}
+
+- (void)dealloc {
+    if(_stallTimer) dispatch_source_cancel(_stallTimer);
+}
+
++ (NSString *)keyForResource:(NSString *)resource
+                  HTTPMethod:(NSString *)HTTPMethod
+               baseURLString:(NSString *)baseURLString
+                  parameters:(NSDictionary *)params {
+    
+    NSMutableString *ms = [NSMutableString stringWithFormat:@"%@ %@/%@", HTTPMethod, baseURLString, resource];
+    
+    NSArray *sortedKeys = [[params allKeys] sortedArrayUsingSelector:@selector(compare:)];
+    for(NSString *key in sortedKeys) {
+        [ms appendFormat:@"%@%@=%@", ([ms rangeOfString:@"?"].location == NSNotFound ? @"?" : @"&"), key, params[key]];
+    }
+    
+    return ms;
+}
+
+#pragma mark Subscribers
+
+- (NSUInteger)subscribersCount {
+    @synchronized(self) {
+        return [_subscriptions count];
+    }
+}
+
+// called with @synchronized(self)
+- (void)updateParserAcceptedTypes {
+    STTwitterStreamJSONTypeMask acceptedTypes = 0;
+    for(STTwitterStreamSubscription *subscription in _subscriptions) {
+        acceptedTypes |= subscription.acceptedTypes;
+    }
+    
+    // needed by the supervision, whatever the subscribers accept
+    if(acceptedTypes) acceptedTypes |= (STTwitterStreamJSONTypeMaskDisconnect | STTwitterStreamJSONTypeMaskWarning);
+    
+    _parser.acceptedTypes = acceptedTypes;
+}
+
+- (STTwitterStreamSubscription *)subscribeWithAcceptedTypes:(STTwitterStreamJSONTypeMask)acceptedTypes
+                                              progressBlock:(void(^)(NSDictionary *json, STTwitterStreamJSONType type))progressBlock
+                                                 errorBlock:(void(^)(NSError *error))errorBlock {
+    
+    STTwitterStreamSubscription *subscription = [[STTwitterStreamSubscription alloc] init];
+    subscription.session = self;
+    subscription.acceptedTypes = acceptedTypes;
+    subscription.progressBlock = progressBlock;
+    subscription.errorBlock = errorBlock;
+    
+    @synchronized(self) {
+        [_subscriptions addObject:subscription];
+        [self updateParserAcceptedTypes];
+    }
+    
+    return subscription;
+}
+
+- (STTwitterStreamSubscription *)subscribeWithAcceptedTypes:(STTwitterStreamJSONTypeMask)acceptedTypes
+                                                streamQueue:(STTwitterStreamQueue *)streamQueue
+                                                 errorBlock:(void(^)(NSError *error))errorBlock {
+    
+    NSParameterAssert(streamQueue);
+    NSAssert(streamQueue.policy != STTwitterStreamQueuePolicyBlock, @"messages are fanned out on the main queue, which must not wait for the consumer");
+    
+    STTwitterStreamSubscription *subscription = [self subscribeWithAcceptedTypes:acceptedTypes progressBlock:[streamQueue enqueueBlock] errorBlock:errorBlock];
+    subscription.streamQueue = streamQueue; // enqueueBlock doesn't retain it
+    
+    return subscription;
+}
+
+- (BOOL)removeSubscription:(STTwitterStreamSubscription *)subscription {
+    
+    BOOL wasLastSubscriber = NO;
+    
+    @synchronized(self) {
+        if([_subscriptions indexOfObjectIdenticalTo:subscription] == NSNotFound) return NO;
+        
+        [_subscriptions removeObjectIdenticalTo:subscription];
+        [self updateParserAcceptedTypes];
+        
+        wasLastSubscriber = ([_subscriptions count] == 0);
+    }
+    
+    if(wasLastSubscriber) {
+        [self disconnect];
+        if(_didEndBlock) _didEndBlock(self);
+    }
+    
+    return YES;
+}
+
+- (void)fanOutJSON:(NSDictionary *)json type:(STTwitterStreamJSONType)type {
+    
+    if(type == STTwitterStreamJSONTypeTweet) {
+        // tweets received again after a reconnection
+        NSString *tweetID = [json valueForKey:@"id_str"];
+        if(tweetID) {
+            if([_recentTweetIDs containsObject:tweetID]) {
+                _duplicatesCount++;
+                return;
+            }
+            [_recentTweetIDs addObject:tweetID];
+            if([_recentTweetIDs count] > kSTTwitterStreamSessionRecentTweetIDsCapacity) {
+                [_recentTweetIDs removeObjectAtIndex:0];
+            }
+        }
+    } else if(type == STTwitterStreamJSONTypeWarning) {
+        if([[json valueForKeyPath:@"warning.code"] isEqual:@"FALLING_BEHIND"]) {
+            _stallWarningsCount++;
+        }
+    } else if(type == STTwitterStreamJSONTypeDisconnect) {
+        // https://dev.twitter.com/streaming/overview/messages-types#disconnect_messages
+        // 2: duplicate stream, 6: token revoked, 7: admin logout
+        NSInteger code = [[json valueForKeyPath:@"disconnect.code"] integerValue];
+        if(code == 2 || code == 6 || code == 7) {
+            self.isDisconnectedByServer = YES;
+        }
+    }
+    
+    NSArray *subscriptions = nil;
+    @synchronized(self) {
+        subscriptions = [_subscriptions copy];
+    }
+    
+    for(STTwitterStreamSubscription *subscription in subscriptions) {
+        if((subscription.acceptedTypes & (1 << type)) == 0) continue;
+        if(subscription.progressBlock) subscription.progressBlock(json, type);
+    }
+}
+
+- (void)failWithError:(NSError *)error {
+    
+    [self disconnect];
+    
+    NSArray *subscriptions = nil;
+    @synchronized(self) {
+        subscriptions = [_subscriptions copy];
+        [_subscriptions removeAllObjects];
+        [self updateParserAcceptedTypes];
+    }
+    
+    if(_didEndBlock) _didEndBlock(self);
+    
+    for(STTwitterStreamSubscription *subscription in subscriptions) {
+        if(subscription.errorBlock) subscription.errorBlock(error);
+    }
+}
+
+#pragma mark Connection
+
+- (void)connect {
+    
+    NSAssert(_connectBlock, @"connectBlock is missing");
+    
+    self.isSupervising = YES;
+    self.isDisconnectedByServer = NO;
+    
+    [self openConnection];
+}
+
+- (void)openConnection {
+    
+    [_parser reset];
+    
+    self.lastDataTime = STTwitterStreamSessionUptime();
+    self.request = _connectBlock(self);
+    
+    if(_request == nil) {
+        NSError *error = [NSError errorWithDomain:NSStringFromClass([self class]) code:0 userInfo:@{NSLocalizedDescriptionKey : @"cannot open stream connection"}];
+        [self failWithError:error];
+        return;
+    }
+    
+    [self startStallTimer];
+}
+
+- (void)disconnect {
+    
+    self.isSupervising = NO;
+    self.connectionGeneration += 1;
+    
+    [self stopStallTimer];
+    
+    [self closeConnection];
+}
+
+- (void)closeConnection {
+    
+    // forget the request first, so that the errors it reports while being cancelled are ignored
+    NSObject<STTwitterRequestProtocol> *request = _request;
+    self.request = nil;
+    [request cancel];
+}
+
+- (void)request:(NSObject<STTwitterRequestProtocol> *)request didReceiveData:(NSData *)data {
+    
+    if(request != _request) return;
+    
+    NSTimeInterval now = STTwitterStreamSessionUptime();
+    
+    self.lastDataTime = now;
+    
+    if(_downtimeStartTime > 0) {
+        self.totalDowntime += now - _downtimeStartTime;
+        self.downtimeStartTime = 0;
+        self.backoff = STTwitterStreamSessionBackoffNone;
+        self.backoffAttempts = 0;
+    }
+    
+    __weak typeof(self) weakSelf = self;
+    
+    [_parser parseWithStreamData:data parsedJSONBlock:^(NSDictionary *json, STTwitterStreamJSONType type) {
+        [weakSelf fanOutJSON:json type:type];
+    }];
+}
+
+- (void)request:(NSObject<STTwitterRequestProtocol> *)request didFailWithError:(NSError *)error {
+    
+    if(request != _request) return;
+    
+    self.request = nil;
+    
+    [self connectionDidEndWithError:error backoff:[[self class] backoffForError:error]];
+}
+
+- (void)connectionDidEndWithError:(NSError *)error backoff:(STTwitterStreamSessionBackoff)backoff {
+    
+    self.lastError = error;
+    
+    [self stopStallTimer];
+    
+    if(_downtimeStartTime == 0) self.downtimeStartTime = STTwitterStreamSessionUptime();
+    
+    if(_reconnects == NO || _isDisconnectedByServer || backoff == STTwitterStreamSessionBackoffNone) {
+        [self failWithError:error];
+        return;
+    }
+    
+    if(backoff != _backoff) {
+        self.backoff = backoff;
+        self.backoffAttempts = 0;
+    }
+    
+    self.backoffAttempts += 1;
+    
+    NSTimeInterval delay = 0;
+    switch (backoff) {
+        case STTwitterStreamSessionBackoffNetwork:
+            delay = MIN(0.25 * _backoffAttempts, 16);
+            break;
+        case STTwitterStreamSessionBackoffHTTP:
+            delay = MIN(5 * pow(2, _backoffAttempts - 1), 320);
+            break;
+        case STTwitterStreamSessionBackoffRateLimited:
+            delay = MIN(60 * pow(2, _backoffAttempts - 1), 960);
+            break;
+        default:
+            break;
+    }
+    
+    NSUInteger generation = _connectionGeneration;
+    __weak typeof(self) weakSelf = self;
+    
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC)), dispatch_get_main_queue(), ^{
+        __strong typeof(weakSelf) strongSelf = weakSelf;
+        if(strongSelf == nil || strongSelf.isSupervising == NO || strongSelf.connectionGeneration != generation) return;
+        
+        strongSelf.reconnectionsCount += 1;
+        [strongSelf openConnection];
+    });
+}
+
++ (STTwitterStreamSessionBackoff)backoffForError:(NSError *)error {
+    
+    // the HTTP status is the code of STHTTPRequest errors, which Twitter errors wrap
+    NSError *httpError = error;
+    if([[httpError domain] isEqualToString:@"STHTTPRequest"] == NO) {
+        httpError = [[error userInfo] valueForKey:NSUnderlyingErrorKey];
+    }
+    
+    NSInteger status = 0;
+    if([[httpError domain] isEqualToString:@"STHTTPRequest"] && [httpError code] >= 400) {
+        status = [httpError code];
+    }
+    
+    if(status == 0) return STTwitterStreamSessionBackoffNetwork;
+    
+    if(status == 420) return STTwitterStreamSessionBackoffRateLimited;
+    
+    // errors which reconnecting won't fix
+    if(status == 401 || status == 403 || status == 404 || status == 406 || status == 413 || status == 416) {
+        return STTwitterStreamSessionBackoffNone;
+    }
+    
+    return STTwitterStreamSessionBackoffHTTP;
+}
+
+#pragma mark Stall detection
+
+- (void)startStallTimer {
+    
+    [self stopStallTimer];
+    
+    NSTimeInterval interval = MAX(_stallTimeout / 6, 1);
+    
+    __weak typeof(self) weakSelf = self;
+    
+    dispatch_source_t timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_main_queue());
+    dispatch_source_set_timer(timer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)(interval * NSEC_PER_SEC)), (uint64_t)(interval * NSEC_PER_SEC), NSEC_PER_SEC / 10);
+    dispatch_source_set_event_handler(timer, ^{
+        [weakSelf checkForStall];
+    });
+    
+    self.stallTimer = timer;
+    dispatch_resume(timer);
+}
+
+- (void)stopStallTimer {
+    if(_stallTimer == nil) return;
+    dispatch_source_cancel(_stallTimer);
+    self.stallTimer = nil;
+}
+
+- (void)checkForStall {
+    
+    if(_request == nil) return;
+    
+    NSTimeInterval silence = STTwitterStreamSessionUptime() - _lastDataTime;
+    if(silence < _stallTimeout) return;
+    
+    self.stallsCount += 1;
+    
+    NSString *description = [NSString stringWithFormat:@"stream stalled, no data received for %.0f seconds", silence];
+    NSError *error = [NSError errorWithDomain:NSStringFromClass([self class]) code:0 userInfo:@{NSLocalizedDescriptionKey : description}];
+    
+    [self closeConnection];
+    
+    [self connectionDidEndWithError:error backoff:STTwitterStreamSessionBackoffNetwork];
+}
+
+@end
@@ -0,0 +1,45 @@
+//
+//  STTwitterUserLookupBatcher.h
+//  STTwitter
+//
+
+#import <Foundation/Foundation.h>
+#import "STTwitterRequestProtocol.h"
+
+@class STTwitterAPI;
+
+/*
+ Gathers the user lookups made within batchingInterval into users/lookup requests of up to 100 users,
+ instead of one users/show request per user.
+
+ Users asked several times share one entry, including while their batch is in flight, and every caller
+ receives its own user. Users missing from the response (unknown, suspended or deleted) fail with error 34.
+
+ The batcher runs on the main queue, its blocks are called on the main queue.
+ */
+
+@interface STTwitterUserLookupBatcher : NSObject
+
+- (instancetype)initWithTwitterAPI:(STTwitterAPI *)twitter; // not retained, see -[STTwitterAPI userLookupBatcher]
+
+@property (nonatomic) NSTimeInterval batchingInterval; // default 0.05, from the first pending lookup to the request
+@property (nonatomic) NSUInteger maxBatchSize; // default 100, the API limit, a full batch is sent right away
+@property (nonatomic, strong) NSNumber *includeEntities; // default nil
+
+// cancelling the returned handle detaches this caller only
+- (NSObject<STTwitterRequestProtocol> *)lookupUserID:(NSString *)userID
+                                        successBlock:(void(^)(NSDictionary *user))successBlock
+                                          errorBlock:(void(^)(NSError *error))errorBlock;
+
+- (NSObject<STTwitterRequestProtocol> *)lookupScreenName:(NSString *)screenName
+                                            successBlock:(void(^)(NSDictionary *user))successBlock
+                                              errorBlock:(void(^)(NSError *error))errorBlock;
+
+- (void)flush; // sends the pending lookups now
+
+// counters
+@property (nonatomic, readonly) NSUInteger lookupsCount; // calls to lookupUserID: and lookupScreenName:
+@property (nonatomic, readonly) NSUInteger batchesCount; // users/lookup requests sent
+@property (nonatomic, readonly) NSUInteger pendingLookupsCount; // distinct users waiting for a batch
+
+@end
@@ -0,0 +1,253 @@
+//
+//  STTwitterUserLookupBatcher.m
+//  STTwitter
+//
+
+#import "STTwitterUserLookupBatcher.h"
+#import "STTwitterAPI.h"
+#import "STHTTPRequest.h"
+#import "NSError+STTwitter.h"
+
+@class STTwitterUserLookup;
+
+@interface STTwitterUserLookupBatcher ()
+@property (nonatomic, weak) STTwitterAPI *twitter;
+@property (nonatomic, strong) NSMutableArray *pendingKeys; // in order of arrival
+@property (nonatomic, strong) NSMutableDictionary *waitersByKey; // STTwitterUserLookup instances, pending and in flight
+@property (nonatomic) BOOL isFlushScheduled;
+@property (nonatomic) NSUInteger lookupsCount;
+@property (nonatomic) NSUInteger batchesCount;
+
+- (void)removeLookup:(STTwitterUserLookup *)lookup;
+@end
+
+/**/
+
+@interface STTwitterUserLookup : NSObject <STTwitterRequestProtocol>
+@property (nonatomic, weak) STTwitterUserLookupBatcher *batcher;
+@property (nonatomic, strong) NSString *key;
+@property (nonatomic, copy) void(^successBlock)(NSDictionary *user);
+@property (nonatomic, copy) void(^errorBlock)(NSError *error);
+@end
+
+@implementation STTwitterUserLookup
+
+- (void)cancel {
+    dispatch_async(dispatch_get_main_queue(), ^{
+        [self.batcher removeLookup:self];
+    });
+}
+
+@end
+
+/**/
+
+@implementation STTwitterUserLookupBatcher
+
+- (instancetype)initWithTwitterAPI:(STTwitterAPI *)twitter {
+    self = [super init];
+    
+    self.twitter = twitter;
+    self.batchingInterval = 0.05;
+    self.maxBatchSize = 100;
+    self.pendingKeys = [NSMutableArray array];
+    self.waitersByKey = [NSMutableDictionary dictionary];
+    
+    return self;
+}
+
+- (NSUInteger)pendingLookupsCount {
+    return [_pendingKeys count];
+}
+
+// user IDs and screen names share the key space, screen names are case insensitive
++ (NSString *)keyForUserID:(NSString *)userID {
+    return [@"id:" stringByAppendingString:userID];
+}
+
++ (NSString *)keyForScreenName:(NSString *)screenName {
+    return [@"name:" stringByAppendingString:[screenName lowercaseString]];
+}
+
+#pragma mark Lookups
+
+- (NSObject<STTwitterRequestProtocol> *)lookupUserID:(NSString *)userID
+                                        successBlock:(void(^)(NSDictionary *user))successBlock
+                                          errorBlock:(void(^)(NSError *error))errorBlock {
+    
+    NSParameterAssert(userID);
+    
+    return [self lookupWithKey:[[self class] keyForUserID:userID] successBlock:successBlock errorBlock:errorBlock];
+}
+
+- (NSObject<STTwitterRequestProtocol> *)lookupScreenName:(NSString *)screenName
+                                            successBlock:(void(^)(NSDictionary *user))successBlock
+                                              errorBlock:(void(^)(NSError *error))errorBlock {
+    
+    NSParameterAssert(screenName);
+    
+    return [self lookupWithKey:[[self class] keyForScreenName:screenName] successBlock:successBlock errorBlock:errorBlock];
+}
+
+- (NSObject<STTwitterRequestProtocol> *)lookupWithKey:(NSString *)key
+                                         successBlock:(void(^)(NSDictionary *user))successBlock
+                                           errorBlock:(void(^)(NSError *error))errorBlock {
+    
+    STTwitterUserLookup *lookup = [[STTwitterUserLookup alloc] init];
+    lookup.batcher = self;
+    lookup.key = key;
+    lookup.successBlock = successBlock;
+    lookup.errorBlock = errorBlock;
+    
+    if([NSThread isMainThread]) {
+        [self addLookup:lookup];
+    } else {
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [self addLookup:lookup];
+        });
+    }
+    
+    return lookup;
+}
+
+- (void)addLookup:(STTwitterUserLookup *)lookup {
+    
+    self.lookupsCount += 1;
+    
+    NSMutableArray *waiters = _waitersByKey[lookup.key];
+    
+    if(waiters) { // pending or in flight
+        [waiters addObject:lookup];
+        return;
+    }
+    
+    _waitersByKey[lookup.key] = [NSMutableArray arrayWithObject:lookup];
+    [_pendingKeys addObject:lookup.key];
+    
+    if([_pendingKeys count] >= MAX(_maxBatchSize, 1)) {
+        [self flush];
+        return;
+    }
+    
+    if(_isFlushScheduled) return;
+    self.isFlushScheduled = YES;
+    
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(_batchingInterval * NSEC_PER_SEC)), dispatch_get_main_queue(), ^{
+        self.isFlushScheduled = NO;
+        [self flush];
+    });
+}
+
+- (void)removeLookup:(STTwitterUserLookup *)lookup {
+    
+    NSMutableArray *waiters = _waitersByKey[lookup.key];
+    if([waiters containsObject:lookup] == NO) return;
+    
+    [waiters removeObject:lookup];
+    
+    // a pending user nobody waits for anymore is not requested, an in flight one is just ignored
+    if([waiters count] == 0 && [_pendingKeys containsObject:lookup.key]) {
+        [_pendingKeys removeObject:lookup.key];
+        [_waitersByKey removeObjectForKey:lookup.key];
+    }
+    
+    NSError *error = [NSError st_cancellationError];
+    
+    if(lookup.errorBlock) lookup.errorBlock(error);
+}
+
+#pragma mark Batches
+
+- (void)flush {
+    
+    if([NSThread isMainThread] == NO) {
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [self flush];
+        });
+        return;
+    }
+    
+    while([_pendingKeys count] > 0) {
+        NSUInteger count = MIN([_pendingKeys count], MAX(_maxBatchSize, 1));
+        NSArray *keys = [_pendingKeys subarrayWithRange:NSMakeRange(0, count)];
+        [_pendingKeys removeObjectsInRange:NSMakeRange(0, count)];
+        
+        [self sendBatchWithKeys:keys];
+    }
+}
+
+- (void)sendBatchWithKeys:(NSArray *)keys {
+    
+    NSMutableArray *userIDs = [NSMutableArray array];
+    NSMutableArray *screenNames = [NSMutableArray array];
+    
+    for(NSString *key in keys) {
+        if([key hasPrefix:@"id:"]) {
+            [userIDs addObject:[key substringFromIndex:3]];
+        } else {
+            [screenNames addObject:[key substringFromIndex:5]];
+        }
+    }
+    
+    STTwitterAPI *twitter = _twitter;
+    
+    if(twitter == nil) {
+        NSError *error = [NSError errorWithDomain:NSStringFromClass([self class]) code:0 userInfo:@{NSLocalizedDescriptionKey : @"the STTwitterAPI instance was released"}];
+        [self completeBatchWithKeys:keys users:nil error:error];
+        return;
+    }
+    
+    self.batchesCount += 1;
+    
+    [twitter getUsersLookupForScreenName:[screenNames count] ? [screenNames componentsJoinedByString:@","] : nil
+                                orUserID:[userIDs count] ? [userIDs componentsJoinedByString:@","] : nil
+                         includeEntities:_includeEntities
+                            successBlock:^(NSArray *users) {
+                                dispatch_async(dispatch_get_main_queue(), ^{
+                                    [self completeBatchWithKeys:keys users:users error:nil];
+                                });
+                            } errorBlock:^(NSError *error) {
+                                dispatch_async(dispatch_get_main_queue(), ^{
+                                    [self completeBatchWithKeys:keys users:nil error:error];
+                                });
+                            }];
+}
+
+- (void)completeBatchWithKeys:(NSArray *)keys users:(NSArray *)users error:(NSError *)error {
+    
+    // the order of the users may not match the order of the request
+    NSMutableDictionary *usersByKey = [NSMutableDictionary dictionary];
+    
+    for(NSDictionary *user in ([users isKindOfClass:[NSArray class]] ? users : nil)) {
+        if([user isKindOfClass:[NSDictionary class]] == NO) continue;
+        
+        NSString *userID = [user valueForKey:@"id_str"];
+        NSString *screenName = [user valueForKey:@"screen_name"];
+        
+        if(userID) usersByKey[[[self class] keyForUserID:userID]] = user;
+        if(screenName) usersByKey[[[self class] keyForScreenName:screenName]] = user;
+    }
+    
+    for(NSString *key in keys) {
+        
+        NSArray *waiters = _waitersByKey[key];
+        [_waitersByKey removeObjectForKey:key];
+        
+        NSDictionary *user = usersByKey[key];
+        
+        NSError *e = error;
+        if(user == nil && e == nil) {
+            e = [NSError errorWithDomain:kSTTwitterTwitterErrorDomain code:STTwitterTwitterErrorPageDoesNotExist userInfo:@{NSLocalizedDescriptionKey : @"User not found"}];
+        }
+        
+        for(STTwitterUserLookup *lookup in waiters) {
+            if(user) {
+                if(lookup.successBlock) lookup.successBlock(user);
+            } else {
+                if(lookup.errorBlock) lookup.errorBlock(e);
+            }
+        }
+    }
+}
+
+@end
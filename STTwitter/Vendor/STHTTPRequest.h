@@ -17,6 +17,10 @@ extern NSUInteger const kSTHTTPRequestCancellationError;
 extern NSUInteger const kSTHTTPRequestDefaultTimeout;
 
 @class STHTTPRequest;
+@class STHTTPRequestParameters;
+@class STHTTPRequestMetrics;
+@class STHTTPRequestResponseCache;
+@class STHTTPRequestScheduler;
 
 typedef void (^sendRequestBlock_t)(STHTTPRequest *request);
 typedef void (^uploadProgressBlock_t)(int64_t bytesWritten, int64_t totalBytesWritten, int64_t totalBytesExpectedToWrite);
@@ -24,6 +28,16 @@ typedef void (^downloadProgressBlock_t)(NSData *data, int64_t totalBytesReceived
 typedef void (^completionBlock_t)(NSDictionary *headers, NSString *body);
 typedef void (^completionDataBlock_t)(NSDictionary *headers, NSData *body);
 typedef void (^errorBlock_t)(NSError *error);
+typedef id (^responseProcessingBlock_t)(NSDictionary *headers, NSData *body);
+typedef void (^completionObjectBlock_t)(NSDictionary *headers, id object);
+typedef NSError *(^errorProcessingBlock_t)(NSError *error, NSDictionary *headers, NSData *body);
+
+typedef NS_ENUM(NSInteger, STHTTPRequestPriority) {
+    STHTTPRequestPriorityInteractive = 0, // eg. sending a message
+    STHTTPRequestPriorityVisibleContent = 1, // default
+    STHTTPRequestPriorityBackfill = 2, // eg. following cursors
+    STHTTPRequestPriorityPrefetch = 3
+};
 
 typedef NS_ENUM(NSUInteger, STHTTPRequestCookiesStorage) {
     STHTTPRequestCookiesStorageShared = 0,
@@ -39,12 +53,21 @@ typedef NS_ENUM(NSUInteger, STHTTPRequestCookiesStorage) {
 @property (copy) completionBlock_t completionBlock;
 @property (copy) errorBlock_t errorBlock;
 @property (copy) completionDataBlock_t completionDataBlock;
+@property (copy) responseProcessingBlock_t responseProcessingBlock; // run on processingQueue, its result is passed to completionObjectBlock
+@property (copy) completionObjectBlock_t completionObjectBlock;
+@property (copy) errorProcessingBlock_t errorProcessingBlock; // run on processingQueue, its result is passed to errorBlock
+
+// queues
+@property (nonatomic, strong) dispatch_queue_t callbackQueue; // completion, error and progress blocks, default: main queue
+@property (nonatomic, strong) dispatch_queue_t processingQueue; // response and error processing blocks, default: global queue
 
 // request
 @property (nonatomic, strong) NSString *HTTPMethod; // default: GET, overridden by POST if POSTDictionary or files to upload
 @property (nonatomic, strong) NSMutableDictionary *requestHeaders;
 @property (nonatomic, strong) NSDictionary *POSTDictionary; // keys and values are NSString instances
 @property (nonatomic, strong) NSDictionary *GETDictionary; // appended to the URL string
+@property (nonatomic, strong) STHTTPRequestParameters *GETParameters; // already encoded and sorted, used instead of GETDictionary
+@property (nonatomic, strong) STHTTPRequestParameters *POSTParameters; // already encoded and sorted, used instead of POSTDictionary for form bodies
 @property (nonatomic, strong) NSData *rawPOSTData; // eg. to post JSON contents
 @property (nonatomic) NSStringEncoding POSTDataEncoding;
 @property (nonatomic) NSTimeInterval timeoutSeconds; // ignored if 0
@@ -63,18 +86,35 @@ typedef NS_ENUM(NSUInteger, STHTTPRequestCookiesStorage) {
 @property (nonatomic, readonly) NSInteger responseStatus;
 @property (nonatomic, strong, readonly) NSString *responseStringEncodingName;
 @property (nonatomic, strong, readonly) NSDictionary *responseHeaders;
-@property (nonatomic, strong) NSString *responseString;
-@property (nonatomic, strong, readonly) NSMutableData *responseData;
+@property (nonatomic, strong) NSString *responseString; // decoded lazily from responseData
+@property (nonatomic, strong, readonly) NSMutableData *responseData; // released once the completion blocks have returned
 @property (nonatomic, strong, readonly) NSError *error;
 @property (nonatomic) long long responseExpectedContentLength; // set by connection:didReceiveResponse: delegate method; web server must send the Content-Length header for accurate value
+@property (nonatomic) BOOL streaming; // default NO, when set received data is only passed to downloadProgressBlock and never accumulated in responseData
+
+// scheduling
+@property (nonatomic, strong) STHTTPRequestScheduler *scheduler; // default nil, the request starts as soon as startAsynchronous is called, streaming requests are never scheduled
+@property (nonatomic) STHTTPRequestPriority priority; // default STHTTPRequestPriorityVisibleContent
+@property (nonatomic, strong) NSString *schedulingGroup; // eg. an account, groups with pending requests of the same priority are served in turn
+
+// metrics
+@property (nonatomic, strong, readonly) STHTTPRequestMetrics *metrics; // filled while the request runs, complete when metricsBlock is called
+@property (copy) void (^metricsBlock)(STHTTPRequestMetrics *metrics); // run on processingQueue once the callbacks have returned, not for streaming requests
 
 // cache
 @property (nonatomic) BOOL ignoreCache; // requests ignore cached responses and responses don't get cached
+@property (nonatomic, strong) STHTTPRequestResponseCache *responseCache; // GET responses are stored with their validators and revalidated, default: globalResponseCache
+@property (nonatomic, strong) NSString *responseCacheVariant; // distinguishes the cached responses which depend on the credentials, eg. an access token, only its SHA-256 digest is stored
+@property (nonatomic, readonly) BOOL responseIsFromCache; // the body was read from responseCache, fresh or revalidated by a 304
 
 + (instancetype)requestWithURL:(NSURL *)url;
 + (instancetype)requestWithURLString:(NSString *)urlString;
 
 + (void)setGlobalIgnoreCache:(BOOL)ignoreCache; // no cache at all when set, overrides the ignoreCache property
++ (void)setGlobalResponseCache:(STHTTPRequestResponseCache *)responseCache; // default nil, overridden by the responseCache property
++ (void)setGlobalCallbackQueue:(dispatch_queue_t)queue; // overridden by the callbackQueue property
++ (void)setGlobalProcessingQueue:(dispatch_queue_t)queue; // overridden by the processingQueue property
++ (void)setGlobalBackgroundUploadThreshold:(unsigned long long)threshold; // POST bodies at least this large are uploaded from a file in a background session, smaller ones are sent from memory, default 1 MB
 
 - (NSString *)debugDescription; // logged when launched with -STHTTPRequestShowDebugDescription 1
 - (NSString *)curlDescription; // logged when launched with -STHTTPRequestShowCurlDescription 1
@@ -83,6 +123,7 @@ typedef NS_ENUM(NSUInteger, STHTTPRequestCookiesStorage) {
 - (NSString *)startSynchronousWithError:(NSError **)e onQueue:(dispatch_queue_t) queue;
 - (void)startAsynchronous;
 - (void)cancel;
+- (void)failWithError:(NSError *)error; // instead of startAsynchronous, delivers error like a failed request would, eg. for a request refused before being sent
 
 // Cookies
 + (void)addCookieToSharedCookiesStorage:(NSHTTPCookie *)cookie;
@@ -125,12 +166,111 @@ typedef NS_ENUM(NSUInteger, STHTTPRequestCookiesStorage) {
 @interface NSError (STHTTPRequest)
 - (BOOL)st_isAuthenticationError;
 - (BOOL)st_isCancellationError;
++ (NSError *)st_cancellationError; // "Connection was cancelled.", recognized by st_isCancellationError
 @end
 
 @interface NSString (RFC3986)
-- (NSString *)st_stringByAddingRFC3986PercentEscapesUsingEncoding:(NSStringEncoding)encoding;
+- (NSString *)st_stringByAddingRFC3986PercentEscapesUsingEncoding:(NSStringEncoding)encoding; // escapes the bytes of the string in encoding, nil if it can't be represented
+- (void)st_appendRFC3986PercentEscapedUTF8BytesToData:(NSMutableData *)data; // same escaping, without intermediate strings
 @end
 
 @interface NSString (STUtilities)
 - (NSString *)st_stringByAppendingGETParameters:(NSDictionary *)parameters doApplyURLEncoding:(BOOL)doApplyURLEncoding;
 @end
+
+// keys and values are percent encoded once, and sorted by encoded key then encoded value, as required for OAuth signatures
+@interface STHTTPRequestParameters : NSObject
+
++ (instancetype)parametersWithDictionary:(NSDictionary *)dictionary; // values are NSString instances, or their description is used
+
+- (STHTTPRequestParameters *)parametersByAddingParameters:(STHTTPRequestParameters *)parameters; // merged, still sorted
+
+@property (nonatomic, readonly) NSUInteger count;
+@property (nonatomic, strong, readonly) NSString *queryString; // k1=v1&k2=v2, built once
+
+- (void)enumerateEncodedKeysAndValuesUsingBlock:(void(^)(NSString *encodedKey, NSString *encodedValue, BOOL *stop))block;
+
+@end
+
+// timings of one request in seconds, -1 when unknown
+// network phases come from NSURLSessionTaskMetrics when available (macOS 10.12, iOS 10), from our own timestamps otherwise
+@interface STHTTPRequestMetrics : NSObject
+
+@property (nonatomic, strong, readonly) NSString *HTTPMethod;
+@property (nonatomic, strong, readonly) NSURL *URL;
+@property (nonatomic, readonly) NSInteger statusCode;
+@property (nonatomic, readonly) BOOL failed;
+@property (nonatomic, readonly) BOOL reusedConnection;
+@property (nonatomic, readonly) int64_t responseBytesCount;
+
+@property (nonatomic, readonly) NSTimeInterval queueing; // from startAsynchronous to the fetch start, waiting for the scheduler included
+@property (nonatomic, readonly) NSTimeInterval domainLookup;
+@property (nonatomic, readonly) NSTimeInterval connect; // TLS included
+@property (nonatomic, readonly) NSTimeInterval secureConnection;
+@property (nonatomic, readonly) NSTimeInterval timeToFirstByte; // from the request start to the first response byte
+@property (nonatomic, readonly) NSTimeInterval transfer; // response body
+@property (nonatomic, readonly) NSTimeInterval decode; // response or error processing block
+@property (nonatomic, readonly) NSTimeInterval callbackDispatch; // waiting for the callback queue
+@property (nonatomic, readonly) NSTimeInterval total; // from startAsynchronous to the return of the callbacks
+
+- (NSDictionary *)dictionaryRepresentation;
+
+@end
+
+/*
+ On-disk cache for GET responses, used instead of NSURLCache so that responses are revalidated
+ with If-None-Match / If-Modified-Since and a 304 only costs its headers.
+
+ A 200 response is stored when it has an ETag, a Last-Modified date, or a time to live.
+ Within its time to live a response is served without network, then it is revalidated when it has validators.
+ The time to live comes from the overrides, then from Cache-Control max-age, then from defaultTimeToLive.
+ The least recently used responses are evicted above maxSize.
+ 
+ Headers and bodies are stored unencrypted, with the data protection of the directory, and can hold
+ private data such as a home timeline. Call removeAllResponses when the user logs out.
+ */
+@interface STHTTPRequestResponseCache : NSObject
+
++ (instancetype)sharedCache; // Caches/STHTTPRequestResponseCache, 20 MB
+
+- (instancetype)initWithDirectoryURL:(NSURL *)directoryURL maxSize:(unsigned long long)maxSize;
+
+@property (nonatomic, strong, readonly) NSURL *directoryURL;
+@property (atomic) unsigned long long maxSize;
+@property (atomic) NSTimeInterval defaultTimeToLive; // default 0, responses without validators are not stored
+
+- (void)setTimeToLive:(NSTimeInterval)timeToLive forURLPathSuffix:(NSString *)pathSuffix; // eg. 86400 for @"/help/configuration.json", overrides Cache-Control including no-store, only for public resources
+- (void)removeAllResponses;
+
+// stats
+@property (readonly) NSUInteger hitsCount; // served without network
+@property (readonly) NSUInteger revalidationsCount; // served after a 304
+@property (readonly) NSUInteger missesCount; // full responses, nothing or a stale response in the cache
+@property (readonly) NSUInteger storesCount;
+@property (readonly) NSUInteger evictionsCount;
+@property (readonly) unsigned long long savedBytesCount; // bodies served from the cache
+@property (readonly) unsigned long long currentSize;
+
+- (NSDictionary *)statistics;
+
+@end
+
+/*
+ Starts the requests given to it by priority, within per-host concurrency limits.
+
+ Pending requests of higher priorities always start first, requests of the same priority and group in order,
+ and the groups of a priority are served in turn, so that one account's long crawl doesn't delay another's requests.
+ Backfill and prefetch requests leave one slot per host free, for the requests of higher priorities.
+ */
+@interface STHTTPRequestScheduler : NSObject
+
++ (instancetype)sharedScheduler;
+
+@property (atomic) NSUInteger maxConcurrentRequestsPerHost; // default 4
+- (void)setMaxConcurrentRequests:(NSUInteger)maxConcurrentRequests forHost:(NSString *)host;
+
+@property (readonly) NSUInteger runningRequestsCount;
+@property (readonly) NSUInteger pendingRequestsCount;
+- (NSUInteger)pendingRequestsCountForPriority:(STHTTPRequestPriority)priority;
+
+@end
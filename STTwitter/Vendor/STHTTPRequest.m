@@ -13,6 +13,7 @@
 #endif
 
 #import "STHTTPRequest.h"
+#import <CommonCrypto/CommonDigest.h>
 
 NSUInteger const kSTHTTPRequestCancellationError = 1;
 NSUInteger const kSTHTTPRequestDefaultTimeout = 30;
@@ -22,6 +23,12 @@ static NSMutableArray *localCookiesStorage = nil;
 static NSMutableDictionary *sessionCompletionHandlersForIdentifier = nil;
 
 static BOOL globalIgnoreCache = NO;
+static dispatch_queue_t globalCallbackQueue = nil;
+static dispatch_queue_t globalProcessingQueue = nil;
+static unsigned long long globalBackgroundUploadThreshold = 1024 * 1024;
+static STHTTPRequestResponseCache *globalResponseCache = nil;
+
+static int64_t const kSTHTTPRequestMaxPreallocatedResponseLength = 8 * 1024 * 1024; // Content-Length is only a hint
 static STHTTPRequestCookiesStorage globalCookiesStoragePolicy = STHTTPRequestCookiesStorageShared;
 
 /**/
@@ -45,10 +52,41 @@ static STHTTPRequestCookiesStorage globalCookiesStoragePolicy = STHTTPRequestCoo
 
 /**/
 
+@interface STHTTPRequestCacheEntry : NSObject
+@property (nonatomic, strong) NSString *key;
+@property (nonatomic, strong) NSString *fileName;
+@property (nonatomic, strong) NSDictionary *headers;
+@property (nonatomic, strong) NSString *textEncodingName;
+@property (nonatomic, strong) NSString *ETag;
+@property (nonatomic, strong) NSString *lastModified;
+@property (nonatomic) NSTimeInterval expirationTime; // since reference date
+@property (nonatomic) NSTimeInterval lastAccessTime;
+@property (nonatomic) unsigned long long size;
+@end
+
+@interface STHTTPRequestResponseCache ()
+- (STHTTPRequestCacheEntry *)entryForKey:(NSString *)key;
+- (BOOL)isEntryFresh:(STHTTPRequestCacheEntry *)entry;
+- (NSURLRequest *)request:(NSURLRequest *)request byAddingValidatorsOfEntry:(STHTTPRequestCacheEntry *)entry;
+- (NSData *)bodyForEntry:(STHTTPRequestCacheEntry *)entry;
+- (NSDictionary *)headersByRevalidatingEntry:(STHTTPRequestCacheEntry *)entry withNotModifiedHeaders:(NSDictionary *)headers URL:(NSURL *)url;
+- (void)storeBody:(NSData *)body headers:(NSDictionary *)headers textEncodingName:(NSString *)textEncodingName forKey:(NSString *)key URL:(NSURL *)url;
+- (void)recordHitWithBodyLength:(NSUInteger)length;
++ (NSString *)keyForURL:(NSURL *)url variant:(NSString *)variant;
+@end
+
+@interface STHTTPRequestScheduler ()
+- (void)enqueueRequest:(STHTTPRequest *)request;
+- (BOOL)removePendingRequest:(STHTTPRequest *)request;
+- (void)requestDidFinish:(STHTTPRequest *)request;
+@end
+
 @interface STHTTPRequest ()
 
 @property (nonatomic) NSInteger responseStatus;
 @property (nonatomic, strong) NSURLSessionTask *task;
+@property (nonatomic, weak) NSURLSession *session; // the pooled session running the task
+@property (atomic) BOOL isCancelled; // the error block already received the cancellation, nothing else is delivered
 @property (nonatomic, strong) NSMutableData *responseData;
 @property (nonatomic, strong) NSString *responseStringEncodingName;
 @property (nonatomic, strong) NSDictionary *responseHeaders;
@@ -59,6 +97,40 @@ static STHTTPRequestCookiesStorage globalCookiesStoragePolicy = STHTTPRequestCoo
 @property (nonatomic, strong) NSURLRequest *request;
 @property (nonatomic, strong) NSURL *HTTPBodyFileURL; // created for NSURLSessionUploadTask, removed on completion
 @property (nonatomic, strong) NSMutableArray *ephemeralRequestCookies;
+@property (nonatomic) int64_t totalBytesReceived;
+@property (nonatomic, strong) STHTTPRequestMetrics *metrics;
+@property (nonatomic) CFAbsoluteTime startTime;
+@property (nonatomic) CFAbsoluteTime responseTime; // first response byte, when task metrics are not available
+@property (nonatomic, strong) NSString *responseCacheKey; // set when the response goes through the response cache
+@property (nonatomic, strong) STHTTPRequestCacheEntry *cachedEntry; // the stored response being served or revalidated
+@property (nonatomic) BOOL responseIsFromCache;
+@property (nonatomic, strong) NSURLRequest *scheduledURLRequest; // prepared, waiting for the scheduler
+@property (atomic) BOOL holdsSchedulerSlot;
+
+- (void)startScheduledRequest;
+
+- (void)readTaskMetrics:(NSURLSessionTaskMetrics *)taskMetrics NS_AVAILABLE(10_12, 10_0);
+
+@end
+
+@interface STHTTPRequestMetrics ()
+
+@property (nonatomic, strong) NSString *HTTPMethod;
+@property (nonatomic, strong) NSURL *URL;
+@property (nonatomic) NSInteger statusCode;
+@property (nonatomic) BOOL failed;
+@property (nonatomic) BOOL reusedConnection;
+@property (nonatomic) int64_t responseBytesCount;
+
+@property (nonatomic) NSTimeInterval queueing;
+@property (nonatomic) NSTimeInterval domainLookup;
+@property (nonatomic) NSTimeInterval connect;
+@property (nonatomic) NSTimeInterval secureConnection;
+@property (nonatomic) NSTimeInterval timeToFirstByte;
+@property (nonatomic) NSTimeInterval transfer;
+@property (nonatomic) NSTimeInterval decode;
+@property (nonatomic) NSTimeInterval callbackDispatch;
+@property (nonatomic) NSTimeInterval total;
 
 @end
 
@@ -66,6 +138,24 @@ static STHTTPRequestCookiesStorage globalCookiesStoragePolicy = STHTTPRequestCoo
 - (NSString *)base64Encoding; // private API
 @end
 
+/**/
+
+// NSURLSession instances own their connection pools, so creating one per request
+// means a new TCP+TLS handshake every time. Sessions are shared by kind and origin,
+// and their delegate callbacks are routed to the STHTTPRequest which owns the task.
+
+@interface STHTTPRequestSessionPool : NSObject <NSURLSessionDataDelegate>
+
++ (instancetype)sharedPool;
+
+- (NSURLSession *)sessionForURL:(NSURL *)url background:(BOOL)background;
+
+- (void)setRequest:(STHTTPRequest *)request forTask:(NSURLSessionTask *)task;
+- (STHTTPRequest *)requestForTask:(NSURLSessionTask *)task;
+- (void)removeRequestForTask:(NSURLSessionTask *)task;
+
+@end
+
 @implementation STHTTPRequest
 
 #pragma mark Initializers
@@ -84,10 +174,26 @@ static STHTTPRequestCookiesStorage globalCookiesStoragePolicy = STHTTPRequestCoo
     globalIgnoreCache = ignoreCache;
 }
 
++ (void)setGlobalResponseCache:(STHTTPRequestResponseCache *)responseCache {
+    globalResponseCache = responseCache;
+}
+
 + (void)setGlobalCookiesStoragePolicy:(STHTTPRequestCookiesStorage)cookieStoragePolicy {
     globalCookiesStoragePolicy = cookieStoragePolicy;
 }
 
++ (void)setGlobalCallbackQueue:(dispatch_queue_t)queue {
+    globalCallbackQueue = queue;
+}
+
++ (void)setGlobalBackgroundUploadThreshold:(unsigned long long)threshold {
+    globalBackgroundUploadThreshold = threshold;
+}
+
++ (void)setGlobalProcessingQueue:(dispatch_queue_t)queue {
+    globalProcessingQueue = queue;
+}
+
 - (instancetype)initWithURL:(NSURL *)theURL {
     
     if (self = [super init]) {
@@ -104,6 +210,7 @@ static STHTTPRequestCookiesStorage globalCookiesStoragePolicy = STHTTPRequestCoo
         self.HTTPMethod = @"GET"; // default
         self.cookieStoragePolicyForInstance = STHTTPRequestCookiesStorageUndefined; // globalCookiesStoragePolicy will be used
         self.ephemeralRequestCookies = [NSMutableArray array];
+        self.priority = STHTTPRequestPriorityVisibleContent;
     }
     
     return self;
@@ -238,7 +345,7 @@ static STHTTPRequestCookiesStorage globalCookiesStoragePolicy = STHTTPRequestCoo
 
 + (void)addCookieToSharedCookiesStorage:(NSHTTPCookie *)cookie {
     [[NSHTTPCookieStorage sharedHTTPCookieStorage] setCookie:cookie];
-    
+
 #if DEBUG
     NSHTTPCookie *readCookie = [[[NSHTTPCookieStorage sharedHTTPCookieStorage] cookies] lastObject];
     NSAssert(readCookie, @"cannot read any cookie after adding one");
@@ -364,22 +471,161 @@ static STHTTPRequestCookiesStorage globalCookiesStoragePolicy = STHTTPRequestCoo
     return sortedDictionaries;
 }
 
-+ (NSData *)multipartContentWithBoundary:(NSString *)boundary data:(NSData *)someData fileName:(NSString *)fileName parameterName:(NSString *)parameterName mimeType:(NSString *)aMimeType {
++ (NSData *)multipartHeaderWithBoundary:(NSString *)boundary fileName:(NSString *)fileName parameterName:(NSString *)parameterName mimeType:(NSString *)aMimeType isFirstPart:(BOOL)isFirstPart {
     
     NSString *mimeType = aMimeType ? aMimeType : @"application/octet-stream";
     
-    NSMutableData *data = [[NSMutableData alloc] init];
+    NSString *fileNameContentDisposition = fileName ? [NSString stringWithFormat:@"filename=\"%@\"", fileName] : @"";
+    
+    NSMutableString *ms = [NSMutableString string];
     
-    [data appendData:[[NSString stringWithFormat:@"--%@\r\n", boundary] dataUsingEncoding:NSUTF8StringEncoding]];
+    if(isFirstPart == NO) [ms appendString:@"\r\n"]; // the delimiter's CRLF belongs to it, not to the previous part
+    [ms appendFormat:@"--%@\r\n", boundary];
+    [ms appendFormat:@"Content-Disposition: form-data; name=\"%@\"; %@\r\n", parameterName, fileNameContentDisposition];
+    [ms appendFormat:@"Content-Type: %@\r\n\r\n", mimeType];
     
-    NSString *fileNameContentDisposition = fileName ? [NSString stringWithFormat:@"filename=\"%@\"", fileName] : @"";
-    NSString *contentDisposition = [NSString stringWithFormat:@"Content-Disposition: form-data; name=\"%@\"; %@\r\n", parameterName, fileNameContentDisposition];
+    return [ms dataUsingEncoding:NSUTF8StringEncoding];
+}
+
+static BOOL STHTTPRequestWriteBytes(NSOutputStream *outputStream, const uint8_t *bytes, NSUInteger length) {
+    while(length > 0) {
+        NSInteger written = [outputStream write:bytes maxLength:length];
+        if(written <= 0) return NO;
+        bytes += written;
+        length -= written;
+    }
+    return YES;
+}
+
+static BOOL STHTTPRequestWriteData(NSOutputStream *outputStream, NSData *data) {
+    return STHTTPRequestWriteBytes(outputStream, [data bytes], [data length]);
+}
+
+// upper bound of the multipart body length, without the part headers
+- (unsigned long long)multipartContentsLength {
+    
+    unsigned long long length = 0;
+    
+    for(STHTTPRequestFileUpload *fileToUpload in self.filesToUpload) {
+        length += [[[NSFileManager defaultManager] attributesOfItemAtPath:fileToUpload.path error:nil] fileSize];
+    }
+    
+    for(STHTTPRequestDataUpload *dataToUpload in self.dataToUpload) {
+        length += [dataToUpload.data length];
+    }
+    
+    return length;
+}
+
+// files to upload are copied through a fixed size buffer, so that memory use doesn't depend on the upload size
+- (BOOL)writeMultipartBodyWithBoundary:(NSString *)boundary
+                sortedPOSTDictionaries:(NSArray *)sortedPOSTDictionaries
+                        toOutputStream:(NSOutputStream *)outputStream {
+    
+    NSUInteger bufferLength = 256 * 1024;
+    NSMutableData *buffer = [NSMutableData dataWithLength:bufferLength];
+    
+    BOOL success = YES;
+    BOOL isFirstPart = YES;
+    
+    for(STHTTPRequestFileUpload *fileToUpload in self.filesToUpload) {
+        
+        NSInputStream *inputStream = [NSInputStream inputStreamWithFileAtPath:fileToUpload.path];
+        [inputStream open];
+        if([inputStream streamStatus] != NSStreamStatusOpen) continue;
+        
+        NSData *header = [[self class] multipartHeaderWithBoundary:boundary
+                                                          fileName:[fileToUpload.path lastPathComponent]
+                                                     parameterName:fileToUpload.parameterName
+                                                          mimeType:fileToUpload.mimeType
+                                                       isFirstPart:isFirstPart];
+        isFirstPart = NO;
+        
+        success = STHTTPRequestWriteData(outputStream, header);
+        
+        NSInteger read = 0;
+        while(success && (read = [inputStream read:[buffer mutableBytes] maxLength:bufferLength]) > 0) {
+            success = STHTTPRequestWriteBytes(outputStream, [buffer bytes], read);
+        }
+        if(read < 0) success = NO;
+        
+        [inputStream close];
+        
+        if(success == NO) break;
+    }
+    
+    for(STHTTPRequestDataUpload *dataToUpload in self.dataToUpload) {
+        if(success == NO) break;
+        
+        NSData *header = [[self class] multipartHeaderWithBoundary:boundary
+                                                          fileName:dataToUpload.fileName
+                                                     parameterName:dataToUpload.parameterName
+                                                          mimeType:dataToUpload.mimeType
+                                                       isFirstPart:isFirstPart];
+        isFirstPart = NO;
+        
+        success = STHTTPRequestWriteData(outputStream, header) && STHTTPRequestWriteData(outputStream, dataToUpload.data);
+    }
+    
+    for(NSDictionary *d in sortedPOSTDictionaries) {
+        if(success == NO) break;
+        
+        NSString *key = [[d allKeys] lastObject];
+        NSObject *value = [[d allValues] lastObject];
+        
+        NSString *s = [NSString stringWithFormat:@"\r\n--%@\r\nContent-Disposition: form-data; name=\"%@\"\r\n\r\n%@", boundary, key, [value description]];
+        
+        success = STHTTPRequestWriteData(outputStream, [s dataUsingEncoding:NSUTF8StringEncoding]);
+    }
+    
+    if(success) {
+        NSString *s = [NSString stringWithFormat:@"\r\n--%@--\r\n", boundary];
+        success = STHTTPRequestWriteData(outputStream, [s dataUsingEncoding:NSUTF8StringEncoding]);
+    }
+    
+    if(success == NO) {
+        NSLog(@"-- can't write multipart body, %@", [outputStream streamError]);
+    }
+    
+    return success;
+}
+
+// large bodies are written to a temporary file, to be uploaded by a background session
+- (NSURL *)writeMultipartBodyFileWithBoundary:(NSString *)boundary
+                       sortedPOSTDictionaries:(NSArray *)sortedPOSTDictionaries
+                                       length:(unsigned long long *)length {
+    
+    NSString *fileName = [[NSProcessInfo processInfo] globallyUniqueString];
+    NSURL *fileURL = [NSURL fileURLWithPath:[NSTemporaryDirectory() stringByAppendingPathComponent:fileName]];
+    
+    NSOutputStream *outputStream = [NSOutputStream outputStreamWithURL:fileURL append:NO];
+    [outputStream open];
     
-    [data appendData:[contentDisposition dataUsingEncoding:NSUTF8StringEncoding]];
-    [data appendData:[[NSString stringWithFormat:@"Content-Type: %@\r\n\r\n", mimeType] dataUsingEncoding:NSUTF8StringEncoding]];
-    [data appendData:someData];
+    BOOL success = [self writeMultipartBodyWithBoundary:boundary sortedPOSTDictionaries:sortedPOSTDictionaries toOutputStream:outputStream];
     
-    return data;
+    [outputStream close];
+    
+    if(success == NO) {
+        [[NSFileManager defaultManager] removeItemAtURL:fileURL error:nil];
+        return nil;
+    }
+    
+    *length = [[[NSFileManager defaultManager] attributesOfItemAtPath:[fileURL path] error:nil] fileSize];
+    
+    return fileURL;
+}
+
+- (void)removeHTTPBodyFile {
+    
+    if(_HTTPBodyFileURL == nil) return;
+    
+    NSError *error = nil;
+    BOOL status = [[NSFileManager defaultManager] removeItemAtURL:_HTTPBodyFileURL error:&error];
+    if(status == NO) {
+        NSLog(@"-- can't remove %@, %@", _HTTPBodyFileURL, [error localizedDescription]);
+    }
+    
+    self.HTTPBodyFileURL = nil;
 }
 
 + (NSURL *)appendURL:(NSURL *)url withGETParameters:(NSDictionary *)parameters doApplyURLEncoding:(BOOL)doApplyURLEncoding {
@@ -403,10 +649,18 @@ static STHTTPRequestCookiesStorage globalCookiesStoragePolicy = STHTTPRequestCoo
         theURL = _url;
     }
     
-    theURL = [[self class] appendURL:theURL withGETParameters:_GETDictionary doApplyURLEncoding:_encodeGETDictionary];
+    if(_GETParameters) {
+        if([_GETParameters count] > 0) {
+            NSString *absoluteString = [theURL absoluteString];
+            NSString *separator = [absoluteString rangeOfString:@"?"].location == NSNotFound ? @"?" : @"&";
+            theURL = [NSURL URLWithString:[NSString stringWithFormat:@"%@%@%@", absoluteString, separator, [_GETParameters queryString]]];
+        }
+    } else {
+        theURL = [[self class] appendURL:theURL withGETParameters:_GETDictionary doApplyURLEncoding:_encodeGETDictionary];
+    }
     
     if([_HTTPMethod isEqualToString:@"GET"]) {
-        if(_POSTDictionary || _rawPOSTData || [self.filesToUpload count] > 0 || [self.dataToUpload count] > 0) {
+        if(_POSTDictionary || _POSTParameters || _rawPOSTData || [self.filesToUpload count] > 0 || [self.dataToUpload count] > 0) {
             self.HTTPMethod = @"POST";
         }
     }
@@ -451,58 +705,44 @@ static STHTTPRequestCookiesStorage globalCookiesStoragePolicy = STHTTPRequestCoo
         
         /**/
         
-        NSMutableData *mutableBodyData = [NSMutableData data];
+        [self removeHTTPBodyFile]; // in case the request was already prepared
         
-        for(STHTTPRequestFileUpload *fileToUpload in self.filesToUpload) {
+        if([self multipartContentsLength] < globalBackgroundUploadThreshold) {
             
-            NSData *data = [NSData dataWithContentsOfFile:fileToUpload.path];
-            if(data == nil) continue;
-            NSString *fileName = [fileToUpload.path lastPathComponent];
+            NSOutputStream *outputStream = [NSOutputStream outputStreamToMemory];
+            [outputStream open];
+            BOOL success = [self writeMultipartBodyWithBoundary:boundary sortedPOSTDictionaries:sortedPOSTDictionaries toOutputStream:outputStream];
+            bodyData = [outputStream propertyForKey:NSStreamDataWrittenToMemoryStreamKey];
+            [outputStream close];
+            if(success == NO) return nil;
             
-            NSData *multipartData = [[self class] multipartContentWithBoundary:boundary
-                                                                          data:data
-                                                                      fileName:fileName
-                                                                 parameterName:fileToUpload.parameterName
-                                                                      mimeType:fileToUpload.mimeType];
-            [mutableBodyData appendData:multipartData];
-        }
-        
-        /**/
-        
-        for(STHTTPRequestDataUpload *dataToUpload in self.dataToUpload) {
-            NSData *multipartData = [[self class] multipartContentWithBoundary:boundary
-                                                                          data:dataToUpload.data
-                                                                      fileName:dataToUpload.fileName
-                                                                 parameterName:dataToUpload.parameterName
-                                                                      mimeType:dataToUpload.mimeType];
+            [request setValue:[NSString stringWithFormat:@"%u", (unsigned int)[bodyData length]] forHTTPHeaderField:@"Content-Length"];
             
-            [mutableBodyData appendData:multipartData];
-        }
-        
-        /**/
-        
-        [sortedPOSTDictionaries enumerateObjectsUsingBlock:^(id obj, NSUInteger idx, BOOL *stop) {
-            NSDictionary *d = (NSDictionary *)obj;
-            NSString *key = [[d allKeys] lastObject];
-            NSObject *value = [[d allValues] lastObject];
+        } else {
             
-            [mutableBodyData appendData:[[NSString stringWithFormat:@"\r\n--%@\r\n", boundary] dataUsingEncoding:NSUTF8StringEncoding]];
-            [mutableBodyData appendData:[[NSString stringWithFormat:@"Content-Disposition: form-data; name=\"%@\"\r\n\r\n", key] dataUsingEncoding:NSUTF8StringEncoding]];
-            [mutableBodyData appendData:[[value description] dataUsingEncoding:NSUTF8StringEncoding]];
-        }];
+            unsigned long long length = 0;
+            
+            self.HTTPBodyFileURL = [self writeMultipartBodyFileWithBoundary:boundary sortedPOSTDictionaries:sortedPOSTDictionaries length:&length];
+            if(_HTTPBodyFileURL == nil) return nil;
+            
+            [request setValue:[NSString stringWithFormat:@"%llu", length] forHTTPHeaderField:@"Content-Length"];
+            
+            // upload tasks read the file directly and ignore the stream
+            [request setHTTPBodyStream:[NSInputStream inputStreamWithURL:_HTTPBodyFileURL]];
+        }
         
-        /**/
+    } else if (_rawPOSTData) {
         
-        [mutableBodyData appendData:[[NSString stringWithFormat:@"\r\n--%@--\r\n", boundary] dataUsingEncoding:NSUTF8StringEncoding]];
+        [request setValue:[NSString stringWithFormat:@"%u", (unsigned int)[_rawPOSTData length]] forHTTPHeaderField:@"Content-Length"];
+        bodyData = _rawPOSTData;
         
-        [request setValue:[NSString stringWithFormat:@"%u", (unsigned int)[bodyData length]] forHTTPHeaderField:@"Content-Length"];
+    } else if (_POSTParameters != nil) {
         
-        bodyData = mutableBodyData;
+        [self setHeaderWithName:@"Content-Type" value:@"application/x-www-form-urlencoded; charset=utf-8"];
         
-    } else if (_rawPOSTData) {
+        bodyData = [[_POSTParameters queryString] dataUsingEncoding:NSUTF8StringEncoding]; // ASCII, already encoded
         
-        [request setValue:[NSString stringWithFormat:@"%u", (unsigned int)[_rawPOSTData length]] forHTTPHeaderField:@"Content-Length"];
-        bodyData = _rawPOSTData;
+        [request setValue:[NSString stringWithFormat:@"%u", (unsigned int)[bodyData length]] forHTTPHeaderField:@"Content-Length"];
         
     } else if (_POSTDictionary != nil) { // may be empty (POST request without body)
         
@@ -702,6 +942,8 @@ static STHTTPRequestCookiesStorage globalCookiesStoragePolicy = STHTTPRequestCoo
         }];
         NSString *ss = [postParameters componentsJoinedByString:@"&"];
         [ma addObject:[NSString stringWithFormat:@"-d \"%@\"", ss]];
+    } else if(_POSTParameters) {
+        [ma addObject:[NSString stringWithFormat:@"-d \"%@\"", [_POSTParameters queryString]]];
     }
     
     if(_rawPOSTData) {
@@ -748,7 +990,7 @@ static STHTTPRequestCookiesStorage globalCookiesStoragePolicy = STHTTPRequestCoo
     
     NSMutableString *ms = [NSMutableString string];
     
-    NSString *method = (self.POSTDictionary || [self.filesToUpload count] || [self.dataToUpload count]) ? @"POST" : @"GET";
+    NSString *method = (self.POSTDictionary || self.POSTParameters || [self.filesToUpload count] || [self.dataToUpload count]) ? @"POST" : @"GET";
     
     [ms appendFormat:@"%@ %@\n", method, [_request URL]];
     
@@ -770,6 +1012,12 @@ static STHTTPRequestCookiesStorage globalCookiesStoragePolicy = STHTTPRequestCoo
         [ms appendFormat:@"\t %@ = %@\n", k, v];
     }
     
+    if([_POSTParameters count]) [ms appendString:@"POST DATA\n"];
+    
+    [_POSTParameters enumerateEncodedKeysAndValuesUsingBlock:^(NSString *encodedKey, NSString *encodedValue, BOOL *stop) {
+        [ms appendFormat:@"\t %@ = %@\n", encodedKey, encodedValue];
+    }];
+    
     for(STHTTPRequestFileUpload *f in self.filesToUpload) {
         [ms appendString:@"UPLOAD FILE\n"];
         [ms appendFormat:@"\t %@ = %@\n", f.parameterName, f.path];
@@ -787,43 +1035,133 @@ static STHTTPRequestCookiesStorage globalCookiesStoragePolicy = STHTTPRequestCoo
 
 - (void)startAsynchronous {
     
-    NSAssert((self.completionBlock || self.completionDataBlock), @"a completion block is mandatory");
+    NSAssert((self.completionBlock || self.completionDataBlock || self.completionObjectBlock), @"a completion block is mandatory");
     NSAssert(self.errorBlock, @"the error block is mandatory");
     
     NSURLRequest *request = [self prepareURLRequest];
     
-    BOOL useUploadTaskInBackground = [request.HTTPMethod isEqualToString:@"POST"] && request.HTTPBody != nil;
+    self.metrics = [[STHTTPRequestMetrics alloc] init];
+    _metrics.HTTPMethod = request.HTTPMethod;
+    _metrics.URL = request.URL;
+    self.startTime = CFAbsoluteTimeGetCurrent();
+    self.responseTime = 0;
     
-    NSURLSessionConfiguration *sessionConfiguration = nil;
+    STHTTPRequestResponseCache *responseCache = [self actualResponseCache];
     
-    if(useUploadTaskInBackground) {
-        NSString *backgroundSessionIdentifier = [[NSProcessInfo processInfo] globallyUniqueString];
-        if ([[NSURLSessionConfiguration class] respondsToSelector:@selector(backgroundSessionConfigurationWithIdentifier:)]) {
-            // iOS 8+
-            sessionConfiguration = [NSURLSessionConfiguration backgroundSessionConfigurationWithIdentifier:backgroundSessionIdentifier];
-        } else {
-            // iOS 7
-            sessionConfiguration = [NSURLSessionConfiguration ephemeralSessionConfiguration];
+    if(responseCache && [request.HTTPMethod isEqualToString:@"GET"]) {
+        
+        self.responseCacheKey = [STHTTPRequestResponseCache keyForURL:request.URL variant:_responseCacheVariant];
+        self.cachedEntry = [responseCache entryForKey:_responseCacheKey];
+        
+        if(_cachedEntry && [responseCache isEntryFresh:_cachedEntry]) {
+            [self deliverCachedResponseOrStartTaskWithRequest:request];
+            return;
         }
-    } else {
-        sessionConfiguration = [NSURLSessionConfiguration defaultSessionConfiguration];
+        
+        request = [responseCache request:request byAddingValidatorsOfEntry:_cachedEntry];
+    }
+    
+    [self scheduleOrStartTaskWithRequest:request];
+}
+
+- (void)scheduleOrStartTaskWithRequest:(NSURLRequest *)request {
+    
+    // streams would hold their slot for hours
+    if(_scheduler && _streaming == NO) {
+        self.scheduledURLRequest = request;
+        [_scheduler enqueueRequest:self];
+        return;
+    }
+    
+    [self startTaskWithRequest:request];
+}
+
+// called by the scheduler, which counts the request as running until its task completes
+- (void)startScheduledRequest {
+    NSURLRequest *request = _scheduledURLRequest;
+    self.scheduledURLRequest = nil;
+    
+    self.holdsSchedulerSlot = YES;
+    
+    // cancelled while being enqueued from the processing queue
+    if(self.isCancelled) {
+        [self releaseSchedulerSlot];
+        return;
     }
     
-    sessionConfiguration.allowsCellularAccess = YES;
+    [self startTaskWithRequest:request];
+}
+
+- (void)releaseSchedulerSlot {
+    if(self.holdsSchedulerSlot == NO) return;
+    self.holdsSchedulerSlot = NO;
+    
+    [_scheduler requestDidFinish:self];
+}
+
+- (STHTTPRequestResponseCache *)actualResponseCache {
+    if(globalIgnoreCache || _ignoreCache || _streaming) return nil;
+    return _responseCache ? _responseCache : globalResponseCache;
+}
+
+// a fresh response is read on the processing queue, the request goes through the scheduler to the network if its body is gone
+- (void)deliverCachedResponseOrStartTaskWithRequest:(NSURLRequest *)request {
+    
+    self.request = request;
+    self.requestHeaders = [[request allHTTPHeaderFields] mutableCopy];
+    
+    STHTTPRequestResponseCache *responseCache = [self actualResponseCache];
+    STHTTPRequestCacheEntry *entry = _cachedEntry;
+    
+    dispatch_async([self actualProcessingQueue], ^{
+        
+        if(self.isCancelled) return;
+        
+        NSData *body = [responseCache bodyForEntry:entry]; // drops the entry when its body is gone
+        
+        if(body == nil) {
+            self.cachedEntry = nil;
+            [self scheduleOrStartTaskWithRequest:request];
+            return;
+        }
+        
+        [responseCache recordHitWithBodyLength:[body length]];
+        
+        self.responseHeaders = entry.headers;
+        self.responseStatus = 200;
+        self.responseStringEncodingName = entry.textEncodingName;
+        self.responseData = [body mutableCopy];
+        self.responseIsFromCache = YES;
+        
+        [self deliverResponse];
+    });
+}
+
+- (void)startTaskWithRequest:(NSURLRequest *)request {
+    
+    // small bodies are sent from memory on a foreground session, without touching the disk
+    BOOL hasLargeBody = (_HTTPBodyFileURL != nil) || ([request.HTTPBody length] >= globalBackgroundUploadThreshold);
+    BOOL useUploadTaskInBackground = [request.HTTPMethod isEqualToString:@"POST"] && hasLargeBody;
     
-    NSURLSession *session = [NSURLSession sessionWithConfiguration:sessionConfiguration
-                                                          delegate:self
-                                                     delegateQueue:nil];
+    NSURLSession *session = [[STHTTPRequestSessionPool sharedPool] sessionForURL:request.URL background:useUploadTaskInBackground];
     
     if(useUploadTaskInBackground) {
-        NSString *fileName = [[NSProcessInfo processInfo] globallyUniqueString];
-        self.HTTPBodyFileURL = [NSURL fileURLWithPath:[NSTemporaryDirectory() stringByAppendingPathComponent:fileName]];
-        [request.HTTPBody writeToURL:_HTTPBodyFileURL atomically:YES];
+        if(_HTTPBodyFileURL == nil) { // multipart bodies are already written to a file
+            NSString *fileName = [[NSProcessInfo processInfo] globallyUniqueString];
+            self.HTTPBodyFileURL = [NSURL fileURLWithPath:[NSTemporaryDirectory() stringByAppendingPathComponent:fileName]];
+            [request.HTTPBody writeToURL:_HTTPBodyFileURL atomically:YES];
+        }
         self.task = [session uploadTaskWithRequest:request fromFile:_HTTPBodyFileURL];
     } else {
         self.task = [session dataTaskWithRequest:request];
     }
     
+    self.session = session;
+    
+    if(_task) {
+        [[STHTTPRequestSessionPool sharedPool] setRequest:self forTask:_task];
+    }
+    
     [_task resume];
     
     self.request = [_task currentRequest];
@@ -862,6 +1200,8 @@ static STHTTPRequestCookiesStorage globalCookiesStoragePolicy = STHTTPRequestCoo
     /**/
     
     if(_task == nil) {
+        [self releaseSchedulerSlot];
+        
         NSString *s = @"can't create task";
         self.error = [NSError errorWithDomain:NSStringFromClass([self class])
                                          code:0
@@ -907,16 +1247,31 @@ static STHTTPRequestCookiesStorage globalCookiesStoragePolicy = STHTTPRequestCoo
 }
 
 - (void)cancel {
+    self.isCancelled = YES;
+    
+    [_scheduler removePendingRequest:self]; // not started yet
+    
     [_task cancel];
     
-    NSString *s = @"Connection was cancelled.";
-    self.error = [NSError errorWithDomain:NSStringFromClass([self class])
-                                     code:kSTHTTPRequestCancellationError
-                                 userInfo:@{NSLocalizedDescriptionKey: s}];
+    self.error = [NSError st_cancellationError];
     
     self.errorBlock(self.error);
 }
 
+- (void)failWithError:(NSError *)error {
+    
+    NSAssert(self.errorBlock, @"the error block is mandatory");
+    
+    self.metrics = [[STHTTPRequestMetrics alloc] init];
+    _metrics.HTTPMethod = _HTTPMethod;
+    _metrics.URL = _url;
+    self.startTime = CFAbsoluteTimeGetCurrent();
+    
+    self.error = error;
+    
+    [self deliverError:error];
+}
+
 + (void)setBackgroundCompletionHandler:(void(^)())completionHandler forSessionIdentifier:(NSString *)sessionIdentifier {
     if(sessionCompletionHandlersForIdentifier == nil) {
         sessionCompletionHandlersForIdentifier = [NSMutableDictionary dictionary];
@@ -929,25 +1284,161 @@ static STHTTPRequestCookiesStorage globalCookiesStoragePolicy = STHTTPRequestCoo
 //    return sessionCompletionHandlersForIdentifier[sessionIdentifier];
 //}
 
-#pragma mark NSURLSessionDelegate
+#pragma mark Delivery
 
-- (void)URLSession:(NSURLSession *)session didBecomeInvalidWithError:(NSError *)error {
+// delegate callbacks arrive on the session's serial delegate queue, where the response is
+// accumulated; transforming the response happens on processingQueue, and only the final
+// result is dispatched to callbackQueue
+
+- (dispatch_queue_t)actualCallbackQueue {
+    if(_callbackQueue) return _callbackQueue;
+    if(globalCallbackQueue) return globalCallbackQueue;
+    return dispatch_get_main_queue();
+}
+
+- (dispatch_queue_t)actualProcessingQueue {
+    if(_processingQueue) return _processingQueue;
+    if(globalProcessingQueue) return globalProcessingQueue;
+    return dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+}
 
-    __weak typeof(self) weakSelf = self;
+- (void)deliverError:(NSError *)error {
     
-    dispatch_async(dispatch_get_main_queue(), ^{
+    dispatch_async([self actualProcessingQueue], ^{
+        
+        CFAbsoluteTime processingTime = CFAbsoluteTimeGetCurrent();
         
-        __strong typeof(weakSelf) strongSelf = weakSelf;
-        if(strongSelf == nil) return;
+        NSError *processedError = self.errorProcessingBlock ? self.errorProcessingBlock(error, self.responseHeaders, self.responseData) : error;
         
-        if(error == nil) return; // normal session invalidation, no error
+        CFAbsoluteTime dispatchTime = CFAbsoluteTimeGetCurrent();
+        self.metrics.decode = dispatchTime - processingTime;
+        
+        dispatch_async([self actualCallbackQueue], ^{
+            
+            if(self.isCancelled) return; // cancelled while being processed
+            
+            CFAbsoluteTime callbackTime = CFAbsoluteTimeGetCurrent();
+            
+            self.errorBlock(processedError);
+            
+            [self finishMetricsWithCallbackDispatch:(callbackTime - dispatchTime) failed:YES];
+        });
+    });
+}
 
-        if(strongSelf.errorBlock) {
-            strongSelf.errorBlock(error);
+- (void)deliverResponse {
+    
+    dispatch_async([self actualProcessingQueue], ^{
+        
+        CFAbsoluteTime processingTime = CFAbsoluteTimeGetCurrent();
+        
+        id responseObject = nil;
+        if(self.completionObjectBlock) {
+            responseObject = self.responseProcessingBlock ? self.responseProcessingBlock(self.responseHeaders, self.responseData) : self.responseData;
         }
+        
+        NSString *responseString = nil;
+        if(self.completionBlock) {
+            responseString = [self stringWithData:self.responseData encodingName:self.responseStringEncodingName];
+        }
+        
+        CFAbsoluteTime dispatchTime = CFAbsoluteTimeGetCurrent();
+        self.metrics.decode = dispatchTime - processingTime;
+        
+        dispatch_async([self actualCallbackQueue], ^{
+            
+            if(self.isCancelled) return; // cancelled while being processed
+            
+            CFAbsoluteTime callbackTime = CFAbsoluteTimeGetCurrent();
+            
+            if(self.completionDataBlock) {
+                self.completionDataBlock(self.responseHeaders, self.responseData);
+            }
+            
+            if(self.completionBlock) {
+                self.completionBlock(self.responseHeaders, responseString);
+            }
+            
+            if(self.completionObjectBlock) {
+                self.completionObjectBlock(self.responseHeaders, responseObject);
+            }
+            
+            // the typed result is delivered, don't keep the raw response alive as long as the request
+            self.responseData = nil;
+            self.responseString = nil;
+            
+            [self finishMetricsWithCallbackDispatch:(callbackTime - dispatchTime) failed:NO];
+        });
+    });
+}
+
+// called on the callback queue, once the callbacks have returned
+- (void)finishMetricsWithCallbackDispatch:(NSTimeInterval)callbackDispatch failed:(BOOL)failed {
+    
+    STHTTPRequestMetrics *metrics = _metrics;
+    if(metrics == nil) return; // not started asynchronously
+    
+    metrics.callbackDispatch = callbackDispatch;
+    metrics.total = CFAbsoluteTimeGetCurrent() - _startTime;
+    metrics.statusCode = _responseStatus;
+    metrics.responseBytesCount = _totalBytesReceived;
+    metrics.failed = failed;
+    
+    void (^metricsBlock)(STHTTPRequestMetrics *metrics) = self.metricsBlock;
+    if(metricsBlock == nil || _streaming) return;
+    
+    dispatch_async([self actualProcessingQueue], ^{
+        metricsBlock(metrics);
     });
 }
 
+static NSTimeInterval STHTTPRequestInterval(NSDate *startDate, NSDate *endDate) {
+    if(startDate == nil || endDate == nil) return -1;
+    return [endDate timeIntervalSinceDate:startDate];
+}
+
+- (void)readTaskMetrics:(NSURLSessionTaskMetrics *)taskMetrics NS_AVAILABLE(10_12, 10_0) {
+    
+    // the last transaction is the one which produced the response, after redirections
+    NSURLSessionTaskTransactionMetrics *t = [taskMetrics.transactionMetrics lastObject];
+    if(t == nil || _metrics == nil) return;
+    
+    NSDate *startDate = [NSDate dateWithTimeIntervalSinceReferenceDate:_startTime];
+    
+    _metrics.queueing = STHTTPRequestInterval(startDate, t.fetchStartDate);
+    _metrics.domainLookup = STHTTPRequestInterval(t.domainLookupStartDate, t.domainLookupEndDate);
+    _metrics.connect = STHTTPRequestInterval(t.connectStartDate, t.connectEndDate);
+    _metrics.secureConnection = STHTTPRequestInterval(t.secureConnectionStartDate, t.secureConnectionEndDate);
+    _metrics.timeToFirstByte = STHTTPRequestInterval(t.requestStartDate, t.responseStartDate);
+    _metrics.transfer = STHTTPRequestInterval(t.responseStartDate, t.responseEndDate);
+    _metrics.reusedConnection = t.reusedConnection;
+}
+
+- (void)readResponse:(NSURLResponse *)response forTask:(NSURLSessionTask *)task {
+    
+    NSHTTPURLResponse *r = (NSHTTPURLResponse *)response;
+    
+    self.responseHeaders = [r allHeaderFields];
+    self.responseStatus = [r statusCode];
+    self.responseStringEncodingName = [r textEncodingName];
+    self.responseExpectedContentLength = [r expectedContentLength];
+    
+    // size the buffer once when the length is known, rather than growing it chunk after chunk
+    BOOL accumulatesData = (_streaming == NO || _responseStatus >= 400);
+    if(accumulatesData && _responseExpectedContentLength > 0 && [_responseData length] == 0) {
+        NSUInteger capacity = (NSUInteger)MIN(_responseExpectedContentLength, kSTHTTPRequestMaxPreallocatedResponseLength);
+        self.responseData = [NSMutableData dataWithCapacity:capacity];
+    }
+    
+    NSArray *responseCookies = [NSHTTPCookie cookiesWithResponseHeaderFields:_responseHeaders forURL:task.currentRequest.URL];
+    for(NSHTTPCookie *cookie in responseCookies) {
+        //NSLog(@"-- %@", cookie);
+        [self addCookie:cookie]; // won't store anything when STHTTPRequestCookiesStorageNoStorage
+    }
+}
+
+#pragma mark NSURLSessionTaskDelegate
+
 #if DEBUG
 - (void)URLSession:(NSURLSession *)session task:(NSURLSessionTask *)task didReceiveChallenge:(NSURLAuthenticationChallenge *)challenge completionHandler:(void (^)(NSURLSessionAuthChallengeDisposition disposition, NSURLCredential *credential))completionHandler
 {
@@ -962,37 +1453,15 @@ static STHTTPRequestCookiesStorage globalCookiesStoragePolicy = STHTTPRequestCoo
 }
 #endif
 
-- (void)URLSessionDidFinishEventsForBackgroundURLSession:(NSURLSession *)session NS_AVAILABLE_IOS(7_0) {
-    
-    dispatch_async(dispatch_get_main_queue(), ^{
-        
-        void (^completionHandler)() = sessionCompletionHandlersForIdentifier[session.configuration.identifier];
-        
-        if(completionHandler) {
-            completionHandler();
-            [sessionCompletionHandlersForIdentifier removeObjectForKey:session.configuration.identifier];
-        }
-        
-    });
-}
-
-#pragma mark NSURLSessionTaskDelegate
-
 - (void)URLSession:(NSURLSession *)session
               task:(NSURLSessionTask *)task
 willPerformHTTPRedirection:(NSHTTPURLResponse *)response
         newRequest:(NSURLRequest *)request
  completionHandler:(void (^)(NSURLRequest *))completionHandler {
     
-    __weak typeof(self) weakSelf = self;
+    NSURLRequest *actualRequest = _preventRedirections ? nil : request;
     
-    dispatch_async(dispatch_get_main_queue(), ^{
-        
-        NSURLRequest *actualRequest = weakSelf.preventRedirections ? nil : request;
-        
-        completionHandler(actualRequest);
-        
-    });
+    completionHandler(actualRequest);
 }
 
 - (void)URLSession:(NSURLSession *)session task:(NSURLSessionTask *)task
@@ -1000,17 +1469,10 @@ willPerformHTTPRedirection:(NSHTTPURLResponse *)response
     totalBytesSent:(int64_t)totalBytesSent
 totalBytesExpectedToSend:(int64_t)totalBytesExpectedToSend {
     
-    __weak typeof(self) weakSelf = self;
+    if(_uploadProgressBlock == nil) return;
     
-    dispatch_async(dispatch_get_main_queue(), ^{
-        
-        __strong typeof(weakSelf) strongSelf = weakSelf;
-        if(strongSelf == nil) return;
-        
-        if(strongSelf.uploadProgressBlock) {
-            strongSelf.uploadProgressBlock(bytesSent, totalBytesSent, totalBytesExpectedToSend);
-        }
-        
+    dispatch_async([self actualCallbackQueue], ^{
+        self.uploadProgressBlock(bytesSent, totalBytesSent, totalBytesExpectedToSend);
     });
 }
 
@@ -1018,66 +1480,68 @@ totalBytesExpectedToSend:(int64_t)totalBytesExpectedToSend {
               task:(NSURLSessionTask *)task
 didCompleteWithError:(NSError *)error {
     
-    __weak typeof(self) weakSelf = self;
+    // the blocks dispatched from here retain self, the session pool releases us once this returns
     
-    dispatch_async(dispatch_get_main_queue(), ^{
-        
-        __strong typeof(weakSelf) strongSelf = weakSelf;
-        if(strongSelf == nil) return;
-        
-        if (error) {
-            strongSelf.errorBlock(error);
-            [session finishTasksAndInvalidate];
-            return;
-        }
-        
-        if([task.response isKindOfClass:[NSHTTPURLResponse class]]) {
-            NSHTTPURLResponse *r = (NSHTTPURLResponse *)[task response];
-            strongSelf.responseHeaders = [r allHeaderFields];
-            strongSelf.responseStatus = [r statusCode];
-            strongSelf.responseStringEncodingName = [r textEncodingName];
-            strongSelf.responseExpectedContentLength = [r expectedContentLength];
-            
-            NSArray *responseCookies = [NSHTTPCookie cookiesWithResponseHeaderFields:strongSelf.responseHeaders forURL:task.currentRequest.URL];
-            for(NSHTTPCookie *cookie in responseCookies) {
-                //NSLog(@"-- %@", cookie);
-                [strongSelf addCookie:cookie]; // won't store anything when STHTTPRequestCookiesStorageNoStorage
-            }
-        } else {
-            NSDictionary *userInfo = @{NSLocalizedDescriptionKey: [NSString stringWithFormat:@"bad response class: %@", [task.response class]]};
-            NSError *e = [NSError errorWithDomain:NSStringFromClass([strongSelf class]) code:0 userInfo:userInfo];
-            strongSelf.errorBlock(e);
-            [session finishTasksAndInvalidate];
-            return;
-        }
-        
-        if(strongSelf.HTTPBodyFileURL) {
-            NSError *error = nil;
-            BOOL status = [[NSFileManager defaultManager] removeItemAtURL:strongSelf.HTTPBodyFileURL error:&error];
-            if(status == NO) {
-                NSLog(@"-- can't remove %@, %@", strongSelf.HTTPBodyFileURL, [error localizedDescription]);
-            }
-        }
+    [self removeHTTPBodyFile];
+    
+    [self releaseSchedulerSlot];
+    
+    // without task metrics, time to first byte and transfer include the connection setup
+    if(_metrics && _metrics.timeToFirstByte < 0 && _responseTime > 0) {
+        _metrics.timeToFirstByte = _responseTime - _startTime;
+        _metrics.transfer = CFAbsoluteTimeGetCurrent() - _responseTime;
+    }
+    
+    if(self.isCancelled) return; // cancel called the error block already, the task then completes with NSURLErrorCancelled
+    
+    if (error) {
+        [self deliverError:error];
+        return;
+    }
+    
+    if([task.response isKindOfClass:[NSHTTPURLResponse class]]) {
+        [self readResponse:task.response forTask:task];
+    } else {
+        NSDictionary *userInfo = @{NSLocalizedDescriptionKey: [NSString stringWithFormat:@"bad response class: %@", [task.response class]]};
+        NSError *e = [NSError errorWithDomain:NSStringFromClass([self class]) code:0 userInfo:userInfo];
+        [self deliverError:e];
+        return;
+    }
+    
+    if(_responseCacheKey) {
+        [self updateResponseCacheWithURL:task.currentRequest.URL];
+    }
+    
+    if(_responseStatus >= 400) {
+        NSDictionary *userInfo = [[self class] userInfoWithErrorDescriptionForHTTPStatus:_responseStatus];
+        self.error = [NSError errorWithDomain:NSStringFromClass([self class]) code:_responseStatus userInfo:userInfo];
+        [self deliverError:_error];
+        return;
+    }
+    
+    [self deliverResponse];
+}
+
+// a 304 is delivered as the stored 200, with the updated headers, a new 200 is stored
+- (void)updateResponseCacheWithURL:(NSURL *)url {
+    
+    STHTTPRequestResponseCache *responseCache = [self actualResponseCache];
+    
+    if(_responseStatus == 304 && _cachedEntry) {
         
-        if(strongSelf.responseStatus >= 400) {
-            NSDictionary *userInfo = [[strongSelf class] userInfoWithErrorDescriptionForHTTPStatus:strongSelf.responseStatus];
-            strongSelf.error = [NSError errorWithDomain:NSStringFromClass([strongSelf class]) code:strongSelf.responseStatus userInfo:userInfo];
-            strongSelf.errorBlock(strongSelf.error);
-            [session finishTasksAndInvalidate];
-            return;
-        }
+        NSData *body = [responseCache bodyForEntry:_cachedEntry];
+        if(body == nil) return; // evicted meanwhile, the 304 is delivered as is
         
-        if(strongSelf.completionDataBlock) {
-            strongSelf.completionDataBlock(strongSelf.responseHeaders,strongSelf.responseData);
-        }
+        self.responseHeaders = [responseCache headersByRevalidatingEntry:_cachedEntry withNotModifiedHeaders:_responseHeaders URL:url];
+        self.responseStatus = 200;
+        if(_responseStringEncodingName == nil) self.responseStringEncodingName = _cachedEntry.textEncodingName;
+        self.responseData = [body mutableCopy];
+        self.responseIsFromCache = YES;
         
-        if(strongSelf.completionBlock) {
-            NSString *responseString = [strongSelf stringWithData:strongSelf.responseData encodingName:strongSelf.responseStringEncodingName];
-            strongSelf.completionBlock(strongSelf.responseHeaders, responseString);
-        }
+    } else if(_responseStatus == 200) {
         
-        [session finishTasksAndInvalidate];
-    });
+        [responseCache storeBody:_responseData headers:_responseHeaders textEncodingName:_responseStringEncodingName forKey:_responseCacheKey URL:url];
+    }
 }
 
 #pragma mark NSURLSessionDataDelegate
@@ -1087,49 +1551,35 @@ didCompleteWithError:(NSError *)error {
 didReceiveResponse:(NSURLResponse *)response
  completionHandler:(void (^)(NSURLSessionResponseDisposition disposition))completionHandler {
     
-    __weak typeof(self) weakSelf = self;
+    if(_responseTime == 0) self.responseTime = CFAbsoluteTimeGetCurrent();
     
-    dispatch_async(dispatch_get_main_queue(), ^{
-        
-        __strong typeof(weakSelf) strongSelf = weakSelf;
-        if(strongSelf == nil) return;
-        
-        if([dataTask.response isKindOfClass:[NSHTTPURLResponse class]]) {
-            NSHTTPURLResponse *r = (NSHTTPURLResponse *)[dataTask response];
-            
-            strongSelf.responseHeaders = [r allHeaderFields];
-            strongSelf.responseStatus = [r statusCode];
-            strongSelf.responseStringEncodingName = [r textEncodingName];
-            strongSelf.responseExpectedContentLength = [r expectedContentLength];
-            
-            NSArray *responseCookies = [NSHTTPCookie cookiesWithResponseHeaderFields:strongSelf.responseHeaders forURL:dataTask.currentRequest.URL];
-            for(NSHTTPCookie *cookie in responseCookies) {
-                //NSLog(@"-- %@", cookie);
-                [strongSelf addCookie:cookie]; // won't store anything when STHTTPRequestCookiesStorageNoStorage
-            }
-        }
-        
-        completionHandler(NSURLSessionResponseAllow);
-    });
+    if([response isKindOfClass:[NSHTTPURLResponse class]]) {
+        [self readResponse:response forTask:dataTask];
+    }
+    
+    completionHandler(NSURLSessionResponseAllow);
 }
 
 - (void)URLSession:(NSURLSession *)session
           dataTask:(NSURLSessionDataTask *)dataTask
     didReceiveData:(NSData *)data {
     
-    __weak typeof(self) weakSelf = self;
+    _totalBytesReceived += [data length];
     
-    dispatch_async(dispatch_get_main_queue(), ^{
-        
-        __strong typeof(weakSelf) strongSelf = weakSelf;
-        if(strongSelf == nil) return;
-        
-        [strongSelf.responseData appendData:data];
-        
-        if (strongSelf.downloadProgressBlock) {
-            strongSelf.downloadProgressBlock(data, [strongSelf.responseData length], strongSelf.responseExpectedContentLength);
-        }
-        
+    // error bodies of streams are kept for the error block, not streamed
+    BOOL isErrorBody = _streaming && _responseStatus >= 400;
+    
+    if(_streaming == NO || isErrorBody) {
+        [_responseData appendData:data];
+    }
+    
+    if(_downloadProgressBlock == nil || isErrorBody) return;
+    
+    int64_t totalBytesReceived = _totalBytesReceived;
+    int64_t totalBytesExpectedToReceive = _responseExpectedContentLength;
+    
+    dispatch_async([self actualCallbackQueue], ^{
+        self.downloadProgressBlock(data, totalBytesReceived, totalBytesExpectedToReceive);
     });
 }
 
@@ -1138,18 +1588,10 @@ didReceiveResponse:(NSURLResponse *)response
  willCacheResponse:(NSCachedURLResponse *)proposedResponse
  completionHandler:(void (^)(NSCachedURLResponse *cachedResponse))completionHandler {
     
-    __weak typeof(self) weakSelf = self;
+    // responses going through our response cache are not stored twice
+    NSCachedURLResponse *actualResponse = (globalIgnoreCache || _ignoreCache || _responseCacheKey) ? nil : proposedResponse;
     
-    dispatch_async(dispatch_get_main_queue(), ^{
-        
-        __strong typeof(weakSelf) strongSelf = weakSelf;
-        if(strongSelf == nil) return;
-        
-        NSCachedURLResponse *actualResponse = (globalIgnoreCache || strongSelf.ignoreCache) ? nil : proposedResponse;
-        
-        completionHandler(actualResponse);
-        
-    });
+    completionHandler(actualResponse);
 }
 
 @end
@@ -1171,18 +1613,95 @@ didReceiveResponse:(NSURLResponse *)response
     return ([[self domain] isEqualToString:@"STHTTPRequest"] && [self code] == kSTHTTPRequestCancellationError);
 }
 
++ (NSError *)st_cancellationError {
+    NSString *s = @"Connection was cancelled.";
+    return [NSError errorWithDomain:@"STHTTPRequest"
+                               code:kSTHTTPRequestCancellationError
+                           userInfo:@{NSLocalizedDescriptionKey: s}];
+}
+
 @end
 
+// RFC 3986 unreserved characters, ALPHA / DIGIT / "-" / "." / "_" / "~", are the only ones left unescaped
+static const BOOL STRFC3986Unreserved[256] = {
+    ['A' ... 'Z'] = YES,
+    ['a' ... 'z'] = YES,
+    ['0' ... '9'] = YES,
+    ['-'] = YES, ['.'] = YES, ['_'] = YES, ['~'] = YES
+};
+
+static const char STRFC3986HexDigits[] = "0123456789ABCDEF";
+
+// dst must hold 3 * length bytes, returns the number of bytes written
+static NSUInteger STRFC3986PercentEscapeBytes(const uint8_t *src, NSUInteger length, char *dst) {
+    char *p = dst;
+    for(NSUInteger i = 0; i < length; i++) {
+        uint8_t c = src[i];
+        if(STRFC3986Unreserved[c]) {
+            *p++ = (char)c;
+        } else {
+            *p++ = '%';
+            *p++ = STRFC3986HexDigits[c >> 4];
+            *p++ = STRFC3986HexDigits[c & 0x0F];
+        }
+    }
+    return p - dst;
+}
+
 @implementation NSString (RFC3986)
+
+// UTF-8 bytes of the string, without copying when CoreFoundation stores them as such
+- (const uint8_t *)st_UTF8Bytes:(NSUInteger *)length {
+    const char *bytes = CFStringGetCStringPtr((__bridge CFStringRef)self, kCFStringEncodingUTF8);
+    if(bytes == NULL) bytes = [self UTF8String];
+    *length = bytes ? strlen(bytes) : 0;
+    return (const uint8_t *)bytes;
+}
+
 - (NSString *)st_stringByAddingRFC3986PercentEscapesUsingEncoding:(NSStringEncoding)encoding {
     
-    NSString *s = (__bridge_transfer NSString *)(CFURLCreateStringByAddingPercentEscapes(kCFAllocatorDefault,
-                                                                                         (CFStringRef)self,
-                                                                                         NULL,
-                                                                                         CFSTR("!*'();:@&=+$,/?%#[]"),
-                                                                                         kCFStringEncodingUTF8));
-    return s;
+    NSUInteger length = 0;
+    const uint8_t *bytes = NULL;
+    NSData *encodedData = nil; // keeps the bytes alive for other encodings, eg. a non UTF-8 POSTDataEncoding
+    
+    if(encoding == NSUTF8StringEncoding) {
+        bytes = [self st_UTF8Bytes:&length];
+    } else {
+        encodedData = [self dataUsingEncoding:encoding allowLossyConversion:NO];
+        bytes = [encodedData bytes];
+        length = [encodedData length];
+    }
+    
+    if(bytes == NULL && [self length] > 0) return nil; // not representable in the encoding
+    
+    // fast path, most keys and values need no escaping
+    NSUInteger i = 0;
+    while(i < length && STRFC3986Unreserved[bytes[i]]) i++;
+    if(i == length) return [self copy];
+    
+    char *escaped = malloc(i + 3 * (length - i));
+    if(escaped == NULL) return nil;
+    
+    memcpy(escaped, bytes, i);
+    NSUInteger escapedLength = i + STRFC3986PercentEscapeBytes(bytes + i, length - i, escaped + i);
+    
+    return [[NSString alloc] initWithBytesNoCopy:escaped length:escapedLength encoding:NSASCIIStringEncoding freeWhenDone:YES];
+}
+
+- (void)st_appendRFC3986PercentEscapedUTF8BytesToData:(NSMutableData *)data {
+    
+    NSUInteger length = 0;
+    const uint8_t *bytes = [self st_UTF8Bytes:&length];
+    if(length == 0) return;
+    
+    NSUInteger offset = [data length];
+    [data setLength:offset + 3 * length];
+    
+    NSUInteger escapedLength = STRFC3986PercentEscapeBytes(bytes, length, (char *)[data mutableBytes] + offset);
+    
+    [data setLength:offset + escapedLength];
 }
+
 @end
 
 /**/
@@ -1221,6 +1740,114 @@ didReceiveResponse:(NSURLResponse *)response
 
 @end
 
+/**/
+
+@interface STHTTPRequestParameters ()
+@property (nonatomic, strong) NSArray *pairs; // @[encodedKey, encodedValue], sorted
+@property (nonatomic, strong) NSString *queryString;
+@end
+
+@implementation STHTTPRequestParameters
+
+static NSComparisonResult STHTTPRequestComparePairs(NSArray *pair1, NSArray *pair2) {
+    NSComparisonResult result = [pair1[0] compare:pair2[0] options:NSLiteralSearch];
+    if(result != NSOrderedSame) return result;
+    return [pair1[1] compare:pair2[1] options:NSLiteralSearch];
+}
+
++ (instancetype)parametersWithDictionary:(NSDictionary *)dictionary {
+    
+    NSMutableArray *pairs = [NSMutableArray arrayWithCapacity:[dictionary count]];
+    
+    [dictionary enumerateKeysAndObjectsUsingBlock:^(id key, id obj, BOOL *stop) {
+        NSString *value = [obj isKindOfClass:[NSString class]] ? obj : [obj description];
+        NSString *encodedKey = [[key description] st_stringByAddingRFC3986PercentEscapesUsingEncoding:NSUTF8StringEncoding];
+        NSString *encodedValue = [value st_stringByAddingRFC3986PercentEscapesUsingEncoding:NSUTF8StringEncoding];
+        if(encodedKey == nil || encodedValue == nil) return;
+        [pairs addObject:@[encodedKey, encodedValue]];
+    }];
+    
+    [pairs sortUsingComparator:^NSComparisonResult(id obj1, id obj2) {
+        return STHTTPRequestComparePairs(obj1, obj2);
+    }];
+    
+    STHTTPRequestParameters *parameters = [[self alloc] init];
+    parameters.pairs = pairs;
+    return parameters;
+}
+
+- (STHTTPRequestParameters *)parametersByAddingParameters:(STHTTPRequestParameters *)parameters {
+    
+    if([parameters count] == 0) return self;
+    if([self count] == 0) return parameters;
+    
+    NSArray *pairs1 = _pairs;
+    NSArray *pairs2 = parameters.pairs;
+    NSUInteger count1 = [pairs1 count];
+    NSUInteger count2 = [pairs2 count];
+    
+    NSMutableArray *merged = [NSMutableArray arrayWithCapacity:count1 + count2];
+    
+    NSUInteger i = 0, j = 0;
+    while(i < count1 && j < count2) {
+        if(STHTTPRequestComparePairs(pairs1[i], pairs2[j]) != NSOrderedDescending) {
+            [merged addObject:pairs1[i++]];
+        } else {
+            [merged addObject:pairs2[j++]];
+        }
+    }
+    while(i < count1) [merged addObject:pairs1[i++]];
+    while(j < count2) [merged addObject:pairs2[j++]];
+    
+    STHTTPRequestParameters *mergedParameters = [[[self class] alloc] init];
+    mergedParameters.pairs = merged;
+    return mergedParameters;
+}
+
+- (NSUInteger)count {
+    return [_pairs count];
+}
+
+- (NSString *)queryString {
+    
+    @synchronized(self) {
+        
+        if(_queryString) return _queryString;
+        
+        NSUInteger length = 0;
+        for(NSArray *pair in _pairs) {
+            length += [pair[0] length] + [pair[1] length] + 2;
+        }
+        
+        NSMutableString *ms = [NSMutableString stringWithCapacity:length];
+        
+        for(NSArray *pair in _pairs) {
+            if([ms length]) [ms appendString:@"&"];
+            [ms appendString:pair[0]];
+            [ms appendString:@"="];
+            [ms appendString:pair[1]];
+        }
+        
+        _queryString = ms;
+        
+        return _queryString;
+    }
+}
+
+- (void)enumerateEncodedKeysAndValuesUsingBlock:(void(^)(NSString *encodedKey, NSString *encodedValue, BOOL *stop))block {
+    
+    BOOL stop = NO;
+    
+    for(NSArray *pair in _pairs) {
+        block(pair[0], pair[1], &stop);
+        if(stop) break;
+    }
+}
+
+@end
+
+/**/
+
 @implementation STHTTPRequestFileUpload
 
 + (instancetype)fileUploadWithPath:(NSString *)path parameterName:(NSString *)parameterName mimeType:(NSString *)mimeType {
@@ -1249,3 +1876,864 @@ didReceiveResponse:(NSURLResponse *)response
 }
 
 @end
+
+/**/
+
+@implementation STHTTPRequestMetrics
+
+- (instancetype)init {
+    self = [super init];
+    
+    _queueing = -1;
+    _domainLookup = -1;
+    _connect = -1;
+    _secureConnection = -1;
+    _timeToFirstByte = -1;
+    _transfer = -1;
+    _decode = -1;
+    _callbackDispatch = -1;
+    _total = -1;
+    
+    return self;
+}
+
+- (NSDictionary *)dictionaryRepresentation {
+    return @{@"method"            : _HTTPMethod ? _HTTPMethod : @"",
+             @"url"               : _URL ? [_URL absoluteString] : @"",
+             @"status"            : @(_statusCode),
+             @"failed"            : @(_failed),
+             @"reused_connection" : @(_reusedConnection),
+             @"response_bytes"    : @(_responseBytesCount),
+             @"queueing"          : @(_queueing),
+             @"dns"               : @(_domainLookup),
+             @"connect"           : @(_connect),
+             @"tls"               : @(_secureConnection),
+             @"ttfb"              : @(_timeToFirstByte),
+             @"transfer"          : @(_transfer),
+             @"decode"            : @(_decode),
+             @"callback_dispatch" : @(_callbackDispatch),
+             @"total"             : @(_total)};
+}
+
+- (NSString *)description {
+    return [NSString stringWithFormat:@"<%@ %p %@ %@ %ld total:%.3fs ttfb:%.3fs transfer:%.3fs decode:%.3fs>",
+            NSStringFromClass([self class]), self, _HTTPMethod, _URL, (long)_statusCode, _total, _timeToFirstByte, _transfer, _decode];
+}
+
+@end
+
+/**/
+
+@implementation STHTTPRequestCacheEntry
+
++ (instancetype)entryWithPropertyList:(NSDictionary *)d {
+    if([d isKindOfClass:[NSDictionary class]] == NO || d[@"key"] == nil || d[@"fileName"] == nil) return nil;
+    
+    STHTTPRequestCacheEntry *entry = [[self alloc] init];
+    entry.key = d[@"key"];
+    entry.fileName = d[@"fileName"];
+    entry.headers = d[@"headers"];
+    entry.textEncodingName = d[@"textEncodingName"];
+    entry.ETag = d[@"ETag"];
+    entry.lastModified = d[@"lastModified"];
+    entry.expirationTime = [d[@"expirationTime"] doubleValue];
+    entry.lastAccessTime = [d[@"lastAccessTime"] doubleValue];
+    entry.size = [d[@"size"] unsignedLongLongValue];
+    return entry;
+}
+
+- (NSDictionary *)propertyList {
+    NSMutableDictionary *md = [NSMutableDictionary dictionary];
+    md[@"key"] = _key;
+    md[@"fileName"] = _fileName;
+    if(_headers) md[@"headers"] = _headers;
+    if(_textEncodingName) md[@"textEncodingName"] = _textEncodingName;
+    if(_ETag) md[@"ETag"] = _ETag;
+    if(_lastModified) md[@"lastModified"] = _lastModified;
+    md[@"expirationTime"] = @(_expirationTime);
+    md[@"lastAccessTime"] = @(_lastAccessTime);
+    md[@"size"] = @(_size);
+    return md;
+}
+
+- (instancetype)copyOfEntry {
+    return [[self class] entryWithPropertyList:[self propertyList]];
+}
+
+@end
+
+/**/
+
+static NSString *STHTTPHeaderValue(NSDictionary *headers, NSString *name) {
+    for(NSString *key in headers) {
+        if([key caseInsensitiveCompare:name] == NSOrderedSame) return headers[key];
+    }
+    return nil;
+}
+
+@interface STHTTPRequestResponseCache ()
+@property (nonatomic, strong) NSURL *directoryURL;
+@property (nonatomic, strong) dispatch_queue_t queue; // protects everything below
+@property (nonatomic, strong) NSMutableDictionary *entries; // STHTTPRequestCacheEntry instances by key, loaded lazily
+@property (nonatomic, strong) NSMutableDictionary *timeToLiveByPathSuffix;
+@property (nonatomic) BOOL isSaveScheduled;
+
+@property NSUInteger hitsCount;
+@property NSUInteger revalidationsCount;
+@property NSUInteger missesCount;
+@property NSUInteger storesCount;
+@property NSUInteger evictionsCount;
+@property unsigned long long savedBytesCount;
+@property unsigned long long currentSize;
+@end
+
+@implementation STHTTPRequestResponseCache
+
++ (instancetype)sharedCache {
+    static STHTTPRequestResponseCache *sharedCache = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        NSURL *cachesURL = [[[NSFileManager defaultManager] URLsForDirectory:NSCachesDirectory inDomains:NSUserDomainMask] firstObject];
+        NSURL *directoryURL = [cachesURL URLByAppendingPathComponent:@"STHTTPRequestResponseCache" isDirectory:YES];
+        sharedCache = [[self alloc] initWithDirectoryURL:directoryURL maxSize:20 * 1024 * 1024];
+    });
+    return sharedCache;
+}
+
+- (instancetype)initWithDirectoryURL:(NSURL *)directoryURL maxSize:(unsigned long long)maxSize {
+    self = [super init];
+    
+    _directoryURL = directoryURL;
+    _maxSize = maxSize;
+    _queue = dispatch_queue_create("STHTTPRequestResponseCache", DISPATCH_QUEUE_SERIAL);
+    _timeToLiveByPathSuffix = [NSMutableDictionary dictionary];
+    
+    return self;
+}
+
+- (void)setTimeToLive:(NSTimeInterval)timeToLive forURLPathSuffix:(NSString *)pathSuffix {
+    dispatch_sync(_queue, ^{
+        _timeToLiveByPathSuffix[pathSuffix] = @(timeToLive);
+    });
+}
+
+#pragma mark Index
+
+- (NSURL *)indexURL {
+    return [_directoryURL URLByAppendingPathComponent:@"index.plist"];
+}
+
+- (NSURL *)fileURLForEntry:(STHTTPRequestCacheEntry *)entry {
+    return [_directoryURL URLByAppendingPathComponent:entry.fileName];
+}
+
++ (NSString *)fileNameForKey:(NSString *)key {
+    NSData *data = [key dataUsingEncoding:NSUTF8StringEncoding];
+    
+    unsigned char digest[CC_SHA1_DIGEST_LENGTH];
+    CC_SHA1([data bytes], (CC_LONG)[data length], digest);
+    
+    NSMutableString *ms = [NSMutableString stringWithCapacity:CC_SHA1_DIGEST_LENGTH * 2];
+    for(NSUInteger i = 0; i < CC_SHA1_DIGEST_LENGTH; i++) {
+        [ms appendFormat:@"%02x", digest[i]];
+    }
+    return ms;
+}
+
+// the keys are written to the index, the variant is usually a credential and only its digest is kept
++ (NSString *)keyForURL:(NSURL *)url variant:(NSString *)variant {
+    if(variant == nil) return [NSString stringWithFormat:@" %@", [url absoluteString]];
+    
+    NSData *data = [variant dataUsingEncoding:NSUTF8StringEncoding];
+    
+    unsigned char digest[CC_SHA256_DIGEST_LENGTH];
+    CC_SHA256([data bytes], (CC_LONG)[data length], digest);
+    
+    NSMutableString *ms = [NSMutableString stringWithCapacity:CC_SHA256_DIGEST_LENGTH * 2 + 1 + [[url absoluteString] length]];
+    for(NSUInteger i = 0; i < CC_SHA256_DIGEST_LENGTH; i++) {
+        [ms appendFormat:@"%02x", digest[i]];
+    }
+    [ms appendFormat:@" %@", [url absoluteString]];
+    return ms;
+}
+
+// called on queue
+- (void)loadIndexIfNeeded {
+    if(_entries) return;
+    
+    self.entries = [NSMutableDictionary dictionary];
+    
+    [[NSFileManager defaultManager] createDirectoryAtURL:_directoryURL withIntermediateDirectories:YES attributes:nil error:nil];
+    
+    unsigned long long size = 0;
+    
+    NSArray *a = [NSArray arrayWithContentsOfURL:[self indexURL]];
+    for(NSDictionary *d in a) {
+        STHTTPRequestCacheEntry *entry = [STHTTPRequestCacheEntry entryWithPropertyList:d];
+        if(entry == nil) continue;
+        _entries[entry.key] = entry;
+        size += entry.size;
+    }
+    
+    self.currentSize = size;
+}
+
+// called on queue, the index is written at most once per second
+- (void)scheduleSave {
+    if(_isSaveScheduled) return;
+    self.isSaveScheduled = YES;
+    
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(1 * NSEC_PER_SEC)), _queue, ^{
+        self.isSaveScheduled = NO;
+        
+        NSMutableArray *a = [NSMutableArray arrayWithCapacity:[_entries count]];
+        for(STHTTPRequestCacheEntry *entry in [_entries allValues]) {
+            [a addObject:[entry propertyList]];
+        }
+        
+        [a writeToURL:[self indexURL] atomically:YES];
+    });
+}
+
+// called on queue
+- (void)removeEntry:(STHTTPRequestCacheEntry *)entry {
+    [_entries removeObjectForKey:entry.key];
+    [[NSFileManager defaultManager] removeItemAtURL:[self fileURLForEntry:entry] error:nil];
+    self.currentSize -= MIN(_currentSize, entry.size);
+    [self scheduleSave];
+}
+
+// called on queue, least recently used first
+- (void)evictEntriesIfNeeded {
+    if(_currentSize <= _maxSize) return;
+    
+    NSArray *sortedEntries = [[_entries allValues] sortedArrayUsingComparator:^NSComparisonResult(STHTTPRequestCacheEntry *e1, STHTTPRequestCacheEntry *e2) {
+        if(e1.lastAccessTime == e2.lastAccessTime) return NSOrderedSame;
+        return (e1.lastAccessTime < e2.lastAccessTime) ? NSOrderedAscending : NSOrderedDescending;
+    }];
+    
+    for(STHTTPRequestCacheEntry *entry in sortedEntries) {
+        if(_currentSize <= _maxSize) break;
+        [self removeEntry:entry];
+        self.evictionsCount += 1;
+    }
+}
+
+// called on queue, the longest matching suffix wins
+- (NSNumber *)timeToLiveOverrideForURL:(NSURL *)url {
+    
+    NSString *path = [url path];
+    NSString *matchingSuffix = nil;
+    
+    for(NSString *suffix in _timeToLiveByPathSuffix) {
+        if([path hasSuffix:suffix] && [suffix length] > [matchingSuffix length]) {
+            matchingSuffix = suffix;
+        }
+    }
+    
+    return matchingSuffix ? _timeToLiveByPathSuffix[matchingSuffix] : nil;
+}
+
+// called on queue
+- (NSTimeInterval)timeToLiveForURL:(NSURL *)url headers:(NSDictionary *)headers {
+    
+    NSNumber *timeToLiveOverride = [self timeToLiveOverrideForURL:url];
+    if(timeToLiveOverride) return [timeToLiveOverride doubleValue];
+    
+    NSString *cacheControl = [STHTTPHeaderValue(headers, @"Cache-Control") lowercaseString];
+    
+    if([cacheControl rangeOfString:@"no-cache"].location != NSNotFound) return 0;
+    
+    NSRange range = [cacheControl rangeOfString:@"max-age="];
+    if(range.location != NSNotFound) {
+        return [[cacheControl substringFromIndex:NSMaxRange(range)] doubleValue];
+    }
+    
+    return self.defaultTimeToLive;
+}
+
+#pragma mark Lookup and storage
+
+- (STHTTPRequestCacheEntry *)entryForKey:(NSString *)key {
+    __block STHTTPRequestCacheEntry *entry = nil;
+    
+    dispatch_sync(_queue, ^{
+        [self loadIndexIfNeeded];
+        
+        STHTTPRequestCacheEntry *storedEntry = _entries[key];
+        storedEntry.lastAccessTime = CFAbsoluteTimeGetCurrent();
+        
+        entry = [storedEntry copyOfEntry];
+    });
+    
+    return entry;
+}
+
+- (BOOL)isEntryFresh:(STHTTPRequestCacheEntry *)entry {
+    return CFAbsoluteTimeGetCurrent() < entry.expirationTime;
+}
+
+- (NSURLRequest *)request:(NSURLRequest *)request byAddingValidatorsOfEntry:(STHTTPRequestCacheEntry *)entry {
+    
+    NSMutableURLRequest *mutableRequest = [request mutableCopy];
+    
+    // we keep and revalidate the responses ourselves, so that the 304 reaches us
+    mutableRequest.cachePolicy = NSURLRequestReloadIgnoringLocalCacheData;
+    
+    if(entry.ETag) [mutableRequest setValue:entry.ETag forHTTPHeaderField:@"If-None-Match"];
+    if(entry.lastModified) [mutableRequest setValue:entry.lastModified forHTTPHeaderField:@"If-Modified-Since"];
+    
+    return mutableRequest;
+}
+
+- (NSData *)bodyForEntry:(STHTTPRequestCacheEntry *)entry {
+    
+    NSData *body = [NSData dataWithContentsOfURL:[self fileURLForEntry:entry] options:NSDataReadingMappedIfSafe error:nil];
+    
+    if(body == nil) {
+        dispatch_async(_queue, ^{
+            STHTTPRequestCacheEntry *storedEntry = _entries[entry.key];
+            if(storedEntry) [self removeEntry:storedEntry];
+        });
+    }
+    
+    return body;
+}
+
+- (void)recordHitWithBodyLength:(NSUInteger)length {
+    dispatch_async(_queue, ^{
+        self.hitsCount += 1;
+        self.savedBytesCount += length;
+    });
+}
+
+- (NSDictionary *)headersByRevalidatingEntry:(STHTTPRequestCacheEntry *)entry withNotModifiedHeaders:(NSDictionary *)headers URL:(NSURL *)url {
+    
+    // the 304 headers update the stored ones, eg. Date or rate limits
+    NSMutableDictionary *mergedHeaders = [entry.headers mutableCopy];
+    if(mergedHeaders == nil) mergedHeaders = [NSMutableDictionary dictionary];
+    
+    [headers enumerateKeysAndObjectsUsingBlock:^(NSString *name, NSString *value, BOOL *stop) {
+        for(NSString *key in [mergedHeaders allKeys]) {
+            if([key caseInsensitiveCompare:name] == NSOrderedSame) [mergedHeaders removeObjectForKey:key];
+        }
+        mergedHeaders[name] = value;
+    }];
+    
+    dispatch_async(_queue, ^{
+        self.revalidationsCount += 1;
+        self.savedBytesCount += entry.size;
+        
+        STHTTPRequestCacheEntry *storedEntry = _entries[entry.key];
+        if(storedEntry == nil) return;
+        
+        storedEntry.headers = mergedHeaders;
+        storedEntry.expirationTime = CFAbsoluteTimeGetCurrent() + [self timeToLiveForURL:url headers:mergedHeaders];
+        storedEntry.lastAccessTime = CFAbsoluteTimeGetCurrent();
+        
+        NSString *ETag = STHTTPHeaderValue(headers, @"ETag");
+        if(ETag) storedEntry.ETag = ETag;
+        
+        NSString *lastModified = STHTTPHeaderValue(headers, @"Last-Modified");
+        if(lastModified) storedEntry.lastModified = lastModified;
+        
+        [self scheduleSave];
+    });
+    
+    return mergedHeaders;
+}
+
+- (void)storeBody:(NSData *)body headers:(NSDictionary *)headers textEncodingName:(NSString *)textEncodingName forKey:(NSString *)key URL:(NSURL *)url {
+    
+    NSData *bodyCopy = [body copy]; // the request releases its response data once delivered
+    
+    dispatch_async(_queue, ^{
+        
+        self.missesCount += 1;
+        
+        [self loadIndexIfNeeded];
+        
+        NSString *cacheControl = [STHTTPHeaderValue(headers, @"Cache-Control") lowercaseString];
+        NSString *ETag = STHTTPHeaderValue(headers, @"ETag");
+        NSString *lastModified = STHTTPHeaderValue(headers, @"Last-Modified");
+        NSTimeInterval timeToLive = [self timeToLiveForURL:url headers:headers];
+        
+        // an explicit override wins over no-store, which the API sends on every response
+        BOOL isStorable = [cacheControl rangeOfString:@"no-store"].location == NSNotFound || [self timeToLiveOverrideForURL:url] != nil;
+        
+        BOOL isCacheable = isStorable
+        && (timeToLive > 0 || ETag || lastModified)
+        && [bodyCopy length] <= _maxSize / 4;
+        
+        STHTTPRequestCacheEntry *previousEntry = _entries[key];
+        if(previousEntry) [self removeEntry:previousEntry];
+        
+        if(isCacheable == NO) return;
+        
+        STHTTPRequestCacheEntry *entry = [[STHTTPRequestCacheEntry alloc] init];
+        entry.key = key;
+        entry.fileName = [[self class] fileNameForKey:key];
+        entry.headers = headers;
+        entry.textEncodingName = textEncodingName;
+        entry.ETag = ETag;
+        entry.lastModified = lastModified;
+        entry.expirationTime = CFAbsoluteTimeGetCurrent() + timeToLive;
+        entry.lastAccessTime = CFAbsoluteTimeGetCurrent();
+        entry.size = [bodyCopy length];
+        
+        if([bodyCopy writeToURL:[self fileURLForEntry:entry] atomically:YES] == NO) return;
+        
+        _entries[key] = entry;
+        self.currentSize += entry.size;
+        self.storesCount += 1;
+        
+        [self evictEntriesIfNeeded];
+        [self scheduleSave];
+    });
+}
+
+- (void)removeAllResponses {
+    dispatch_sync(_queue, ^{
+        [self loadIndexIfNeeded];
+        for(STHTTPRequestCacheEntry *entry in [_entries allValues]) {
+            [self removeEntry:entry];
+        }
+    });
+}
+
+#pragma mark Stats
+
+- (NSDictionary *)statistics {
+    __block NSDictionary *d = nil;
+    
+    dispatch_sync(_queue, ^{
+        d = @{@"hits"          : @(_hitsCount),
+              @"revalidations" : @(_revalidationsCount),
+              @"misses"        : @(_missesCount),
+              @"stores"        : @(_storesCount),
+              @"evictions"     : @(_evictionsCount),
+              @"saved_bytes"   : @(_savedBytesCount),
+              @"size"          : @(_currentSize),
+              @"entries"       : @([_entries count])};
+    });
+    
+    return d;
+}
+
+@end
+
+/**/
+
+@interface STHTTPRequestScheduler ()
+@property (nonatomic, strong) NSArray *pendingRequestsByPriority; // for each priority, NSMutableArray of pending requests by group, protected by @synchronized(self)
+@property (nonatomic, strong) NSArray *groupsByPriority; // for each priority, NSMutableArray of groups with pending requests, next served first
+@property (nonatomic, strong) NSCountedSet *runningRequestsByHost;
+@property (nonatomic, strong) NSMutableDictionary *maxConcurrentRequestsByHost;
+@property NSUInteger runningRequestsCount;
+@end
+
+@implementation STHTTPRequestScheduler
+
++ (instancetype)sharedScheduler {
+    static STHTTPRequestScheduler *sharedScheduler = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        sharedScheduler = [[self alloc] init];
+    });
+    return sharedScheduler;
+}
+
+- (instancetype)init {
+    self = [super init];
+    
+    _maxConcurrentRequestsPerHost = 4;
+    _maxConcurrentRequestsByHost = [NSMutableDictionary dictionary];
+    _runningRequestsByHost = [NSCountedSet set];
+    
+    NSMutableArray *pendingRequestsByPriority = [NSMutableArray array];
+    NSMutableArray *groupsByPriority = [NSMutableArray array];
+    for(STHTTPRequestPriority p = STHTTPRequestPriorityInteractive; p <= STHTTPRequestPriorityPrefetch; p++) {
+        [pendingRequestsByPriority addObject:[NSMutableDictionary dictionary]];
+        [groupsByPriority addObject:[NSMutableArray array]];
+    }
+    _pendingRequestsByPriority = pendingRequestsByPriority;
+    _groupsByPriority = groupsByPriority;
+    
+    return self;
+}
+
+- (void)setMaxConcurrentRequests:(NSUInteger)maxConcurrentRequests forHost:(NSString *)host {
+    @synchronized(self) {
+        _maxConcurrentRequestsByHost[host] = @(maxConcurrentRequests);
+    }
+    
+    [self startPendingRequests];
+}
+
++ (NSString *)hostOfRequest:(STHTTPRequest *)request {
+    NSString *host = [[request url] host];
+    return host ? host : @"";
+}
+
++ (NSInteger)priorityOfRequest:(STHTTPRequest *)request {
+    return MAX(STHTTPRequestPriorityInteractive, MIN(STHTTPRequestPriorityPrefetch, request.priority));
+}
+
+- (void)enqueueRequest:(STHTTPRequest *)request {
+    
+    @synchronized(self) {
+        NSInteger priority = [[self class] priorityOfRequest:request];
+        NSString *group = request.schedulingGroup ? request.schedulingGroup : @"";
+        
+        NSMutableDictionary *pendingRequestsByGroup = _pendingRequestsByPriority[priority];
+        NSMutableArray *pendingRequests = pendingRequestsByGroup[group];
+        
+        if(pendingRequests == nil) {
+            pendingRequests = [NSMutableArray array];
+            pendingRequestsByGroup[group] = pendingRequests;
+            [_groupsByPriority[priority] addObject:group];
+        }
+        
+        [pendingRequests addObject:request];
+    }
+    
+    [self startPendingRequests];
+}
+
+- (BOOL)removePendingRequest:(STHTTPRequest *)request {
+    
+    @synchronized(self) {
+        NSInteger priority = [[self class] priorityOfRequest:request];
+        NSString *group = request.schedulingGroup ? request.schedulingGroup : @"";
+        
+        NSMutableDictionary *pendingRequestsByGroup = _pendingRequestsByPriority[priority];
+        NSMutableArray *pendingRequests = pendingRequestsByGroup[group];
+        
+        if([pendingRequests indexOfObjectIdenticalTo:request] == NSNotFound) return NO;
+        
+        [pendingRequests removeObjectIdenticalTo:request];
+        
+        if([pendingRequests count] == 0) {
+            [pendingRequestsByGroup removeObjectForKey:group];
+            [_groupsByPriority[priority] removeObject:group];
+        }
+        
+        return YES;
+    }
+}
+
+- (void)requestDidFinish:(STHTTPRequest *)request {
+    
+    @synchronized(self) {
+        [_runningRequestsByHost removeObject:[[self class] hostOfRequest:request]];
+        self.runningRequestsCount -= 1;
+    }
+    
+    [self startPendingRequests];
+}
+
+// called with @synchronized(self)
+- (NSUInteger)maxConcurrentRequestsForHost:(NSString *)host priority:(NSInteger)priority {
+    NSNumber *n = _maxConcurrentRequestsByHost[host];
+    NSUInteger max = n ? [n unsignedIntegerValue] : self.maxConcurrentRequestsPerHost;
+    
+    // the last slot is kept for interactive and visible requests
+    if(priority >= STHTTPRequestPriorityBackfill && max > 1) return max - 1;
+    
+    return MAX(max, 1);
+}
+
+// called with @synchronized(self), returns the next request which can start, and removes it from the pending ones
+- (STHTTPRequest *)dequeueNextRequest {
+    
+    for(NSInteger priority = STHTTPRequestPriorityInteractive; priority <= STHTTPRequestPriorityPrefetch; priority++) {
+        
+        NSMutableDictionary *pendingRequestsByGroup = _pendingRequestsByPriority[priority];
+        NSMutableArray *groups = _groupsByPriority[priority];
+        
+        for(NSString *group in [groups copy]) {
+            
+            NSMutableArray *pendingRequests = pendingRequestsByGroup[group];
+            
+            for(STHTTPRequest *request in pendingRequests) {
+                
+                NSString *host = [[self class] hostOfRequest:request];
+                if([_runningRequestsByHost countForObject:host] >= [self maxConcurrentRequestsForHost:host priority:priority]) continue;
+                
+                [pendingRequests removeObjectIdenticalTo:request];
+                
+                // the group goes last in turn
+                [groups removeObject:group];
+                if([pendingRequests count] > 0) {
+                    [groups addObject:group];
+                } else {
+                    [pendingRequestsByGroup removeObjectForKey:group];
+                }
+                
+                [_runningRequestsByHost addObject:host];
+                self.runningRequestsCount += 1;
+                
+                return request;
+            }
+        }
+    }
+    
+    return nil;
+}
+
+- (void)startPendingRequests {
+    
+    NSMutableArray *requestsToStart = [NSMutableArray array];
+    
+    @synchronized(self) {
+        STHTTPRequest *request = nil;
+        while((request = [self dequeueNextRequest])) {
+            [requestsToStart addObject:request];
+        }
+    }
+    
+    for(STHTTPRequest *request in requestsToStart) {
+        [request startScheduledRequest];
+    }
+}
+
+#pragma mark Counters
+
+- (NSUInteger)pendingRequestsCount {
+    NSUInteger count = 0;
+    for(STHTTPRequestPriority p = STHTTPRequestPriorityInteractive; p <= STHTTPRequestPriorityPrefetch; p++) {
+        count += [self pendingRequestsCountForPriority:p];
+    }
+    return count;
+}
+
+- (NSUInteger)pendingRequestsCountForPriority:(STHTTPRequestPriority)priority {
+    if(priority < STHTTPRequestPriorityInteractive || priority > STHTTPRequestPriorityPrefetch) return 0;
+    
+    @synchronized(self) {
+        NSUInteger count = 0;
+        for(NSArray *pendingRequests in [_pendingRequestsByPriority[priority] allValues]) {
+            count += [pendingRequests count];
+        }
+        return count;
+    }
+}
+
+@end
+
+/**/
+
+@interface STHTTPRequestSessionPool ()
+@property (nonatomic, strong) NSMutableDictionary *sessionsForKeys;
+@property (nonatomic, strong) NSMapTable *requestsForTasks;
+@end
+
+@implementation STHTTPRequestSessionPool
+
++ (instancetype)sharedPool {
+    static STHTTPRequestSessionPool *sharedPool = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        sharedPool = [[self alloc] init];
+    });
+    return sharedPool;
+}
+
+- (instancetype)init {
+    if (self = [super init]) {
+        self.sessionsForKeys = [NSMutableDictionary dictionary];
+        self.requestsForTasks = [NSMapTable mapTableWithKeyOptions:(NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality)
+                                                      valueOptions:NSPointerFunctionsStrongMemory];
+    }
+    return self;
+}
+
++ (NSString *)sessionKeyForURL:(NSURL *)url background:(BOOL)background {
+    NSString *kind = background ? @"background" : @"default";
+    return [NSString stringWithFormat:@"%@ %@://%@:%@", kind, [url scheme], [url host], [url port]];
+}
+
+- (NSURLSession *)sessionForURL:(NSURL *)url background:(BOOL)background {
+    
+    NSString *key = [[self class] sessionKeyForURL:url background:background];
+    
+    @synchronized(self) {
+        NSURLSession *session = _sessionsForKeys[key];
+        if(session) return session;
+        
+        NSURLSessionConfiguration *sessionConfiguration = nil;
+        
+        if(background) {
+            NSString *backgroundSessionIdentifier = [[NSProcessInfo processInfo] globallyUniqueString];
+            if ([[NSURLSessionConfiguration class] respondsToSelector:@selector(backgroundSessionConfigurationWithIdentifier:)]) {
+                // iOS 8+
+                sessionConfiguration = [NSURLSessionConfiguration backgroundSessionConfigurationWithIdentifier:backgroundSessionIdentifier];
+            } else {
+                // iOS 7
+                sessionConfiguration = [NSURLSessionConfiguration ephemeralSessionConfiguration];
+            }
+        } else {
+            sessionConfiguration = [NSURLSessionConfiguration defaultSessionConfiguration];
+        }
+        
+        sessionConfiguration.allowsCellularAccess = YES;
+        
+        session = [NSURLSession sessionWithConfiguration:sessionConfiguration
+                                                delegate:self
+                                           delegateQueue:nil];
+        
+        _sessionsForKeys[key] = session;
+        
+        return session;
+    }
+}
+
+- (void)setRequest:(STHTTPRequest *)request forTask:(NSURLSessionTask *)task {
+    @synchronized(self) {
+        [_requestsForTasks setObject:request forKey:task];
+    }
+}
+
+- (STHTTPRequest *)requestForTask:(NSURLSessionTask *)task {
+    @synchronized(self) {
+        return [_requestsForTasks objectForKey:task];
+    }
+}
+
+- (void)removeRequestForTask:(NSURLSessionTask *)task {
+    @synchronized(self) {
+        [_requestsForTasks removeObjectForKey:task];
+    }
+}
+
+#pragma mark NSURLSessionDelegate
+
+- (void)URLSession:(NSURLSession *)session didBecomeInvalidWithError:(NSError *)error {
+    
+    NSMutableArray *requests = [NSMutableArray array];
+    
+    @synchronized(self) {
+        for(NSString *key in [_sessionsForKeys allKeys]) {
+            if(_sessionsForKeys[key] == session) {
+                [_sessionsForKeys removeObjectForKey:key];
+            }
+        }
+        
+        // the tasks of a session invalidated by an error won't complete, their requests fail with it
+        if(error) {
+            for(NSURLSessionTask *task in [[_requestsForTasks keyEnumerator] allObjects]) {
+                STHTTPRequest *request = [_requestsForTasks objectForKey:task];
+                if(request.session != session) continue;
+                [requests addObject:request];
+                [_requestsForTasks removeObjectForKey:task];
+            }
+        }
+    }
+    
+    for(STHTTPRequest *request in requests) {
+        [request URLSession:session task:request.task didCompleteWithError:error];
+    }
+}
+
+- (void)URLSessionDidFinishEventsForBackgroundURLSession:(NSURLSession *)session NS_AVAILABLE_IOS(7_0) {
+    
+    dispatch_async(dispatch_get_main_queue(), ^{
+        
+        void (^completionHandler)() = sessionCompletionHandlersForIdentifier[session.configuration.identifier];
+        
+        if(completionHandler) {
+            completionHandler();
+            [sessionCompletionHandlersForIdentifier removeObjectForKey:session.configuration.identifier];
+        }
+        
+    });
+}
+
+#pragma mark NSURLSessionTaskDelegate
+
+- (void)URLSession:(NSURLSession *)session task:(NSURLSessionTask *)task didReceiveChallenge:(NSURLAuthenticationChallenge *)challenge completionHandler:(void (^)(NSURLSessionAuthChallengeDisposition disposition, NSURLCredential *credential))completionHandler {
+    
+    STHTTPRequest *request = [self requestForTask:task];
+    
+    if([request respondsToSelector:_cmd]) {
+        [request URLSession:session task:task didReceiveChallenge:challenge completionHandler:completionHandler];
+    } else {
+        completionHandler(NSURLSessionAuthChallengePerformDefaultHandling, nil);
+    }
+}
+
+- (void)URLSession:(NSURLSession *)session
+              task:(NSURLSessionTask *)task
+willPerformHTTPRedirection:(NSHTTPURLResponse *)response
+        newRequest:(NSURLRequest *)request
+ completionHandler:(void (^)(NSURLRequest *))completionHandler {
+    
+    STHTTPRequest *r = [self requestForTask:task];
+    
+    if(r) {
+        [r URLSession:session task:task willPerformHTTPRedirection:response newRequest:request completionHandler:completionHandler];
+    } else {
+        completionHandler(request);
+    }
+}
+
+- (void)URLSession:(NSURLSession *)session task:(NSURLSessionTask *)task
+   didSendBodyData:(int64_t)bytesSent
+    totalBytesSent:(int64_t)totalBytesSent
+totalBytesExpectedToSend:(int64_t)totalBytesExpectedToSend {
+    
+    [[self requestForTask:task] URLSession:session task:task didSendBodyData:bytesSent totalBytesSent:totalBytesSent totalBytesExpectedToSend:totalBytesExpectedToSend];
+}
+
+- (void)URLSession:(NSURLSession *)session task:(NSURLSessionTask *)task didFinishCollectingMetrics:(NSURLSessionTaskMetrics *)metrics NS_AVAILABLE(10_12, 10_0) {
+    
+    [[self requestForTask:task] readTaskMetrics:metrics];
+}
+
+- (void)URLSession:(NSURLSession *)session
+              task:(NSURLSessionTask *)task
+didCompleteWithError:(NSError *)error {
+    
+    [[self requestForTask:task] URLSession:session task:task didCompleteWithError:error];
+    
+    [self removeRequestForTask:task];
+}
+
+#pragma mark NSURLSessionDataDelegate
+
+- (void)URLSession:(NSURLSession *)session
+          dataTask:(NSURLSessionDataTask *)dataTask
+didReceiveResponse:(NSURLResponse *)response
+ completionHandler:(void (^)(NSURLSessionResponseDisposition disposition))completionHandler {
+    
+    STHTTPRequest *r = [self requestForTask:dataTask];
+    
+    if(r) {
+        [r URLSession:session dataTask:dataTask didReceiveResponse:response completionHandler:completionHandler];
+    } else {
+        completionHandler(NSURLSessionResponseAllow);
+    }
+}
+
+- (void)URLSession:(NSURLSession *)session
+          dataTask:(NSURLSessionDataTask *)dataTask
+    didReceiveData:(NSData *)data {
+    
+    [[self requestForTask:dataTask] URLSession:session dataTask:dataTask didReceiveData:data];
+}
+
+- (void)URLSession:(NSURLSession *)session
+          dataTask:(NSURLSessionDataTask *)dataTask
+ willCacheResponse:(NSCachedURLResponse *)proposedResponse
+ completionHandler:(void (^)(NSCachedURLResponse *cachedResponse))completionHandler {
+    
+    STHTTPRequest *r = [self requestForTask:dataTask];
+    
+    if(r) {
+        [r URLSession:session dataTask:dataTask willCacheResponse:proposedResponse completionHandler:completionHandler];
+    } else {
+        completionHandler(proposedResponse);
+    }
+}
+
+@end
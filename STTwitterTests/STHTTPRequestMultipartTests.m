@@ -0,0 +1,238 @@
+//
+//  STHTTPRequestMultipartTests.m
+//  STTwitter
+//
+
+#import <XCTest/XCTest.h>
+#import <mach/mach.h>
+#import "STHTTPRequest.h"
+
+static unsigned long long const kLargeFileSize = 200 * 1024 * 1024;
+static uint64_t const kMaxFootprintGrowth = 16 * 1024 * 1024; // the copy buffer is 256 KB
+static NSString * const kBoundary = @"----------kStHtTpReQuEsTbOuNdArY";
+
+@interface STHTTPRequest (Tests)
+@property (nonatomic, strong) NSURL *HTTPBodyFileURL;
+- (NSURLRequest *)prepareURLRequest;
+- (BOOL)writeMultipartBodyWithBoundary:(NSString *)boundary
+                sortedPOSTDictionaries:(NSArray *)sortedPOSTDictionaries
+                        toOutputStream:(NSOutputStream *)outputStream;
+- (void)removeHTTPBodyFile;
+@end
+
+// dirty memory of the process, file pages cached by the kernel are not counted
+static uint64_t STPhysicalFootprint(void) {
+    task_vm_info_data_t info;
+    mach_msg_type_number_t count = TASK_VM_INFO_COUNT;
+    if(task_info(mach_task_self(), TASK_VM_INFO, (task_info_t)&info, &count) != KERN_SUCCESS) return 0;
+    return info.phys_footprint;
+}
+
+@interface STHTTPRequestMultipartTests : XCTestCase
+@property (nonatomic, strong) NSString *largeFilePath;
+@property (nonatomic, strong) NSMutableArray *temporaryPaths;
+@end
+
+@implementation STHTTPRequestMultipartTests
+
+- (void)setUp {
+    [super setUp];
+    
+    self.temporaryPaths = [NSMutableArray array];
+    
+    // real bytes rather than a sparse file, so that every page is actually read
+    self.largeFilePath = [self temporaryPath];
+    [[NSFileManager defaultManager] createFileAtPath:_largeFilePath contents:nil attributes:nil];
+    NSFileHandle *fileHandle = [NSFileHandle fileHandleForWritingAtPath:_largeFilePath];
+    
+    NSMutableData *megabyte = [NSMutableData dataWithLength:1024 * 1024];
+    for(unsigned long long i = 0; i < kLargeFileSize / [megabyte length]; i++) {
+        memset([megabyte mutableBytes], (int)('a' + i % 26), [megabyte length]);
+        [fileHandle writeData:megabyte];
+    }
+    [fileHandle closeFile];
+}
+
+- (void)tearDown {
+    for(NSString *path in _temporaryPaths) {
+        [[NSFileManager defaultManager] removeItemAtPath:path error:nil];
+    }
+    [STHTTPRequest setGlobalBackgroundUploadThreshold:1024 * 1024];
+    [super tearDown];
+}
+
+#pragma mark Helpers
+
+- (NSString *)temporaryPath {
+    NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]];
+    [_temporaryPaths addObject:path];
+    return path;
+}
+
+// samples the footprint every millisecond on another thread while the block runs
+- (uint64_t)peakFootprintGrowthDuringBlock:(dispatch_block_t)block {
+    
+    uint64_t baseline = STPhysicalFootprint();
+    __block uint64_t peak = baseline;
+    
+    dispatch_queue_t queue = dispatch_queue_create("STHTTPRequestMultipartTests.sampling", DISPATCH_QUEUE_SERIAL);
+    dispatch_source_t timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, queue);
+    dispatch_source_set_timer(timer, DISPATCH_TIME_NOW, NSEC_PER_MSEC, 0);
+    dispatch_source_set_event_handler(timer, ^{
+        peak = MAX(peak, STPhysicalFootprint());
+    });
+    dispatch_resume(timer);
+    
+    @autoreleasepool {
+        block();
+    }
+    
+    dispatch_source_cancel(timer);
+    dispatch_sync(queue, ^{
+        peak = MAX(peak, STPhysicalFootprint());
+    });
+    
+    return peak - baseline;
+}
+
+- (void)logFootprintGrowth:(uint64_t)growth label:(NSString *)label {
+    NSLog(@"-- %@: peak footprint +%.1f MB for a %.0f MB file", label, growth / (1024.0 * 1024.0), kLargeFileSize / (1024.0 * 1024.0));
+}
+
+- (STHTTPRequest *)uploadRequestWithFileAtPath:(NSString *)path {
+    STHTTPRequest *r = [STHTTPRequest requestWithURLString:@"https://upload.twitter.com/1.1/media/upload.json"];
+    r.POSTDictionary = @{@"command" : @"APPEND", @"media_id" : @"710511363345354753", @"segment_index" : @"0"};
+    [r addFileToUpload:path parameterName:@"media"];
+    return r;
+}
+
+- (unsigned long long)fileSizeAtPath:(NSString *)path {
+    return [[[NSFileManager defaultManager] attributesOfItemAtPath:path error:nil] fileSize];
+}
+
+- (NSData *)tailOfFileAtPath:(NSString *)path length:(unsigned long long)length {
+    NSFileHandle *fileHandle = [NSFileHandle fileHandleForReadingAtPath:path];
+    [fileHandle seekToFileOffset:[self fileSizeAtPath:path] - length];
+    NSData *data = [fileHandle readDataToEndOfFile];
+    [fileHandle closeFile];
+    return data;
+}
+
+#pragma mark Footprint
+
+- (void)testWritingTheBodyDoesNotLoadTheFile {
+    STHTTPRequest *r = [self uploadRequestWithFileAtPath:_largeFilePath];
+    NSString *bodyPath = [self temporaryPath];
+    
+    __block BOOL success = NO;
+    
+    uint64_t growth = [self peakFootprintGrowthDuringBlock:^{
+        NSOutputStream *outputStream = [NSOutputStream outputStreamToFileAtPath:bodyPath append:NO];
+        [outputStream open];
+        success = [r writeMultipartBodyWithBoundary:kBoundary sortedPOSTDictionaries:nil toOutputStream:outputStream];
+        [outputStream close];
+    }];
+    
+    [self logFootprintGrowth:growth label:@"multipart body written to a file"];
+    
+    XCTAssertTrue(success);
+    XCTAssertLessThan(growth, kMaxFootprintGrowth);
+    
+    // headers, the whole file and the closing delimiter
+    unsigned long long bodySize = [self fileSizeAtPath:bodyPath];
+    XCTAssertGreaterThan(bodySize, kLargeFileSize);
+    XCTAssertLessThan(bodySize, kLargeFileSize + 1024);
+    
+    char lastByte = (char)('a' + (kLargeFileSize / (1024 * 1024) - 1) % 26);
+    NSString *closingDelimiter = [NSString stringWithFormat:@"%c\r\n--%@--\r\n", lastByte, kBoundary];
+    NSData *tail = [self tailOfFileAtPath:bodyPath length:[closingDelimiter length]];
+    XCTAssertEqualObjects([[NSString alloc] initWithData:tail encoding:NSUTF8StringEncoding], closingDelimiter);
+}
+
+- (void)testPreparingALargeUploadDoesNotLoadTheFile {
+    STHTTPRequest *r = [self uploadRequestWithFileAtPath:_largeFilePath];
+    
+    __block NSURLRequest *request = nil;
+    
+    uint64_t growth = [self peakFootprintGrowthDuringBlock:^{
+        request = [r prepareURLRequest];
+    }];
+    
+    [self logFootprintGrowth:growth label:@"request prepared for a background upload"];
+    
+    XCTAssertNotNil(request);
+    XCTAssertLessThan(growth, kMaxFootprintGrowth);
+    
+    // the body is read from the temporary file, never from memory
+    XCTAssertNotNil(r.HTTPBodyFileURL);
+    XCTAssertNil([request HTTPBody]);
+    XCTAssertNotNil([request HTTPBodyStream]);
+    
+    unsigned long long bodySize = [self fileSizeAtPath:[r.HTTPBodyFileURL path]];
+    XCTAssertEqualObjects([request valueForHTTPHeaderField:@"Content-Length"], ([NSString stringWithFormat:@"%llu", bodySize]));
+    XCTAssertGreaterThan(bodySize, kLargeFileSize);
+    
+    NSString *lastParameter = [NSString stringWithFormat:@"name=\"segment_index\"\r\n\r\n0\r\n--%@--\r\n", kBoundary];
+    NSData *tail = [self tailOfFileAtPath:[r.HTTPBodyFileURL path] length:[lastParameter length]];
+    XCTAssertEqualObjects([[NSString alloc] initWithData:tail encoding:NSUTF8StringEncoding], lastParameter);
+    
+    NSURL *bodyFileURL = r.HTTPBodyFileURL;
+    [r removeHTTPBodyFile];
+    XCTAssertFalse([[NSFileManager defaultManager] fileExistsAtPath:[bodyFileURL path]]);
+}
+
+- (void)testFootprintAgainstLoadingTheFileInMemory {
+    
+    // what the body used to be, the file read with dataWithContentsOfFile: and appended to the parts
+    uint64_t inMemoryGrowth = [self peakFootprintGrowthDuringBlock:^{
+        NSMutableData *body = [NSMutableData data];
+        [body appendData:[[NSString stringWithFormat:@"--%@\r\n", kBoundary] dataUsingEncoding:NSUTF8StringEncoding]];
+        [body appendData:[NSData dataWithContentsOfFile:self.largeFilePath]];
+        [body appendData:[[NSString stringWithFormat:@"\r\n--%@--\r\n", kBoundary] dataUsingEncoding:NSUTF8StringEncoding]];
+    }];
+    
+    STHTTPRequest *r = [self uploadRequestWithFileAtPath:_largeFilePath];
+    
+    uint64_t streamedGrowth = [self peakFootprintGrowthDuringBlock:^{
+        [r prepareURLRequest];
+    }];
+    [r removeHTTPBodyFile];
+    
+    [self logFootprintGrowth:inMemoryGrowth label:@"body built in memory"];
+    [self logFootprintGrowth:streamedGrowth label:@"body streamed to a file"];
+    
+    XCTAssertLessThan(streamedGrowth, inMemoryGrowth / 10);
+}
+
+#pragma mark Threshold
+
+- (void)testSmallUploadsAreBuiltInMemory {
+    NSString *smallFilePath = [self temporaryPath];
+    [[NSMutableData dataWithLength:100 * 1024] writeToFile:smallFilePath atomically:NO];
+    
+    STHTTPRequest *r = [self uploadRequestWithFileAtPath:smallFilePath];
+    NSURLRequest *request = [r prepareURLRequest];
+    
+    XCTAssertNil(r.HTTPBodyFileURL);
+    XCTAssertNil([request HTTPBodyStream]);
+    XCTAssertGreaterThan([[request HTTPBody] length], 100 * 1024);
+    XCTAssertEqualObjects([request valueForHTTPHeaderField:@"Content-Length"], ([NSString stringWithFormat:@"%lu", (unsigned long)[[request HTTPBody] length]]));
+}
+
+- (void)testThresholdSelectsTheTemporaryFile {
+    NSString *smallFilePath = [self temporaryPath];
+    [[NSMutableData dataWithLength:100 * 1024] writeToFile:smallFilePath atomically:NO];
+    
+    [STHTTPRequest setGlobalBackgroundUploadThreshold:64 * 1024];
+    
+    STHTTPRequest *r = [self uploadRequestWithFileAtPath:smallFilePath];
+    NSURLRequest *request = [r prepareURLRequest];
+    
+    XCTAssertNotNil(r.HTTPBodyFileURL);
+    XCTAssertNil([request HTTPBody]);
+    XCTAssertNotNil([request HTTPBodyStream]);
+    
+    [r removeHTTPBodyFile];
+}
+
+@end
@@ -0,0 +1,187 @@
+//
+//  STHTTPRequestSessionPoolTests.m
+//  STTwitter
+//
+
+#import <XCTest/XCTest.h>
+#import "STHTTPRequest.h"
+#import "STTwitterTestServer.h"
+
+static NSUInteger const kRequestsCount = 1000;
+static NSUInteger const kConcurrentRequestsCount = 4; // the default per host limit of the scheduler
+
+@interface STHTTPRequestSessionPoolTests : XCTestCase
+@property (nonatomic, strong) STTwitterTestServer *server;
+@end
+
+@implementation STHTTPRequestSessionPoolTests
+
+- (void)setUp {
+    [super setUp];
+    
+    NSData *body = [@"{\"id_str\":\"20\",\"text\":\"just setting up my twttr\"}" dataUsingEncoding:NSUTF8StringEncoding];
+    
+    self.server = [[STTwitterTestServer alloc] initWithHandler:^STTwitterTestResponse *(STTwitterTestRequest *request) {
+        return [STTwitterTestResponse responseWithStatusCode:200 headers:@{@"Content-Type" : @"application/json;charset=utf-8"} body:body];
+    }];
+    
+    NSError *error = nil;
+    XCTAssertTrue([_server startWithError:&error], @"%@", error);
+}
+
+- (void)tearDown {
+    [_server stop];
+    [super tearDown];
+}
+
+#pragma mark Helpers
+
+- (NSURL *)URLForRequestAtIndex:(NSUInteger)i {
+    return [NSURL URLWithString:[NSString stringWithFormat:@"%@/statuses/show.json?id=%lu", _server.baseURLString, (unsigned long)i]];
+}
+
+// starts count requests, at most concurrency at a time, returns their latencies in seconds
+- (NSArray *)latenciesOfRequestsCount:(NSUInteger)count
+                          concurrency:(NSUInteger)concurrency
+                           startBlock:(void(^)(NSUInteger i, void(^completion)(BOOL success)))startBlock {
+    
+    XCTestExpectation *expectation = [self expectationWithDescription:@"requests"];
+    
+    NSMutableArray *latencies = [NSMutableArray arrayWithCapacity:count];
+    __block NSUInteger startedCount = 0;
+    __block NSUInteger failuresCount = 0;
+    __block void (^startNext)(void) = nil;
+    __block __weak void (^weakStartNext)(void) = nil;
+    
+    // called on the main queue only
+    startNext = ^{
+        if(startedCount == count) return;
+        
+        NSUInteger i = startedCount++;
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        
+        startBlock(i, ^(BOOL success) {
+            dispatch_async(dispatch_get_main_queue(), ^{
+                [latencies addObject:@(CFAbsoluteTimeGetCurrent() - start)];
+                if(success == NO) failuresCount++;
+                
+                if([latencies count] == count) {
+                    [expectation fulfill];
+                } else {
+                    weakStartNext();
+                }
+            });
+        });
+    };
+    weakStartNext = startNext;
+    
+    for(NSUInteger i = 0; i < concurrency; i++) startNext();
+    
+    [self waitForExpectationsWithTimeout:60 handler:nil];
+    startNext = nil;
+    
+    XCTAssertEqual(failuresCount, 0);
+    
+    return latencies;
+}
+
+- (NSTimeInterval)percentile:(double)percentile ofLatencies:(NSArray *)latencies {
+    NSArray *sorted = [latencies sortedArrayUsingSelector:@selector(compare:)];
+    NSUInteger index = MIN((NSUInteger)(percentile * [sorted count]), [sorted count] - 1);
+    return [sorted[index] doubleValue];
+}
+
+- (void)logLatencies:(NSArray *)latencies connectionsCount:(NSUInteger)connectionsCount label:(NSString *)label {
+    NSLog(@"-- %@: %lu connections per %lu requests, p50 %.2f ms, p99 %.2f ms",
+          label,
+          (unsigned long)connectionsCount,
+          (unsigned long)[latencies count],
+          [self percentile:0.50 ofLatencies:latencies] * 1000,
+          [self percentile:0.99 ofLatencies:latencies] * 1000);
+}
+
+- (void)startPooledRequestAtIndex:(NSUInteger)i completion:(void(^)(BOOL success))completion {
+    STHTTPRequest *r = [STHTTPRequest requestWithURL:[self URLForRequestAtIndex:i]];
+    r.ignoreCache = YES;
+    r.completionBlock = ^(NSDictionary *headers, NSString *body) {
+        completion(YES);
+    };
+    r.errorBlock = ^(NSError *error) {
+        completion(NO);
+    };
+    [r startAsynchronous];
+}
+
+#pragma mark Connection reuse
+
+- (void)testRequestsReuseThePooledConnections {
+    NSArray *latencies = [self latenciesOfRequestsCount:kRequestsCount concurrency:kConcurrentRequestsCount startBlock:^(NSUInteger i, void (^completion)(BOOL)) {
+        [self startPooledRequestAtIndex:i completion:completion];
+    }];
+    
+    NSUInteger connectionsCount = _server.acceptedConnectionsCount;
+    [self logLatencies:latencies connectionsCount:connectionsCount label:@"pooled sessions"];
+    
+    XCTAssertEqual(_server.requestsCount, kRequestsCount);
+    XCTAssertLessThanOrEqual(connectionsCount, 2 * kConcurrentRequestsCount); // at most a few, however many requests
+}
+
+- (void)testRequestsReportReusedConnections {
+    NSMutableArray *reused = [NSMutableArray array];
+    
+    [self latenciesOfRequestsCount:20 concurrency:1 startBlock:^(NSUInteger i, void (^completion)(BOOL)) {
+        STHTTPRequest *r = [STHTTPRequest requestWithURL:[self URLForRequestAtIndex:i]];
+        r.ignoreCache = YES;
+        r.completionBlock = ^(NSDictionary *headers, NSString *body) {};
+        r.metricsBlock = ^(STHTTPRequestMetrics *metrics) {
+            dispatch_async(dispatch_get_main_queue(), ^{
+                [reused addObject:@(metrics.reusedConnection)];
+                completion(metrics.failed == NO);
+            });
+        };
+        [r startAsynchronous];
+    }];
+    
+    // one handshake, then every request rides the same connection
+    XCTAssertEqual(_server.acceptedConnectionsCount, 1);
+    XCTAssertEqual([[reused filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"boolValue == YES"]] count], 19);
+}
+
+#pragma mark Latency
+
+- (void)testLatencyAgainstOneSessionPerRequest {
+    
+    // what STHTTPRequest did before the pool, a session created and invalidated for each request
+    NSArray *unpooledLatencies = [self latenciesOfRequestsCount:kRequestsCount concurrency:kConcurrentRequestsCount startBlock:^(NSUInteger i, void (^completion)(BOOL)) {
+        NSURLSession *session = [NSURLSession sessionWithConfiguration:[NSURLSessionConfiguration defaultSessionConfiguration]];
+        NSURLSessionDataTask *task = [session dataTaskWithURL:[self URLForRequestAtIndex:i] completionHandler:^(NSData *data, NSURLResponse *response, NSError *error) {
+            completion(error == nil && [(NSHTTPURLResponse *)response statusCode] == 200);
+        }];
+        [task resume];
+        [session finishTasksAndInvalidate];
+    }];
+    
+    NSUInteger unpooledConnectionsCount = _server.acceptedConnectionsCount;
+    
+    NSArray *pooledLatencies = [self latenciesOfRequestsCount:kRequestsCount concurrency:kConcurrentRequestsCount startBlock:^(NSUInteger i, void (^completion)(BOOL)) {
+        [self startPooledRequestAtIndex:i completion:completion];
+    }];
+    
+    NSUInteger pooledConnectionsCount = _server.acceptedConnectionsCount - unpooledConnectionsCount;
+    
+    [self logLatencies:unpooledLatencies connectionsCount:unpooledConnectionsCount label:@"one session per request"];
+    [self logLatencies:pooledLatencies connectionsCount:pooledConnectionsCount label:@"pooled sessions"];
+    
+    XCTAssertLessThan(pooledConnectionsCount, unpooledConnectionsCount);
+    XCTAssertLessThan([self percentile:0.99 ofLatencies:pooledLatencies], 0.5); // loopback, generous for loaded CI machines
+}
+
+- (void)testPerformanceOfPooledRequests {
+    [self measureBlock:^{
+        [self latenciesOfRequestsCount:200 concurrency:kConcurrentRequestsCount startBlock:^(NSUInteger i, void (^completion)(BOOL)) {
+            [self startPooledRequestAtIndex:i completion:completion];
+        }];
+    }];
+}
+
+@end
@@ -0,0 +1,183 @@
+//
+//  STTwitterDateParsingTests.m
+//  STTwitter
+//
+
+#import <XCTest/XCTest.h>
+#import "NSDateFormatter+STTwitter.h"
+
+static NSUInteger const kRandomDatesCount = 10000;
+static NSUInteger const kBenchmarkDatesCount = 100000;
+
+@interface STTwitterDateParsingTests : XCTestCase
+@end
+
+@implementation STTwitterDateParsingTests
+
+#pragma mark Helpers
+
+- (NSTimeInterval)timeIntervalFromBytesOfString:(NSString *)s {
+    const char *bytes = [s UTF8String];
+    NSTimeInterval timeInterval = NAN;
+    if(STTwitterTimeIntervalSince1970FromDateBytes(bytes, strlen(bytes), &timeInterval) == NO) return NAN;
+    return timeInterval;
+}
+
+- (void)assertParsersAgreeOnDateString:(NSString *)s {
+    NSDate *date = [[NSDateFormatter st_TwitterDateFormatter] dateFromString:s];
+    XCTAssertNotNil(date, @"%@", s);
+    
+    XCTAssertEqual([self timeIntervalFromBytesOfString:s], [date timeIntervalSince1970], @"%@", s);
+    XCTAssertEqual([NSDateFormatter st_timeIntervalSince1970FromTwitterDateString:s], [date timeIntervalSince1970], @"%@", s);
+}
+
+// created_at values as Twitter would send them, at random times and offsets from 1970 to 2100
+- (NSArray *)randomDateStringsCount:(NSUInteger)count {
+    NSDateFormatter *formatter = [[NSDateFormatter alloc] init];
+    [formatter setLocale:[[NSLocale alloc] initWithLocaleIdentifier:@"en_US_POSIX"]];
+    [formatter setDateFormat:@"EEE MMM dd HH:mm:ss Z yyyy"];
+    
+    NSMutableArray *strings = [NSMutableArray arrayWithCapacity:count];
+    
+    for(NSUInteger i = 0; i < count; i++) {
+        NSTimeInterval timeInterval = (NSTimeInterval)arc4random_uniform(130 * 365 * 86400U / 16) * 16 + arc4random_uniform(16);
+        NSInteger offset = ((NSInteger)arc4random_uniform(26 * 4 + 1) - 12 * 4) * 15 * 60; // -1200 to +1400 by quarters of an hour
+        
+        [formatter setTimeZone:[NSTimeZone timeZoneForSecondsFromGMT:offset]];
+        [strings addObject:[formatter stringFromDate:[NSDate dateWithTimeIntervalSince1970:timeInterval]]];
+    }
+    
+    return strings;
+}
+
+#pragma mark Equivalence
+
+- (void)testDocumentedDate {
+    XCTAssertEqual([self timeIntervalFromBytesOfString:@"Sun Jun 28 20:33:01 +0000 2009"], 1246221181);
+    [self assertParsersAgreeOnDateString:@"Sun Jun 28 20:33:01 +0000 2009"];
+}
+
+- (void)testOffsets {
+    [self assertParsersAgreeOnDateString:@"Mon Feb 29 12:00:00 -0800 2016"];
+    [self assertParsersAgreeOnDateString:@"Wed Jul 06 08:15:42 +0530 2016"];
+    [self assertParsersAgreeOnDateString:@"Sat Nov 05 23:59:59 -0330 2016"];
+    [self assertParsersAgreeOnDateString:@"Sun Apr 02 02:45:00 +1345 2017"];
+    [self assertParsersAgreeOnDateString:@"Fri Jan 01 00:30:00 +1400 2016"]; // still 2015 in UTC
+    [self assertParsersAgreeOnDateString:@"Thu Dec 31 23:30:00 -1200 2015"]; // already 2016 in UTC
+}
+
+- (void)testLeapDays {
+    XCTAssertEqual([self timeIntervalFromBytesOfString:@"Mon Feb 29 12:00:00 -0800 2016"], 1456776000);
+    
+    [self assertParsersAgreeOnDateString:@"Mon Feb 29 12:00:00 -0800 2016"];
+    [self assertParsersAgreeOnDateString:@"Tue Feb 29 23:59:59 +0000 2000"]; // divisible by 400
+    [self assertParsersAgreeOnDateString:@"Wed Mar 01 00:00:00 +0000 2000"];
+    [self assertParsersAgreeOnDateString:@"Mon Mar 01 00:00:00 +0000 2100"]; // divisible by 100, not a leap year
+    [self assertParsersAgreeOnDateString:@"Sun Dec 31 12:00:00 +0000 2028"]; // 366th day
+}
+
+- (void)testEpochBoundaries {
+    [self assertParsersAgreeOnDateString:@"Thu Jan 01 00:00:00 +0000 1970"];
+    [self assertParsersAgreeOnDateString:@"Wed Dec 31 23:00:00 -0200 1969"]; // after the epoch in UTC
+    [self assertParsersAgreeOnDateString:@"Tue Jan 19 03:14:08 +0000 2038"]; // past 32 bit time_t
+}
+
+- (void)testRandomDates {
+    for(NSString *s in [self randomDateStringsCount:kRandomDatesCount]) {
+        [self assertParsersAgreeOnDateString:s];
+    }
+}
+
+- (void)testStringsWithoutASCIIBytes {
+    // not backed by ASCII bytes, copied to the stack by st_timeIntervalSince1970FromTwitterDateString:
+    NSString *s = @"Mon Feb 29 12:00:00 -0800 2016";
+    unichar characters[30];
+    [s getCharacters:characters range:NSMakeRange(0, [s length])];
+    NSString *unicodeString = [NSString stringWithCharacters:characters length:[s length]];
+    
+    XCTAssertEqual([NSDateFormatter st_timeIntervalSince1970FromTwitterDateString:unicodeString], 1456776000);
+}
+
+#pragma mark Malformed strings
+
+- (void)testMalformedStrings {
+    NSArray *malformedStrings = @[@"",
+                                  @"Mon Feb 29 12:00:00 -0800 201", // too short
+                                  @"Mon Feb 29 12:00:00 -0800 20166", // too long
+                                  @"Mon Fev 29 12:00:00 -0800 2016", // unknown month
+                                  @"Mon Feb 29 12:00:00 *0800 2016", // no offset sign
+                                  @"Mon Feb 29 12-00-00 -0800 2016", // separators
+                                  @"Mon Feb 2x 12:00:00 -0800 2016", // not a digit
+                                  @"Mon Feb 00 12:00:00 -0800 2016",
+                                  @"Mon Feb 29 24:00:00 -0800 2016",
+                                  @"Mon Feb 29 12:60:00 -0800 2016",
+                                  @"Mon Feb 29 12:00:00 -0860 2016",
+                                  @"Mon Fév 29 12:00:00 -0800 2016", // not ASCII, 30 characters
+                                  @"2016-02-29T12:00:00-08:00     "]; // ISO 8601, padded to 30 characters
+    
+    for(NSString *s in malformedStrings) {
+        const char *bytes = [s UTF8String];
+        NSTimeInterval timeInterval = 42;
+        XCTAssertFalse(STTwitterTimeIntervalSince1970FromDateBytes(bytes, strlen(bytes), &timeInterval), @"%@", s);
+        XCTAssertEqual(timeInterval, 42, @"%@", s); // untouched
+        XCTAssertTrue(isnan([NSDateFormatter st_timeIntervalSince1970FromTwitterDateString:s]), @"%@", s);
+    }
+    
+    XCTAssertNil([[NSDateFormatter st_TwitterDateFormatter] dateFromString:@"Mon Fev 29 12:00:00 -0800 2016"]);
+    XCTAssertNil([[NSDateFormatter st_TwitterDateFormatter] dateFromString:@"2016-02-29T12:00:00-08:00     "]);
+    
+    XCTAssertTrue(isnan([NSDateFormatter st_timeIntervalSince1970FromTwitterDateString:nil]));
+    XCTAssertFalse(STTwitterTimeIntervalSince1970FromDateBytes(NULL, 30, NULL));
+}
+
+#pragma mark Performance
+
+- (void)testPerformanceOfDateBytes {
+    NSArray *strings = [self randomDateStringsCount:kBenchmarkDatesCount];
+    
+    [self measureBlock:^{
+        for(NSString *s in strings) {
+            [NSDateFormatter st_timeIntervalSince1970FromTwitterDateString:s];
+        }
+    }];
+}
+
+- (void)testPerformanceOfDateFormatter {
+    NSArray *strings = [self randomDateStringsCount:kBenchmarkDatesCount / 10];
+    NSDateFormatter *formatter = [NSDateFormatter st_TwitterDateFormatter];
+    
+    [self measureBlock:^{
+        for(NSString *s in strings) {
+            @autoreleasepool {
+                [formatter dateFromString:s];
+            }
+        }
+    }];
+}
+
+- (void)testParsesPerSecondAgainstDateFormatter {
+    NSArray *strings = [self randomDateStringsCount:kBenchmarkDatesCount / 10];
+    NSDateFormatter *formatter = [NSDateFormatter st_TwitterDateFormatter];
+    
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    for(NSString *s in strings) {
+        @autoreleasepool {
+            [formatter dateFromString:s];
+        }
+    }
+    NSTimeInterval formatterElapsed = CFAbsoluteTimeGetCurrent() - start;
+    
+    start = CFAbsoluteTimeGetCurrent();
+    for(NSString *s in strings) {
+        [NSDateFormatter st_timeIntervalSince1970FromTwitterDateString:s];
+    }
+    NSTimeInterval bytesElapsed = CFAbsoluteTimeGetCurrent() - start;
+    
+    NSLog(@"-- NSDateFormatter: %.0f parses/s, STTwitterTimeIntervalSince1970FromDateBytes: %.0f parses/s",
+          [strings count] / formatterElapsed,
+          [strings count] / bytesElapsed);
+    
+    XCTAssertLessThan(bytesElapsed, formatterElapsed);
+}
+
+@end
@@ -0,0 +1,174 @@
+//
+//  STTwitterDirectMessageTests.m
+//  STTwitter
+//
+
+#import <XCTest/XCTest.h>
+#import "STTwitterAPI.h"
+#import "STHTTPRequest.h"
+#import "STTwitterTestServer.h"
+
+static NSUInteger const kMessagesCount = 200;
+
+@interface STHTTPRequest (Tests)
+@property (nonatomic, strong) NSURLSessionTask *task;
+@end
+
+@interface STTwitterDirectMessageTests : XCTestCase
+@property (nonatomic, strong) STTwitterTestServer *server;
+@property (nonatomic, strong) NSString *savedAPIBaseURLString;
+@property (nonatomic, strong) STTwitterAPI *twitter;
+@property (nonatomic, strong) NSMutableArray *receivedParameters;
+@end
+
+@implementation STTwitterDirectMessageTests
+
+- (void)setUp {
+    [super setUp];
+    
+    self.receivedParameters = [NSMutableArray array];
+    
+    __weak typeof(self) weakSelf = self;
+    
+    self.server = [[STTwitterTestServer alloc] initWithHandler:^STTwitterTestResponse *(STTwitterTestRequest *request) {
+        __strong typeof(weakSelf) strongSelf = weakSelf;
+        
+        if([request.HTTPMethod isEqualToString:@"POST"] == NO || [request.path hasPrefix:@"/1.1/direct_messages/new.json"] == NO) {
+            return [STTwitterTestResponse responseWithStatusCode:404 JSONObject:@{@"errors" : @[@{@"code" : @34, @"message" : @"Sorry, that page does not exist."}]}];
+        }
+        
+        NSDictionary *parameters = [request formParameters];
+        
+        @synchronized(strongSelf) {
+            [strongSelf.receivedParameters addObject:parameters];
+        }
+        
+        return [STTwitterTestResponse responseWithStatusCode:200 JSONObject:@{@"id_str" : @"240136858829479936",
+                                                                              @"text" : parameters[@"text"] ?: @"",
+                                                                              @"recipient_screen_name" : parameters[@"screen_name"] ?: @"",
+                                                                              @"sender_screen_name" : @"theSeanCook"}];
+    }];
+    
+    NSError *error = nil;
+    XCTAssertTrue([_server startWithError:&error], @"%@", error);
+    
+    self.savedAPIBaseURLString = kBaseURLStringAPI_1_1;
+    kBaseURLStringAPI_1_1 = _server.baseURLString;
+    
+    self.twitter = [STTwitterAPI twitterAPIWithOAuthConsumerKey:@"consumer key" consumerSecret:@"consumer secret" oauthToken:@"token" oauthTokenSecret:@"token secret"];
+}
+
+- (void)tearDown {
+    kBaseURLStringAPI_1_1 = _savedAPIBaseURLString;
+    [STHTTPRequest setGlobalBackgroundUploadThreshold:1024 * 1024];
+    [_server stop];
+    [super tearDown];
+}
+
+#pragma mark Helpers
+
+// sends count messages one after the other, as a user would, returns their round trip latencies in seconds
+- (NSArray *)latenciesOfDirectMessagesCount:(NSUInteger)count requests:(NSMutableArray *)requests {
+    
+    XCTestExpectation *expectation = [self expectationWithDescription:@"direct messages"];
+    
+    NSMutableArray *latencies = [NSMutableArray arrayWithCapacity:count];
+    __block NSUInteger failuresCount = 0;
+    __block void (^sendNext)(void) = nil;
+    __block __weak void (^weakSendNext)(void) = nil;
+    
+    sendNext = ^{
+        NSString *text = [NSString stringWithFormat:@"message %lu, ça va ? 👋", (unsigned long)[latencies count]];
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        
+        void (^completion)(BOOL) = ^(BOOL success) {
+            [latencies addObject:@(CFAbsoluteTimeGetCurrent() - start)];
+            if(success == NO) failuresCount++;
+            
+            if([latencies count] == count) {
+                [expectation fulfill];
+            } else {
+                weakSendNext();
+            }
+        };
+        
+        id r = [self.twitter postDirectMessage:text forScreenName:@"episod" orUserID:nil successBlock:^(NSDictionary *message) {
+            completion([message[@"text"] isEqualToString:text]);
+        } errorBlock:^(NSError *error) {
+            NSLog(@"-- %@", error);
+            completion(NO);
+        }];
+        
+        if(r) [requests addObject:r];
+    };
+    weakSendNext = sendNext;
+    
+    sendNext();
+    
+    [self waitForExpectationsWithTimeout:120 handler:nil];
+    sendNext = nil;
+    
+    XCTAssertEqual(failuresCount, 0);
+    
+    return latencies;
+}
+
+- (NSTimeInterval)percentile:(double)percentile ofLatencies:(NSArray *)latencies {
+    NSArray *sorted = [latencies sortedArrayUsingSelector:@selector(compare:)];
+    NSUInteger index = MIN((NSUInteger)(percentile * [sorted count]), [sorted count] - 1);
+    return [sorted[index] doubleValue];
+}
+
+- (void)logLatencies:(NSArray *)latencies label:(NSString *)label {
+    NSLog(@"-- %@: %lu direct messages, p50 %.2f ms, p99 %.2f ms",
+          label,
+          (unsigned long)[latencies count],
+          [self percentile:0.50 ofLatencies:latencies] * 1000,
+          [self percentile:0.99 ofLatencies:latencies] * 1000);
+}
+
+#pragma mark Round trip
+
+- (void)testDirectMessagesAreSentFromMemory {
+    NSMutableArray *requests = [NSMutableArray array];
+    
+    NSArray *latencies = [self latenciesOfDirectMessagesCount:kMessagesCount requests:requests];
+    [self logLatencies:latencies label:@"foreground data tasks"];
+    
+    XCTAssertEqual([_receivedParameters count], kMessagesCount);
+    XCTAssertEqualObjects([_receivedParameters firstObject][@"screen_name"], @"episod");
+    XCTAssertEqualObjects([_receivedParameters firstObject][@"text"], @"message 0, ça va ? 👋");
+    
+    // data tasks on the pooled default session, upload tasks would read the body from a temporary file
+    XCTAssertEqual([requests count], kMessagesCount);
+    for(STHTTPRequest *r in requests) {
+        XCTAssertFalse([r.task isKindOfClass:[NSURLSessionUploadTask class]]);
+    }
+    
+    // one handshake for the whole conversation
+    XCTAssertEqual(_server.acceptedConnectionsCount, 1);
+    XCTAssertLessThan([self percentile:0.99 ofLatencies:latencies], 0.5); // loopback, generous for loaded CI machines
+}
+
+- (void)testLatencyAgainstBackgroundUploads {
+    
+    // what every POST did before the threshold, a body file uploaded by a background session
+    [STHTTPRequest setGlobalBackgroundUploadThreshold:1];
+    NSArray *backgroundLatencies = [self latenciesOfDirectMessagesCount:kMessagesCount / 4 requests:[NSMutableArray array]];
+    
+    [STHTTPRequest setGlobalBackgroundUploadThreshold:1024 * 1024];
+    NSArray *foregroundLatencies = [self latenciesOfDirectMessagesCount:kMessagesCount / 4 requests:[NSMutableArray array]];
+    
+    [self logLatencies:backgroundLatencies label:@"background upload tasks"];
+    [self logLatencies:foregroundLatencies label:@"foreground data tasks"];
+    
+    XCTAssertLessThan([self percentile:0.50 ofLatencies:foregroundLatencies], [self percentile:0.50 ofLatencies:backgroundLatencies]);
+}
+
+- (void)testPerformanceOfDirectMessages {
+    [self measureBlock:^{
+        [self latenciesOfDirectMessagesCount:kMessagesCount requests:[NSMutableArray array]];
+    }];
+}
+
+@end
@@ -0,0 +1,376 @@
+//
+//  STTwitterMediaUploaderTests.m
+//  STTwitter
+//
+
+#import <XCTest/XCTest.h>
+#import "STTwitterMediaUploader.h"
+#import "STTwitterAPI.h"
+#import "STTwitterTestServer.h"
+
+@interface STTwitterMediaUploader (Tests)
+- (NSUInteger)nextSegmentSize;
+@end
+
+@interface STTwitterMediaUploaderTests : XCTestCase
+@property (nonatomic, strong) STTwitterTestServer *server;
+@property (nonatomic, strong) NSString *savedUploadBaseURLString;
+@property (nonatomic, strong) STTwitterAPI *twitter;
+@property (nonatomic, strong) NSMutableArray *receivedSegments; // [index, data, time], in the order received
+@property (nonatomic, copy) STTwitterTestResponse *(^segmentHandler)(NSUInteger index, NSUInteger attempt); // nil response means 204
+@property (nonatomic, strong) NSMutableArray *temporaryFileURLs;
+@end
+
+@implementation STTwitterMediaUploaderTests
+
+- (void)setUp {
+    [super setUp];
+    
+    self.receivedSegments = [NSMutableArray array];
+    self.temporaryFileURLs = [NSMutableArray array];
+    
+    __weak typeof(self) weakSelf = self;
+    
+    self.server = [[STTwitterTestServer alloc] initWithHandler:^STTwitterTestResponse *(STTwitterTestRequest *request) {
+        __strong typeof(weakSelf) strongSelf = weakSelf;
+        
+        NSDictionary *parts = [request multipartParts];
+        NSString *indexString = [[NSString alloc] initWithData:parts[@"segment_index"] encoding:NSUTF8StringEncoding];
+        if(indexString == nil || parts[@"media"] == nil) return [STTwitterTestResponse responseWithStatusCode:400 JSONObject:nil];
+        
+        NSUInteger index = (NSUInteger)[indexString integerValue];
+        NSUInteger attempt = 0;
+        
+        @synchronized(strongSelf) {
+            for(NSArray *a in strongSelf.receivedSegments) {
+                if([a[0] unsignedIntegerValue] == index) attempt += 1;
+            }
+            [strongSelf.receivedSegments addObject:@[@(index), parts[@"media"], @(request.receivedTime)]];
+        }
+        
+        STTwitterTestResponse *response = strongSelf.segmentHandler ? strongSelf.segmentHandler(index, attempt) : nil;
+        return response ? response : [STTwitterTestResponse responseWithStatusCode:204 headers:nil body:nil];
+    }];
+    
+    NSError *error = nil;
+    XCTAssertTrue([_server startWithError:&error], @"%@", error);
+    
+    self.savedUploadBaseURLString = kBaseURLStringUpload_1_1;
+    kBaseURLStringUpload_1_1 = _server.baseURLString;
+    
+    self.twitter = [STTwitterAPI twitterAPIWithOAuthConsumerKey:@"consumer key" consumerSecret:@"consumer secret" oauthToken:@"token" oauthTokenSecret:@"token secret"];
+}
+
+- (void)tearDown {
+    kBaseURLStringUpload_1_1 = _savedUploadBaseURLString;
+    [_server stop];
+    
+    for(NSURL *url in _temporaryFileURLs) {
+        [[NSFileManager defaultManager] removeItemAtURL:url error:nil];
+    }
+    
+    [super tearDown];
+}
+
+#pragma mark Helpers
+
+- (NSURL *)temporaryFileURL {
+    NSString *name = [[NSProcessInfo processInfo] globallyUniqueString];
+    NSURL *url = [NSURL fileURLWithPath:[NSTemporaryDirectory() stringByAppendingPathComponent:name]];
+    [_temporaryFileURLs addObject:url];
+    return url;
+}
+
+- (NSURL *)fileWithLength:(NSUInteger)length {
+    NSMutableData *data = [NSMutableData dataWithLength:length];
+    uint8_t *bytes = [data mutableBytes];
+    for(NSUInteger i = 0; i < length; i++) {
+        bytes[i] = (uint8_t)(i % 251); // no period aligned with the segments
+    }
+    
+    NSURL *url = [self temporaryFileURL];
+    [data writeToURL:url atomically:NO];
+    return url;
+}
+
+- (NSURL *)sparseFileWithLength:(unsigned long long)length {
+    NSURL *url = [self temporaryFileURL];
+    [[NSFileManager defaultManager] createFileAtPath:[url path] contents:nil attributes:nil];
+    NSFileHandle *fileHandle = [NSFileHandle fileHandleForWritingToURL:url error:nil];
+    [fileHandle truncateFileAtOffset:length];
+    [fileHandle closeFile];
+    return url;
+}
+
+- (STTwitterMediaUploader *)uploaderWithFileURL:(NSURL *)fileURL segmentSize:(NSUInteger)segmentSize {
+    STTwitterMediaUploader *uploader = [[STTwitterMediaUploader alloc] initWithTwitterAPI:_twitter fileURL:fileURL mediaID:@"710511363345354753"];
+    uploader.initialSegmentSize = segmentSize;
+    uploader.minimumSegmentSize = 1;
+    uploader.maximumSegmentSize = segmentSize;
+    uploader.maxConcurrentSegments = 1;
+    return uploader;
+}
+
+// nil on success
+- (NSError *)runUploader:(STTwitterMediaUploader *)uploader timeout:(NSTimeInterval)timeout {
+    
+    XCTestExpectation *expectation = [self expectationWithDescription:@"upload"];
+    __block NSError *uploadError = nil;
+    
+    [uploader startWithSuccessBlock:^(id response) {
+        [expectation fulfill];
+    } errorBlock:^(NSError *error) {
+        uploadError = error;
+        [expectation fulfill];
+    }];
+    
+    [self waitForExpectationsWithTimeout:timeout handler:nil];
+    return uploadError;
+}
+
+- (NSArray *)receivedSegmentsColumn:(NSUInteger)column {
+    NSMutableArray *ma = [NSMutableArray array];
+    @synchronized(self) {
+        for(NSArray *a in _receivedSegments) [ma addObject:a[column]];
+    }
+    return ma;
+}
+
+// the last received data for each index, joined in index order
+- (NSData *)reassembledData {
+    NSMutableDictionary *dataByIndex = [NSMutableDictionary dictionary];
+    @synchronized(self) {
+        for(NSArray *a in _receivedSegments) dataByIndex[a[0]] = a[1];
+    }
+    
+    NSMutableData *data = [NSMutableData data];
+    for(NSNumber *index in [[dataByIndex allKeys] sortedArrayUsingSelector:@selector(compare:)]) {
+        [data appendData:dataByIndex[index]];
+    }
+    return data;
+}
+
+- (NSArray *)receivedTimesForIndex:(NSUInteger)index {
+    NSMutableArray *ma = [NSMutableArray array];
+    @synchronized(self) {
+        for(NSArray *a in _receivedSegments) {
+            if([a[0] unsignedIntegerValue] == index) [ma addObject:a[2]];
+        }
+    }
+    return ma;
+}
+
+#pragma mark Upload
+
+- (void)testUploadSendsEverySegmentOnce {
+    NSURL *fileURL = [self fileWithLength:10000];
+    STTwitterMediaUploader *uploader = [self uploaderWithFileURL:fileURL segmentSize:1000];
+    uploader.maxConcurrentSegments = 3;
+    
+    __block int64_t lastTotalBytesWritten = 0;
+    uploader.uploadProgressBlock = ^(int64_t bytesWritten, int64_t totalBytesWritten, int64_t totalBytesExpectedToWrite) {
+        lastTotalBytesWritten = totalBytesWritten;
+    };
+    
+    XCTAssertNil([self runUploader:uploader timeout:10]);
+    
+    NSArray *indexes = [[self receivedSegmentsColumn:0] sortedArrayUsingSelector:@selector(compare:)];
+    XCTAssertEqualObjects(indexes, (@[@0, @1, @2, @3, @4, @5, @6, @7, @8, @9]));
+    XCTAssertEqualObjects([self reassembledData], [NSData dataWithContentsOfURL:fileURL]);
+    XCTAssertEqual(uploader.uploadedBytesCount, 10000);
+    XCTAssertEqual(lastTotalBytesWritten, 10000);
+}
+
+#pragma mark Retries
+
+- (void)testServerErrorsAreRetriedWithBackoff {
+    NSURL *fileURL = [self fileWithLength:4000];
+    STTwitterMediaUploader *uploader = [self uploaderWithFileURL:fileURL segmentSize:1000];
+    
+    self.segmentHandler = ^STTwitterTestResponse *(NSUInteger index, NSUInteger attempt) {
+        if(index == 1 && attempt < 2) return [STTwitterTestResponse responseWithStatusCode:503 JSONObject:nil];
+        return nil;
+    };
+    
+    XCTAssertNil([self runUploader:uploader timeout:15]);
+    
+    NSArray *times = [self receivedTimesForIndex:1];
+    XCTAssertEqual([times count], 3);
+    if([times count] == 3) {
+        // 1 then 2 seconds, plus the request time
+        XCTAssertGreaterThanOrEqual([times[1] doubleValue] - [times[0] doubleValue], 0.95);
+        XCTAssertGreaterThanOrEqual([times[2] doubleValue] - [times[1] doubleValue], 1.95);
+    }
+    
+    // the next segments don't wait for the retries
+    NSArray *times2 = [self receivedTimesForIndex:2];
+    XCTAssertEqual([times2 count], 1);
+    if([times count] == 3 && [times2 count] == 1) {
+        XCTAssertLessThan([times2[0] doubleValue], [times[1] doubleValue]);
+    }
+    
+    XCTAssertEqualObjects([self reassembledData], [NSData dataWithContentsOfURL:fileURL]);
+}
+
+- (void)testDroppedConnectionsAreRetried {
+    NSURL *fileURL = [self fileWithLength:3000];
+    STTwitterMediaUploader *uploader = [self uploaderWithFileURL:fileURL segmentSize:1000];
+    
+    self.segmentHandler = ^STTwitterTestResponse *(NSUInteger index, NSUInteger attempt) {
+        if(index == 0 && attempt == 0) return [STTwitterTestResponse droppedConnection];
+        return nil;
+    };
+    
+    XCTAssertNil([self runUploader:uploader timeout:10]);
+    
+    XCTAssertGreaterThanOrEqual([[self receivedTimesForIndex:0] count], 2);
+    XCTAssertEqualObjects([self reassembledData], [NSData dataWithContentsOfURL:fileURL]);
+}
+
+- (void)testRetriesStopAfterMaxRetriesPerSegment {
+    NSURL *fileURL = [self fileWithLength:2000];
+    STTwitterMediaUploader *uploader = [self uploaderWithFileURL:fileURL segmentSize:1000];
+    uploader.maxRetriesPerSegment = 2;
+    
+    self.segmentHandler = ^STTwitterTestResponse *(NSUInteger index, NSUInteger attempt) {
+        return [STTwitterTestResponse responseWithStatusCode:503 JSONObject:nil];
+    };
+    
+    NSError *error = [self runUploader:uploader timeout:15];
+    
+    XCTAssertEqualObjects([error domain], @"STHTTPRequest");
+    XCTAssertEqual([error code], 503);
+    XCTAssertEqual([[self receivedTimesForIndex:0] count], 3); // the first attempt and 2 retries
+    XCTAssertEqual(uploader.uploadedBytesCount, 0);
+}
+
+- (void)testClientErrorsAreNotRetried {
+    NSURL *fileURL = [self fileWithLength:2000];
+    STTwitterMediaUploader *uploader = [self uploaderWithFileURL:fileURL segmentSize:1000];
+    
+    self.segmentHandler = ^STTwitterTestResponse *(NSUInteger index, NSUInteger attempt) {
+        return [STTwitterTestResponse responseWithStatusCode:400 JSONObject:@{@"errors" : @[@{@"code" : @324, @"message" : @"Media id is invalid."}]}];
+    };
+    
+    NSError *error = [self runUploader:uploader timeout:10];
+    
+    XCTAssertNotNil(error);
+    XCTAssertEqual([[self receivedSegmentsColumn:0] count], 1);
+}
+
+#pragma mark Resume data
+
+- (void)testResumeDataRoundTrip {
+    NSURL *fileURL = [self fileWithLength:5000];
+    STTwitterMediaUploader *uploader = [self uploaderWithFileURL:fileURL segmentSize:1000];
+    
+    self.segmentHandler = ^STTwitterTestResponse *(NSUInteger index, NSUInteger attempt) {
+        if(index == 2) return [STTwitterTestResponse responseWithStatusCode:400 JSONObject:nil];
+        return nil;
+    };
+    
+    XCTAssertNotNil([self runUploader:uploader timeout:10]);
+    XCTAssertEqual(uploader.uploadedBytesCount, 2000);
+    
+    // as an app would store it
+    NSError *error = nil;
+    NSData *plist = [NSPropertyListSerialization dataWithPropertyList:uploader.resumeData format:NSPropertyListBinaryFormat_v1_0 options:0 error:&error];
+    XCTAssertNotNil(plist, @"%@", error);
+    NSDictionary *resumeData = [NSPropertyListSerialization propertyListWithData:plist options:0 format:NULL error:&error];
+    XCTAssertNotNil(resumeData, @"%@", error);
+    
+    STTwitterMediaUploader *resumedUploader = [[STTwitterMediaUploader alloc] initWithTwitterAPI:_twitter resumeData:resumeData];
+    XCTAssertNotNil(resumedUploader);
+    XCTAssertEqualObjects(resumedUploader.mediaID, uploader.mediaID);
+    XCTAssertEqual(resumedUploader.uploadedBytesCount, 2000);
+    resumedUploader.minimumSegmentSize = 1;
+    resumedUploader.maximumSegmentSize = 1000;
+    resumedUploader.maxConcurrentSegments = 1;
+    
+    NSUInteger firstRunCount = [[self receivedSegmentsColumn:0] count];
+    self.segmentHandler = nil;
+    
+    XCTAssertNil([self runUploader:resumedUploader timeout:10]);
+    
+    NSArray *resumedIndexes = [[self receivedSegmentsColumn:0] subarrayWithRange:NSMakeRange(firstRunCount, [[self receivedSegmentsColumn:0] count] - firstRunCount)];
+    XCTAssertEqualObjects([resumedIndexes sortedArrayUsingSelector:@selector(compare:)], (@[@2, @3, @4]));
+    XCTAssertEqualObjects([self reassembledData], [NSData dataWithContentsOfURL:fileURL]);
+    XCTAssertEqual(resumedUploader.uploadedBytesCount, 5000);
+}
+
+- (void)testResumeDataIsRejectedWhenTheFileChanged {
+    NSURL *fileURL = [self fileWithLength:3000];
+    STTwitterMediaUploader *uploader = [self uploaderWithFileURL:fileURL segmentSize:1000];
+    NSDictionary *resumeData = uploader.resumeData;
+    
+    XCTAssertNotNil([[STTwitterMediaUploader alloc] initWithTwitterAPI:_twitter resumeData:resumeData]);
+    
+    NSDate *date = [NSDate dateWithTimeIntervalSinceNow:-3600];
+    [[NSFileManager defaultManager] setAttributes:@{NSFileModificationDate : date} ofItemAtPath:[fileURL path] error:nil];
+    XCTAssertNil([[STTwitterMediaUploader alloc] initWithTwitterAPI:_twitter resumeData:resumeData]);
+    
+    NSFileHandle *fileHandle = [NSFileHandle fileHandleForWritingToURL:fileURL error:nil];
+    [fileHandle truncateFileAtOffset:3001];
+    [fileHandle closeFile];
+    [[NSFileManager defaultManager] setAttributes:@{NSFileModificationDate : resumeData[@"file_modification_date"]} ofItemAtPath:[fileURL path] error:nil];
+    XCTAssertNil([[STTwitterMediaUploader alloc] initWithTwitterAPI:_twitter resumeData:resumeData]);
+}
+
+#pragma mark Segment sizes
+
+- (void)testSegmentSizeFollowsThroughput {
+    STTwitterMediaUploader *uploader = [[STTwitterMediaUploader alloc] initWithTwitterAPI:_twitter fileURL:[self sparseFileWithLength:20 * 1024 * 1024] mediaID:@"1"];
+    
+    XCTAssertEqual([uploader nextSegmentSize], 1024 * 1024); // no measure yet
+    
+    [uploader setValue:@(100 * 1024) forKey:@"throughput"];
+    XCTAssertEqual([uploader nextSegmentSize], 400 * 1024); // 4 seconds worth
+    
+    [uploader setValue:@(10 * 1024) forKey:@"throughput"];
+    XCTAssertEqual([uploader nextSegmentSize], 256 * 1024);
+    
+    [uploader setValue:@(10 * 1024 * 1024) forKey:@"throughput"];
+    XCTAssertEqual([uploader nextSegmentSize], 5 * 1024 * 1024);
+    
+    [uploader setValue:@(20 * 1024 * 1024 - 1000) forKey:@"nextOffset"];
+    XCTAssertEqual([uploader nextSegmentSize], 1000); // the rest of the file
+}
+
+- (void)testSegmentSizeKeepsTheIndexesUnder1000 {
+    unsigned long long length = 512 * 1024 * 1024; // the API limit for videos
+    STTwitterMediaUploader *uploader = [[STTwitterMediaUploader alloc] initWithTwitterAPI:_twitter fileURL:[self sparseFileWithLength:length] mediaID:@"1"];
+    [uploader setValue:@(1024) forKey:@"throughput"]; // a slow connection asks for the smallest segments
+    
+    NSMutableArray *segments = [uploader valueForKey:@"segments"];
+    int64_t offset = 0;
+    
+    while(offset < (int64_t)length) {
+        NSUInteger size = [uploader nextSegmentSize];
+        XCTAssertGreaterThan(size, 0);
+        if(size == 0) break;
+        
+        [segments addObject:[NSNull null]]; // only the count matters
+        offset += size;
+        [uploader setValue:@(offset) forKey:@"nextOffset"];
+    }
+    
+    XCTAssertEqual(offset, (int64_t)length);
+    XCTAssertLessThanOrEqual([segments count], 1000);
+}
+
+- (void)testUploadOfTinySegmentsUsesAtMost1000Indexes {
+    NSURL *fileURL = [self fileWithLength:3000];
+    STTwitterMediaUploader *uploader = [self uploaderWithFileURL:fileURL segmentSize:1];
+    uploader.maximumSegmentSize = 3000;
+    uploader.targetSegmentDuration = 0; // the measured throughput asks for the smallest segments
+    uploader.maxConcurrentSegments = 8;
+    
+    XCTAssertNil([self runUploader:uploader timeout:60]);
+    
+    NSArray *indexes = [self receivedSegmentsColumn:0];
+    XCTAssertLessThanOrEqual([indexes count], 1000);
+    XCTAssertLessThanOrEqual([[indexes valueForKeyPath:@"@max.self"] unsignedIntegerValue], 999);
+    XCTAssertEqualObjects([self reassembledData], [NSData dataWithContentsOfURL:fileURL]);
+}
+
+@end
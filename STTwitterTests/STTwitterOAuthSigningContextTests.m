@@ -0,0 +1,211 @@
+//
+//  STTwitterOAuthSigningContextTests.m
+//  STTwitter
+//
+
+#import <XCTest/XCTest.h>
+#import <CommonCrypto/CommonHMAC.h>
+#import <pthread.h>
+#import "STTwitterOAuthSigningContext.h"
+#import "STTwitterOAuth.h"
+
+// libmalloc calls this hook on every allocation when it is set, as MallocStackLogging does
+typedef void (malloc_logger_t)(uint32_t type, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3, uintptr_t result, uint32_t num_hot_frames_to_skip);
+extern malloc_logger_t *malloc_logger;
+
+static const uint32_t kMallocLogTypeAllocate = 2; // realloc is logged as allocate | deallocate
+static volatile uint64_t mainThreadAllocations = 0;
+
+static void STCountMainThreadAllocations(uint32_t type, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3, uintptr_t result, uint32_t num_hot_frames_to_skip) {
+    if((type & kMallocLogTypeAllocate) && pthread_main_np()) mainThreadAllocations++;
+}
+
+static uint64_t STCountAllocationsOnMainThread(dispatch_block_t block) {
+    malloc_logger_t *previousLogger = malloc_logger;
+    mainThreadAllocations = 0;
+    malloc_logger = STCountMainThreadAllocations;
+    block();
+    malloc_logger = previousLogger;
+    return mainThreadAllocations;
+}
+
+@interface STTwitterOAuthSigningContextTests : XCTestCase
+@end
+
+@implementation STTwitterOAuthSigningContextTests
+
+// the straightforward RFC 2104 implementation, CommonCrypto hashes keys longer than the block itself
+- (NSString *)referenceSignatureForBaseString:(NSString *)baseString consumerSecret:(NSString *)consumerSecret tokenSecret:(NSString *)tokenSecret {
+    NSString *key = [NSString stringWithFormat:@"%@&%@", [consumerSecret st_urlEncodedString], tokenSecret ? [tokenSecret st_urlEncodedString] : @""];
+    NSData *keyData = [key dataUsingEncoding:NSUTF8StringEncoding];
+    NSData *messageData = [baseString dataUsingEncoding:NSUTF8StringEncoding];
+    
+    unsigned char digest[CC_SHA1_DIGEST_LENGTH];
+    CCHmac(kCCHmacAlgSHA1, [keyData bytes], [keyData length], [messageData bytes], [messageData length], digest);
+    return [[NSData dataWithBytes:digest length:sizeof(digest)] base64EncodedStringWithOptions:0];
+}
+
+- (NSArray *)secretPairs {
+    NSString *sixtyFour = [@"" stringByPaddingToLength:63 withString:@"k" startingAtIndex:0]; // 63 + '&'
+    NSString *long200 = [@"" stringByPaddingToLength:200 withString:@"0123456789abcdef" startingAtIndex:0];
+    
+    return @[@[@"kAcSOqF21Fu85e7zjz7ZN2U4ZRhfV3WpwPAoE3Z7kBw", @"LswwdoUaIvS8ltyTt5jkRh4J50vUPVVHtR2YPi5kE"],
+             @[@"short", @"s"],
+             @[@"", @""],
+             @[sixtyFour, @""], // key of exactly one block
+             @[sixtyFour, @"x"], // one byte over
+             @[long200, long200],
+             @[@"sécret", @"ключ-秘密-\U0001F511"], // percent encoded UTF-8, longer than a block
+             @[@"consumer secret with spaces+&=", [NSNull null]]];
+}
+
+- (NSArray *)baseStrings {
+    NSString *large = [@"" stringByPaddingToLength:100000 withString:@"POST&https%3A%2F%2Fapi.twitter.com%2F" startingAtIndex:0];
+    
+    return @[@"",
+             @"POST&https%3A%2F%2Fapi.twitter.com%2F1.1%2Fstatuses%2Fupdate.json&include_entities%3Dtrue",
+             @"GET&caf%C3%A9&été", // not produced by the library, but must hash the UTF-8 bytes
+             large];
+}
+
+#pragma mark Signatures
+
+- (void)testSignaturesMatchCommonCryptoHMAC {
+    for(NSArray *pair in [self secretPairs]) {
+        NSString *consumerSecret = pair[0];
+        NSString *tokenSecret = [pair[1] isKindOfClass:[NSString class]] ? pair[1] : nil;
+        
+        STTwitterOAuthSigningContext *context = [[STTwitterOAuthSigningContext alloc] initWithConsumerSecret:consumerSecret tokenSecret:tokenSecret];
+        
+        for(NSString *baseString in [self baseStrings]) {
+            NSString *expected = [self referenceSignatureForBaseString:baseString consumerSecret:consumerSecret tokenSecret:tokenSecret];
+            XCTAssertEqualObjects([context signatureForBaseString:baseString], expected, @"secrets %@, base string of length %lu", pair, (unsigned long)[baseString length]);
+        }
+    }
+}
+
+- (void)testTwitterDocumentedSignature {
+    NSString *baseString = @"POST&https%3A%2F%2Fapi.twitter.com%2F1%2Fstatuses%2Fupdate.json&include_entities%3Dtrue%26oauth_consumer_key%3Dxvz1evFS4wEEPTGEFPHBog%26oauth_nonce%3DkYjzVBB8Y0ZFabxSWbWovY3uYSQ2pTgmZeNu2VS4cg%26oauth_signature_method%3DHMAC-SHA1%26oauth_timestamp%3D1318622958%26oauth_token%3D370773112-GmHxMAgYyLbNEtIKZeRNFsMKPR9EyMZeS9weJAEb%26oauth_version%3D1.0%26status%3DHello%2520Ladies%2520%252B%2520Gentlemen%252C%2520a%2520signed%2520OAuth%2520request%2521";
+    
+    STTwitterOAuthSigningContext *context = [[STTwitterOAuthSigningContext alloc] initWithConsumerSecret:@"kAcSOqF21Fu85e7zjz7ZN2U4ZRhfV3WpwPAoE3Z7kBw" tokenSecret:@"LswwdoUaIvS8ltyTt5jkRh4J50vUPVVHtR2YPi5kE"];
+    XCTAssertEqualObjects([context signatureForBaseString:baseString], @"tnnArxj06cWHq44gCs1OSKk/jLY=");
+}
+
+- (void)testContextMatchesTheStringCategory {
+    NSString *baseString = [self baseStrings][1];
+    
+    for(NSArray *pair in [self secretPairs]) {
+        NSString *tokenSecret = [pair[1] isKindOfClass:[NSString class]] ? pair[1] : nil;
+        NSString *key = [NSString stringWithFormat:@"%@&%@", [pair[0] st_urlEncodedString], tokenSecret ? [tokenSecret st_urlEncodedString] : @""];
+        
+        STTwitterOAuthSigningContext *context = [[STTwitterOAuthSigningContext alloc] initWithConsumerSecret:pair[0] tokenSecret:tokenSecret];
+        XCTAssertEqualObjects([context signatureForBaseString:baseString], [baseString st_signHmacSHA1WithKey:key]);
+    }
+}
+
+- (void)testConcurrentSigningWithOneContext {
+    NSArray *pair = [self secretPairs][6];
+    STTwitterOAuthSigningContext *context = [[STTwitterOAuthSigningContext alloc] initWithConsumerSecret:pair[0] tokenSecret:pair[1]];
+    NSArray *baseStrings = [self baseStrings];
+    
+    NSMutableArray *expected = [NSMutableArray array];
+    for(NSString *baseString in baseStrings) {
+        [expected addObject:[self referenceSignatureForBaseString:baseString consumerSecret:pair[0] tokenSecret:pair[1]]];
+    }
+    
+    __block NSUInteger mismatches = 0;
+    NSObject *lock = [[NSObject alloc] init];
+    
+    dispatch_apply(400, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+        NSUInteger index = i % [baseStrings count];
+        if([[context signatureForBaseString:baseStrings[index]] isEqualToString:expected[index]]) return;
+        @synchronized(lock) {
+            mismatches++;
+        }
+    });
+    
+    XCTAssertEqual(mismatches, 0);
+}
+
+#pragma mark Nonces
+
+- (void)testNoncesAreUniqueHexStrings {
+    NSCharacterSet *nonHex = [[NSCharacterSet characterSetWithCharactersInString:@"0123456789abcdefABCDEF"] invertedSet];
+    NSMutableSet *nonces = [NSMutableSet set];
+    
+    for(NSUInteger i = 0; i < 10000; i++) {
+        NSString *nonce = [STTwitterOAuthSigningContext nonce];
+        XCTAssertEqual([nonce length], 32);
+        XCTAssertEqual([nonce rangeOfCharacterFromSet:nonHex].location, NSNotFound);
+        [nonces addObject:nonce];
+    }
+    
+    XCTAssertEqual([nonces count], 10000);
+}
+
+#pragma mark Performance
+
+- (void)testPerformanceOfSignatures {
+    STTwitterOAuthSigningContext *context = [[STTwitterOAuthSigningContext alloc] initWithConsumerSecret:@"kAcSOqF21Fu85e7zjz7ZN2U4ZRhfV3WpwPAoE3Z7kBw" tokenSecret:@"LswwdoUaIvS8ltyTt5jkRh4J50vUPVVHtR2YPi5kE"];
+    NSString *baseString = [self baseStrings][1];
+    const NSUInteger count = 100000;
+    
+    [self measureBlock:^{
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        for(NSUInteger i = 0; i < count; i++) {
+            @autoreleasepool {
+                [context signatureForBaseString:baseString];
+            }
+        }
+        NSLog(@"-- %.0f signatures/sec", count / (CFAbsoluteTimeGetCurrent() - start));
+    }];
+}
+
+- (void)testPerformanceOfHMACWithoutContext {
+    NSString *key = @"kAcSOqF21Fu85e7zjz7ZN2U4ZRhfV3WpwPAoE3Z7kBw&LswwdoUaIvS8ltyTt5jkRh4J50vUPVVHtR2YPi5kE";
+    NSString *baseString = [self baseStrings][1];
+    const NSUInteger count = 100000;
+    
+    [self measureBlock:^{
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        for(NSUInteger i = 0; i < count; i++) {
+            @autoreleasepool {
+                [baseString st_signHmacSHA1WithKey:key];
+            }
+        }
+        NSLog(@"-- %.0f signatures/sec without a signing context", count / (CFAbsoluteTimeGetCurrent() - start));
+    }];
+}
+
+- (void)testAllocationsPerSignature {
+    NSString *consumerSecret = @"kAcSOqF21Fu85e7zjz7ZN2U4ZRhfV3WpwPAoE3Z7kBw";
+    NSString *tokenSecret = @"LswwdoUaIvS8ltyTt5jkRh4J50vUPVVHtR2YPi5kE";
+    NSString *key = [NSString stringWithFormat:@"%@&%@", consumerSecret, tokenSecret];
+    NSString *baseString = [self baseStrings][1];
+    const NSUInteger count = 10000;
+    
+    STTwitterOAuthSigningContext *context = [[STTwitterOAuthSigningContext alloc] initWithConsumerSecret:consumerSecret tokenSecret:tokenSecret];
+    [context signatureForBaseString:baseString]; // warm up caches
+    
+    uint64_t contextAllocations = STCountAllocationsOnMainThread(^{
+        for(NSUInteger i = 0; i < count; i++) {
+            @autoreleasepool {
+                [context signatureForBaseString:baseString];
+            }
+        }
+    });
+    
+    uint64_t plainAllocations = STCountAllocationsOnMainThread(^{
+        for(NSUInteger i = 0; i < count; i++) {
+            @autoreleasepool {
+                [baseString st_signHmacSHA1WithKey:key];
+            }
+        }
+    });
+    
+    NSLog(@"-- %.1f allocations per signature, %.1f without a signing context", (double)contextAllocations / count, (double)plainAllocations / count);
+    
+    XCTAssertLessThanOrEqual(contextAllocations, plainAllocations);
+}
+
+@end
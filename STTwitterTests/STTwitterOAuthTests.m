@@ -0,0 +1,181 @@
+//
+//  STTwitterOAuthTests.m
+//  STTwitter
+//
+
+#import <XCTest/XCTest.h>
+#import "STTwitterOAuth.h"
+#import "STHTTPRequest.h"
+
+@interface STTwitterOAuth (Tests)
++ (NSString *)signatureBaseStringWithHTTPMethod:(NSString *)httpMethod url:(NSURL *)url allParametersUnsorted:(NSArray *)parameters;
++ (NSString *)oauthSignatureWithHTTPMethod:(NSString *)httpMethod url:(NSURL *)url parameters:(NSArray *)parameters consumerSecret:(NSString *)consumerSecret tokenSecret:(NSString *)tokenSecret;
+- (void)setTestOauthNonce:(NSString *)testOauthNonce;
+- (void)setTestOauthTimestamp:(NSString *)testOauthTimestamp;
+@end
+
+// https://dev.twitter.com/oauth/overview/creating-signatures
+static NSString * const kConsumerKey = @"xvz1evFS4wEEPTGEFPHBog";
+static NSString * const kConsumerSecret = @"kAcSOqF21Fu85e7zjz7ZN2U4ZRhfV3WpwPAoE3Z7kBw";
+static NSString * const kOAuthToken = @"370773112-GmHxMAgYyLbNEtIKZeRNFsMKPR9EyMZeS9weJAEb";
+static NSString * const kOAuthTokenSecret = @"LswwdoUaIvS8ltyTt5jkRh4J50vUPVVHtR2YPi5kE";
+static NSString * const kNonce = @"kYjzVBB8Y0ZFabxSWbWovY3uYSQ2pTgmZeNu2VS4cg";
+static NSString * const kTimestamp = @"1318622958";
+
+@interface STTwitterOAuthTests : XCTestCase
+@end
+
+@implementation STTwitterOAuthTests
+
+- (STTwitterOAuth *)documentedOAuth {
+    STTwitterOAuth *oauth = [STTwitterOAuth twitterOAuthWithConsumerName:nil
+                                                             consumerKey:kConsumerKey
+                                                          consumerSecret:kConsumerSecret
+                                                              oauthToken:kOAuthToken
+                                                        oauthTokenSecret:kOAuthTokenSecret];
+    [oauth setTestOauthNonce:kNonce];
+    [oauth setTestOauthTimestamp:kTimestamp];
+    return oauth;
+}
+
+#pragma mark Percent encoding
+
+- (void)testEscapingKeepsUnreservedCharacters {
+    NSString *s = @"ABCXYZabcxyz0189-._~";
+    XCTAssertEqualObjects([s st_stringByAddingRFC3986PercentEscapesUsingEncoding:NSUTF8StringEncoding], s);
+    XCTAssertEqualObjects([@"" st_stringByAddingRFC3986PercentEscapesUsingEncoding:NSUTF8StringEncoding], @"");
+}
+
+- (void)testEscapingOfReservedCharacters {
+    NSString *s = @"!*'();:@&=+$,/?#[] %";
+    XCTAssertEqualObjects([s st_stringByAddingRFC3986PercentEscapesUsingEncoding:NSUTF8StringEncoding], @"%21%2A%27%28%29%3B%3A%40%26%3D%2B%24%2C%2F%3F%23%5B%5D%20%25");
+}
+
+- (void)testEscapingOfNonASCIICharacters {
+    NSString *s = @"café ☕ \U0001F600";
+    XCTAssertEqualObjects([s st_stringByAddingRFC3986PercentEscapesUsingEncoding:NSUTF8StringEncoding], @"caf%C3%A9%20%E2%98%95%20%F0%9F%98%80");
+}
+
+- (void)testEscapingHonoursTheEncoding {
+    XCTAssertEqualObjects([@"café ok" st_stringByAddingRFC3986PercentEscapesUsingEncoding:NSISOLatin1StringEncoding], @"caf%E9%20ok");
+    XCTAssertEqualObjects([@"plain" st_stringByAddingRFC3986PercentEscapesUsingEncoding:NSISOLatin1StringEncoding], @"plain");
+    XCTAssertNil([@"☕" st_stringByAddingRFC3986PercentEscapesUsingEncoding:NSISOLatin1StringEncoding]);
+}
+
+- (void)testEscapingIntoDataMatchesStrings {
+    for(NSString *s in @[@"", @"plain", @"!*'();:@&=+$,/?#[] %", @"café ☕ \U0001F600"]) {
+        NSMutableData *data = [NSMutableData dataWithBytes:"x" length:1];
+        [s st_appendRFC3986PercentEscapedUTF8BytesToData:data];
+        
+        NSString *expected = [@"x" stringByAppendingString:[s st_stringByAddingRFC3986PercentEscapesUsingEncoding:NSUTF8StringEncoding]];
+        XCTAssertEqualObjects([[NSString alloc] initWithData:data encoding:NSASCIIStringEncoding], expected);
+    }
+}
+
+#pragma mark Base strings and signatures
+
+- (void)testTwitterDocumentedExample {
+    NSArray *parameters = @[@{@"status" : @"Hello Ladies + Gentlemen, a signed OAuth request!"},
+                            @{@"include_entities" : @"true"},
+                            @{@"oauth_consumer_key" : kConsumerKey},
+                            @{@"oauth_nonce" : kNonce},
+                            @{@"oauth_signature_method" : @"HMAC-SHA1"},
+                            @{@"oauth_timestamp" : kTimestamp},
+                            @{@"oauth_token" : kOAuthToken},
+                            @{@"oauth_version" : @"1.0"}];
+    
+    NSURL *url = [NSURL URLWithString:@"https://api.twitter.com/1/statuses/update.json"];
+    
+    NSString *baseString = [STTwitterOAuth signatureBaseStringWithHTTPMethod:@"POST" url:url allParametersUnsorted:parameters];
+    XCTAssertEqualObjects(baseString, @"POST&https%3A%2F%2Fapi.twitter.com%2F1%2Fstatuses%2Fupdate.json&include_entities%3Dtrue%26oauth_consumer_key%3Dxvz1evFS4wEEPTGEFPHBog%26oauth_nonce%3DkYjzVBB8Y0ZFabxSWbWovY3uYSQ2pTgmZeNu2VS4cg%26oauth_signature_method%3DHMAC-SHA1%26oauth_timestamp%3D1318622958%26oauth_token%3D370773112-GmHxMAgYyLbNEtIKZeRNFsMKPR9EyMZeS9weJAEb%26oauth_version%3D1.0%26status%3DHello%2520Ladies%2520%252B%2520Gentlemen%252C%2520a%2520signed%2520OAuth%2520request%2521");
+    
+    NSString *signature = [STTwitterOAuth oauthSignatureWithHTTPMethod:@"POST" url:url parameters:parameters consumerSecret:kConsumerSecret tokenSecret:kOAuthTokenSecret];
+    XCTAssertEqualObjects(signature, @"tnnArxj06cWHq44gCs1OSKk/jLY=");
+}
+
+- (void)testNonASCIIValuesAndSecrets {
+    NSArray *parameters = @[@{@"text" : @"Café ☕ \U0001F600 日本"},
+                            @{@"screen_name" : @"jürgen"}];
+    
+    NSURL *url = [NSURL URLWithString:@"https://api.twitter.com/1.1/direct_messages/new.json"];
+    
+    NSString *baseString = [STTwitterOAuth signatureBaseStringWithHTTPMethod:@"POST" url:url allParametersUnsorted:parameters];
+    XCTAssertEqualObjects(baseString, @"POST&https%3A%2F%2Fapi.twitter.com%2F1.1%2Fdirect_messages%2Fnew.json&screen_name%3Dj%25C3%25BCrgen%26text%3DCaf%25C3%25A9%2520%25E2%2598%2595%2520%25F0%259F%2598%2580%2520%25E6%2597%25A5%25E6%259C%25AC");
+    
+    NSString *signature = [STTwitterOAuth oauthSignatureWithHTTPMethod:@"POST" url:url parameters:parameters consumerSecret:@"cönsumer-sécret" tokenSecret:@"tøken&secret"];
+    XCTAssertEqualObjects(signature, @"58LWZCHncL8QM0aMQtexGPD9mJU=");
+}
+
+- (void)testReservedCharactersInKeysAndValues {
+    NSArray *parameters = @[@{@"status" : @"!*'();:@&=+$,/?#[] %~-._"},
+                            @{@"k&=ey" : @"v"}];
+    
+    NSURL *url = [NSURL URLWithString:@"https://api.twitter.com/1.1/statuses/update.json"];
+    
+    NSString *baseString = [STTwitterOAuth signatureBaseStringWithHTTPMethod:@"POST" url:url allParametersUnsorted:parameters];
+    XCTAssertEqualObjects(baseString, @"POST&https%3A%2F%2Fapi.twitter.com%2F1.1%2Fstatuses%2Fupdate.json&k%2526%253Dey%3Dv%26status%3D%2521%252A%2527%2528%2529%253B%253A%2540%2526%253D%252B%2524%252C%252F%253F%2523%255B%255D%2520%2525~-._");
+    
+    // no token secret, the key ends with '&'
+    NSString *signature = [STTwitterOAuth oauthSignatureWithHTTPMethod:@"POST" url:url parameters:parameters consumerSecret:kConsumerSecret tokenSecret:nil];
+    XCTAssertEqualObjects(signature, @"2MndMtQPO6QaKCp78XeFPPWbXUA=");
+}
+
+- (void)testRepeatedKeysAreSortedByValue {
+    NSArray *parameters = @[@{@"a" : @"2"}, @{@"b" : @"x"}, @{@"a" : @"1"}, @{@"A" : @"z"}, @{@"a" : @"10"}];
+    
+    NSURL *url = [NSURL URLWithString:@"https://api.twitter.com/1.1/friends/ids.json"];
+    
+    NSString *baseString = [STTwitterOAuth signatureBaseStringWithHTTPMethod:@"get" url:url allParametersUnsorted:parameters];
+    XCTAssertEqualObjects(baseString, @"GET&https%3A%2F%2Fapi.twitter.com%2F1.1%2Ffriends%2Fids.json&A%3Dz%26a%3D1%26a%3D10%26a%3D2%26b%3Dx");
+}
+
+- (void)testSignedRequestWithQueryInURL {
+    // the query is left out of the base string URL, its decoded parameters are signed with the others
+    STHTTPRequest *r = [STHTTPRequest requestWithURLString:@"https://api.twitter.com/1.1/statuses/user_timeline.json?screen_name=twitterapi&q=caf%C3%A9%20bar&count=2"];
+    r.HTTPMethod = @"GET";
+    
+    [[self documentedOAuth] signRequest:r isMediaUpload:NO oauthCallback:nil];
+    
+    NSString *authorization = r.requestHeaders[@"Authorization"];
+    XCTAssertTrue([authorization hasPrefix:@"OAuth "]);
+    XCTAssertTrue([authorization rangeOfString:@"oauth_nonce=\"kYjzVBB8Y0ZFabxSWbWovY3uYSQ2pTgmZeNu2VS4cg\""].location != NSNotFound);
+    XCTAssertTrue([authorization rangeOfString:@"oauth_signature=\"gJzlbAypz9%2FWqKbtHhK9gcx%2FuWI%3D\""].location != NSNotFound, @"%@", authorization);
+}
+
+#pragma mark Direct messages
+
+// about length bytes once UTF-8 encoded, with characters to escape
+- (NSString *)directMessageTextWithLength:(NSUInteger)length {
+    NSMutableString *ms = [NSMutableString string];
+    while([ms lengthOfBytesUsingEncoding:NSUTF8StringEncoding] < length) {
+        [ms appendString:@"Meet at the café at 5:30? ☕ 50% off & free wifi! "];
+    }
+    return ms;
+}
+
+// what fetchResource does for a POST: encode and sort the parameters once, sign, build the body
+- (void)measureSigningDirectMessagesWithTextLength:(NSUInteger)length {
+    
+    STTwitterOAuth *oauth = [self documentedOAuth];
+    NSString *text = [self directMessageTextWithLength:length];
+    
+    [self measureBlock:^{
+        for(NSUInteger i = 0; i < 1000; i++) {
+            STHTTPRequest *r = [STHTTPRequest requestWithURLString:@"https://api.twitter.com/1.1/direct_messages/new.json"];
+            r.HTTPMethod = @"POST";
+            r.POSTParameters = [STHTTPRequestParameters parametersWithDictionary:@{@"screen_name" : @"twitterapi", @"text" : text}];
+            [oauth signRequest:r isMediaUpload:NO oauthCallback:nil];
+            [r prepareURLRequest];
+        }
+    }];
+}
+
+- (void)testPerformanceOfSigning1KBDirectMessages {
+    [self measureSigningDirectMessagesWithTextLength:1024];
+}
+
+- (void)testPerformanceOfSigning10KBDirectMessages {
+    [self measureSigningDirectMessagesWithTextLength:10 * 1024];
+}
+
+@end
@@ -0,0 +1,192 @@
+//
+//  STTwitterStreamParserTests.m
+//  STTwitter
+//
+
+#import <XCTest/XCTest.h>
+#import "STTwitterStreamParser.h"
+#import "STTwitterStreamRecorder.h"
+
+static NSUInteger const kFixtureTweetsCount = 842;
+static NSUInteger const kFixtureDeletesCount = 91;
+static NSUInteger const kFixtureLimitsCount = 36;
+static NSUInteger const kBenchmarkRepetitions = 20; // about 40 MB per measure
+
+@interface STTwitterStreamParserTests : XCTestCase
+@property (nonatomic, strong) NSURL *fixtureURL;
+@property (nonatomic, strong) NSArray *chunks; // NSData, as received by the recording connection
+@property (nonatomic) uint64_t bytesCount;
+@end
+
+@implementation STTwitterStreamParserTests
+
+- (void)setUp {
+    [super setUp];
+    
+    // 2 MB of length delimited sample stream: tweets, retweets, deletes, limits and keep-alives in many languages,
+    // in 351 chunks of random sizes, 3 of which start inside a multi-byte UTF-8 character
+    self.fixtureURL = [[NSBundle bundleForClass:[self class]] URLForResource:@"SampleStream" withExtension:@"capture"];
+    NSData *capture = [NSData dataWithContentsOfURL:_fixtureURL];
+    XCTAssertNotNil(capture);
+    
+    // see STTwitterStreamRecorder.h for the record format
+    NSMutableArray *chunks = [NSMutableArray array];
+    const uint8_t *bytes = [capture bytes];
+    NSUInteger offset = 0;
+    self.bytesCount = 0;
+    
+    while(offset + 12 <= [capture length]) {
+        uint32_t length;
+        memcpy(&length, bytes + offset + 8, sizeof(length));
+        length = CFSwapInt32LittleToHost(length);
+        offset += 12;
+        
+        [chunks addObject:[capture subdataWithRange:NSMakeRange(offset, length)]];
+        offset += length;
+        self.bytesCount += length;
+    }
+    
+    self.chunks = chunks;
+}
+
+#pragma mark Helpers
+
+- (NSArray *)parsedIDsOfChunks:(NSArray *)chunks countsByType:(NSCountedSet *)countsByType {
+    STTwitterStreamParser *parser = [[STTwitterStreamParser alloc] initWithDecodingConcurrency:1];
+    NSMutableArray *ids = [NSMutableArray array];
+    
+    for(NSData *chunk in chunks) {
+        [parser parseWithStreamData:chunk parsedJSONBlock:^(NSDictionary *json, STTwitterStreamJSONType type) {
+            [countsByType addObject:@(type)];
+            if(type == STTwitterStreamJSONTypeTweet) [ids addObject:json[@"id_str"]];
+            if(type == STTwitterStreamJSONTypeDelete) [ids addObject:[json valueForKeyPath:@"delete.status.id_str"]];
+        }];
+    }
+    
+    return ids;
+}
+
+- (NSData *)concatenatedChunks {
+    NSMutableData *data = [NSMutableData dataWithCapacity:(NSUInteger)_bytesCount];
+    for(NSData *chunk in _chunks) [data appendData:chunk];
+    return data;
+}
+
+- (void)logThroughputOfBytesCount:(uint64_t)bytesCount elapsed:(NSTimeInterval)elapsed label:(NSString *)label {
+    NSLog(@"-- %@: %.1f MB/s", label, bytesCount / (1024.0 * 1024.0) / elapsed);
+}
+
+#pragma mark Framing
+
+- (void)testFixtureFramesEveryMessage {
+    NSCountedSet *countsByType = [NSCountedSet set];
+    NSArray *ids = [self parsedIDsOfChunks:_chunks countsByType:countsByType];
+    
+    XCTAssertEqual([countsByType countForObject:@(STTwitterStreamJSONTypeTweet)], kFixtureTweetsCount);
+    XCTAssertEqual([countsByType countForObject:@(STTwitterStreamJSONTypeDelete)], kFixtureDeletesCount);
+    XCTAssertEqual([countsByType countForObject:@(STTwitterStreamJSONTypeLimit)], kFixtureLimitsCount);
+    XCTAssertEqual([countsByType count], 3);
+    XCTAssertEqual([ids count], kFixtureTweetsCount + kFixtureDeletesCount);
+}
+
+- (void)testFramingDoesNotDependOnChunkBoundaries {
+    NSArray *expected = [self parsedIDsOfChunks:_chunks countsByType:[NSCountedSet set]];
+    
+    NSData *stream = [self concatenatedChunks];
+    XCTAssertEqualObjects([self parsedIDsOfChunks:@[stream] countsByType:[NSCountedSet set]], expected);
+    
+    // one byte at a time over the first 256 KB, every boundary falls inside a length prefix or a character somewhere
+    NSUInteger prefixLength = MIN([stream length], 256 * 1024);
+    NSMutableArray *bytes = [NSMutableArray arrayWithCapacity:prefixLength];
+    for(NSUInteger i = 0; i < prefixLength; i++) {
+        [bytes addObject:[stream subdataWithRange:NSMakeRange(i, 1)]];
+    }
+    NSArray *prefixIDs = [self parsedIDsOfChunks:bytes countsByType:[NSCountedSet set]];
+    
+    XCTAssertGreaterThan([prefixIDs count], 0);
+    XCTAssertEqualObjects(prefixIDs, [expected subarrayWithRange:NSMakeRange(0, MIN([prefixIDs count], [expected count]))]);
+}
+
+- (void)testReplayOfTheFixtureWithConcurrentDecoding {
+    NSError *error = nil;
+    STTwitterStreamReplayer *replayer = [[STTwitterStreamReplayer alloc] initWithFileURL:_fixtureURL error:&error];
+    XCTAssertNotNil(replayer, @"%@", error);
+    
+    STTwitterStreamParser *parser = [[STTwitterStreamParser alloc] initWithDecodingConcurrency:[[NSProcessInfo processInfo] activeProcessorCount]];
+    NSMutableArray *ids = [NSMutableArray array];
+    
+    XCTestExpectation *expectation = [self expectationWithDescription:@"replay"];
+    
+    [replayer replayIntoParser:parser speed:0 parsedJSONBlock:^(NSDictionary *json, STTwitterStreamJSONType type) {
+        if(type == STTwitterStreamJSONTypeTweet) [ids addObject:json[@"id_str"]];
+        if(type == STTwitterStreamJSONTypeDelete) [ids addObject:[json valueForKeyPath:@"delete.status.id_str"]];
+    } completionBlock:^(uint64_t bytesCount, NSUInteger messagesCount, NSTimeInterval elapsed) {
+        XCTAssertEqual(bytesCount, self.bytesCount);
+        XCTAssertEqual(messagesCount, kFixtureTweetsCount + kFixtureDeletesCount + kFixtureLimitsCount);
+        [expectation fulfill];
+    }];
+    
+    [self waitForExpectationsWithTimeout:30 handler:nil];
+    
+    // delivered in arrival order
+    XCTAssertEqualObjects(ids, [self parsedIDsOfChunks:_chunks countsByType:[NSCountedSet set]]);
+}
+
+#pragma mark Performance
+
+// framing and classification only, the messages are dropped before being decoded
+- (void)testPerformanceOfFraming {
+    [self measureBlock:^{
+        STTwitterStreamParser *parser = [[STTwitterStreamParser alloc] initWithDecodingConcurrency:1];
+        parser.acceptedTypes = STTwitterStreamJSONTypeMaskControl; // none in the fixture
+        
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        for(NSUInteger i = 0; i < kBenchmarkRepetitions; i++) {
+            for(NSData *chunk in self.chunks) {
+                [parser parseWithStreamData:chunk parsedJSONBlock:^(NSDictionary *json, STTwitterStreamJSONType type) {}];
+            }
+        }
+        [self logThroughputOfBytesCount:self.bytesCount * kBenchmarkRepetitions elapsed:CFAbsoluteTimeGetCurrent() - start label:@"framing"];
+    }];
+}
+
+- (void)testPerformanceOfFramingAndDecoding {
+    [self measureBlock:^{
+        STTwitterStreamParser *parser = [[STTwitterStreamParser alloc] initWithDecodingConcurrency:1];
+        
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        for(NSUInteger i = 0; i < kBenchmarkRepetitions; i++) {
+            @autoreleasepool {
+                for(NSData *chunk in self.chunks) {
+                    [parser parseWithStreamData:chunk parsedJSONBlock:^(NSDictionary *json, STTwitterStreamJSONType type) {}];
+                }
+            }
+        }
+        [self logThroughputOfBytesCount:self.bytesCount * kBenchmarkRepetitions elapsed:CFAbsoluteTimeGetCurrent() - start label:@"framing and decoding"];
+    }];
+}
+
+- (void)testPerformanceOfConcurrentDecoding {
+    NSError *error = nil;
+    STTwitterStreamReplayer *replayer = [[STTwitterStreamReplayer alloc] initWithFileURL:_fixtureURL error:&error];
+    XCTAssertNotNil(replayer, @"%@", error);
+    
+    NSUInteger concurrency = [[NSProcessInfo processInfo] activeProcessorCount];
+    
+    [self measureBlock:^{
+        STTwitterStreamParser *parser = [[STTwitterStreamParser alloc] initWithDecodingConcurrency:concurrency];
+        
+        XCTestExpectation *expectation = [self expectationWithDescription:@"replay"];
+        
+        [replayer replayIntoParser:parser speed:0 parsedJSONBlock:^(NSDictionary *json, STTwitterStreamJSONType type) {
+        } completionBlock:^(uint64_t bytesCount, NSUInteger messagesCount, NSTimeInterval elapsed) {
+            NSString *label = [NSString stringWithFormat:@"framing and decoding on %lu workers", (unsigned long)concurrency];
+            [self logThroughputOfBytesCount:bytesCount elapsed:elapsed label:label];
+            [expectation fulfill];
+        }];
+        
+        [self waitForExpectationsWithTimeout:30 handler:nil];
+    }];
+}
+
+@end
@@ -0,0 +1,286 @@
+//
+//  STTwitterStreamSessionTests.m
+//  STTwitter
+//
+
+#import <XCTest/XCTest.h>
+#import "STTwitterStreamSession.h"
+#import "STTwitterStreamRecorder.h"
+#import "STTwitterAPI.h"
+#import "STTwitterTestServer.h"
+
+@interface STTwitterStreamSessionTests : XCTestCase
+@property (nonatomic, strong) STTwitterAPI *twitter;
+@property (nonatomic, strong) STTwitterStreamReplayer *replayer;
+@property (nonatomic, strong) STTwitterTestServer *server;
+@property (nonatomic, strong) NSMutableArray *connectionTimes; // NSNumber, uptime of each connectBlock call
+@property (nonatomic, strong) NSMutableArray *tweetIDs; // as delivered to the subscriber
+@property (nonatomic, strong) NSError *subscriptionError;
+@property (nonatomic, strong) NSMutableArray *temporaryFileURLs;
+@end
+
+@implementation STTwitterStreamSessionTests
+
+- (void)setUp {
+    [super setUp];
+    
+    self.twitter = [STTwitterAPI twitterAPIWithOAuthConsumerKey:@"consumer key" consumerSecret:@"consumer secret" oauthToken:@"token" oauthTokenSecret:@"token secret"];
+    self.connectionTimes = [NSMutableArray array];
+    self.tweetIDs = [NSMutableArray array];
+    self.temporaryFileURLs = [NSMutableArray array];
+}
+
+- (void)tearDown {
+    [_replayer stopServing];
+    [_server stop];
+    
+    for(NSURL *url in _temporaryFileURLs) {
+        [[NSFileManager defaultManager] removeItemAtURL:url error:nil];
+    }
+    
+    [super tearDown];
+}
+
+#pragma mark Helpers
+
+// capture records are [delay in seconds, message], see STTwitterStreamRecorder.h
+// messages are length delimited as the streams requested by STTwitterAPI, empty ones are keep-alives
+- (STTwitterStreamReplayer *)replayerWithRecords:(NSArray *)records {
+    
+    NSMutableData *capture = [NSMutableData data];
+    
+    for(NSArray *record in records) {
+        uint64_t microseconds = CFSwapInt64HostToLittle((uint64_t)([record[0] doubleValue] * USEC_PER_SEC));
+        NSData *message = [[record[1] stringByAppendingString:@"\r\n"] dataUsingEncoding:NSUTF8StringEncoding];
+        NSMutableData *chunk = [NSMutableData data];
+        if([message length] > 2) [chunk appendData:[[NSString stringWithFormat:@"%lu\r\n", (unsigned long)[message length]] dataUsingEncoding:NSASCIIStringEncoding]];
+        [chunk appendData:message];
+        uint32_t length = CFSwapInt32HostToLittle((uint32_t)[chunk length]);
+        
+        [capture appendBytes:&microseconds length:sizeof(microseconds)];
+        [capture appendBytes:&length length:sizeof(length)];
+        [capture appendData:chunk];
+    }
+    
+    NSURL *url = [NSURL fileURLWithPath:[NSTemporaryDirectory() stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]]];
+    [_temporaryFileURLs addObject:url];
+    [capture writeToURL:url atomically:NO];
+    
+    NSError *error = nil;
+    STTwitterStreamReplayer *replayer = [[STTwitterStreamReplayer alloc] initWithFileURL:url error:&error];
+    XCTAssertNotNil(replayer, @"%@", error);
+    return replayer;
+}
+
+- (NSString *)tweetWithID:(NSString *)tweetID {
+    return [NSString stringWithFormat:@"{\"id_str\":\"%@\",\"text\":\"tweet %@\",\"user\":{\"id_str\":\"12\"}}", tweetID, tweetID];
+}
+
+// wired as STTwitterAPI wires its stream sessions, with every connection recorded
+- (STTwitterStreamSession *)sessionStreamingFromBaseURLString:(NSString *)baseURLString {
+    
+    STTwitterStreamSession *session = [[STTwitterStreamSession alloc] initWithKey:@"test" decodingConcurrency:1];
+    
+    __weak typeof(self) weakSelf = self;
+    STTwitterAPI *twitter = _twitter;
+    
+    session.connectBlock = ^NSObject<STTwitterRequestProtocol> *(STTwitterStreamSession *s) {
+        
+        [weakSelf.connectionTimes addObject:@([[NSProcessInfo processInfo] systemUptime])];
+        
+        __weak STTwitterStreamSession *weakSession = s;
+        
+        return [twitter fetchResource:@"statuses/sample.json"
+                           HTTPMethod:@"GET"
+                        baseURLString:baseURLString
+                           parameters:@{@"stall_warnings" : @"true"}
+                  uploadProgressBlock:nil
+                downloadProgressBlock:^(NSObject<STTwitterRequestProtocol> *request, NSData *data) {
+                    [weakSession request:request didReceiveData:data];
+                } successBlock:^(NSObject<STTwitterRequestProtocol> *request, NSDictionary *requestHeaders, NSDictionary *responseHeaders, id response) {
+                    NSError *error = [NSError errorWithDomain:NSStringFromClass([STTwitterAPI class]) code:STTwitterAPIEmptyStream userInfo:@{NSLocalizedDescriptionKey : @"stream ended"}];
+                    [weakSession request:request didFailWithError:error];
+                } errorBlock:^(NSObject<STTwitterRequestProtocol> *request, NSDictionary *requestHeaders, NSDictionary *responseHeaders, NSError *error) {
+                    [weakSession request:request didFailWithError:error];
+                }];
+    };
+    
+    [session subscribeWithAcceptedTypes:STTwitterStreamJSONTypeMaskTweet progressBlock:^(NSDictionary *json, STTwitterStreamJSONType type) {
+        [weakSelf.tweetIDs addObject:json[@"id_str"]];
+    } errorBlock:^(NSError *error) {
+        weakSelf.subscriptionError = error;
+    }];
+    
+    return session;
+}
+
+- (NSString *)servingBaseURLStringOfReplayer:(STTwitterStreamReplayer *)replayer {
+    return [NSString stringWithFormat:@"http://127.0.0.1:%u/1.1", replayer.servingPort];
+}
+
+// spins the main run loop, the session supervises its connection there
+- (BOOL)waitForCondition:(BOOL(^)(void))condition timeout:(NSTimeInterval)timeout {
+    NSDate *limit = [NSDate dateWithTimeIntervalSinceNow:timeout];
+    while(condition() == NO) {
+        if([limit timeIntervalSinceNow] < 0) return NO;
+        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.01]];
+    }
+    return YES;
+}
+
+- (NSArray *)connectionIntervals {
+    NSMutableArray *ma = [NSMutableArray array];
+    for(NSUInteger i = 1; i < [_connectionTimes count]; i++) {
+        [ma addObject:@([_connectionTimes[i] doubleValue] - [_connectionTimes[i-1] doubleValue])];
+    }
+    return ma;
+}
+
+#pragma mark Reconnections
+
+- (void)testClosedStreamsReconnectWithoutDuplicates {
+    self.replayer = [self replayerWithRecords:@[@[@0, [self tweetWithID:@"1"]],
+                                                @[@0, [self tweetWithID:@"2"]],
+                                                @[@0, [self tweetWithID:@"3"]]]];
+    
+    NSError *error = nil;
+    XCTAssertTrue([_replayer startServingOnPort:0 speed:0 error:&error], @"%@", error);
+    
+    STTwitterStreamSession *session = [self sessionStreamingFromBaseURLString:[self servingBaseURLStringOfReplayer:_replayer]];
+    [session connect];
+    
+    XCTAssertTrue([self waitForCondition:^BOOL{ return [self.connectionTimes count] >= 4; } timeout:10]);
+    [session disconnect];
+    
+    XCTAssertEqual(session.reconnectionsCount, 3);
+    XCTAssertEqualObjects(_tweetIDs, (@[@"1", @"2", @"3"]));
+    XCTAssertEqual(session.duplicatesCount, 6); // the tweets of the second and third connections
+    XCTAssertEqualObjects([session.lastError domain], NSStringFromClass([STTwitterAPI class]));
+    
+    // data was received each time, the backoff starts over at its first step
+    for(NSNumber *interval in [self connectionIntervals]) {
+        XCTAssertGreaterThanOrEqual([interval doubleValue], 0.2);
+        XCTAssertLessThan([interval doubleValue], 1.0);
+    }
+}
+
+- (void)testNetworkErrorsBackOffLinearly {
+    // a port nobody listens on
+    self.replayer = [self replayerWithRecords:@[@[@0, [self tweetWithID:@"1"]]]];
+    XCTAssertTrue([_replayer startServingOnPort:0 speed:0 error:nil]);
+    NSString *baseURLString = [self servingBaseURLStringOfReplayer:_replayer];
+    [_replayer stopServing];
+    
+    STTwitterStreamSession *session = [self sessionStreamingFromBaseURLString:baseURLString];
+    [session connect];
+    
+    XCTAssertTrue([self waitForCondition:^BOOL{ return [self.connectionTimes count] >= 5; } timeout:10]);
+    [session disconnect];
+    
+    XCTAssertEqualObjects([session.lastError domain], NSURLErrorDomain);
+    XCTAssertNil(_subscriptionError);
+    
+    // 250 ms, 500 ms, 750 ms, 1 s
+    NSArray *intervals = [self connectionIntervals];
+    for(NSUInteger i = 0; i < 4; i++) {
+        double expected = 0.25 * (i + 1);
+        XCTAssertGreaterThanOrEqual([intervals[i] doubleValue], expected - 0.05, @"reconnection %lu", (unsigned long)i + 1);
+        XCTAssertLessThan([intervals[i] doubleValue], expected + 0.5, @"reconnection %lu", (unsigned long)i + 1);
+    }
+}
+
+- (void)testServerErrorsBackOffExponentially {
+    self.server = [[STTwitterTestServer alloc] initWithHandler:^STTwitterTestResponse *(STTwitterTestRequest *request) {
+        return [STTwitterTestResponse responseWithStatusCode:503 JSONObject:nil];
+    }];
+    XCTAssertTrue([_server startWithError:nil]);
+    
+    STTwitterStreamSession *session = [self sessionStreamingFromBaseURLString:_server.baseURLString];
+    [session connect];
+    
+    XCTAssertTrue([self waitForCondition:^BOOL{ return [self.connectionTimes count] >= 2; } timeout:10]);
+    [session disconnect];
+    
+    XCTAssertEqual([session.lastError code], 503);
+    XCTAssertGreaterThanOrEqual([[self connectionIntervals][0] doubleValue], 4.95); // 5 s, then 10 s, 20 s...
+    XCTAssertNil(_subscriptionError);
+}
+
+- (void)testUnauthorizedEndsTheSession {
+    self.server = [[STTwitterTestServer alloc] initWithHandler:^STTwitterTestResponse *(STTwitterTestRequest *request) {
+        return [STTwitterTestResponse responseWithStatusCode:401 JSONObject:nil];
+    }];
+    XCTAssertTrue([_server startWithError:nil]);
+    
+    STTwitterStreamSession *session = [self sessionStreamingFromBaseURLString:_server.baseURLString];
+    [session connect];
+    
+    XCTAssertTrue([self waitForCondition:^BOOL{ return self.subscriptionError != nil; } timeout:10]);
+    
+    XCTAssertEqual([_subscriptionError code], 401);
+    XCTAssertEqual([_connectionTimes count], 1);
+    XCTAssertEqual(session.subscribersCount, 0);
+}
+
+- (void)testRevokedTokenDisconnectEndsTheSession {
+    self.replayer = [self replayerWithRecords:@[@[@0, [self tweetWithID:@"1"]],
+                                                @[@0, @"{\"disconnect\":{\"code\":6,\"stream_name\":\"sample\",\"reason\":\"token revoked\"}}"]]];
+    XCTAssertTrue([_replayer startServingOnPort:0 speed:0 error:nil]);
+    
+    STTwitterStreamSession *session = [self sessionStreamingFromBaseURLString:[self servingBaseURLStringOfReplayer:_replayer]];
+    [session connect];
+    
+    XCTAssertTrue([self waitForCondition:^BOOL{ return self.subscriptionError != nil; } timeout:10]);
+    
+    XCTAssertEqualObjects(_tweetIDs, @[@"1"]);
+    XCTAssertEqual([_connectionTimes count], 1);
+    XCTAssertEqual(session.reconnectionsCount, 0);
+}
+
+#pragma mark Stalls
+
+- (void)testStallsAreDetectedAndReconnected {
+    // the second message comes after the stall timeout, the connection stays open meanwhile
+    self.replayer = [self replayerWithRecords:@[@[@0, [self tweetWithID:@"1"]],
+                                                @[@10, [self tweetWithID:@"2"]]]];
+    XCTAssertTrue([_replayer startServingOnPort:0 speed:1 error:nil]);
+    
+    STTwitterStreamSession *session = [self sessionStreamingFromBaseURLString:[self servingBaseURLStringOfReplayer:_replayer]];
+    session.stallTimeout = 2; // checked every second
+    [session connect];
+    
+    XCTAssertTrue([self waitForCondition:^BOOL{ return [self.connectionTimes count] >= 2; } timeout:8]);
+    [session disconnect];
+    
+    XCTAssertEqual(session.stallsCount, 1);
+    XCTAssertTrue([[session.lastError localizedDescription] hasPrefix:@"stream stalled"]);
+    XCTAssertEqualObjects(_tweetIDs, @[@"1"]);
+    
+    // detected between 2 and 3 seconds of silence, then the first network backoff step
+    double interval = [[self connectionIntervals][0] doubleValue];
+    XCTAssertGreaterThanOrEqual(interval, 2.2);
+    XCTAssertLessThan(interval, 4.0);
+}
+
+- (void)testKeepAlivesPreventStalls {
+    // keep-alives are empty lines, sent more often than the stall timeout
+    NSMutableArray *records = [NSMutableArray arrayWithObject:@[@0, [self tweetWithID:@"1"]]];
+    for(NSUInteger i = 1; i <= 8; i++) {
+        [records addObject:@[@(i * 0.5), @""]];
+    }
+    self.replayer = [self replayerWithRecords:records];
+    XCTAssertTrue([_replayer startServingOnPort:0 speed:1 error:nil]);
+    
+    STTwitterStreamSession *session = [self sessionStreamingFromBaseURLString:[self servingBaseURLStringOfReplayer:_replayer]];
+    session.stallTimeout = 2;
+    [session connect];
+    
+    // the replay lasts 4 seconds, then the server closes the stream
+    XCTAssertTrue([self waitForCondition:^BOOL{ return [self.connectionTimes count] >= 2; } timeout:8]);
+    [session disconnect];
+    
+    XCTAssertEqual(session.stallsCount, 0);
+    XCTAssertGreaterThanOrEqual([[self connectionIntervals][0] doubleValue], 3.9);
+}
+
+@end
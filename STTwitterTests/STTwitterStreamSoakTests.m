@@ -0,0 +1,138 @@
+//
+//  STTwitterStreamSoakTests.m
+//  STTwitter
+//
+
+#import <XCTest/XCTest.h>
+#import <mach/mach.h>
+#import "STHTTPRequest.h"
+#import "STTwitterStreamParser.h"
+#import "STTwitterStreamRecorder.h"
+
+static NSUInteger const kSoakChunksCount = 2000;
+static NSUInteger const kSoakMessagesPerChunk = 1000; // 2 million messages, about 170 MB
+static NSTimeInterval const kSoakDuration = 30; // as recorded, so that the parser keeps up with the replay
+static uint64_t const kSoakMaxResidentGrowth = 32 * 1024 * 1024;
+
+// the physical footprint is the resident memory without clean file pages, the replayer maps the capture file in this process
+static uint64_t STResidentMemorySize(void) {
+    task_vm_info_data_t info;
+    mach_msg_type_number_t count = TASK_VM_INFO_COUNT;
+    if(task_info(mach_task_self(), TASK_VM_INFO, (task_info_t)&info, &count) != KERN_SUCCESS) return 0;
+    return info.phys_footprint;
+}
+
+@interface STTwitterStreamSoakTests : XCTestCase
+@property (nonatomic, strong) NSURL *captureURL;
+@property (nonatomic, strong) STTwitterStreamReplayer *replayer;
+@end
+
+@implementation STTwitterStreamSoakTests
+
+- (void)setUp {
+    [super setUp];
+    
+    // the same chunk of length delimited tweets over and over, see STTwitterStreamRecorder.h for the record format
+    NSMutableData *chunk = [NSMutableData data];
+    for(NSUInteger i = 0; i < kSoakMessagesPerChunk; i++) {
+        NSString *json = [NSString stringWithFormat:@"{\"id_str\":\"%lu\",\"text\":\"soak test, café ☕\",\"user\":{\"id_str\":\"12\"}}\r\n", (unsigned long)(240558470661799936 + i)];
+        NSData *message = [json dataUsingEncoding:NSUTF8StringEncoding];
+        [chunk appendData:[[NSString stringWithFormat:@"%lu\r\n", (unsigned long)[message length]] dataUsingEncoding:NSASCIIStringEncoding]];
+        [chunk appendData:message];
+    }
+    
+    self.captureURL = [NSURL fileURLWithPath:[NSTemporaryDirectory() stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]]];
+    [[NSFileManager defaultManager] createFileAtPath:[_captureURL path] contents:nil attributes:nil];
+    NSFileHandle *fileHandle = [NSFileHandle fileHandleForWritingToURL:_captureURL error:nil];
+    
+    for(NSUInteger i = 0; i < kSoakChunksCount; i++) {
+        @autoreleasepool {
+            uint64_t microseconds = CFSwapInt64HostToLittle((uint64_t)(i * kSoakDuration * USEC_PER_SEC / kSoakChunksCount));
+            uint32_t length = CFSwapInt32HostToLittle((uint32_t)[chunk length]);
+            
+            NSMutableData *record = [NSMutableData dataWithBytes:&microseconds length:sizeof(microseconds)];
+            [record appendBytes:&length length:sizeof(length)];
+            [record appendData:chunk];
+            [fileHandle writeData:record];
+        }
+    }
+    [fileHandle closeFile];
+    
+    NSError *error = nil;
+    self.replayer = [[STTwitterStreamReplayer alloc] initWithFileURL:_captureURL error:&error];
+    XCTAssertNotNil(_replayer, @"%@", error);
+    XCTAssertTrue([_replayer startServingOnPort:0 speed:1 error:&error], @"%@", error);
+}
+
+- (void)tearDown {
+    [_replayer stopServing];
+    [[NSFileManager defaultManager] removeItemAtURL:_captureURL error:nil];
+    [super tearDown];
+}
+
+- (void)testStreamingRequestsKeepResidentMemoryFlat {
+    
+    STTwitterStreamParser *parser = [[STTwitterStreamParser alloc] initWithDecodingConcurrency:1];
+    
+    __block NSUInteger messagesCount = 0;
+    __block uint64_t bytesCount = 0;
+    __block uint64_t baselineResidentSize = 0;
+    __block uint64_t peakResidentSize = 0;
+    __block uint64_t nextSampleBytesCount = 0;
+    __block NSUInteger accumulatedBytesCount = 0;
+    
+    uint64_t expectedBytesCount = _replayer.bytesCount;
+    
+    XCTestExpectation *expectation = [self expectationWithDescription:@"stream"];
+    
+    STHTTPRequest *r = [STHTTPRequest requestWithURL:[NSURL URLWithString:@"statuses/sample.json" relativeToURL:_replayer.servingURL]];
+    r.streaming = YES;
+    
+    __weak STHTTPRequest *wr = r;
+    
+    r.downloadProgressBlock = ^(NSData *data, int64_t totalBytesReceived, int64_t totalBytesExpectedToReceive) {
+        
+        [parser parseWithStreamData:data parsedJSONBlock:^(NSDictionary *json, STTwitterStreamJSONType type) {
+            messagesCount += 1;
+        }];
+        
+        bytesCount += [data length];
+        accumulatedBytesCount = MAX(accumulatedBytesCount, [wr.responseData length]);
+        
+        // sampled every MB, once the allocators warmed up on the first tenth of the stream
+        if(bytesCount < nextSampleBytesCount) return;
+        nextSampleBytesCount = bytesCount + 1024 * 1024;
+        
+        if(bytesCount < expectedBytesCount / 10) return;
+        
+        uint64_t residentSize = STResidentMemorySize();
+        if(baselineResidentSize == 0) baselineResidentSize = residentSize;
+        peakResidentSize = MAX(peakResidentSize, residentSize);
+    };
+    
+    r.completionBlock = ^(NSDictionary *headers, NSString *body) {
+        [expectation fulfill];
+    };
+    
+    r.errorBlock = ^(NSError *error) {
+        XCTFail(@"%@", error);
+        [expectation fulfill];
+    };
+    
+    [r startAsynchronous];
+    
+    [self waitForExpectationsWithTimeout:kSoakDuration * 4 handler:nil];
+    
+    NSLog(@"-- %lu messages, %.1f MB streamed, resident size %.1f MB after the first tenth, peak %.1f MB",
+          (unsigned long)messagesCount,
+          bytesCount / (1024.0 * 1024.0),
+          baselineResidentSize / (1024.0 * 1024.0),
+          peakResidentSize / (1024.0 * 1024.0));
+    
+    XCTAssertEqual(bytesCount, expectedBytesCount);
+    XCTAssertEqual(messagesCount, kSoakChunksCount * kSoakMessagesPerChunk);
+    XCTAssertEqual(accumulatedBytesCount, 0);
+    XCTAssertLessThan(peakResidentSize - baselineResidentSize, kSoakMaxResidentGrowth); // the stream itself is about 170 MB
+}
+
+@end
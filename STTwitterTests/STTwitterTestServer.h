@@ -0,0 +1,55 @@
+//
+//  STTwitterTestServer.h
+//  STTwitter
+//
+
+#import <Foundation/Foundation.h>
+
+/*
+ A plain HTTP/1.1 stand-in for the Twitter hosts, on 127.0.0.1.
+ Connections are kept alive between requests, so that tests can count the connections a client opens.
+ Point kBaseURLStringAPI_1_1 and friends at baseURLString to use it.
+ */
+
+@interface STTwitterTestRequest : NSObject
+@property (nonatomic, strong, readonly) NSString *HTTPMethod;
+@property (nonatomic, strong, readonly) NSString *path; // with the query
+@property (nonatomic, strong, readonly) NSDictionary *headers; // lowercase names
+@property (nonatomic, strong, readonly) NSData *body;
+@property (nonatomic, readonly) NSUInteger connectionIndex; // in the order of accepted connections, from 0
+@property (nonatomic, readonly) CFAbsoluteTime receivedTime; // once the body is read
+
+- (NSDictionary *)multipartParts; // part name -> NSData, empty if the body is not multipart/form-data
+- (NSDictionary *)formParameters; // application/x-www-form-urlencoded body, decoded
+@end
+
+/**/
+
+@interface STTwitterTestResponse : NSObject
++ (instancetype)responseWithStatusCode:(NSInteger)statusCode JSONObject:(id)JSONObject;
++ (instancetype)responseWithStatusCode:(NSInteger)statusCode headers:(NSDictionary *)headers body:(NSData *)body;
++ (instancetype)droppedConnection; // the connection is closed without a response
+
+@property (nonatomic) NSInteger statusCode;
+@property (nonatomic, strong) NSDictionary *headers;
+@property (nonatomic, strong) NSData *body;
+@property (nonatomic) BOOL dropsConnection;
+@property (nonatomic) NSTimeInterval delay; // before responding
+@end
+
+/**/
+
+@interface STTwitterTestServer : NSObject
+
+// the handler is called on the connection queues, concurrently for different connections
+- (instancetype)initWithHandler:(STTwitterTestResponse *(^)(STTwitterTestRequest *request))handler;
+
+- (BOOL)startWithError:(NSError **)error; // on a free port
+- (void)stop; // closes the open connections too
+
+@property (nonatomic, readonly) uint16_t port;
+@property (nonatomic, readonly) NSString *baseURLString; // http://127.0.0.1:port/1.1
+@property (readonly) NSUInteger acceptedConnectionsCount;
+@property (readonly) NSUInteger requestsCount;
+
+@end
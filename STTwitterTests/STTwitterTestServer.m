@@ -0,0 +1,341 @@
+//
+//  STTwitterTestServer.m
+//  STTwitter
+//
+
+#import "STTwitterTestServer.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+static BOOL STTwitterTestServerWriteAll(int fd, const void *bytes, size_t length) {
+    const char *p = bytes;
+    while (length > 0) {
+        ssize_t n = write(fd, p, length);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return NO;
+        p += n;
+        length -= n;
+    }
+    return YES;
+}
+
+@interface STTwitterTestRequest ()
+@property (nonatomic, strong) NSString *HTTPMethod;
+@property (nonatomic, strong) NSString *path;
+@property (nonatomic, strong) NSDictionary *headers;
+@property (nonatomic, strong) NSData *body;
+@property (nonatomic) NSUInteger connectionIndex;
+@property (nonatomic) CFAbsoluteTime receivedTime;
+@end
+
+@implementation STTwitterTestRequest
+
+- (NSDictionary *)multipartParts {
+    
+    NSString *contentType = _headers[@"content-type"];
+    NSRange range = [contentType rangeOfString:@"boundary="];
+    if([contentType hasPrefix:@"multipart/form-data"] == NO || range.location == NSNotFound) return @{};
+    
+    NSString *boundary = [contentType substringFromIndex:NSMaxRange(range)];
+    NSData *delimiter = [[NSString stringWithFormat:@"\r\n--%@", boundary] dataUsingEncoding:NSUTF8StringEncoding];
+    NSData *headerEnd = [@"\r\n\r\n" dataUsingEncoding:NSUTF8StringEncoding];
+    
+    // the first delimiter has no leading CRLF
+    NSMutableData *body = [NSMutableData dataWithBytes:"\r\n" length:2];
+    [body appendData:_body];
+    
+    NSMutableDictionary *parts = [NSMutableDictionary dictionary];
+    
+    NSRange delimiterRange = [body rangeOfData:delimiter options:0 range:NSMakeRange(0, [body length])];
+    while(delimiterRange.location != NSNotFound) {
+        NSUInteger partStart = NSMaxRange(delimiterRange);
+        NSRange nextRange = [body rangeOfData:delimiter options:0 range:NSMakeRange(partStart, [body length] - partStart)];
+        if(nextRange.location == NSNotFound) break; // closing delimiter
+        
+        NSRange headerEndRange = [body rangeOfData:headerEnd options:0 range:NSMakeRange(partStart, nextRange.location - partStart)];
+        if(headerEndRange.location != NSNotFound) {
+            NSData *headerData = [body subdataWithRange:NSMakeRange(partStart, headerEndRange.location - partStart)];
+            NSString *header = [[NSString alloc] initWithData:headerData encoding:NSUTF8StringEncoding];
+            
+            NSRange nameRange = [header rangeOfString:@"name=\""];
+            if(nameRange.location != NSNotFound) {
+                NSString *name = [header substringFromIndex:NSMaxRange(nameRange)];
+                name = [name substringToIndex:[name rangeOfString:@"\""].location];
+                
+                NSUInteger dataStart = NSMaxRange(headerEndRange);
+                parts[name] = [body subdataWithRange:NSMakeRange(dataStart, nextRange.location - dataStart)];
+            }
+        }
+        
+        delimiterRange = nextRange;
+    }
+    
+    return parts;
+}
+
+- (NSDictionary *)formParameters {
+    
+    NSString *s = [[NSString alloc] initWithData:_body encoding:NSUTF8StringEncoding];
+    
+    NSMutableDictionary *md = [NSMutableDictionary dictionary];
+    for(NSString *pair in [s componentsSeparatedByString:@"&"]) {
+        NSArray *kv = [pair componentsSeparatedByString:@"="];
+        if([kv count] != 2) continue;
+        NSString *key = [[kv[0] stringByReplacingOccurrencesOfString:@"+" withString:@" "] stringByRemovingPercentEncoding];
+        NSString *value = [[kv[1] stringByReplacingOccurrencesOfString:@"+" withString:@" "] stringByRemovingPercentEncoding];
+        if(key && value) md[key] = value;
+    }
+    return md;
+}
+
+@end
+
+/**/
+
+@implementation STTwitterTestResponse
+
++ (instancetype)responseWithStatusCode:(NSInteger)statusCode headers:(NSDictionary *)headers body:(NSData *)body {
+    STTwitterTestResponse *response = [[self alloc] init];
+    response.statusCode = statusCode;
+    response.headers = headers;
+    response.body = body;
+    return response;
+}
+
++ (instancetype)responseWithStatusCode:(NSInteger)statusCode JSONObject:(id)JSONObject {
+    NSData *body = JSONObject ? [NSJSONSerialization dataWithJSONObject:JSONObject options:0 error:nil] : [NSData data];
+    return [self responseWithStatusCode:statusCode headers:@{@"Content-Type" : @"application/json;charset=utf-8"} body:body];
+}
+
++ (instancetype)droppedConnection {
+    STTwitterTestResponse *response = [[self alloc] init];
+    response.dropsConnection = YES;
+    return response;
+}
+
+@end
+
+/**/
+
+@interface STTwitterTestServer ()
+@property (nonatomic, copy) STTwitterTestResponse *(^handler)(STTwitterTestRequest *request);
+@property (nonatomic, strong) dispatch_source_t listeningSource;
+@property (nonatomic, strong) NSMutableSet *clientSockets; // NSNumber, to be shut down by stop
+@property (nonatomic) uint16_t port;
+@property (readwrite) NSUInteger acceptedConnectionsCount;
+@property (readwrite) NSUInteger requestsCount;
+@end
+
+@implementation STTwitterTestServer
+
+- (instancetype)initWithHandler:(STTwitterTestResponse *(^)(STTwitterTestRequest *request))handler {
+    self = [super init];
+    self.handler = handler;
+    self.clientSockets = [NSMutableSet set];
+    return self;
+}
+
+- (void)dealloc {
+    [self stop];
+}
+
+- (NSString *)baseURLString {
+    return [NSString stringWithFormat:@"http://127.0.0.1:%u/1.1", _port];
+}
+
+- (BOOL)startWithError:(NSError **)error {
+    
+    [self stop];
+    
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) {
+        if(error) *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+        return NO;
+    }
+    
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = 0;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    
+    if(bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(fd, 64) != 0) {
+        if(error) *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+        close(fd);
+        return NO;
+    }
+    
+    socklen_t addressLength = sizeof(address);
+    getsockname(fd, (struct sockaddr *)&address, &addressLength);
+    self.port = ntohs(address.sin_port);
+    
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    
+    __weak typeof(self) weakSelf = self;
+    
+    dispatch_source_t source = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, fd, 0, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0));
+    
+    dispatch_source_set_event_handler(source, ^{
+        int clientSocket;
+        while ((clientSocket = accept(fd, NULL, NULL)) >= 0) {
+            fcntl(clientSocket, F_SETFL, fcntl(clientSocket, F_GETFL) & ~O_NONBLOCK);
+            
+            __strong typeof(weakSelf) strongSelf = weakSelf;
+            if(strongSelf == nil) {
+                close(clientSocket);
+                continue;
+            }
+            
+            NSUInteger connectionIndex;
+            @synchronized(strongSelf) {
+                connectionIndex = strongSelf.acceptedConnectionsCount;
+                strongSelf.acceptedConnectionsCount += 1;
+                [strongSelf.clientSockets addObject:@(clientSocket)];
+            }
+            
+            dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+                [strongSelf serveClientSocket:clientSocket connectionIndex:connectionIndex];
+                @synchronized(strongSelf) {
+                    [strongSelf.clientSockets removeObject:@(clientSocket)];
+                }
+                close(clientSocket);
+            });
+        }
+    });
+    
+    dispatch_source_set_cancel_handler(source, ^{
+        close(fd);
+    });
+    
+    self.listeningSource = source;
+    dispatch_resume(source);
+    
+    return YES;
+}
+
+- (void)stop {
+    if(_listeningSource) {
+        dispatch_source_cancel(_listeningSource);
+        self.listeningSource = nil;
+    }
+    
+    // blocked reads return, the connection blocks close the sockets
+    @synchronized(self) {
+        for(NSNumber *n in _clientSockets) {
+            shutdown([n intValue], SHUT_RDWR);
+        }
+    }
+}
+
+#pragma mark Connections
+
+// reads up to the end of the head, the bytes read past it are left in buffer
+- (NSString *)readHeadFromSocket:(int)fd buffer:(NSMutableData *)buffer {
+    
+    NSData *headEnd = [@"\r\n\r\n" dataUsingEncoding:NSASCIIStringEncoding];
+    char chunk[16384];
+    
+    while(YES) {
+        NSRange range = [buffer rangeOfData:headEnd options:0 range:NSMakeRange(0, [buffer length])];
+        if(range.location != NSNotFound) {
+            NSString *head = [[NSString alloc] initWithData:[buffer subdataWithRange:NSMakeRange(0, range.location)] encoding:NSISOLatin1StringEncoding];
+            [buffer replaceBytesInRange:NSMakeRange(0, NSMaxRange(range)) withBytes:NULL length:0];
+            return head;
+        }
+        
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return nil;
+        [buffer appendBytes:chunk length:n];
+    }
+}
+
+- (BOOL)readBodyFromSocket:(int)fd length:(NSUInteger)length buffer:(NSMutableData *)buffer {
+    
+    char chunk[65536];
+    
+    while([buffer length] < length) {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return NO;
+        [buffer appendBytes:chunk length:n];
+    }
+    return YES;
+}
+
+- (void)serveClientSocket:(int)clientSocket connectionIndex:(NSUInteger)connectionIndex {
+    
+    int yes = 1;
+#ifdef SO_NOSIGPIPE
+    setsockopt(clientSocket, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(yes));
+#endif
+    setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    
+    NSMutableData *buffer = [NSMutableData data];
+    
+    while(YES) {
+        @autoreleasepool {
+            NSString *head = [self readHeadFromSocket:clientSocket buffer:buffer];
+            if(head == nil) return;
+            
+            NSArray *lines = [head componentsSeparatedByString:@"\r\n"];
+            NSArray *requestLine = [lines[0] componentsSeparatedByString:@" "];
+            if([requestLine count] < 3) return;
+            
+            NSMutableDictionary *headers = [NSMutableDictionary dictionary];
+            for(NSString *line in [lines subarrayWithRange:NSMakeRange(1, [lines count] - 1)]) {
+                NSRange colon = [line rangeOfString:@":"];
+                if(colon.location == NSNotFound) continue;
+                NSString *name = [[line substringToIndex:colon.location] lowercaseString];
+                headers[name] = [[line substringFromIndex:colon.location + 1] stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
+            }
+            
+            NSUInteger contentLength = (NSUInteger)[headers[@"content-length"] longLongValue];
+            if([self readBodyFromSocket:clientSocket length:contentLength buffer:buffer] == NO) return;
+            
+            STTwitterTestRequest *request = [[STTwitterTestRequest alloc] init];
+            request.HTTPMethod = requestLine[0];
+            request.path = requestLine[1];
+            request.headers = headers;
+            request.body = [buffer subdataWithRange:NSMakeRange(0, contentLength)];
+            request.connectionIndex = connectionIndex;
+            request.receivedTime = CFAbsoluteTimeGetCurrent();
+            [buffer replaceBytesInRange:NSMakeRange(0, contentLength) withBytes:NULL length:0];
+            
+            @synchronized(self) {
+                self.requestsCount += 1;
+            }
+            
+            STTwitterTestResponse *response = _handler ? _handler(request) : nil;
+            if(response == nil) response = [STTwitterTestResponse responseWithStatusCode:404 JSONObject:nil];
+            
+            if(response.delay > 0) usleep((useconds_t)(response.delay * USEC_PER_SEC));
+            
+            if(response.dropsConnection) return;
+            
+            NSData *body = response.body ? response.body : [NSData data];
+            
+            NSMutableString *responseHead = [NSMutableString stringWithFormat:@"HTTP/1.1 %ld %@\r\n", (long)response.statusCode, [NSHTTPURLResponse localizedStringForStatusCode:response.statusCode]];
+            [response.headers enumerateKeysAndObjectsUsingBlock:^(NSString *name, NSString *value, BOOL *stop) {
+                [responseHead appendFormat:@"%@: %@\r\n", name, value];
+            }];
+            [responseHead appendFormat:@"Content-Length: %lu\r\n\r\n", (unsigned long)[body length]];
+            
+            NSData *headData = [responseHead dataUsingEncoding:NSISOLatin1StringEncoding];
+            if(STTwitterTestServerWriteAll(clientSocket, [headData bytes], [headData length]) == NO) return;
+            if(STTwitterTestServerWriteAll(clientSocket, [body bytes], [body length]) == NO) return;
+            
+            if([[headers[@"connection"] lowercaseString] isEqualToString:@"close"]) return;
+        }
+    }
+}
+
+@end